@@ -0,0 +1,702 @@
+/* #bench
+
+This is the benchmark driver for cmpr.
+
+We include all of cmpr.c (without its main) so that we can time the real functions against synthetic projects of any size, rather than only against cmpr's own source.
+
+There are two halves:
+
+- a generator, which writes a synthetic C or Python project with a matching .cmpr/conf, and
+- a driver, which loads such a project exactly as cmpr does (parse_config, get_code) and then times our hot paths.
+
+Typical usage:
+
+    bench --gen /tmp/bigproj --lang C --files 200 --blocks 50 --block-lines 40 --line-len 60
+    bench --run /tmp/bigproj
+
+Or both in one go by passing --gen and --run together.
+
+There is also a mock LLM endpoint, for trying out and testing the direct LLM client (#llm in cmpr.c) without a real server:
+
+    bench --mock-llm 8089 --mock-delay 20 &
+    (and in the project's conf) llmurl: http://127.0.0.1:8089/v1/chat/completions
+
+Each benchmark prints a single line of JSON to stdout, so results can be collected and compared across commits with jq or similar.
+Everything that the timed functions themselves print (e.g. rendering) goes to /dev/null while the clock is running.
+
+The build line is kept with the other shell functions at the top of cmpr.c (see bench() there).
+*/
+
+#define CMPR_NO_MAIN
+#include "cmpr.c"
+#include <netinet/in.h>
+
+/*
+The bench_opts struct holds the generator parameters and the driver settings.
+
+- dir, the project directory to write to and/or run in
+- lang, either "C" or "Python"
+- files, the number of project files
+- blocks, the number of blocks per file
+- block_lines, the number of lines in each block (comment and code together)
+- line_len, the approximate length of each line
+- seed, for the pseudo-random word choice, so that projects are reproducible
+- min_iters and min_secs, each benchmark runs until both are satisfied (or max_iters is reached)
+- max_iters, an upper bound, mostly to keep the rev-writing benchmarks from filling the disk
+*/
+
+typedef struct {
+    char* dir;
+    char* lang;
+    int files;
+    int blocks;
+    int block_lines;
+    int line_len;
+    unsigned seed;
+    int min_iters;
+    int max_iters;
+    double min_secs;
+} bench_opts;
+
+/*
+A tiny LCG is enough for choosing words, and it is the same on every platform, unlike rand().
+*/
+
+unsigned bench_rand_state;
+
+unsigned bench_rand() {
+    bench_rand_state = bench_rand_state * 1103515245u + 12345u;
+    return bench_rand_state >> 8;
+}
+
+char* bench_words[] = {
+    "span", "block", "index", "buffer", "state", "file", "count", "line", "search", "render",
+    "terminal", "offset", "length", "project", "revision", "comment", "code", "prompt", "config", "value",
+    "result", "input", "output", "cursor", "window", "screen", "token", "table", "entry", "node",
+};
+
+#define BENCH_NWORDS (int)(sizeof(bench_words) / sizeof(bench_words[0]))
+
+/*
+In bench_line we prt one line of roughly line_len characters, made of a prefix and then random words.
+The prefix lets us make comment lines and code lines look different, which matters for the comment/code split in the real functions.
+*/
+
+void bench_line(char* prefix, int line_len) {
+    u8* start = out.end;
+    prt("%s", prefix);
+    while (out.end - start < line_len) {
+        prt("%s ", bench_words[bench_rand() % BENCH_NWORDS]);
+    }
+    bksp();
+    terpri();
+}
+
+/*
+In bench_block we prt a single block in the given language.
+
+A C block is a block comment followed by a function; a Python block is a triple-quoted docstring followed by a def.
+Roughly a third of the lines are comment and the rest are code, with a minimum of one of each.
+
+We put the word "needle" in the code part of the very last block of the last file, so that a search for it has to scan the whole project and finds exactly one match.
+*/
+
+void bench_block(bench_opts* o, int file_no, int block_no, int needle) {
+    int comment_lines = o->block_lines / 3;
+    if (comment_lines < 1) comment_lines = 1;
+    int code_lines = o->block_lines - comment_lines - 2;
+    if (code_lines < 1) code_lines = 1;
+    int python = strcmp(o->lang, "Python") == 0;
+
+    prt(python ? "\"\"\"\n" : "/*\n");
+    for (int i = 0; i < comment_lines; i++) bench_line("", o->line_len);
+    prt(python ? "\"\"\"\n\n" : "*/\n\n");
+
+    if (python) {
+        prt("def fn_%d_%d(x):\n", file_no, block_no);
+        for (int i = 0; i < code_lines; i++) bench_line("    x = ", o->line_len);
+        if (needle) prt("    needle = x\n");
+        prt("    return x\n\n");
+    } else {
+        prt("int fn_%d_%d(int x) {\n", file_no, block_no);
+        for (int i = 0; i < code_lines; i++) bench_line("    x += ", o->line_len);
+        if (needle) prt("    int needle = x;\n");
+        prt("    return x;\n}\n\n");
+    }
+}
+
+/*
+In bench_generate we create the directory layout of a cmpr project (the same as cmpr --init makes, plus a src directory), then write each file and finally the conf.
+The files go in a tree under src, ten to a directory and ten directories to a parent (src/d00/e00/f0000.c, ..., src/d00/e01/f0010.c, ...; bench_file_path), so that walking it (#dir_sources in cmpr.c) has directories to read and the dir cache has directories to stat.
+
+All paths in the conf are relative to the project directory, since the driver chdir()s there before loading it.
+
+We prt into out and use flush_to() to write each file, which also resets out so memory use stays constant however large the project.
+*/
+
+void bench_mkdir(char* path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        prt("Failed to create directory %s\n", path);
+        flush();
+        exit(EXIT_FAILURE);
+    }
+}
+
+void bench_file_path(char* buf, int size, int f, char* ext) {
+    snprintf(buf, size, "src/d%02d/e%02d/f%04d.%s", f / 100, f / 10 % 10, f, ext);
+}
+
+void bench_generate(bench_opts* o) {
+    char path[2048];
+    bench_rand_state = o->seed;
+    char* ext = strcmp(o->lang, "Python") == 0 ? "py" : "c";
+
+    bench_mkdir(o->dir);
+    snprintf(path, sizeof(path), "%s/.cmpr", o->dir); bench_mkdir(path);
+    snprintf(path, sizeof(path), "%s/.cmpr/revs", o->dir); bench_mkdir(path);
+    snprintf(path, sizeof(path), "%s/.cmpr/tmp", o->dir); bench_mkdir(path);
+    snprintf(path, sizeof(path), "%s/src", o->dir); bench_mkdir(path);
+
+    flush();
+    for (int f = 0; f < o->files; f++) {
+        char file[256];
+        bench_file_path(file, sizeof(file), f, ext);
+        if (f % 10 == 0) {
+            if (f % 100 == 0) {
+                snprintf(path, sizeof(path), "%s/src/d%02d", o->dir, f / 100);
+                bench_mkdir(path);
+            }
+            snprintf(path, sizeof(path), "%s/%.*s", o->dir, (int)(strrchr(file, '/') - file), file);
+            bench_mkdir(path);
+        }
+        for (int b = 0; b < o->blocks; b++) {
+            bench_block(o, f, b, f == o->files - 1 && b == o->blocks - 1);
+        }
+        snprintf(path, sizeof(path), "%s/%s", o->dir, file);
+        flush_to(path);
+    }
+
+    prt("projdir: .\n");
+    prt("revdir: .cmpr/revs\n");
+    prt("tmpdir: .cmpr/tmp\n");
+    prt("buildcmd: true\n");
+    prt("cbcopy: cat >/dev/null\n");
+    prt("cbpaste: cat /dev/null\n");
+    prt("language: %s\n", o->lang);
+    for (int f = 0; f < o->files; f++) {
+        char file[256];
+        bench_file_path(file, sizeof(file), f, ext);
+        prt("file: %s\n", file);
+    }
+    snprintf(path, sizeof(path), "%s/.cmpr/conf", o->dir);
+    flush_to(path);
+}
+
+/*
+Timing.
+
+We use CLOCK_MONOTONIC in nanoseconds.
+Each benchmark records one sample per iteration into a static array, which we sort to get percentiles.
+
+While a benchmark is running, fd 1 points at /dev/null, so that anything the timed code flushes costs what it would cost on a terminal minus the terminal itself.
+We swap the real stdout back in to print each result line.
+*/
+
+#define BENCH_MAX_SAMPLES (1 << 20)
+
+long long bench_samples[BENCH_MAX_SAMPLES];
+int bench_stdout_fd = -1;
+
+long long bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void bench_quiet() {
+    flush();
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) exit_with_error("Failed to open /dev/null");
+    bench_stdout_fd = dup(STDOUT_FILENO);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+}
+
+void bench_loud() {
+    flush();
+    out.end = out.buf;
+    out_WRITTEN = 0;
+    dup2(bench_stdout_fd, STDOUT_FILENO);
+    close(bench_stdout_fd);
+}
+
+int bench_cmp_ll(const void* a, const void* b) {
+    long long x = *(long long*)a, y = *(long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+In bench_report we sort the samples and print a JSON line with the name, the project shape, the number of iterations, ops/sec (based on the sum of the samples, so setup work between iterations is excluded), and min/p50/p90/p99/max in nanoseconds.
+*/
+
+void bench_report(bench_opts* o, char* name, int n) {
+    long long total = 0;
+    for (int i = 0; i < n; i++) total += bench_samples[i];
+    qsort(bench_samples, n, sizeof(long long), bench_cmp_ll);
+
+    prt("{\"bench\":\"%s\",\"files\":%d,\"blocks\":%d,\"bytes\":%d,\"iters\":%d,"
+        "\"ops_per_sec\":%.1f,\"min_ns\":%lld,\"p50_ns\":%lld,\"p90_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld}\n",
+        name, (int)state->files.n, state->blocks.n, len(inp), n,
+        total ? n * 1e9 / total : 0.0,
+        bench_samples[0], bench_samples[n / 2], bench_samples[n * 9 / 10], bench_samples[n * 99 / 100], bench_samples[n - 1]);
+    flush();
+}
+
+/*
+The BENCH macro wraps the body in the iteration loop.
+
+SETUP runs before each iteration and is not timed, BODY is timed.
+We stop once we have at least min_iters samples and min_secs of timed work, or max_iters samples.
+Since rendering and search write to out, and out is never otherwise reset, we rewind it after each iteration so that the buffer stays small.
+*/
+
+#define BENCH(o, name, max, SETUP, BODY) do { \
+    bench_quiet(); \
+    int n_ = 0; long long spent_ = 0; \
+    int cap_ = (max) < BENCH_MAX_SAMPLES ? (max) : BENCH_MAX_SAMPLES; \
+    while (n_ < cap_ && (n_ < (o)->min_iters || spent_ < (o)->min_secs * 1e9)) { \
+        SETUP; \
+        long long t0_ = bench_now(); \
+        BODY; \
+        long long dt_ = bench_now() - t0_; \
+        bench_samples[n_++] = dt_; spent_ += dt_; \
+        flush(); out.end = out.buf; out_WRITTEN = 0; \
+    } \
+    bench_loud(); \
+    bench_report(o, name, n_); \
+} while (0)
+
+/*
+For the "R" benchmark we need the code part of the current block in the cmp space, the same place that replace_code_clipboard() reads the clipboard into.
+We copy it into cmp_compl() without advancing cmp, so every iteration reuses the same space.
+
+Unchanged content is (deliberately) a no-op for both handle_edited_file and replace_block_code_part, so when change is set we toggle the case of the first letter of the code part, which makes a real edit every time (and flips back on the next iteration).
+bench_write_block does the same for the whole block, writing it to the tmp file for handle_edited_file.
+*/
+
+span bench_code;
+
+void bench_toggle_first_letter(span s) {
+    for (u8* p = s.buf; p < s.end; p++) {
+        if (isalpha(*p)) {
+            *p ^= 0x20;
+            return;
+        }
+    }
+}
+
+void bench_copy_code_part(int change) {
+    span block = state->blocks.s[state->current_index];
+    span code = {block_comment(state->current_index).end, block.end};
+    bench_code = (span){cmp.end, cmp.end + len(code)};
+    memcpy(bench_code.buf, code.buf, len(code));
+    if (change) bench_toggle_first_letter(bench_code);
+}
+
+void bench_write_block(char* path, int change) {
+    unlink(path);
+    bench_copy_code_part(change);
+    span block = state->blocks.s[state->current_index];
+    span copy = {bench_code.end, bench_code.end + len(block)};
+    memcpy(copy.buf, block.buf, len(block));
+    if (change) bench_toggle_first_letter((span){copy.buf + block_table.comment_end[state->current_index], copy.end});
+    write_to_file(copy, path);
+}
+
+void bench_history_walk() {
+    history_open();
+    while (history_more());
+    history_close();
+}
+
+/*
+bench_backdate sets the mtime of a directory and everything under it to a minute ago.
+The generated directories were all written just now, and dir_cache_save (#dir_sources in cmpr.c) won't save a walk of directories that changed within the last second, as they might still be changing; so without this there would never be a cache for dir_source_cached to use.
+*/
+
+void bench_backdate(char* path) {
+    struct timespec times[2] = {{time(NULL) - 60, 0}, {time(NULL) - 60, 0}};
+    DIR* dir = opendir(path);
+    if (dir) {
+        struct dirent* e;
+        while ((e = readdir(dir))) {
+            if (e->d_type != DT_DIR || !strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+            char sub[2048];
+            snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+            bench_backdate(sub);
+        }
+        closedir(dir);
+    }
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+void bench_dir_cache_path(char* path, int size) {
+    dir_source d;
+    dir_source_parse(&d, S("dir"), S("src"));
+    d.language = state->current_language;
+    dir_cache_path(&d, path, size);
+}
+
+void bench_dir_reset(int files_n, u8* cmp_end, int uncached) {
+    state->files.n = files_n;
+    cmp.end = cmp_end;
+    dir_sources.n = 0;
+    if (!uncached) return;
+    char path[2048];
+    bench_dir_cache_path(path, sizeof(path));
+    unlink(path);
+}
+
+/*
+bench_dir_check makes sure the walk left a dir cache before we time dir_source_cached; if it didn't, that benchmark would only measure the walk again, so we stop rather than report it.
+*/
+
+void bench_dir_check() {
+    char path[2048];
+    struct stat st;
+    bench_dir_cache_path(path, sizeof(path));
+    if (stat(path, &st) == -1) {
+        prt("No dir cache at %s after dir_source_walk, so dir_source_cached would not measure the cache.\n", path);
+        flush();
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+In bench_run we load the project from the directory and run every benchmark.
+
+- get_code: reading all the files into inp and finding the blocks. We rewind inp and the span arena each time so this is a cold load every iteration, except that after the first one the block index (#block_index in cmpr.c) is there, as it would be on a second start; get_code_noindex removes the index first each time, so every file is scanned.
+- find_all_blocks: just the block finding, on the already loaded code.
+- dir_source_walk: expanding "dir: src" (the generated tree) by walking it, as at startup with no cache (#dir_sources in cmpr.c), and dir_source_cached: the same with the cache the walk left, which only stats the directories; we backdate the tree first (bench_backdate) so that the walk does leave one, and fail if it didn't (bench_dir_check).
+- perform_search: a search for "needle", which only matches the very last block, one for a common word, a regex (#regex in cmpr.c), and a ranked search (#ranked_search, forgetting the last results each time so that it really ranks, though the term statistics stay built after the first time); these use the search pool (#search_pool in cmpr.c), as does
+- finalize_search: jumping to the first match for "needle", which can't stop early since the only match is the last block.
+- handle_edited_file: we write the middle block out to a tmp file with one letter changed and hand it to handle_edited_file, as if the user had saved it in their editor; this includes re-indexing and writing a rev.
+- handle_edited_file_noop: the same but unchanged, which should only cost reading and hashing the tmp file.
+- replace_block_code_part: as if the user had pasted the code part back in with "R", again with one letter changed; this also writes a rev.
+- replace_block_code_part_noop: pasting the same code part back, which is detected by hashing and does nothing.
+- undo_step: undoing the edits made by the benchmarks above, one block each, with "u" (#undo in cmpr.c), and once they are all undone redoing one and undoing it again; this includes re-indexing and writing a rev.
+- new_rev: just writing the rev for one file.
+- history_walk: opening the history of the middle block (#history in cmpr.c) and stepping back to its oldest version, through the revs the benchmarks above wrote.
+- render: a full screen of the middle block, at a few terminal sizes.
+
+The rev-writing benchmarks are capped at max_iters so that we don't fill the disk with revs.
+*/
+
+void bench_run(bench_opts* o) {
+    if (chdir(o->dir) == -1) {
+        prt("Failed to chdir to %s\n", o->dir);
+        flush();
+        exit(EXIT_FAILURE);
+    }
+
+    state->config_file_path = S(".cmpr/conf");
+    parse_config();
+
+    u8* inp_start = inp.end;
+    span_arena_push();
+
+    BENCH(o, "get_code", 1 << 30,
+          (inp.end = inp_start, span_arena_pop(), span_arena_push()),
+          get_code());
+
+    char index_path[2048];
+    llm_cache_path(index_path, sizeof(index_path), "blocks");
+    BENCH(o, "get_code_noindex", 1 << 30,
+          (inp.end = inp_start, span_arena_pop(), span_arena_push(), unlink(index_path)),
+          get_code());
+
+    BENCH(o, "find_all_blocks", 1 << 30,
+          (span_arena_pop(), span_arena_push()),
+          find_all_blocks());
+
+    int files_n = state->files.n;
+    u8* cmp_end = cmp.end;
+    bench_backdate("src");
+    BENCH(o, "dir_source_walk", 1 << 30, bench_dir_reset(files_n, cmp_end, 1), dir_source_add(S("dir"), S("src")));
+    bench_dir_check();
+    BENCH(o, "dir_source_cached", 1 << 30, bench_dir_reset(files_n, cmp_end, 0), dir_source_add(S("dir"), S("src")));
+    bench_dir_reset(files_n, cmp_end, 1);
+
+    state->terminal_rows = 50;
+    state->terminal_cols = 200;
+    state->search = S("/needle");
+    BENCH(o, "perform_search_rare", 1 << 30, , perform_search());
+    state->search = S("/span");
+    BENCH(o, "perform_search_common", 1 << 30, , perform_search());
+    state->search = S("//^span \\w+\\(");
+    BENCH(o, "perform_search_regex", 1 << 30, , perform_search());
+    state->search = S("/~index block");
+    BENCH(o, "perform_search_ranked", 1 << 30, (rank.query_len = -1), perform_search());
+    BENCH(o, "finalize_search_rare", 1 << 30, (state->search = S("/needle")), finalize_search());
+    BENCH(o, "finalize_search_common", 1 << 30, (state->search = S("/block")), finalize_search());
+    BENCH(o, "match_jump", 1 << 30, , match_jump(1));
+    state->search = nullspan();
+
+    state->current_index = state->blocks.n / 2;
+    char tmp_path[2048];
+    snprintf(tmp_path, sizeof(tmp_path), "%.*s/bench-edit", len(state->tmpdir), state->tmpdir.buf);
+    BENCH(o, "handle_edited_file", o->max_iters, bench_write_block(tmp_path, 1), handle_edited_file(tmp_path));
+    BENCH(o, "handle_edited_file_noop", 1 << 30, bench_write_block(tmp_path, 0), handle_edited_file(tmp_path));
+
+    BENCH(o, "replace_block_code_part", o->max_iters, bench_copy_code_part(1), replace_block_code_part(bench_code));
+    BENCH(o, "replace_block_code_part_noop", 1 << 30, bench_copy_code_part(0), replace_block_code_part(bench_code));
+    BENCH(o, "undo_step", o->max_iters, , undo_step(undo.at == 0));
+
+    int file_index = block_table.file[state->current_index];
+    BENCH(o, "new_rev", o->max_iters, , new_rev(NULL, file_index));
+    BENCH(o, "history_walk", 1 << 30, , bench_history_walk());
+
+    int sizes[][2] = {{24, 80}, {50, 200}, {100, 300}};
+    for (int i = 0; i < 3; i++) {
+        char name[64];
+        state->terminal_rows = sizes[i][0];
+        state->terminal_cols = sizes[i][1];
+        snprintf(name, sizeof(name), "render_%dx%d", sizes[i][0], sizes[i][1]);
+        BENCH(o, name, 1 << 30, , (clear_display(), render_block_range(state->current_index, state->current_index + 1)));
+    }
+}
+
+/*
+In bench_mock_llm we serve a fake OpenAI-compatible chat completions endpoint on 127.0.0.1:port, forever.
+
+For each connection (handled in a forked child, so several requests can stream at once) we read the request headers and the body (by Content-Length), and reply with status (normally 200).
+A 200 reply is a chunked server-sent event stream, like the real thing: one "data:" event per few characters of a canned reply, delay_ms apart, and then "data: [DONE]".
+The reply is a fenced code block with a function that returns the length of the request body, so each reply depends on its prompt.
+Any other status gets a short JSON error body instead.
+*/
+
+void bench_mock_send(int fd, char* data, int n) {
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w <= 0) _exit(0);
+        data += w;
+        n -= w;
+    }
+}
+
+void bench_mock_chunk(int fd, char* data) {
+    char head[32];
+    int n = strlen(data);
+    snprintf(head, sizeof(head), "%x\r\n", n);
+    bench_mock_send(fd, head, strlen(head));
+    bench_mock_send(fd, data, n);
+    bench_mock_send(fd, "\r\n", 2);
+}
+
+void bench_mock_serve(int fd, int delay_ms, int status) {
+    char req[1 << 16];
+    int n = 0, body_at = -1, content_length = 0;
+    while (n < (int)sizeof(req) - 1) {
+        ssize_t r = read(fd, req + n, sizeof(req) - 1 - n);
+        if (r <= 0) break;
+        n += r;
+        req[n] = 0;
+        if (body_at < 0) {
+            char* end = strstr(req, "\r\n\r\n");
+            if (!end) continue;
+            body_at = end + 4 - req;
+            char* cl = strstr(req, "Content-Length:");
+            content_length = cl ? atoi(cl + 15) : 0;
+        }
+        if (n - body_at >= content_length) break;
+    }
+
+    char buf[4096];
+    if (status != 200) {
+        char* body = "{\"error\": {\"message\": \"mock error\"}}";
+        snprintf(buf, sizeof(buf), "HTTP/1.1 %d Mock\r\nContent-Type: application/json\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s", status, (int)strlen(body), body);
+        bench_mock_send(fd, buf, strlen(buf));
+        return;
+    }
+
+    char* head = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+    bench_mock_send(fd, head, strlen(head));
+    char reply[256];
+    snprintf(reply, sizeof(reply), "```c\nint mock_reply(void) {\n    return %d;\n}\n```\n", content_length);
+    for (char* p = reply; *p; ) {
+        char piece[64] = {0};
+        int k = 0;
+        for (int i = 0; i < 4 && *p; i++, p++) {
+            if (*p == '\n') piece[k++] = '\\', piece[k++] = 'n';
+            else if (*p == '"' || *p == '\\') piece[k++] = '\\', piece[k++] = *p;
+            else piece[k++] = *p;
+        }
+        snprintf(buf, sizeof(buf), "data: {\"choices\": [{\"index\": 0, \"delta\": {\"content\": \"%s\"}}]}\n\n", piece);
+        bench_mock_chunk(fd, buf);
+        if (delay_ms) usleep(delay_ms * 1000);
+    }
+    bench_mock_chunk(fd, "data: [DONE]\n\n");
+    bench_mock_send(fd, "0\r\n\r\n", 5);
+}
+
+void bench_mock_llm(int port, int delay_ms, int status) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (lfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 64) < 0) {
+        prt("Failed to listen on port %d\n", port);
+        flush();
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGCHLD, SIG_IGN);
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) continue;
+        if (fork() == 0) {
+            close(lfd);
+            bench_mock_serve(fd, delay_ms, status);
+            close(fd);
+            _exit(0);
+        }
+        close(fd);
+    }
+}
+
+/*
+bench_check_regex is a regression check for the DFA state cache (#regex in cmpr.c), run with --check regex.
+
+The pattern needs many more than REGEX_DFA_MAX states on random text, so a search that goes on from match to match with the same pair of DFAs (as #match_list does) has to drop its states again and again, and must still find exactly what a fresh pair of DFAs finds on each line by itself.
+It's anchored with ^, so that the forward DFA has an idle state and regex_find skips from newline to newline between matches.
+The same comparison also checks that a negated class doesn't match newline, with a second pattern, "a[^b]*c", which would otherwise run on from a line without a c to the next c, so the search through the whole text would find a match on that line that the line by itself doesn't have.
+It prints one line of JSON for each pattern, like the benchmarks, and returns the number of lines where the two differ.
+*/
+
+int bench_check_regex_pattern(char* pattern) {
+    static regex rx;
+    static rx_dfa fwd, rev, one_fwd, one_rev;
+    if (!regex_compile(&rx, S(pattern))) exit_with_error(rx.error);
+    int drops = fwd.drops;
+    rx_dfa_prepare(&fwd, &rx, 0);
+    rx_dfa_prepare(&rev, &rx, 1);
+
+    span text = {cmp.end, cmp.end};
+    for (int i = 0; i < 20000; i++) {
+        int n = bench_rand() % 300;
+        for (int k = 0; k < n; k++) *text.end++ = bench_rand() % 32 ? "abx"[bench_rand() % 3] : 'c';
+        *text.end++ = '\n';
+    }
+
+    int lines = 0, matches = 0, wrong = 0;
+    span found, expect;
+    int have = regex_find(&fwd, &rev, text, 1, &found);
+    for (span rest = text; !empty(rest); lines++) {
+        span line = next_line(&rest);
+        one_fwd.rx = one_rev.rx = NULL;
+        rx_dfa_prepare(&one_fwd, &rx, 0);
+        rx_dfa_prepare(&one_rev, &rx, 1);
+        int want = regex_find(&one_fwd, &one_rev, line, 1, &expect);
+        int got = have && found.buf < rest.buf;
+        matches += want;
+        if (want != got || (want && (expect.buf != found.buf || expect.end != found.end))) wrong++;
+        if (got) have = regex_find(&fwd, &rev, rest, 1, &found);
+    }
+    prt("{\"check\":\"regex\",\"pattern\":\"%s\",\"lines\":%d,\"matches\":%d,\"drops\":%d,\"wrong\":%d}\n", pattern, lines, matches, fwd.drops - drops, wrong);
+    return wrong;
+}
+
+int bench_check_regex() {
+    return bench_check_regex_pattern("^a.*b..............c") + bench_check_regex_pattern("a[^b]*c");
+}
+
+/*
+In main we set up spanio and the arenas the same way cmpr's main does, then parse our own flags.
+
+Flags:
+
+- --gen <dir>, generate a project into dir
+- --run <dir>, run the benchmarks in dir
+- --lang, --files, --blocks, --block-lines, --line-len, --seed for the generator
+- --min-iters, --min-secs, --max-iters for the driver
+- --mock-llm <port>, serve the mock LLM endpoint (never returns), with --mock-delay (ms between events, default 10) and --mock-status (default 200)
+- --check regex, run bench_check_regex instead, exiting with failure if anything differs
+*/
+
+int main(int argc, char** argv) {
+    init_spans();
+    projfiles_arena_alloc(1 << 14);
+    span_arena_alloc(1 << 24);
+
+    ui_state local_state = {0};
+    state = &local_state;
+    state->files = projfiles_alloc(1 << 14);
+    state->files.n = 0;
+
+    bench_opts o = {.lang = "C", .files = 100, .blocks = 40, .block_lines = 30, .line_len = 60,
+                    .seed = 1, .min_iters = 10, .max_iters = 200, .min_secs = 0.5};
+    char* gen_dir = NULL;
+    char* run_dir = NULL;
+    int mock_port = 0, mock_delay = 10, mock_status = 200;
+    char* check = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            prt("Usage: %s [--gen <dir>] [--run <dir>] [--lang C|Python] [--files N] [--blocks N] [--block-lines N] [--line-len N] [--seed N] [--min-iters N] [--max-iters N] [--min-secs S] [--mock-llm PORT] [--mock-delay MS] [--mock-status N] [--check regex]\n", argv[0]);
+            flush();
+            exit(EXIT_FAILURE);
+        }
+        char* a = argv[i];
+        char* v = argv[++i];
+        if (!strcmp(a, "--gen")) gen_dir = v;
+        else if (!strcmp(a, "--run")) run_dir = v;
+        else if (!strcmp(a, "--lang")) o.lang = v;
+        else if (!strcmp(a, "--files")) o.files = atoi(v);
+        else if (!strcmp(a, "--blocks")) o.blocks = atoi(v);
+        else if (!strcmp(a, "--block-lines")) o.block_lines = atoi(v);
+        else if (!strcmp(a, "--line-len")) o.line_len = atoi(v);
+        else if (!strcmp(a, "--seed")) o.seed = atoi(v);
+        else if (!strcmp(a, "--min-iters")) o.min_iters = atoi(v);
+        else if (!strcmp(a, "--max-iters")) o.max_iters = atoi(v);
+        else if (!strcmp(a, "--min-secs")) o.min_secs = atof(v);
+        else if (!strcmp(a, "--mock-llm")) mock_port = atoi(v);
+        else if (!strcmp(a, "--mock-delay")) mock_delay = atoi(v);
+        else if (!strcmp(a, "--mock-status")) mock_status = atoi(v);
+        else if (!strcmp(a, "--check")) check = v;
+        else {
+            prt("Unknown flag %s\n", a);
+            flush();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (strcmp(o.lang, "C") && strcmp(o.lang, "Python")) {
+        prt("--lang must be C or Python\n");
+        flush();
+        exit(EXIT_FAILURE);
+    }
+
+    if (check) {
+        if (strcmp(check, "regex")) {
+            prt("--check must be regex\n");
+            flush();
+            exit(EXIT_FAILURE);
+        }
+        int wrong = bench_check_regex();
+        flush();
+        return wrong ? EXIT_FAILURE : 0;
+    }
+
+    if (mock_port) bench_mock_llm(mock_port, mock_delay, mock_status);
+
+    if (gen_dir) {
+        o.dir = gen_dir;
+        bench_generate(&o);
+    }
+    if (run_dir) {
+        o.dir = run_dir;
+        bench_run(&o);
+    }
+
+    flush();
+    return 0;
+}
@@ -66,7 +66,20 @@ index() {
 }
 
 build() {
-  gcc -o cmpr/dist/cmpr -g cmpr/cmpr.c -lm
+  gcc -o cmpr/dist/cmpr -g cmpr/cmpr.c -lm -pthread
+}
+
+build_trace() {
+  gcc -o cmpr/dist/cmpr -g -DCMPR_TRACE cmpr/cmpr.c -lm -pthread
+}
+
+build_debug() {
+  gcc -o cmpr/dist/cmpr -g -DCMPR_DEBUG_BLOCKS cmpr/cmpr.c -lm -pthread
+}
+
+# e.g. bench --gen /tmp/bigproj --files 200 --run /tmp/bigproj
+bench() {
+  gcc -O2 -o cmpr/dist/bench -g cmpr/bench.c -lm -pthread && cmpr/dist/bench "$@"
 }
 
 clipboard_copy() {
@@ -97,8 +110,13 @@ The known config settings are:
 - revdir, a span containing a relative or absolute path to where we store our revisions
 - tmpdir, another path for temp files that we use for editing blocks
 - buildcmd, the command to do a build (e.g. by the "b" key)
-- cbcopy, the command to pipe data to the clipboard on the user's platform
+- cbcopy, the command to pipe data to the clipboard on the user's platform (or a unix:, fifo: or file: transport, see #clipboard_transport)
 - cbpaste, the same but for getting data from the clipboard
+- llmurl, optionally, the URL of an OpenAI-compatible chat completions endpoint (e.g. http://localhost:8080/v1/chat/completions); when set, "r" talks to it directly instead of going through the clipboard (see #llm)
+- llmmodel, the model name to send to that endpoint
+- llmjobs, how many requests a batch rewrite ("r" on a visual selection) keeps in flight at once (default 4)
+- liveedit, optionally, a command that opens a file in an editor without needing our terminal (e.g. "tmux split-window vi"), for live editing with "E" (see #live_edit)
+- undomax, optionally, how many megabytes the undo history ("u" and Ctrl-R) may use (default 64, see #undo)
 */
 
 #define CONFIG_FIELDS \
@@ -107,7 +125,12 @@ X(revdir) \
 X(tmpdir) \
 X(buildcmd) \
 X(cbcopy) \
-X(cbpaste)
+X(cbpaste) \
+X(llmurl) \
+X(llmmodel) \
+X(llmjobs) \
+X(liveedit) \
+X(undomax)
 
 /*
 A project can contain multiple files.
@@ -117,6 +140,9 @@ We have a projfile type which contains for each file:
 - the path as a span
 - the language, also a span
 - the contents of the file, also a span
+- line_starts and nlines, an index of the offset (into contents) of the start of every line, built on demand by file_line_index() and freed whenever the contents change (ssize_t, since a windowed file can be bigger than an int)
+- windowed, set if the contents are mapped from the file rather than read into inp, because the file is too big (see #windowed)
+- mtime, the modification time the file had when get_code read it, for the block index (see #block_index)
 
 Here we have a typedef for the projfile, and we also call our generic macro to make a corresponding array type called projfiles, choosing 256 for the stack size.
 */
@@ -125,6 +151,10 @@ typedef struct {
     span path;
     span language;
     span contents;
+    ssize_t* line_starts;
+    ssize_t nlines;
+    int windowed;
+    struct timespec mtime;
 } projfile;
 
 MAKE_ARENA(projfile, projfiles, 256)
@@ -140,6 +170,9 @@ This includes, so far:
 - the config file path as a span
 - terminal_rows and _cols which stores the terminal dimensions
 - scrolled_lines, the number of physical lines that have been scrolled off the screen upwards
+- headless, set when we are driven by a --script instead of a terminal, and script, the keystrokes not yet consumed
+- fixed_rows and fixed_cols, terminal dimensions given by --rows/--cols, which override the terminal's own (used by headless mode)
+- blocks_version, incremented every time the blocks are re-found, so that anything caching block indices knows when to refresh
 
 Additionally, we include a span for each of the config files, with an X macro inside the struct, using CONFIG_FIELDS defined above.
 */
@@ -155,6 +188,11 @@ typedef struct ui_state {
     int terminal_rows;
     int terminal_cols;
     int scrolled_lines;
+    int headless;
+    span script;
+    int fixed_rows;
+    int fixed_cols;
+    int blocks_version;
     #define X(name) span name;
     CONFIG_FIELDS
     #undef X
@@ -164,7 +202,7 @@ In main,
 
 First we call init_spans, since all our i/o relies on it.
 
-We call projfiles_arena_alloc near the top and and _free before we exit, with room for 1 << 14 (2^14) elements.
+We call projfiles_arena_alloc near the top and and _free before we exit, with room for 1 << 16 (2^16) elements.
 
 We call span_arena_alloc(), and at the end we call span_arena_free() just for clarity even though it doesn't matter anyway since we're exiting the process.
 We allocate a spans arena of 1 << 20 or a binary million spans.
@@ -172,7 +210,7 @@ We allocate a spans arena of 1 << 20 or a binary million spans.
 Just above main, we declare a global ui_state* called state, which will allow us to not pass around the ui_state singleton all over our program.
 After declaring our ui_state variable in main, which we initialize to {0}, we will set this global pointer to it.
 We set config_file_path on the state to the default configuration file path which is ".cmpr/conf", i.e. always relative to the CWD.
-We projfiles_alloc room for 1024 files on the state, and set the ".n" to zero, so we can use the _push() pattern.
+We projfiles_alloc room for all of those files on the state (a dir line can add thousands, see #dir_sources), and set the ".n" to zero, so we can use the _push() pattern.
 
 We call a function handle_args to handle argc and argv.
 This function will also read our config file (if any).
@@ -185,27 +223,36 @@ In either case, once this returns, inp is populated and any other initial code i
 Then we call main_loop().
 
 The main loop reads input in a loop and probably won't return, but just in case, we always call flush() before we return so that our buffered output from prt and friends will be flushed to stdout.
+
+When built with CMPR_TRACE (see #trace in spanio.c), we register trace_at_exit() with atexit() once the conf has been read, so that the trace is written to tmpdir however we exit.
+
+Other programs (currently bench.c) can include this file with CMPR_NO_MAIN defined to get everything except main().
 */
 
 void handle_args(int argc, char **argv);
 void get_code();
 void check_conf_vars();
 void main_loop();
+void trace_at_exit();
 
 ui_state* state;
 
+#ifndef CMPR_NO_MAIN
 int main(int argc, char** argv) {
     init_spans();
-    projfiles_arena_alloc(1 << 14);
+    projfiles_arena_alloc(1 << 16);
     span_arena_alloc(1 << 20);
 
     ui_state local_state = {0};
     state = &local_state;
     state->config_file_path = S(".cmpr/conf");
-    state->files = projfiles_alloc(1024);
+    state->files = projfiles_alloc(1 << 16);
     state->files.n = 0;
 
     handle_args(argc, argv);
+#ifdef CMPR_TRACE
+    atexit(trace_at_exit);
+#endif
     check_conf_vars();
     get_code();
     main_loop();
@@ -215,12 +262,31 @@ int main(int argc, char** argv) {
     span_arena_free();
     return 0;
 }
+#endif
+/*
+In trace_at_exit we write the trace (if this is a tracing build) to tmpdir as trace-<pid>.json, and tell the user where it went on stderr.
+In normal builds this does nothing.
+*/
+
+void trace_at_exit() {
+#ifdef CMPR_TRACE
+    char path[2048];
+    int need_slash = !empty(state->tmpdir) && state->tmpdir.end[-1] != '/';
+    snprintf(path, sizeof(path), "%.*s%strace-%d.json", len(state->tmpdir), state->tmpdir.buf, need_slash ? "/" : "", (int)getpid());
+    trace_dump(path);
+    fprintf(stderr, "trace written to %s\n", path);
+#endif
+}
 /* #all_functions
 */
 
 void edit_current_block();
 void rewrite_current_block_with_llm();
 void compile();
+void show_build_log();
+void diag_jump(int direction);
+void show_block_diff();
+void show_block_history();
 void replace_code_clipboard();
 void toggle_visual();
 void start_search();
@@ -258,6 +324,8 @@ void exit_success() {
     exit(0);
 }
 
+enum { QUERY_LIST_BLOCKS = 1, QUERY_DUMP_BLOCK, QUERY_GREP, QUERY_COUNT };
+
 void print_config();
 void parse_config();
 void exit_with_error(char*);
@@ -280,6 +348,12 @@ We include argv[0] as usual and indicate that typical usage is by providing a pr
 
 With "--init" we call a function, cmpr_init(), which performs some initialization of a new directory to be used with the tool.
 
+With "--script <file>" we run headless: keystrokes come from the file instead of the terminal (see start_script below).
+"--rows N" and "--cols N" fix the terminal dimensions (headless mode defaults to 24x80), and "--frames <file>" says where rendered output goes in headless mode (default /dev/null).
+
+The query flags "--list-blocks", "--dump-block N", "--grep PATTERN" and "--count" answer a question about the project and exit without ever touching the terminal (see run_query below).
+Like --print-conf, we handle these after parse_config, and they do not call check_conf_vars (which may prompt and always rewrites the conf).
+
 With "--version" we print the version number.
 (The version is always a natural number, and goes up when a release significantly increases usability.
 Here we use "Version: $VERSION$" and the dollar-delimited variable-looking thing is replaced by a build step.)
@@ -287,18 +361,50 @@ Here we use "Version: $VERSION$" and the dollar-delimited variable-looking thing
 void handle_args(int argc, char **argv);
 */
 
+void start_script(char* script_path, char* frames_path);
+void run_query(int query, char* arg);
+
 void handle_args(int argc, char **argv) {
     int print_conf = 0;
+    int query = 0;
+    char* query_arg = NULL;
+    char* script_path = NULL;
+    char* frames_path = "/dev/null";
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--conf") == 0 && i + 1 < argc) {
             state->config_file_path = S(argv[++i]);
         } else if (strcmp(argv[i], "--print-conf") == 0) {
             print_conf = 1;
+        } else if (strcmp(argv[i], "--list-blocks") == 0) {
+            query = QUERY_LIST_BLOCKS;
+        } else if (strcmp(argv[i], "--count") == 0) {
+            query = QUERY_COUNT;
+        } else if (strcmp(argv[i], "--dump-block") == 0 && i + 1 < argc) {
+            query = QUERY_DUMP_BLOCK;
+            query_arg = argv[++i];
+        } else if (strcmp(argv[i], "--grep") == 0 && i + 1 < argc) {
+            query = QUERY_GREP;
+            query_arg = argv[++i];
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            script_path = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames_path = argv[++i];
+        } else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            state->fixed_rows = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cols") == 0 && i + 1 < argc) {
+            state->fixed_cols = atoi(argv[++i]);
         } else if (strcmp(argv[i], "--help") == 0) {
-            prt("Usage: %s [--conf <config-file>] [--print-conf] [--init] [--help] [--version]\n", argv[0]);
+            prt("Usage: %s [--conf <config-file>] [--print-conf] [--script <file> [--frames <file>]] [--rows N] [--cols N] [--init] [--help] [--version]\n", argv[0]);
             prt("       --conf <config-file>   Use an alternate configuration file.\n");
             prt("       --print-conf           Print the current configuration settings.\n");
+            prt("       --script <file>        Run headless, reading keystrokes from file; per-key timings go to stderr.\n");
+            prt("       --frames <file>        Where rendered frames go in --script mode (default /dev/null).\n");
+            prt("       --rows N, --cols N     Use these terminal dimensions instead of asking the terminal (either can be given alone).\n");
+            prt("       --list-blocks          Print index, file, offset, length and first comment line of every block.\n");
+            prt("       --dump-block N         Print block N (one-based, as shown in the UI).\n");
+            prt("       --grep PATTERN         Print block number, file:line and text of every line containing PATTERN.\n");
+            prt("       --count                Print the number of blocks.\n");
             prt("       --init                 Initialize a new directory for use with the tool.\n");
             prt("       --help                 Display this help message and exit.\n");
             prt("       --version              Print the version number and exit.\n");
@@ -318,6 +424,15 @@ void handle_args(int argc, char **argv) {
         print_config();
         exit_success();
     }
+
+    if (query) {
+        run_query(query, query_arg);
+        exit_success();
+    }
+
+    if (script_path) {
+        start_script(script_path, frames_path);
+    }
 }
 /*
 In clear_display() we clear the terminal by printing some escape codes (with prt and flush as usual).
@@ -344,6 +459,8 @@ If either of these conditions fails, the sanity test fails.
 For every other block, .buf is equal to the .end of the previous.
 No block is empty (i.e. len() > 0 in every case).
 If this sanity check fails, we complain and crash as usual (prt, flush, exit).
+
+The block finding guarantees all of this by construction (see grammar_scan), so we only run the check in builds with -DCMPR_DEBUG_BLOCKS, when changing the block finding.
 */
 
 void block_sanity_check(span file, spans blocks) {
@@ -380,266 +497,1013 @@ void block_sanity_check(span file, spans blocks) {
     }
 }
 
+/* #grammar
+
+Blocks are found according to a grammar per language, which has:
+
+- start, a pattern that begins a block when a line starts with it (for C slash-star, for Python three double quotes)
+- end, the comment terminator, which ends the comment part of a block at its first occurrence after the start pattern (for C star-slash, for Python three double quotes again)
+- ext, the file extension, which we use for tmp files (so the editor knows the language), for the fence in prompts, and to pick the language of a file that has none in the conf
+
+C and Python are built in (grammar_init).
+Others, or replacements for the built-in ones, come from grammar lines in the conf (handle_conf_grammar), which have four fields separated by spaces: the language name (as used in language lines), the extension, the start pattern and the terminator.
+For example "grammar: Markdown .md # \n" makes every heading a block, with the heading line as its comment part, and JS, Go or Rust are the same as C except for the name and extension.
+In the patterns \s is a space, \n a newline, \t a tab and \\ a backslash, and each is at most GRAMMAR_PAT_MAX bytes.
+
+The language id that we keep per block (block_table.lang) is the index of the grammar in grammars; LANG_C and LANG_PYTHON are the built-in ones, and stay at those indexes even if the conf replaces them.
+
+The rules are the same for every language:
+
+- The first line of a file always begins a block, whatever it starts with, so a file always has at least one block (an empty file has one empty block).
+- A line that starts with the start pattern begins a block and opens its comment part.
+- While the comment part is open, the terminator closes it; the comment part runs to there, plus any whitespace after it.
+  A start pattern at the start of a line that also completes the terminator (as in Python, where they are the same) closes the comment rather than beginning a block.
+- A block whose comment part is never closed (or never opened, like a first block that doesn't start with the pattern) is all comment part.
+
+grammar_compile turns a grammar into a DFA over byte classes, so that one scan finds both the block starts and the comment ends, with one table lookup per byte:
+
+- Bytes are mapped to classes first: every byte that occurs in either pattern, and newline, gets its own class, and all other bytes share class 0.
+- A state is the combination of how much of the start pattern we have matched since the start of the line (or that it can't match on this line any more), whether a comment part is open, and how much of the terminator we have matched (as in KMP, using its failure function).
+  We number the states directly from these three, so there is no search for reachable states.
+- Each table entry is the offset of the next state's row, shifted left by two, with two bits of action: GRAMMAR_START (the start pattern was just completed at the start of a line) and GRAMMAR_END (the terminator was just completed).
+
+Most bytes are outside comments, on lines that didn't start with the start pattern; in this (idle) state nothing but a newline makes a difference, so grammar_scan jumps to the next newline with memchr.
+*/
+
+#define GRAMMAR_MAX 32
+#define GRAMMAR_PAT_MAX 16
+
+enum { LANG_C, LANG_PYTHON };
+enum { GRAMMAR_START = 1, GRAMMAR_END = 2 };
+
+typedef struct {
+    span name;
+    span ext;
+    span conf;
+    u8 start[GRAMMAR_PAT_MAX];
+    u8 end[GRAMMAR_PAT_MAX];
+    int start_len, end_len;
+    u8 class[256];
+    int nclasses;
+    int idle;
+    int* table;
+} grammar;
+
+grammar grammars[GRAMMAR_MAX];
+int ngrammars;
+
+void grammar_compile(grammar* g) {
+    int S = g->start_len, E = g->end_len;
+    u8 rep[2 * GRAMMAR_PAT_MAX + 2];
+    memset(g->class, 0, sizeof(g->class));
+    g->nclasses = 1;
+    for (int i = 0; i < S + E + 1; i++) {
+        u8 b = i < S ? g->start[i] : i < S + E ? g->end[i - S] : '\n';
+        if (!g->class[b]) {
+            rep[g->nclasses] = b;
+            g->class[b] = g->nclasses++;
+        }
+    }
+    rep[0] = 0;
+    while (g->class[rep[0]] || rep[0] == '\n') rep[0]++;
+
+    int fail[GRAMMAR_PAT_MAX] = {0};
+    for (int i = 1, k = 0; i < E; i++) {
+        while (k > 0 && g->end[i] != g->end[k]) k = fail[k - 1];
+        if (g->end[i] == g->end[k]) k++;
+        fail[i] = k;
+    }
+
+    int nstates = (S + 1) * 2 * E;
+    g->table = realloc(g->table, nstates * g->nclasses * sizeof(int));
+    if (!g->table) exit_with_error("Failed to allocate grammar table");
+    for (int sp = 0; sp <= S; sp++) {
+        for (int open = 0; open < 2; open++) {
+            for (int ep = 0; ep < E; ep++) {
+                int row = ((sp * 2 + open) * E + ep) * g->nclasses;
+                for (int c = 0; c < g->nclasses; c++) {
+                    u8 b = rep[c];
+                    int nsp = S, nopen = open, nep = 0, action = 0;
+                    if (open) {
+                        nep = ep;
+                        while (nep > 0 && g->end[nep] != b) nep = fail[nep - 1];
+                        if (g->end[nep] == b) nep++;
+                        if (nep == E) {
+                            action |= GRAMMAR_END;
+                            nopen = 0;
+                            nep = 0;
+                        }
+                    }
+                    if (sp < S && g->start[sp] == b) {
+                        if (sp + 1 < S) nsp = sp + 1;
+                        else if (!(action & GRAMMAR_END)) {
+                            action |= GRAMMAR_START;
+                            nopen = 1;
+                            nep = 0;
+                        }
+                    }
+                    if (b == '\n') nsp = 0;
+                    g->table[row + c] = ((nsp * 2 + nopen) * E + nep) * g->nclasses << 2 | action;
+                }
+            }
+        }
+    }
+    g->idle = S * 2 * E * g->nclasses;
+}
+
 /*
-In find_all_blocks, we find the blocks in each file.
+grammar_define adds a grammar, or replaces the one of the same name, and compiles it; the patterns are already unescaped.
+*/
 
-We are going to need to know how many blocks there are in all the files, and to store all of the blocks so that we can allocate a single spans to hold all of them at the end.
-Therefore we first allocate an array of the `spans` type, one per file.
+void grammar_define(span name, span ext, span start, span end, span conf) {
+    int i = 0;
+    while (i < ngrammars && !span_eq(grammars[i].name, name)) i++;
+    if (i == GRAMMAR_MAX) {
+        prt("Error: Too many grammars (at most %d).\n", GRAMMAR_MAX);
+        flush();
+        exit(EXIT_FAILURE);
+    }
+    if (i == ngrammars) ngrammars++;
+    grammar* g = &grammars[i];
+    g->name = name;
+    g->ext = ext;
+    g->conf = conf;
+    memcpy(g->start, start.buf, len(start));
+    g->start_len = len(start);
+    memcpy(g->end, end.buf, len(end));
+    g->end_len = len(end);
+    grammar_compile(g);
+}
 
-Then for each of the projfiles, we call find_blocks_by_type() to find the blocks in that file, and stash those temporarily on our array.
-We also call block_sanity_check on the returned blocks for each file.
+void grammar_init() {
+    if (ngrammars) return;
+    grammar_define(S("C"), S(".c"), S("/*"), S("*" "/"), nullspan());
+    grammar_define(S("Python"), S(".py"), S("\"\"\""), S("\"\"\""), nullspan());
+}
 
-Once we have all of the blocks for each of the files, we then can construct a new spans (using spans_alloc) of the right size, and we can copy all the blocks into this, which we store on the state.
-(We don't store the blocks per file anywhere, since we can always determine which file a block belongs to by comparing the block's span with the contents span on the projfile.)
+/*
+In handle_conf_grammar we get the value of a grammar line from the conf (see #grammar), split it into its four fields, unescape the patterns into a local buffer, and define the grammar.
+We keep the value itself (it's in cmp, which the conf stays in) so that save_conf can write the line back out.
+A malformed line is a conf error, so we complain and exit as usual.
 */
 
-spans find_blocks_by_type_python(span);
-spans find_blocks_by_type_c(span);
-spans find_blocks_by_type(span, span);
+int grammar_unescape(span pattern, u8* out) {
+    int n = 0;
+    for (u8* p = pattern.buf; p < pattern.end; p++) {
+        if (n == GRAMMAR_PAT_MAX) return -1;
+        u8 c = *p;
+        if (c == '\\' && p + 1 < pattern.end) {
+            c = *++p;
+            c = c == 'n' ? '\n' : c == 't' ? '\t' : c == 's' ? ' ' : c;
+        }
+        out[n++] = c;
+    }
+    return n;
+}
 
-void find_all_blocks() {
-    spans* file_blocks = (spans*)malloc(state->files.n * sizeof(spans));
-    if (!file_blocks) {
-        perror("Failed to allocate memory for file_blocks");
+void handle_conf_grammar(span value) {
+    grammar_init();
+    span fields[4];
+    int nfields = 0;
+    span rest = value;
+    while (nfields < 4) {
+        while (!empty(rest) && isspace(*rest.buf)) rest.buf++;
+        if (empty(rest)) break;
+        u8* p = rest.buf;
+        while (p < rest.end && !isspace(*p)) p++;
+        fields[nfields++] = (span){rest.buf, p};
+        rest.buf = p;
+    }
+
+    u8 start[GRAMMAR_PAT_MAX], end[GRAMMAR_PAT_MAX];
+    int start_len = nfields == 4 ? grammar_unescape(fields[2], start) : -1;
+    int end_len = nfields == 4 ? grammar_unescape(fields[3], end) : -1;
+    if (start_len <= 0 || end_len <= 0 || memchr(start, '\n', start_len)) {
+        prt("Error: Bad grammar line in conf: %.*s\n", len(value), value.buf);
+        prt("Expected: grammar: <language> <extension> <block start> <comment terminator>\n");
+        prt("(patterns of 1 to %d bytes, \\s for space, \\n newline, \\t tab, \\\\ backslash; no newline in the block start)\n", GRAMMAR_PAT_MAX);
+        flush();
         exit(EXIT_FAILURE);
     }
+    grammar_define(fields[0], fields[1], (span){start, start + start_len}, (span){end, end + end_len}, value);
+}
 
-    size_t total_blocks = 0;
-    for (int i = 0; i < state->files.n; ++i) {
-        file_blocks[i] = find_blocks_by_type(state->files.a[i].contents, state->files.a[i].language);
-        block_sanity_check(state->files.a[i].contents, file_blocks[i]);
-        total_blocks += file_blocks[i].n;
+/*
+language_id gives the index of the grammar for a language name.
+A file with no language at all (which only happens before check_conf_vars has asked for one, e.g. in run_query) is treated as C, as it always has been, and so is one with a language we have no grammar for, since before there were grammars everything but Python was; but that is probably a mistake in the conf, so the first time we see each such name we print a warning that says how to add a grammar (unknown_languages remembers which names we have warned about).
+
+language_for_path gives the name of the language whose extension the path has, or nullspan() if none does; get_code uses it for files that have no language in the conf.
+*/
+
+struct {
+    span a[GRAMMAR_MAX];
+    int n;
+} unknown_languages;
+
+int language_id(span language) {
+    grammar_init();
+    if (empty(language)) return LANG_C;
+    for (int i = 0; i < ngrammars; i++) {
+        if (span_eq(grammars[i].name, language)) return i;
+    }
+    for (int i = 0; i < unknown_languages.n; i++) {
+        if (span_eq(unknown_languages.a[i], language)) return LANG_C;
+    }
+    if (unknown_languages.n < GRAMMAR_MAX) unknown_languages.a[unknown_languages.n++] = language;
+    prt("Warning: Unknown language \"%.*s\", treating it as C.\n", len(language), language.buf);
+    prt("To define it, add a line to the conf: grammar: <language> <extension> <block start> <comment terminator>\n");
+    flush();
+    return LANG_C;
+}
+
+span language_for_path(span path) {
+    grammar_init();
+    for (int i = 0; i < ngrammars; i++) {
+        span ext = grammars[i].ext;
+        if (!empty(ext) && len(path) >= len(ext) && span_eq((span){path.end - len(ext), path.end}, ext)) return grammars[i].name;
     }
+    return nullspan();
+}
 
-    spans all_blocks = spans_alloc(total_blocks);
-    size_t index = 0;
-    for (int i = 0; i < state->files.n; ++i) {
-        for (int j = 0; j < file_blocks[i].n; ++j) {
-            all_blocks.s[index++] = file_blocks[i].s[j];
+/*
+grammar_scan makes one pass over a file and appends what it finds to block_scan, a growable scratch table which it empties first:
+
+- start, the offset in the file where each block starts (a ssize_t, as a windowed file can be bigger than an int, see #windowed),
+- comment_end, the end of its comment part relative to the block start (as in block_table.comment_end),
+- lines, the number of lines in it (as in block_table.lines).
+
+It returns the number of blocks, which is block_scan.n, and block_scan_spans turns the starts into the spans of the blocks.
+If max blocks have been found, the next block start ends the scan, and the last block ends there rather than at the end of the file; comment_end_offset uses this to look at only one block.
+
+The lines come for free: every newline either stops the memchr in the idle state, or is stepped over by the table, so we count them as we go.
+The previous block ends at a block start, just after a newline, so only the last block can end without one.
+
+Blocks are never empty except for the one block of an empty file, so the invariants that block_sanity_check tests hold by construction; find_blocks_by_type only runs it in builds with -DCMPR_DEBUG_BLOCKS.
+*/
+
+struct {
+    ssize_t* start;
+    int* comment_end;
+    int* lines;
+    int n, cap;
+} block_scan;
+
+void block_scan_push(ssize_t start) {
+    if (block_scan.n == block_scan.cap) {
+        block_scan.cap = block_scan.cap ? block_scan.cap * 2 : 1024;
+        block_scan.start = realloc(block_scan.start, block_scan.cap * sizeof(ssize_t));
+        block_scan.comment_end = realloc(block_scan.comment_end, block_scan.cap * sizeof(int));
+        block_scan.lines = realloc(block_scan.lines, block_scan.cap * sizeof(int));
+        if (!block_scan.start || !block_scan.comment_end || !block_scan.lines) exit_with_error("Failed to allocate block scan");
+    }
+    block_scan.start[block_scan.n] = start;
+    block_scan.comment_end[block_scan.n] = -1;
+    block_scan.lines[block_scan.n] = 0;
+    block_scan.n++;
+}
+
+int grammar_scan(grammar* g, span file, int max) {
+    block_scan.n = 0;
+    block_scan_push(0);
+    u8* block_start = file.buf;
+    int lines = 0;
+    int* table = g->table;
+    int row = 0;
+    for (u8* p = file.buf; p < file.end; p++) {
+        if (row == g->idle) {
+            p = memchr(p, '\n', file.end - p);
+            if (!p) break;
+        }
+        if (*p == '\n') lines++;
+        int t = table[row + g->class[*p]];
+        row = t >> 2;
+        if (!(t & 3)) continue;
+        int n = block_scan.n;
+        if (t & GRAMMAR_END) {
+            if (block_scan.comment_end[n - 1] < 0) block_scan.comment_end[n - 1] = p + 1 - block_start;
+            continue;
+        }
+        u8* line = p + 1 - g->start_len;
+        if (line == block_start) continue; // the first line, which began a block anyway
+        if (n == max) {
+            file.end = line;
+            break;
         }
+        block_scan.lines[n - 1] = lines;
+        lines = 0;
+        block_scan_push(line - file.buf);
+        block_start = line;
+    }
+    int n = block_scan.n;
+    block_scan.lines[n - 1] = lines + (file.end > block_start && file.end[-1] != '\n');
+    for (int i = 0; i < n; i++) {
+        u8* b = file.buf + block_scan.start[i];
+        int size = (i + 1 < n ? file.buf + block_scan.start[i + 1] : file.end) - b;
+        int e = block_scan.comment_end[i];
+        if (e < 0 || e > size) e = size;
+        while (e < size && isspace(b[e])) e++;
+        block_scan.comment_end[i] = e;
     }
+    return n;
+}
 
-    state->blocks = all_blocks;
-    free(file_blocks);
+void block_scan_spans(span file, span* out) {
+    int n = block_scan.n;
+    for (int i = 0; i < n; i++) {
+        out[i].buf = file.buf + block_scan.start[i];
+        out[i].end = i + 1 < n ? file.buf + block_scan.start[i + 1] : file.end;
+    }
 }
-/*
-In get_code, we get the code into the input buffer.
 
-For each of the projfiles:
+/* #block_table
+
+Alongside state->blocks we keep a table of facts about each block, which many places need for the current block on every keystroke, and which would otherwise mean scanning the projfiles or the block itself each time.
+
+The table is a struct of arrays, all indexed by block number like state->blocks.s:
 
-- we read this file into inp by read_file_S_into_span with inp_compl() as the span argument, always advancing inp as usual in this pattern so we don't overwrite the contents
-- we store the contents on the projfile
+- file, the index of the projfile the block belongs to
+- lang, the language id of that file (the index of its grammar, from language_id(), see #grammar)
+- comment_end, the offset from the start of the block to the end of its comment part, i.e. len(block_comment_part(block))
+- lines, the number of logical lines in the block (a final line without a newline counts)
+- hash, hash_span() of the block's bytes, so that anything that wants to know whether a block has changed (since it last looked, or compared to some new content) can compare one number
 
-Then we call find_all_blocks(), which sets up the blocks according to each file's contents and language.
+There is one more array, first, indexed by file: first[i] is the index of the first block of file i, and first[state->files.n] is the total number of blocks.
+
+The table also owns the storage of state->blocks (in s), which is malloc'd and grown with the other arrays by block_table_reserve(), so that we can splice one file's blocks in place.
+
+block_table_fill() computes the table rows for a range of blocks which all belong to one file, just after find_blocks_by_type() has found them; the caller passes in the comment ends and line counts from that same scan (block_scan.comment_end and block_scan.lines, see grammar_scan), which must not have been overwritten by another scan since.
+
+block_at(p) binary searches state->blocks for the block containing the pointer p, for when we have a pointer into a file's contents rather than a block number.
+The files in inp and their blocks are in order there, but a windowed file (see #windowed) is mapped somewhere else, so we first look for the file that has p and search only its blocks, with block_in_file(file, p), which callers that know the file call directly.
+An empty file has no blocks, and its contents can start where the next file's do, so when we know the file we must not guess it from the pointer.
+Both return -1 if p isn't in a block of the file (counting the end of the last one), which happens for a file with no blocks, or if p isn't in any file at all; callers that don't just have a pointer into a block they know of must check.
 */
 
-void get_code() {
+struct {
+    span* s;
+    int* file;
+    int* comment_end;
+    int* lines;
+    u64* hash;
+    u8* lang;
+    int* first;
+    int cap, files_cap;
+} block_table;
+
+void block_table_reserve(int n) {
+    if (state->files.n + 1 > block_table.files_cap) {
+        block_table.files_cap = state->files.n + 1;
+        block_table.first = realloc(block_table.first, block_table.files_cap * sizeof(int));
+        if (!block_table.first) exit_with_error("Failed to allocate block table");
+    }
+    if (n <= block_table.cap) return;
+    int cap = block_table.cap ? block_table.cap : 1024;
+    while (cap < n) cap *= 2;
+    block_table.s = realloc(block_table.s, cap * sizeof(span));
+    block_table.file = realloc(block_table.file, cap * sizeof(int));
+    block_table.comment_end = realloc(block_table.comment_end, cap * sizeof(int));
+    block_table.lines = realloc(block_table.lines, cap * sizeof(int));
+    block_table.hash = realloc(block_table.hash, cap * sizeof(u64));
+    block_table.lang = realloc(block_table.lang, cap);
+    if (!block_table.s || !block_table.file || !block_table.comment_end || !block_table.lines || !block_table.hash || !block_table.lang) {
+        exit_with_error("Failed to allocate block table");
+    }
+    block_table.cap = cap;
+    state->blocks.s = block_table.s;
+}
+
+int block_in_file(int file_index, u8* p) {
+    int lo = block_table.first[file_index], hi = block_table.first[file_index + 1] - 1;
+    if (hi < lo) return -1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (state->blocks.s[mid].buf <= p) lo = mid;
+        else hi = mid - 1;
+    }
+    span b = state->blocks.s[lo];
+    return b.buf <= p && p <= b.end ? lo : -1;
+}
+
+int block_at(u8* p) {
     for (int i = 0; i < state->files.n; i++) {
-        state->files.a[i].contents = read_file_S_into_span(state->files.a[i].path, inp_compl());
-        inp.end = state->files.a[i].contents.end; // Advance inp to not overwrite contents
+        if (in(state->files.a[i].contents, p)) return block_in_file(i, p);
     }
+    return -1;
+}
 
-    find_all_blocks();
+void block_table_fill(int from, int to, int file_index, int* comment_end, int* lines) {
+    int lang = language_id(state->files.a[file_index].language);
+    memcpy(block_table.comment_end + from, comment_end, (to - from) * sizeof(int));
+    memcpy(block_table.lines + from, lines, (to - from) * sizeof(int));
+    for (int i = from; i < to; i++) {
+        block_table.file[i] = file_index;
+        block_table.lang[i] = lang;
+        block_table.hash[i] = hash_span(state->blocks.s[i]);
+    }
 }
-/*
-In find_blocks_by_type_python, we get a span containing a file.
 
-We write two loops.
-In the first one we count the blocks, then we spans_alloc our return value with the correct number, and in the second loop we assign the spans.
+/* #block_index
+
+Scanning every file for its blocks (and hashing every block) on every start is a pass over all of the code, though usually almost nothing has changed since last time.
+So get_code keeps an index of the blocks in .cmpr/cache/blocks, and find_all_blocks takes the blocks of every file that hasn't changed from there instead of scanning it.
 
-For a Python file, a block starts with triple double-quote at the beginning of a line.
-It contains another triple double-quote at the beginning of a line somewhere in the middle of the block, ending the comment part, which we must skip over.
-It ends where the next block starts (true for all blocks regardless of language).
+The index is one binary file, in the layout we use in memory, so that loading it is map_file and setting a few pointers, with nothing to parse:
 
-There are some special cases:
+- a header (block_index_header): a magic string, BLOCK_INDEX_VERSION, the number of files and blocks, and the time the files were read,
+- a record for each file (block_index_file): a key (a hash of the path and of the grammar it was scanned with), its size, mtime and a hash of its contents, and which of the blocks are its (first and n),
+- then arrays over all the blocks: the offset of each block in its file, and the hash, comment_end and lines from the block table (see #block_table), which we write out straight from the table.
 
-If the file is empty, we return a single empty block.
+block_index_load finds the record for each projfile by its key, and the file can use it if it has the same size, and either:
 
-If a file does not begin with the triple quote, then the first block will just be from the beginning of the file to the second triple quote at the beginning of a line.
+- the same mtime, from before the second in which the index's files were read (a file changed in the same second that it was read could have the same mtime before and after, as with git's "racy" files),
+- or contents that hash the same as when it was indexed (so a touch, or checking out the same bytes again, costs a hash but not a scan).
 
-The last block always goes to the end of the file.
+The offsets are checked as we go (in order, and inside the file), and so are each block's comment_end and lines (neither can be more than the block's length, or its length plus one for lines), so that a damaged index can only cost a scan.
+All other files are scanned as usual; if any were, or a file was only good by its hash, or the files aren't the same ones, block_index_save writes a new index (to a tmp file, renamed over the old one) after find_all_blocks, and otherwise doesn't write anything.
+If the header isn't exactly what we expect (another version, or the wrong size for its counts) we scan everything, and write a new one.
 
-Before the first loop we copy our argument into a new span `copy` so that we can consume it while counting, but then still have access to the original full span for the second loop.
+Edits in a session don't touch the index; an edited file has a new mtime next time and is scanned then.
+*/
 
-The block-finding loop:
-- While the remaining input is not empty, we get the next line. (Note that next_line will return everything left if there is no newline).
-- If this line starts with the pattern, or if it is the first line in the file, then it begins a block (regardless of whether the line is empty), otherwise we simply do nothing and continue the loop. (If it starts with the pattern and we have seen an odd number of them so far, then we skip it because the pattern appears two times in each Python block.)
-- If we are counting blocks, we increment our counter, otherwise we assign .buf of a span for this block, and if we had a previous block, we assign .end of that block to the same offset.
-- When we reach the end of the input we will assign .end of the last block to the end of the input.
+#define BLOCK_INDEX_VERSION 1
 
-(To determine if we are at the start of the input, we can compare .buf of the line with that of the input.)
+typedef struct {
+    char magic[8];
+    int version;
+    int nfiles;
+    u64 nblocks;
+    long long read_sec;
+} block_index_header;
 
-At the end of the function, we ensure with a simple loop, that all the blocks returned together tile the file, and that none are empty.
-This means:
-The first block begins where our input span begins.
-The last block ends where our input ends.
-If either of these conditions fails, the sanity test fails.
-For every other block, .buf is equal to the .end of the previous.
-If this sanity check fails, we complain and crash as usual (prt, flush, exit).
+typedef struct {
+    u64 key;
+    u64 size;
+    u64 content_hash;
+    long long mtime_sec, mtime_nsec;
+    u64 first, n;
+} block_index_file;
+
+struct {
+    span map;
+    block_index_header* h;
+    block_index_file* files;
+    u64* start;
+    u64* hash;
+    int* comment_end;
+    int* lines;
+    int* match;
+    u64* key;
+    int cap;
+    int stale;
+    time_t read_sec;
+} block_index;
+
+void llm_cache_path(char* buf, int size, char* name);
+
+u64 block_index_key(projfile* f) {
+    grammar* g = &grammars[language_id(f->language)];
+    hasher h;
+    hash_init(&h);
+    hash_update(&h, f->path);
+    hash_update(&h, S("\n"));
+    hash_update(&h, g->name);
+    hash_update(&h, S("\n"));
+    hash_update(&h, (span){g->start, g->start + g->start_len});
+    hash_update(&h, S("\n"));
+    hash_update(&h, (span){g->end, g->end + g->end_len});
+    return hash_final(&h);
+}
+
+/*
+block_index_usable is the test above for file i and record r, including the checks of its offsets, comment ends and line counts.
 */
 
+int block_index_usable(int i, block_index_file* r) {
+    projfile* f = &state->files.a[i];
+    u64 size = f->contents.end - f->contents.buf;
+    if (r->key != block_index.key[i] || r->size != size || r->first + r->n > block_index.h->nblocks || !r->n) return 0;
+    u64* start = block_index.start + r->first;
+    int* comment_end = block_index.comment_end + r->first;
+    int* lines = block_index.lines + r->first;
+    if (start[0]) return 0;
+    for (u64 k = 0; k < r->n; k++) {
+        u64 end = k + 1 < r->n ? start[k + 1] : size;
+        if (end < start[k] || end > size) return 0;
+        if (comment_end[k] < 0 || (u64)comment_end[k] > end - start[k] || lines[k] < 0 || (u64)lines[k] > end - start[k] + 1) return 0;
+    }
+    if (r->mtime_sec == f->mtime.tv_sec && r->mtime_nsec == f->mtime.tv_nsec && r->mtime_sec < block_index.h->read_sec) return 1;
+    block_index.stale = 1;
+    return size <= INT_MAX && hash_span(f->contents) == r->content_hash;
+}
+
+/*
+In block_index_load, called by get_code after the files are read, we map the index and set block_index.match[i] to the record that projfile i can use, or -1.
+read_sec is the time from just before the files were read, which goes in the next index.
+To find the records by key we use a small open-addressing table of record numbers, since a file line added or removed moves all the files after it.
+*/
 
-spans find_blocks_by_type_python(span file) {
-    int block_count = 0;
-    span copy = file;
-    span line;
-    int quote_count = 0;
+void block_index_load(time_t read_sec) {
+    TRACE_SCOPE(block_index_load);
+    int n = state->files.n;
+    if (n > block_index.cap) {
+        block_index.cap = n * 2;
+        block_index.match = realloc(block_index.match, block_index.cap * sizeof(int));
+        block_index.key = realloc(block_index.key, block_index.cap * sizeof(u64));
+        if (!block_index.match || !block_index.key) exit_with_error("Failed to allocate block index");
+    }
+    block_index.read_sec = read_sec;
+    block_index.stale = 0;
+    for (int i = 0; i < n; i++) {
+        block_index.match[i] = -1;
+        block_index.key[i] = block_index_key(&state->files.a[i]);
+    }
 
-    // First loop: count blocks
-    while (!empty(copy)) {
-        line = next_line(&copy);
-        if (starts_with(line, S("\"\"\"")) || copy.buf == file.buf) {
-            quote_count++;
-            // Skip the ending quote of a block
-            if (quote_count % 2 == 0) continue;
-            block_count++;
-        }
+    char path[2048];
+    llm_cache_path(path, sizeof(path), "blocks");
+    span m = map_file(path);
+    block_index_header* h = (block_index_header*)m.buf;
+    size_t size = m.end - m.buf;
+    if (size < sizeof(block_index_header) || memcmp(h->magic, "cmprbix", 8) || h->version != BLOCK_INDEX_VERSION || h->nfiles < 0
+        || size != sizeof(block_index_header) + h->nfiles * sizeof(block_index_file) + h->nblocks * (2 * sizeof(u64) + 2 * sizeof(int))) {
+        unmap_file(m);
+        block_index.map = nullspan();
+        block_index.h = NULL;
+        block_index.stale = 1;
+        return;
     }
+    block_index.map = m;
+    block_index.h = h;
+    block_index.files = (block_index_file*)(h + 1);
+    block_index.start = (u64*)(block_index.files + h->nfiles);
+    block_index.hash = block_index.start + h->nblocks;
+    block_index.comment_end = (int*)(block_index.hash + h->nblocks);
+    block_index.lines = block_index.comment_end + h->nblocks;
+    if (h->nfiles != n) block_index.stale = 1;
+
+    int slots = 16;
+    while (slots < 2 * h->nfiles) slots *= 2;
+    int* table = malloc(slots * sizeof(int));
+    if (!table) exit_with_error("Failed to allocate block index");
+    for (int s = 0; s < slots; s++) table[s] = -1;
+    for (int r = 0; r < h->nfiles; r++) {
+        int s = block_index.files[r].key & (slots - 1);
+        while (table[s] >= 0) s = (s + 1) & (slots - 1);
+        table[s] = r;
+    }
+    for (int i = 0; i < n; i++) {
+        int s = block_index.key[i] & (slots - 1);
+        while (table[s] >= 0 && block_index.files[table[s]].key != block_index.key[i]) s = (s + 1) & (slots - 1);
+        if (table[s] >= 0 && block_index_usable(i, &block_index.files[table[s]])) block_index.match[i] = table[s];
+        else block_index.stale = 1;
+    }
+    free(table);
+}
 
-    spans blocks = spans_alloc(block_count);
-    copy = file; // Reset copy for second loop
-    span* previous_block = NULL;
-    int index = 0;
-    quote_count = 0;
+/*
+block_index_use puts the blocks of file i, from its record, into the block table at row at, and returns how many there are; if file i has no usable record it returns -1, and find_all_blocks scans it.
+*/
 
-    // Second loop: assign spans
-    while (!empty(copy)) {
-        line = next_line(&copy);
-        if (starts_with(line, S("\"\"\"")) || copy.buf == file.buf) {
-            quote_count++;
-            if (quote_count % 2 == 0) continue;
-            if (previous_block != NULL) {
-                previous_block->end = line.buf;
-            }
-            blocks.s[index].buf = line.buf;
-            previous_block = &blocks.s[index++];
-        }
+int block_index_use(int file_index, int at) {
+    if (!block_index.h || block_index.match[file_index] < 0) return -1;
+    block_index_file* r = &block_index.files[block_index.match[file_index]];
+    projfile* f = &state->files.a[file_index];
+    int n = r->n;
+    block_table_reserve(at + n);
+    u64* start = block_index.start + r->first;
+    for (int k = 0; k < n; k++) {
+        state->blocks.s[at + k] = (span){f->contents.buf + start[k], k + 1 < n ? f->contents.buf + start[k + 1] : f->contents.end};
     }
-    if (previous_block != NULL) {
-        previous_block->end = file.end;
+    memcpy(block_table.comment_end + at, block_index.comment_end + r->first, n * sizeof(int));
+    memcpy(block_table.lines + at, block_index.lines + r->first, n * sizeof(int));
+    memcpy(block_table.hash + at, block_index.hash + r->first, n * sizeof(u64));
+    int lang = language_id(f->language);
+    for (int k = at; k < at + n; k++) {
+        block_table.file[k] = file_index;
+        block_table.lang[k] = lang;
     }
+    return n;
+}
 
-    // Sanity check
-    for (int i = 0; i < blocks.n; ++i) {
-        if (i == 0 && blocks.s[i].buf != file.buf) {
-            prt("Error: First block does not start where input begins.\n");
-            flush();
-            exit(EXIT_FAILURE);
+/*
+block_index_save writes the new index, if it is stale, as described above, and then lets go of the old one.
+The content hash of a file that used its record is the one in the record; the others we hash now.
+*/
+
+void block_index_save() {
+    TRACE_SCOPE(block_index_save);
+    if (block_index.stale) {
+        int nfiles = state->files.n;
+        u64 nblocks = state->blocks.n;
+        block_index_header h = {"cmprbix", BLOCK_INDEX_VERSION, nfiles, nblocks, block_index.read_sec};
+        block_index_file* files = malloc(nfiles * sizeof(block_index_file) + 1);
+        u64* start = malloc(nblocks * sizeof(u64) + 1);
+        if (!files || !start) exit_with_error("Failed to allocate block index");
+        for (int i = 0; i < nfiles; i++) {
+            projfile* f = &state->files.a[i];
+            u64 size = f->contents.end - f->contents.buf;
+            int r = block_index.h ? block_index.match[i] : -1;
+            files[i] = (block_index_file){
+                .key = block_index.key[i],
+                .size = size,
+                .content_hash = r >= 0 ? block_index.files[r].content_hash : size <= INT_MAX ? hash_span(f->contents) : 0,
+                .mtime_sec = f->mtime.tv_sec,
+                .mtime_nsec = f->mtime.tv_nsec,
+                .first = block_table.first[i],
+                .n = block_table.first[i + 1] - block_table.first[i],
+            };
+            for (int b = block_table.first[i]; b < block_table.first[i + 1]; b++) start[b] = state->blocks.s[b].buf - f->contents.buf;
         }
-        if (i == blocks.n - 1 && blocks.s[i].end != file.end) {
-            prt("Error: Last block does not end where input ends.\n");
-            flush();
-            exit(EXIT_FAILURE);
+
+        char path[2048], tmp[2100];
+        llm_cache_path(path, sizeof(path), "");
+        mkdir(path, 0755);
+        llm_cache_path(path, sizeof(path), "blocks");
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        span parts[6] = {
+            {(u8*)&h, (u8*)(&h + 1)},
+            {(u8*)files, (u8*)(files + nfiles)},
+            {(u8*)start, (u8*)(start + nblocks)},
+            {(u8*)block_table.hash, (u8*)(block_table.hash + nblocks)},
+            {(u8*)block_table.comment_end, (u8*)(block_table.comment_end + nblocks)},
+            {(u8*)block_table.lines, (u8*)(block_table.lines + nblocks)},
+        };
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int ok = fd >= 0 && write_spans(fd, parts, 6) == 0;
+        if (fd >= 0) close(fd);
+        if (!ok || rename(tmp, path) < 0) unlink(tmp);
+        free(files);
+        free(start);
+    }
+    unmap_file(block_index.map);
+    block_index.map = nullspan();
+    block_index.h = NULL;
+}
+
+/*
+In find_all_blocks, we find the blocks in each file.
+
+For each of the projfiles, we take its blocks from the block index if it hasn't changed (block_index_use, see #block_index), and otherwise we scan the file with its grammar (grammar_scan), and put the spans of its blocks straight onto the end of state->blocks (whose storage belongs to the block table, see #block_table) with block_scan_spans, rather than through find_blocks_by_type and the span arena, since a windowed file (see #windowed) can have more blocks than the arena holds.
+We record where this file's blocks start in block_table.first, and fill in the table rows for them.
+In builds with -DCMPR_DEBUG_BLOCKS we check them with block_sanity_check, as find_blocks_by_type does.
+
+Since we are called whenever the contents have changed, we also drop every file's line index and bump blocks_version.
+
+After a single block has been edited we can do better than this; see reindex_file() below.
+*/
+
+spans find_blocks_by_type(span, span);
+
+void find_all_blocks() {
+    TRACE_SCOPE(find_all_blocks);
+    state->blocks.n = 0;
+    block_table_reserve(0);
+    for (int i = 0; i < state->files.n; ++i) {
+        projfile* f = &state->files.a[i];
+        block_table.first[i] = state->blocks.n;
+        int n = block_index_use(i, state->blocks.n);
+        if (n < 0) {
+            n = grammar_scan(&grammars[language_id(f->language)], f->contents, INT_MAX);
+            block_table_reserve(state->blocks.n + n);
+            block_scan_spans(f->contents, state->blocks.s + state->blocks.n);
+#ifdef CMPR_DEBUG_BLOCKS
+            block_sanity_check(f->contents, (spans){state->blocks.s + state->blocks.n, n});
+#endif
+            block_table_fill(state->blocks.n, state->blocks.n + n, i, block_scan.comment_end, block_scan.lines);
         }
-        if (i > 0 && blocks.s[i].buf != blocks.s[i - 1].end) {
-            prt("Error: Block start does not match previous block end.\n");
-            flush();
-            exit(EXIT_FAILURE);
+        state->blocks.n += n;
+
+        free(f->line_starts);
+        f->line_starts = NULL;
+        f->nlines = 0;
+    }
+    block_table.first[state->files.n] = state->blocks.n;
+    state->blocks_version++;
+}
+
+/*
+In reindex_file, one file has just been changed in place: its bytes in inp have been replaced, everything after it in inp has moved by size_diff, and the contents spans of all the projfiles have already been fixed up (as done in handle_edited_file and replace_block_code_part).
+(For a windowed file the new contents are a new mapping instead, and size_diff is zero, see #windowed.)
+
+Rather than finding every block again, we:
+
+- find the blocks of just this file (with grammar_scan, leaving them in block_scan until there is room for them),
+- move the rows of the table (and state->blocks) for all later files up or down, by the difference in the number of blocks in this file, with memmove,
+- add size_diff to the .buf and .end of those later blocks, since their bytes moved in inp (except in windowed files, which are not in inp), and the difference in block count to later entries of first (nothing else in their rows changes: the comment, line and hash facts are about the block's own bytes),
+- write in the new blocks for this file (block_scan_spans) and fill their rows,
+- and drop this file's line index (the others are offsets into their own contents, so they are still good) and bump blocks_version.
+*/
+
+void reindex_file(int file_index, ssize_t size_diff) {
+    TRACE_SCOPE(reindex_file);
+    projfile* f = &state->files.a[file_index];
+    int n = grammar_scan(&grammars[language_id(f->language)], f->contents, INT_MAX);
+
+    int start = block_table.first[file_index];
+    int old_end = block_table.first[file_index + 1];
+    int delta = n - (old_end - start);
+    int tail = state->blocks.n - old_end;
+    block_table_reserve(state->blocks.n + delta);
+
+    int to = old_end + delta;
+    memmove(block_table.s + to, block_table.s + old_end, tail * sizeof(span));
+    memmove(block_table.file + to, block_table.file + old_end, tail * sizeof(int));
+    memmove(block_table.comment_end + to, block_table.comment_end + old_end, tail * sizeof(int));
+    memmove(block_table.lines + to, block_table.lines + old_end, tail * sizeof(int));
+    memmove(block_table.hash + to, block_table.hash + old_end, tail * sizeof(u64));
+    memmove(block_table.lang + to, block_table.lang + old_end, tail);
+    for (int i = file_index + 1; i <= state->files.n; i++) block_table.first[i] += delta;
+    for (int i = file_index + 1; i < state->files.n && size_diff; i++) {
+        if (state->files.a[i].windowed) continue;
+        for (int b = block_table.first[i]; b < block_table.first[i + 1]; b++) {
+            block_table.s[b].buf += size_diff;
+            block_table.s[b].end += size_diff;
         }
     }
 
-    return blocks;
+    block_scan_spans(f->contents, block_table.s + start);
+    state->blocks.n += delta;
+    block_table_fill(start, start + n, file_index, block_scan.comment_end, block_scan.lines);
+
+    free(f->line_starts);
+    f->line_starts = NULL;
+    f->nlines = 0;
+    state->blocks_version++;
+}
+/* #windowed
+
+Normally every projfile is read into inp, one after another, but a file can be far bigger than inp (generated sources, or Python modules full of data), and read_file_into_span can only give up on those.
+So a file that would take more than 1/WINDOW_SHARE of the room left in inp (leaving the rest for the other files and for edits) is windowed instead: load_projfile maps it read-only (map_file), and the contents span points into the mapping.
+Then the blocks, search, the display and everything else that reads spans work unchanged, and the kernel pages in only the parts that we look at, and can drop them again, since they are clean pages of the file.
+
+- Finding the blocks is still one pass of grammar_scan, which keeps only offsets (block_scan), put straight into the block table; we tell the kernel that access is sequential (MADV_SEQUENTIAL), so that it reads ahead and doesn't hold on to what is behind.
+- An edit can't be made in the mapping, so window_splice writes the new file to a staged file in tmpdir, in one write_spans: the part of the mapping before the old text, the new text, and the part after it.
+  Then it maps the staged file in place of the old mapping (which is unmapped only now, since it was being written from) and finds the blocks of the file again (reindex_file, with nothing in inp having moved).
+- The staged file is the new rev: new_rev renames it into revdir instead of writing the contents out again (unless tmpdir is on another filesystem and the rename fails), and the projfile becomes a link to it as usual.
+  Until then another edit just stages the file again, so a batch of rewrites (#llm_batch) still makes one rev.
+- As windowed files are not in inp, the code that moves the rest of inp after an edit (handle_edited_file, live_apply, splice_block_code_part and reindex_file) skips them, and block_at finds the file before it binary searches.
+
+Like the revs, the mapping assumes that nobody rewrites the file in place underneath us; we never do, as we always write a new file and link it.
+*/
+
+#define WINDOW_SHARE 4
+
+int window_wanted(off_t size) {
+    return size > len(inp_compl()) / WINDOW_SHARE;
+}
+
+span window_map(char* path) {
+    span mapped = map_file(path);
+    if (empty(mapped)) {
+        prt("Failed to map %s\n", path);
+        flush();
+        exit(EXIT_FAILURE);
+    }
+    madvise(mapped.buf, mapped.end - mapped.buf, MADV_SEQUENTIAL);
+    return mapped;
+}
+
+span load_projfile(projfile* f) {
+    char path[2048];
+    s(path, sizeof(path), f->path);
+    struct stat statbuf;
+    int ok = stat(path, &statbuf) == 0;
+    f->windowed = ok && window_wanted(statbuf.st_size);
+    f->mtime = ok ? statbuf.st_mtim : (struct timespec){0};
+    return f->windowed ? window_map(path) : read_file_into_span(path, inp_compl());
+}
+
+void window_staged_path(int file_index, char* path, int size) {
+    int need_slash = state->tmpdir.end[-1] != '/';
+    snprintf(path, size, "%.*s%swindow-%d", len(state->tmpdir), state->tmpdir.buf, need_slash ? "/" : "", file_index);
+}
+
+void window_splice(int file_index, span old, span* parts, int nparts) {
+    TRACE_SCOPE(window_splice);
+    projfile* f = &state->files.a[file_index];
+    char path[1024];
+    window_staged_path(file_index, path, sizeof(path));
+
+    span pieces[16];
+    assert(nparts + 2 <= 16);
+    pieces[0] = (span){f->contents.buf, old.buf};
+    for (int i = 0; i < nparts; i++) pieces[i + 1] = parts[i];
+    pieces[nparts + 1] = (span){old.end, f->contents.end};
+
+    unlink(path); // May be the file we have mapped, from an earlier edit; the mapping stays good
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || write_spans(fd, pieces, nparts + 2) < 0 || close(fd) < 0) {
+        prt("Error: Failed to write %s.\n", path);
+        flush();
+        exit(EXIT_FAILURE);
+    }
+
+    span mapped = map_file(path);
+    if (!empty(mapped)) madvise(mapped.buf, mapped.end - mapped.buf, MADV_SEQUENTIAL);
+    unmap_file(f->contents);
+    f->contents = mapped;
+    reindex_file(file_index, 0);
+}
+
+/*
+splice_file replaces the bytes old, somewhere in the contents of file file_index, with text: for a file in inp by moving the rest of inp up or down and fixing the contents of the later files, as in handle_edited_file, or with window_splice for a windowed file, and either way reindex_file.
+It's for callers that have the new text in hand, like live_apply (#live_edit) and undo (#undo); it doesn't write a rev.
+*/
+
+void splice_file(int file_index, span old, span text) {
+    projfile* f = &state->files.a[file_index];
+    if (f->windowed) {
+        window_splice(file_index, old, &text, 1);
+        return;
+    }
+    ssize_t size_diff = len(text) - len(old);
+    memmove(old.end + size_diff, old.end, inp.end - old.end);
+    memcpy(old.buf, text.buf, len(text));
+    inp.end += size_diff;
+    f->contents.end += size_diff;
+    for (int i = file_index + 1; i < state->files.n; ++i) {
+        if (state->files.a[i].windowed) continue;
+        state->files.a[i].contents.buf += size_diff;
+        state->files.a[i].contents.end += size_diff;
+    }
+    reindex_file(file_index, size_diff);
 }
+
 /*
-In find_blocks_by_type_c, we get a span containing a file.
+In get_code, we get the code into the input buffer.
+
+For each of the projfiles, one after another:
+
+- we read this file into inp by load_projfile, which reads it into inp_compl() as usual in this pattern (or maps it, if it is too big, see #windowed), and advance inp past it, so we don't overwrite the contents
+- we store the contents on the projfile (first unmapping any earlier mapping, if the file was windowed)
+
+This is done by read_projfiles (see #dir_sources), which gets the same result but does the reads in parallel.
 
-We write two loops.
-In the first one we count the blocks, then we spans_alloc our return value with the correct number, and in the second loop we assign the spans.
+Then we call find_all_blocks(), which sets up the blocks according to each file's contents and language, around block_index_load and block_index_save, so that files that haven't changed since the last time aren't scanned again (see #block_index).
+*/
 
-For a C file, a block starts with the slash-star pattern at the beginning of a line.
-It ends where the next block starts.
+void read_projfiles();
 
-There are some special cases:
+void get_code() {
+    time_t read_sec = time(NULL);
+    read_projfiles();
+    block_index_load(read_sec);
+    find_all_blocks();
+    block_index_save();
+}
+/* #run_query
 
-If the file is empty, we return a single empty block.
-We handle this as a special case, since it doesn't really work with our two-loop approach.
-We also care about where the blocks are, even if they are empty, so in this case we ensure that the empty block we return is the same as the empty span of the file itself (i.e. .buf and .end are equal to each other, and to those of the file: we can NOT use nullspan() here).
+Here we answer the non-interactive queries from handle_args, for scripts and editor integrations that shell out to us.
 
-If a file does not begin with a block comment, then the first block will just be from the beginning of the file to the first block comment.
+These use the same reading and block finding as get_code() and find_all_blocks(), but one file at a time, so that we can stream results and use constant memory:
 
-The last block always goes to the end of the file.
+- we read file i into inp at the same place every time (inp.end is never advanced past the one file), with load_projfile, so a file too big for that is mapped (see #windowed) and unmapped when we're done with it,
+- we find its blocks with find_blocks_by_type() inside a span_arena_push/pop,
+- we answer the query for those blocks, numbering them from the running total of blocks in earlier files, so the numbers match the UI (one-based),
+- and before moving on we set the file's contents back to nullspan(), so that file_for_block() can never match a file whose bytes have been overwritten.
 
-Before the first loop we copy our argument into a new span `copy` so that we can consume it while counting, but then still have access to the original full span for the second loop.
+Output is prt'd and then sent with flush_reset() after each file (and every 64k within a file), so the first results go out as soon as the first file is done.
 
-The block-finding loop:
-- While the remaining input is not empty, we get the next line. (Note that next_line will return everything left if there is no newline).
-- If this line starts with the pattern, or if it is the first line in the file, then it begins a block (regardless of whether the line is empty), otherwise we simply do nothing and continue the loop.
-- If we are counting blocks, we increment our counter, otherwise we assign .buf of a span for this block, and if we had a previous block, we assign .end of that block to the same offset.
-- When we reach the end of the input we will assign .end of the last block to the end of the input.
+The queries:
 
-(To determine if we are at the start of the input, we can compare .buf of the line with that of the input.)
+- QUERY_LIST_BLOCKS: one tab-separated line per block with the index, file path, byte offset in the file, length, and the first comment line (see first_comment_line below)
+- QUERY_DUMP_BLOCK: the contents of block N exactly; we stop reading files as soon as we have printed it, and complain (prt, flush, exit) if there is no such block
+- QUERY_GREP: for every line containing the pattern, the block index, file:line (one-based) and the line, tab-separated; we memmem through the whole file and walk the blocks and the newline count forward as we go, so each file is scanned once; lines that aren't in any block (all of them, in a file with no blocks) are skipped, as they have no block index to report
+- QUERY_COUNT: the total number of blocks
 */
 
-spans find_blocks_by_type_c(span file) {
-    if (empty(file)) {
-        // Handle special case for empty file
-        spans single_empty_block = spans_alloc(1);
-        single_empty_block.s[0].buf = file.buf;
-        single_empty_block.s[0].end = file.end;
-        return single_empty_block;
-    }
-
-    int block_count = 0;
-    span copy = file;
-    int is_first_line = 1;
-
-    // First loop: count blocks
-    while (!empty(copy)) {
-        span line = next_line(&copy);
-        if (is_first_line || starts_with(line, S("/*"))) {
-            block_count++;
-            is_first_line = 0;
-        }
-    }
-
-    spans blocks = spans_alloc(block_count);
-    copy = file; // Reset copy for second loop
-    span* previous_block = NULL;
-    int index = 0;
-    is_first_line = 1;
-
-    // Second loop: assign spans
-    while (!empty(copy)) {
-        span line = next_line(&copy);
-        if (is_first_line || starts_with(line, S("/*"))) {
-            if (previous_block != NULL) {
-                previous_block->end = line.buf;
+span first_comment_line(span block);
+span block_comment_part(span block);
+
+void query_maybe_flush() {
+    if (len(out) > (1 << 16)) flush_reset();
+}
+
+void query_grep_file(span file, spans blocks, int first_index, span path, span pattern) {
+    if (!blocks.n) return;
+    int b = 0;
+    int line_no = 1;
+    u8* counted = file.buf;
+    span rest = file;
+    while (!empty(rest)) {
+        span hit = spanspan(rest, pattern);
+        if (empty(hit)) break;
+        u8* line_start = hit.buf;
+        while (line_start > file.buf && line_start[-1] != '\n') line_start--;
+        span line = {line_start, hit.buf};
+        while (line.end < file.end && *line.end != '\n') line.end++;
+
+        for (; counted < line_start; counted++) if (*counted == '\n') line_no++;
+        while (b < blocks.n - 1 && blocks.s[b].end <= line_start) b++;
+
+        rest.buf = line.end < file.end ? line.end + 1 : file.end;
+        if (!in(blocks.s[b], line_start)) continue;
+        prt("%d\t%.*s:%d\t%.*s\n", first_index + b + 1, len(path), path.buf, line_no, len(line), line.buf);
+        query_maybe_flush();
+    }
+}
+
+void run_query(int query, char* arg) {
+    span pattern = arg ? S(arg) : nullspan();
+    int wanted = query == QUERY_DUMP_BLOCK ? atoi(arg) : 0;
+    if (query == QUERY_GREP && empty(pattern)) {
+        prt("Error: --grep needs a non-empty pattern\n");
+        flush();
+        exit(EXIT_FAILURE);
+    }
+
+    int total = 0;
+    u8* base = inp.end;
+    for (int i = 0; i < state->files.n; i++) {
+        projfile* f = &state->files.a[i];
+        f->contents = load_projfile(f);
+        span_arena_push();
+        spans blocks = find_blocks_by_type(f->contents, f->language);
+
+        if (query == QUERY_LIST_BLOCKS) {
+            for (int j = 0; j < blocks.n; j++) {
+                span line = first_comment_line(blocks.s[j]);
+                prt("%d\t%.*s\t%d\t%d\t%.*s\n", total + j + 1, len(f->path), f->path.buf,
+                    (int)(blocks.s[j].buf - f->contents.buf), len(blocks.s[j]), len(line), line.buf);
+                query_maybe_flush();
             }
-            blocks.s[index].buf = line.buf;
-            previous_block = &blocks.s[index++];
-            is_first_line = 0;
+        } else if (query == QUERY_DUMP_BLOCK && wanted > total && wanted <= total + blocks.n) {
+            wrs(blocks.s[wanted - total - 1]);
+            flush_reset();
+            return;
+        } else if (query == QUERY_GREP) {
+            query_grep_file(f->contents, blocks, total, f->path, pattern);
         }
+
+        total += blocks.n;
+        span_arena_pop();
+        if (f->windowed) unmap_file(f->contents);
+        f->windowed = 0;
+        f->contents = nullspan();
+        inp.end = base;
+        flush_reset();
+    }
+
+    if (query == QUERY_DUMP_BLOCK) {
+        prt("Error: no block %d (there are %d blocks)\n", wanted, total);
+        flush();
+        exit(EXIT_FAILURE);
     }
-    if (previous_block != NULL) {
-        previous_block->end = file.end;
+    if (query == QUERY_COUNT) {
+        prt("%d\n", total);
     }
+    flush_reset();
+}
+/*
+In first_comment_line we are given a block and return the first line of its comment part that has anything in it besides the block start pattern, with the pattern and surrounding whitespace trimmed.
+E.g. for a C block whose first line is the comment opener followed by "#handle_keystroke" we return "#handle_keystroke", and if the opener is alone on its line we return the next non-blank line.
 
-    return blocks;
+We use block_comment_part(), so this follows the language of the block's file, and we stop at the end of the comment part, returning an empty span (located at the end of the comment) if there is no such line.
+Since we only want to show this on one line, we also drop a trailing comment terminator if the comment is all on one line.
+*/
+
+span first_comment_line(span block) {
+    span comment = block_comment_part(block);
+    while (!empty(comment)) {
+        span line = next_line(&comment);
+        if (!consume_prefix(&line, S("/*"))) consume_prefix(&line, S("\"\"\""));
+        while (!empty(line) && isspace(*line.buf)) line.buf++;
+        while (!empty(line) && isspace(line.end[-1])) line.end--;
+        if (len(line) >= 2 && (span_eq((span){line.end - 2, line.end}, S("*/")))) line.end -= 2;
+        if (len(line) >= 3 && (span_eq((span){line.end - 3, line.end}, S("\"\"\"")))) line.end -= 3;
+        while (!empty(line) && isspace(line.end[-1])) line.end--;
+        if (!empty(line)) return line;
+    }
+    return comment;
 }
 /*
-In `spans find_blocks_by_type(span,span)`, we take a span and a language, which is currently either C or Python.
+In `spans find_blocks_by_type(span,span)`, we take a span and a language, and find the blocks with the grammar for that language (see #grammar).
 
-We dispatch to another function that handles either language, and return the resulting spans.
+We make one pass with grammar_scan, which leaves the block starts in block_scan (along with each block's comment end and line count, for block_table_fill), then we spans_alloc our return value with the correct number and fill in the spans from the starts (block_scan_spans).
 
-If the language is not known, we prt, flush, exit as per usual.
+If the language is not known, language_id complains and exits.
+
+In builds with -DCMPR_DEBUG_BLOCKS we also run block_sanity_check on the result.
 */
 
 spans find_blocks_by_type(span source, span language) {
-    if (span_eq(language, S("C"))) {
-        return find_blocks_by_type_c(source);
-    } else if (span_eq(language, S("Python"))) {
-        return find_blocks_by_type_python(source);
-    } else {
-        prt("Error: Unknown language\n");
-        flush();
-        exit(EXIT_FAILURE);
-    }
+    int n = grammar_scan(&grammars[language_id(language)], source, INT_MAX);
+    spans blocks = spans_alloc(n);
+    block_scan_spans(source, blocks.s);
+#ifdef CMPR_DEBUG_BLOCKS
+    block_sanity_check(source, blocks);
+#endif
+    return blocks;
 }
 /*
 Function to read a single character without echoing it to the terminal.
+
+In headless mode we take the next byte of the script instead (see next_script_key below).
 */
 
+char next_script_key();
+
 char getch(void) {
+  if (state->headless) return next_script_key();
   char buf = 0;
   struct termios old = {0}, new = {0};
   if (tcgetattr(0, &old) < 0) perror("tcgetattr()");
@@ -680,11 +1544,107 @@ void reset_stdin_to_terminal() {
   close(tty_fd);
 }
 
-/*
-In main_loop, we initialize:
+/* #headless
 
-- the current index to 0,
-- the marked index to -1 indicating that we are not in visual selection mode.
+Headless (scripted) mode lets us drive cmpr without a terminal, for benchmarking and automation.
+
+In start_script, we are given the path of a script file and a path to send frames to.
+
+The script is simply the keystrokes, byte for byte, exactly as they would be typed: "j" moves down, "\n" is enter (e.g. to finish a search), 127 is backspace, and so on.
+A script can be made with printf, e.g. `printf 'jjj/needle\nGk' > keys`.
+We read it into the cmp space (advancing cmp.end as usual), and store the span on state->script.
+
+We then point stdout (fd 1) at the frames file, so that everything we render goes there, and set state->headless.
+If no dimensions were given by flags we use 24x80, and if only one was given, the default for the other.
+
+We also register script_summary() with atexit() so that we always print a summary, however the script ends (it may end with "q", or just run out of keys).
+
+In next_script_key, called by getch() in headless mode, we print a timing line for the previous key, which is the time from when getch() returned that key until getch() was called again, i.e. the time to handle the key and render the next frame.
+These go to stderr as tab-separated: the key number (one-based), the key (escaped), and the nanoseconds.
+We store the samples for the summary as well.
+When the script runs out we exit_success().
+
+The summary line, also on stderr, gives the number of keys, total time, mean, p50, p90, p99 and max.
+*/
+
+long long* script_samples;
+int script_nsamples;
+long long script_key_time;
+char script_last_key;
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void script_summary();
+
+void start_script(char* script_path, char* frames_path) {
+  state->script = read_file_into_span(script_path, cmp_compl());
+  cmp.end = state->script.end;
+
+  script_samples = malloc((len(state->script) + 1) * sizeof(long long));
+  if (!script_samples) exit_with_error("Failed to allocate script timing samples");
+
+  int fd = open(frames_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    prt("Failed to open %s for frames\n", frames_path);
+    flush();
+    exit(EXIT_FAILURE);
+  }
+  flush();
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+
+  if (!state->fixed_rows) state->fixed_rows = 24;
+  if (!state->fixed_cols) state->fixed_cols = 80;
+  state->headless = 1;
+  atexit(script_summary);
+}
+
+void script_record() {
+  if (!script_key_time) return;
+  long long dt = now_ns() - script_key_time;
+  script_samples[script_nsamples++] = dt;
+  fprintf(stderr, "%d\t", script_nsamples);
+  if (isprint((u8)script_last_key)) fprintf(stderr, "%c", script_last_key);
+  else fprintf(stderr, "\\%03o", (u8)script_last_key);
+  fprintf(stderr, "\t%lld\n", dt);
+  script_key_time = 0;
+}
+
+char next_script_key() {
+  flush();
+  script_record();
+  if (empty(state->script)) exit_success();
+  script_last_key = *state->script.buf++;
+  script_key_time = now_ns();
+  return script_last_key;
+}
+
+int cmp_long_long(const void* a, const void* b) {
+  long long x = *(long long*)a, y = *(long long*)b;
+  return x < y ? -1 : x > y;
+}
+
+void script_summary() {
+  flush();
+  script_record();
+  int n = script_nsamples;
+  if (!n) return;
+  long long total = 0;
+  for (int i = 0; i < n; i++) total += script_samples[i];
+  qsort(script_samples, n, sizeof(long long), cmp_long_long);
+  fprintf(stderr, "keys %d total_ns %lld mean_ns %lld p50_ns %lld p90_ns %lld p99_ns %lld max_ns %lld\n",
+          n, total, total / n, script_samples[n / 2], script_samples[n * 9 / 10], script_samples[n * 99 / 100], script_samples[n - 1]);
+}
+
+/*
+In main_loop, we initialize:
+
+- the current index to 0,
+- the marked index to -1 indicating that we are not in visual selection mode.
 
 In our loop, we call check_conf_vars(), which just handles the case where some essential configuration variables aren't set.
 
@@ -696,25 +1656,36 @@ We also define a helper function print_current_blocks; we include just the decla
 (Reminder: we never write `const` in C.)
 
 Once we have a keystroke, we will call another function, handle_keystroke, which takes the char that was entered.
+
+Since a build may be running in the background (see #compile), we actually wait with wait_for_key() rather than getch() directly.
+This returns -1 instead of a key when something other than the keyboard needs the screen redrawn (e.g. the build finished), in which case we just go around the loop again.
+
+Before each redraw we also call llm_batch_pump(), which applies any batch rewrite replies that have arrived and keeps the batch going (see #llm_batch).
 */
 
 void check_conf_vars();
+void llm_batch_pump();
 void print_current_blocks();
 void handle_keystroke(char keystroke);
+int wait_for_key();
 
 void main_loop() {
     state->current_index = 0;
     state->marked_index = -1;
 
     while (1) {
+        TRACE_SCOPE(main_loop);
         check_conf_vars(); // Ensure essential configuration variables are set
+        llm_batch_pump(); // Apply batch rewrite replies that have arrived, start more
 
+        TRACE_BEGIN(render);
         clear_display(); // Clear the terminal screen
         print_current_blocks(); // Print the current block or blocks
         flush(); // Flush the output before waiting for input
+        TRACE_END(render);
 
-        char input = getch(); // Wait for a single keystroke
-        handle_keystroke(input); // Handle the input keystroke
+        int input = wait_for_key(); // Wait for a single keystroke, or a build event
+        if (input >= 0) handle_keystroke(input); // Handle the input keystroke
     }
 }
 /* span count_physical_lines(span, int*)
@@ -741,6 +1712,7 @@ The int will go to zero if the span passed in is long enough, otherwise the span
 */
 
 span count_physical_lines(span input, int *max_physical_lines) {
+    TRACE_SCOPE(count_physical_lines);
     span result = input;
     int line_count = 0;
     int chars_in_line = 0;
@@ -861,6 +1833,8 @@ In print_current_blocks, we print either the current block, if we are in normal
 
 Before this, we write a helper function that gets the screen dimensions (rows and cols) from the terminal.
 This function will update the state directly.
+If dimensions were fixed with --rows/--cols (always the case in headless mode), we use those instead of asking the terminal; either one can be given alone, and the other still comes from the terminal.
+If the terminal reports zero rows or columns (e.g. a pty that was never sized), we fall back to 24x80 rather than dividing by zero later.
 
 If marked_index != -1 and != current_index, then we have a "visual" selected range of more than 1 block.
 
@@ -876,15 +1850,16 @@ Helper functions:
 */
 
 void get_screen_dimensions() {
-  struct winsize w;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-  state->terminal_rows = w.ws_row;
-  state->terminal_cols = w.ws_col;
+  struct winsize w = {0};
+  if (!state->fixed_rows || !state->fixed_cols) ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+  state->terminal_rows = state->fixed_rows ? state->fixed_rows : w.ws_row ? w.ws_row : 24;
+  state->terminal_cols = state->fixed_cols ? state->fixed_cols : w.ws_col ? w.ws_col : 80;
 }
 
 void render_block_range(int, int);
 
 void print_current_blocks() {
+  TRACE_SCOPE(print_current_blocks);
   get_screen_dimensions();
 
   if (state->marked_index != -1 && state->marked_index != state->current_index) {
@@ -986,12 +1961,20 @@ In handle_keystroke, we support the following single-char inputs:
 - j/k Go up or down one block. If we are at the first or last block, these are no-ops.
 - g/G Go to the first or last block resp.
 - e, Edit the current block in $EDITOR (or vi by default)
-- r, Request an LLM rewrite the code part of the block based on the comment part; silently updates clipboard
+- E, Edit the current block live: in the liveedit command (or any editor, on the file named in the ruler) while we keep running, applying every save (live_edit_toggle(), see #live_edit); E again stops
+- r, Request an LLM rewrite the code part of the block based on the comment part; silently updates clipboard (or, if llmurl is set, streams the rewrite straight into the block; in visual mode with llmurl set, rewrites every selected block in the background)
 - R, kin to "r", which reads current clipboard contents back into the block, replacing the code part
+- u, undo the last edit (from any of e, E, R or r), and Ctrl-R, redo it (undo_step(), see #undo)
 - space/b, paginate down or ("back") up within a block
-- B, do a build by running the build command you provide
+- B, start a build in the background by running the build command you provide; status shows in the ruler
+- L, show the output of the last (or current) build in a scrollable pane
+- ]/[, jump to the next/previous block with a compiler diagnostic from the last build
+- d, diff the current block against its most recent earlier version in the revs
+- H, browse the history of the current block, version by version, and restore any of them (show_block_history(), see #history)
 - v, sets the marked point to the current index, switching to "visual" selection mode, or leaves visual mode if in it
+- Esc, cancels a batch rewrite in progress (llm_batch_cancel())
 - /, switches to search mode
+- n/N, go to the next/previous match of the last search, in this block or another one (match_jump(), see #match_list)
 - S, (likely to change) goes into settings mode
 - ?, display brief help about the keyboard shortcuts available
 - q, exits (with prt("goodbye\n"); flush(); exit(0))
@@ -1006,10 +1989,16 @@ We can call clear_display first, and flush, getch after, so the user has time to
 We call terpri() on the first line of this function (just to separate output from any handler function from the ruler line).
 
 Implemented inline: j,k,g,G,?,q
-All others call helper functions already declared above (B -> compile()).
+All others call helper functions already declared above (B -> compile(), L -> show_build_log(), d -> show_block_diff(), H -> show_block_history(), n/N -> match_jump(), u/Ctrl-R -> undo_step()).
 */
 
+void llm_batch_cancel();
+void live_edit_toggle();
+void match_jump(int direction);
+void undo_step(int redo);
+
 void handle_keystroke(char input) {
+    TRACE_SCOPE(handle_keystroke);
     terpri();
 
     switch (input) {
@@ -1036,12 +2025,21 @@ void handle_keystroke(char input) {
         case 'e':
             edit_current_block();
             break;
+        case 'E':
+            live_edit_toggle();
+            break;
         case 'r':
             rewrite_current_block_with_llm();
             break;
         case 'R':
             replace_code_clipboard();
             break;
+        case 'u':
+            undo_step(0);
+            break;
+        case 18: // Ctrl-R
+            undo_step(1);
+            break;
         case ' ':
             page_down();
             break;
@@ -1051,12 +2049,36 @@ void handle_keystroke(char input) {
         case 'B':
             compile();
             break;
+        case 'L':
+            show_build_log();
+            break;
+        case 'd':
+            show_block_diff();
+            break;
+        case 'H':
+            show_block_history();
+            break;
+        case ']':
+            diag_jump(1);
+            break;
+        case '[':
+            diag_jump(-1);
+            break;
         case 'v':
             toggle_visual();
             break;
+        case 27:
+            llm_batch_cancel();
+            break;
         case '/':
             start_search();
             break;
+        case 'n':
+            match_jump(1);
+            break;
+        case 'N':
+            match_jump(-1);
+            break;
         case 'S':
             settings_mode();
             break;
@@ -1065,12 +2087,20 @@ void handle_keystroke(char input) {
             prt("j/k: Move up/down one block.\n");
             prt("g/G: Go to the first/last block.\n");
             prt("e: Edit current block in $EDITOR (default: vi).\n");
-            prt("r: Rewrite code part based on comment, puts prompt on clipboard.\n");
+            prt("E: Edit current block live, applying every save (liveedit command, or open the file shown in the ruler); E again stops.\n");
+            prt("r: Rewrite code part based on comment, puts prompt on clipboard (or streams it in from llmurl, if set).\n");
+            prt("   In visual mode with llmurl set, rewrites all selected blocks, llmjobs at a time (progress in the ruler, Esc cancels).\n");
             prt("R: Read clipboard contents back into block, replacing code part.\n");
+            prt("u/Ctrl-R: Undo/redo the last edit (e, E, R or r), writing a rev as usual.\n");
             prt("space/b: Paginate down/back up within a block.\n");
-            prt("B: Execute build command.\n");
+            prt("B: Start build command in the background (status in the ruler).\n");
+            prt("L: Show build output (j/k scroll, space/b page, q to return).\n");
+            prt("]/[: Jump to next/previous block with a build error or warning.\n");
+            prt("d: Diff block against its previous rev (s side-by-side, q to return).\n");
+            prt("H: Block history: p/n step to older/newer versions (shown as diffs), c diffs against the current block, r restores (u undoes).\n");
             prt("v: Mark current index, toggle visual selection mode.\n");
-            prt("/: Enter search mode.\n");
+            prt("/: Enter search mode (start with another / for a regex, e.g. //^span \\w+\\(, or ~ to rank blocks, e.g. /~read block).\n");
+            prt("n/N: Go to the next/previous match of the last search (all matches on the screen are highlighted).\n");
             prt("S: Enter settings mode.\n");
             prt("?: Display this help.\n");
             prt("q: Exit (goodbye).\n");
@@ -1097,7 +2127,7 @@ We can do this using S(), but we prefer to just directly construct the span.
 When we first go into search mode, we point the span at the start of the static buffer, we make it length 1 and the static buffer always starts with slash.
 
 Then we enter our own loop where we call getch and handle basic line editing.
-On any backspace character we will simply shorten the span (.end--) and on any other input at all we will extend it.
+On any backspace character we will simply shorten the span (.end--) and on any other input at all we will extend it, except Ctrl-N and Ctrl-P, which move the choice in a ranked search (rank_select, see #ranked_search).
 However, if we've deleted the initial slash, that means the user doesn't want to be in search mode any more.
 Therefore, if the search span on the ui state has zero length, this means search mode is off.
 So after every backspace, if the search span length goes to zero then we call print_current_blocks() to update the display and then return.
@@ -1118,6 +2148,7 @@ We write declarations for the helper functions (which we define below).
 
 void perform_search();
 void finalize_search();
+void rank_select(int delta);
 
 void start_search() {
     static char search_buffer[256] = {"/"}; // Static buffer for search, pre-initialized with "/"
@@ -1136,6 +2167,8 @@ void start_search() {
                     return;
                 }
             }
+        } else if (input == 14 || input == 16) { // Ctrl-N, Ctrl-P: choose among ranked results
+            rank_select(input == 14 ? 1 : -1);
         } else if ((state->search.end - state->search.buf) < sizeof(search_buffer) - 1) {
             // Ensure there's space for more characters
             *state->search.end++ = input; // Extend the span
@@ -1147,1172 +2180,5562 @@ void start_search() {
     finalize_search(); // Finalize search on Enter
 }
 
-/*
-In perform_search(), we get the state after the search string has been updated.
+/* #regex
 
-The search string (span state.search) will always start with a slash.
-We remove this (there is no library method for this so just directly construct the span) and take the rest of it as the actual string to search for.
-We iterate through the blocks and use spanspan to find the first block that matches, along with the number of other blocks that match.
-If the search span is empty (as when only "/" was typed) then we match every block, so we can use empty() on the result of spanspan to detect a match, but we also match if the search span is empty().
-(This will store the empty span at the beginning of the first block as the match span, which gives the behavior we want when printing the match later.)
-We store both the index of the first block that matched and a copy of the span given by spanspan for this first block only, as we will need both of them later.
+Search mode also takes regular expressions: if the search starts with a second slash ("//^span \w+\("), the rest is a regex rather than a literal string.
 
-This tells us where the first block was that matched, and how many total blocks matched, and also the location in the span that contains the match.
+The syntax is the usual one, on bytes:
 
-Once we have our search results, we call clear_display().
+- . matches any byte but newline, [abc] [a-z] [^...] are byte sets, and \w \d \s (and \W \D \S for their complements) work both inside and outside sets
+- like ., the complements [^...], \W and \D don't match newline, so that they can't run a match on into the next line; a set only matches newline if it has \n (or \s) in it
+- \n and \t are newline and tab, and a backslash before anything else makes it literal
+- ^ and $ match at the start and end of any line (not just of the block)
+- | ( ) * + ? as usual
 
-Also at the top, we declare a local variable of remaining lines from the top of the terminal window, since we want to print something at the bottom later.
-Every time we print a line or multiple lines, we decrement this value with the number of lines we printed, no more and no less.
-In particular, we never decrement this "in advance," for lines to printed later, as that would violate the invariant that the number of actual remaining lines is the number in our variable.
+There is no backtracking, so every search is linear in the size of the blocks, however the pattern is written.
 
-Next, we print "Block N:" on a line (adding one as usual).
-Then we decide how many initial lines of the block to print.
-Without changing the terminal lines remaining value (since we indeed want our last line to be on the last line) we subtract 8 from this remaining number (leaving space for other output) and divide this by two to get the number of initial block physical lines to print.
-Then we print this many physical lines of the block, by calling a function print_physical_lines(span,int).
-(Note: physical lines means terminal rows used, as opposed to logical lines actually ending in newline.)
+regex_compile parses the pattern (rx_alt and friends, a small recursive descent parser) into a tree of rx_node, and from the tree emits two Thompson NFAs (rx_emit): prog[0] for the regex, and prog[1] for the regex reversed (concatenations in the other order, and ^ and $ swapped).
+Each emits one instruction per tree node, so a pattern of our at most 255 bytes always fits in REGEX_MAX.
+Then it divides the 256 bytes into classes (as in #grammar): two bytes are in the same class if every byte set in the pattern either has both or neither, and newline always has a class of its own.
 
-If nothing matched, then we do not print this part, but we still print the "N blocks matched" part later (0 in that case, of course) and the search string itself on the last line.
+The NFAs are run as DFAs which are built lazily (rx_dfa), one state at a time as the text needs them:
 
-After the first lines of the block, we print a blank line, then "Match:" on a line, and then the line that contains the matched span.
-We call a helper function, print_matching_physical_lines, which takes the block and the actual matched span (which we have from before), and handles finding and printing the match, and returns the number of physical lines that it used.
+- A DFA state is a set of NFA instructions (with the epsilon moves already followed), and a flag for whether we are at the start of a line.
+  We keep $ instructions in the set unresolved, since whether they hold depends on the next byte; ^ is resolved by the flag.
+- rx_step gives the next state for a state and a byte class, and also whether a match ended just before that byte, caching both in the transition table, so after warming up it is one table lookup per byte.
+- The states are interned in a hash table; when there are REGEX_DFA_MAX of them we drop them all and start again (only the current state is needed to go on), so memory is bounded for any pattern.
 
-We print another blank line and then "N blocks matched".
+Each search worker has its own pair of DFAs (see #search_pool), so the lazy building needs no locking.
 
-Finally, we will add empty lines until we are at the bottom of the screen as indicated by terminal_rows on the state.
-On the last line we will print the entire search string (including the slash).
-(We can do this with wrs(), we don't need to add a newline as we are already on the last line of the window anyway.)
-Before returning from the function we call flush() as we are responsible for updating the display.
+regex_find finds a match in a span with two passes, together linear in its length:
+
+- the forward DFA, with the start of the regex added back in after every byte, finds where the first match ends,
+- then the reverse DFA runs backwards from there, as far as it can go, to find the leftmost start of a match ending there.
+
+So the match we report is the one that ends first, and the longest one that ends there.
+As the search display shows one line, we clip a match that goes over a newline at the end of its first line.
+The text need not start at the start of a line (see #match_list, which looks for the next match after the last one), so the caller tells us with bol whether ^ holds at its start.
 */
 
-void perform_search() {
-    int remaining_lines = state->terminal_rows;
-    span search_span = {state->search.buf + 1, state->search.end};
-    int match_count = 0;
-    int first_match_index = -1;
-    span first_match_span = nullspan();
+#define REGEX_MAX 512
+#define REGEX_DFA_MAX 2048
 
-    for (int i = 0; i < state->blocks.n; i++) {
-        span match = spanspan(state->blocks.s[i], search_span);
-        if (!empty(match) || empty(search_span)) {
-            if (first_match_index == -1) {
-                first_match_index = i;
-                first_match_span = match;
-            }
-            match_count++;
-        }
-    }
+enum { RX_SET, RX_CAT, RX_ALT, RX_STAR, RX_PLUS, RX_QUEST, RX_BOL, RX_EOL, RX_EMPTY, RX_SPLIT, RX_MATCH };
 
-    clear_display();
+typedef struct { u8 op; int a, b; } rx_node;
 
-    if (first_match_index != -1) {
-        prt("Block %d:\n", first_match_index + 1);
-        remaining_lines -= 1;
+typedef struct {
+    rx_node ast[REGEX_MAX];
+    int nast;
+    u8 sets[REGEX_MAX][32];
+    int nsets;
+    rx_node prog[2][REGEX_MAX + 1];
+    int nprog[2], start[2];
+    u8 class[256], rep[256];
+    int nclasses;
+    int generation;
+    char error[128];
+} regex;
+
+int rx_fail(regex* rx, char* message) {
+    if (!rx->error[0]) snprintf(rx->error, sizeof(rx->error), "%s", message);
+    return -1;
+}
 
-        int initial_lines_to_print = (remaining_lines - 8) / 2;
-        print_physical_lines(state->blocks.s[first_match_index], initial_lines_to_print);
-        remaining_lines -= initial_lines_to_print;
+int rx_new(regex* rx, int op, int a, int b) {
+    if (rx->nast == REGEX_MAX) return rx_fail(rx, "pattern too complex");
+    rx->ast[rx->nast] = (rx_node){op, a, b};
+    return rx->nast++;
+}
 
-        prt("\n");
-        remaining_lines -= 1;
+void rx_set_add(u8* set, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) set[c >> 3] |= 1 << (c & 7);
+}
 
-        prt("Match:\n");
-        remaining_lines -= 1;
+int rx_set_has(u8* set, int c) {
+    return set[c >> 3] >> (c & 7) & 1;
+}
 
-        int lines_printed = print_matching_physical_lines(state->blocks.s[first_match_index], first_match_span);
-        remaining_lines -= lines_printed;
+int rx_set_escape(u8* set, u8 c) {
+    u8 tmp[32] = {0};
+    switch (c | 0x20) {
+    case 'w': rx_set_add(tmp, 'a', 'z'); rx_set_add(tmp, 'A', 'Z'); rx_set_add(tmp, '0', '9'); rx_set_add(tmp, '_', '_'); break;
+    case 'd': rx_set_add(tmp, '0', '9'); break;
+    case 's': rx_set_add(tmp, '\t', '\r'); rx_set_add(tmp, ' ', ' '); break;
+    default: return 0;
+    }
+    int negate = c >= 'A' && c <= 'Z';
+    if (negate) rx_set_add(tmp, '\n', '\n');
+    for (int i = 0; i < 32; i++) set[i] |= negate ? ~tmp[i] : tmp[i];
+    return 1;
+}
 
-        prt("\n");
-        remaining_lines -= 1;
+u8 rx_unescape(u8 c) {
+    return c == 'n' ? '\n' : c == 't' ? '\t' : c;
+}
+
+int rx_alt(regex* rx, span* s);
+
+int rx_class(regex* rx, span* s, u8* set) {
+    int negate = !empty(*s) && *s->buf == '^';
+    if (negate) s->buf++;
+    for (int first = 1;; first = 0) {
+        if (empty(*s)) return rx_fail(rx, "missing ]");
+        u8 c = *s->buf++;
+        if (c == ']' && !first) break;
+        if (c == '\\') {
+            if (empty(*s)) return rx_fail(rx, "trailing \\");
+            c = *s->buf++;
+            if (rx_set_escape(set, c)) continue;
+            c = rx_unescape(c);
+        }
+        u8 hi = c;
+        if (len(*s) >= 2 && s->buf[0] == '-' && s->buf[1] != ']') {
+            s->buf++;
+            hi = *s->buf++;
+            if (hi == '\\') {
+                if (empty(*s)) return rx_fail(rx, "trailing \\");
+                hi = rx_unescape(*s->buf++);
+            }
+            if (hi < c) return rx_fail(rx, "bad range in []");
+        }
+        rx_set_add(set, c, hi);
     }
+    if (negate) rx_set_add(set, '\n', '\n');
+    if (negate) for (int i = 0; i < 32; i++) set[i] = ~set[i];
+    return 0;
+}
 
-    prt("%d blocks matched\n", match_count);
-    remaining_lines -= 1;
+int rx_atom(regex* rx, span* s) {
+    u8 c = *s->buf++;
+    if (c == '(') {
+        int n = rx_alt(rx, s);
+        if (n < 0) return -1;
+        if (empty(*s) || *s->buf != ')') return rx_fail(rx, "missing )");
+        s->buf++;
+        return n;
+    }
+    if (c == '^') return rx_new(rx, RX_BOL, 0, 0);
+    if (c == '$') return rx_new(rx, RX_EOL, 0, 0);
+    if (c == '*' || c == '+' || c == '?') return rx_fail(rx, "nothing to repeat");
+    if (rx->nsets == REGEX_MAX) return rx_fail(rx, "pattern too complex");
+    u8* set = rx->sets[rx->nsets];
+    memset(set, 0, 32);
+    if (c == '.') {
+        rx_set_add(set, 0, 255);
+        set['\n' >> 3] &= ~(1 << ('\n' & 7));
+    } else if (c == '[') {
+        if (rx_class(rx, s, set) < 0) return -1;
+    } else if (c == '\\') {
+        if (empty(*s)) return rx_fail(rx, "trailing \\");
+        c = *s->buf++;
+        if (!rx_set_escape(set, c)) rx_set_add(set, rx_unescape(c), rx_unescape(c));
+    } else {
+        rx_set_add(set, c, c);
+    }
+    return rx_new(rx, RX_SET, rx->nsets++, 0);
+}
 
-    while (remaining_lines > 1) {
-        terpri();
-        remaining_lines -= 1;
+int rx_repeat(regex* rx, span* s) {
+    int n = rx_atom(rx, s);
+    while (n >= 0 && !empty(*s) && (*s->buf == '*' || *s->buf == '+' || *s->buf == '?')) {
+        u8 c = *s->buf++;
+        n = rx_new(rx, c == '*' ? RX_STAR : c == '+' ? RX_PLUS : RX_QUEST, n, 0);
     }
+    return n;
+}
 
-    wrs(state->search);
-    flush();
+int rx_cat(regex* rx, span* s) {
+    int n = rx_new(rx, RX_EMPTY, 0, 0);
+    while (n >= 0 && !empty(*s) && *s->buf != '|' && *s->buf != ')') {
+        int r = rx_repeat(rx, s);
+        if (r < 0) return -1;
+        n = rx->ast[n].op == RX_EMPTY ? r : rx_new(rx, RX_CAT, n, r);
+    }
+    return n;
+}
+
+int rx_alt(regex* rx, span* s) {
+    int n = rx_cat(rx, s);
+    while (n >= 0 && !empty(*s) && *s->buf == '|') {
+        s->buf++;
+        int r = rx_cat(rx, s);
+        if (r < 0) return -1;
+        n = rx_new(rx, RX_ALT, n, r);
+    }
+    return n;
 }
+
 /*
-In next_line_limit(span* s, int n) we are given a span and a length limit.
-We return a span which is a prefix of s.
-If the first n characters do not contain newline, and the n+1th character is also not a newline, then we return a span, not ending in newline, of n characters.
-If the first n characters do not contain newline but n+1 does, we include n+1 characters, including the newline.
-Otherwise, there is a newline within the first n characters, we return n or fewer characters with the last one being the newline.
-We also set s->buf to contain the rest of the span not in the returned prefix.
+rx_emit emits the instructions for a tree node, continuing at next, and returns the first one; we emit from the end of the regex backwards, so next is always known.
+An instruction is an rx_node too: for RX_SET a is next and b the byte set, for RX_SPLIT a and b are the two ways to go, for RX_BOL and RX_EOL a is next.
 */
 
+int rx_inst(regex* rx, int dir, int op, int a, int b) {
+    rx->prog[dir][rx->nprog[dir]] = (rx_node){op, a, b};
+    return rx->nprog[dir]++;
+}
 
-span next_line_limit(span* s, int n) {
-    span result = {s->buf, s->buf}; // Initialize result span to start of input span
-    if (s->buf == NULL || n <= 0) return result; // Check for null pointer or non-positive length
+int rx_emit(regex* rx, int dir, int node, int next) {
+    rx_node t = rx->ast[node];
+    switch (t.op) {
+    case RX_SET: return rx_inst(rx, dir, RX_SET, next, t.a);
+    case RX_CAT: return dir ? rx_emit(rx, dir, t.b, rx_emit(rx, dir, t.a, next)) : rx_emit(rx, dir, t.a, rx_emit(rx, dir, t.b, next));
+    case RX_ALT: {
+        int x = rx_emit(rx, dir, t.a, next);
+        return rx_inst(rx, dir, RX_SPLIT, x, rx_emit(rx, dir, t.b, next));
+    }
+    case RX_QUEST: return rx_inst(rx, dir, RX_SPLIT, rx_emit(rx, dir, t.a, next), next);
+    case RX_STAR:
+    case RX_PLUS: {
+        int split = rx_inst(rx, dir, RX_SPLIT, 0, next);
+        int body = rx_emit(rx, dir, t.a, split);
+        rx->prog[dir][split].a = body;
+        return t.op == RX_STAR ? split : body;
+    }
+    case RX_BOL: return rx_inst(rx, dir, dir ? RX_EOL : RX_BOL, next, 0);
+    case RX_EOL: return rx_inst(rx, dir, dir ? RX_BOL : RX_EOL, next, 0);
+    }
+    return next;
+}
 
-    int i;
-    for (i = 0; i < n && (s->buf + i) < s->end; i++) {
-        if (s->buf[i] == '\n') {
-            result.end = s->buf + i + 1; // Include the newline in the result
-            break;
-        }
+int regex_compile(regex* rx, span pattern) {
+    rx->nast = rx->nsets = 0;
+    rx->error[0] = 0;
+    rx->generation++;
+    span s = pattern;
+    int root = rx_alt(rx, &s);
+    if (root >= 0 && !empty(s)) root = rx_fail(rx, "unmatched )");
+    if (root < 0) return 0;
+
+    for (int dir = 0; dir < 2; dir++) {
+        rx->nprog[dir] = 0;
+        int match = rx_inst(rx, dir, RX_MATCH, 0, 0);
+        rx->start[dir] = rx_emit(rx, dir, root, match);
     }
 
-    if (i == n) { // Reached the length limit without encountering a newline
-        if ((s->buf + n) < s->end && s->buf[n] == '\n') {
-            result.end = s->buf + n + 1; // Include the next character if it is a newline
-        } else {
-            result.end = s->buf + n; // Just include up to the limit
+    rx->nclasses = 0;
+    for (int b = 0; b < 256; b++) {
+        int c = 0;
+        for (; c < rx->nclasses; c++) {
+            int r = rx->rep[c], same = (r == '\n') == (b == '\n');
+            for (int i = 0; same && i < rx->nsets; i++) same = rx_set_has(rx->sets[i], r) == rx_set_has(rx->sets[i], b);
+            if (same) break;
         }
+        if (c == rx->nclasses) rx->rep[rx->nclasses++] = b;
+        rx->class[b] = c;
     }
-
-    s->buf = result.end; // Advance the start of the input span past the returned prefix
-    return result;
+    return 1;
 }
-/*
-In print_ruler we use prt to show
 
-- the number of blocks,
-- the currently selected block,
-- the scrolled lines plus one (i.e. the one-based index of the top visible line)
+/*
+An rx_dfa runs one direction (dir) of a compiled regex; rx_dfa_prepare resets it whenever the regex has been compiled again since it was last used.
 
-all on a line without a newline.
+The states' instruction lists live one after another in pool, and trans has a row of nclasses entries per state, each -1 until it is computed, and otherwise the next state shifted left one, with the low bit set if a match ended just before the byte.
+end_match is the same for the end of the text (-1 until computed).
+The forward DFA is unanchored (a match can start anywhere), so rx_step adds the start of the regex back in after every byte.
+If this direction's program has no ^ (uses_bol is 0) the start-of-line flag can't make any difference, so rx_dfa_add always clears it, and a newline doesn't split every state in two.
 */
 
-void print_ruler() {
-    prt("%d blocks, Block %d, Line %d", state->blocks.n, state->current_index + 1, state->scrolled_lines + 1);
+typedef struct {
+    regex* rx;
+    int dir, unanchored, generation;
+    int uses_bol;
+    int n, drops;
+    int idle, idle_byte, idle_drops;
+    int* trans;
+    int* list_off;
+    int* list_len;
+    u8* bol;
+    signed char* end_match;
+    int* pool;
+    int pool_n, pool_cap;
+    int buckets[REGEX_DFA_MAX * 2];
+    int stack[REGEX_MAX + 1], mark[REGEX_MAX + 1], stamp;
+    int a[REGEX_MAX + 1], b[REGEX_MAX + 1];
+} rx_dfa;
+
+void rx_dfa_prepare(rx_dfa* d, regex* rx, int dir) {
+    if (d->rx == rx && d->generation == rx->generation && d->dir == dir) return;
+    d->rx = rx;
+    d->dir = dir;
+    d->unanchored = !dir;
+    d->generation = rx->generation;
+    d->uses_bol = 0;
+    for (int i = 0; i < rx->nprog[dir]; i++) if (rx->prog[dir][i].op == RX_BOL) d->uses_bol = 1;
+    d->trans = realloc(d->trans, REGEX_DFA_MAX * rx->nclasses * sizeof(int));
+    if (!d->list_off) {
+        d->list_off = malloc(REGEX_DFA_MAX * sizeof(int));
+        d->list_len = malloc(REGEX_DFA_MAX * sizeof(int));
+        d->bol = malloc(REGEX_DFA_MAX);
+        d->end_match = malloc(REGEX_DFA_MAX);
+    }
+    if (!d->trans || !d->list_off || !d->list_len || !d->bol || !d->end_match) exit_with_error("Failed to allocate regex DFA");
+    d->n = 0;
+    d->pool_n = 0;
+    d->idle_drops = 0;
+    memset(d->buckets, 0, sizeof(d->buckets));
 }
-/*
-In print_single_block_with_skipping we get a block index and a pagination index in the form of a number of lines already "scrolled off" above the top of the screen (skipped_lines).
-
-First, we call count_physical_lines, which gives us a span of skipped lines and alters an int, subtracting the number of physical lines which this span represents.
-We make a copy of the block and adjust this copy to the suffix which is meant to be aligned to the top of our content area, by setting the .buf of the copy to the .end of the scrolled-off span.
-
-We set a variable remaining_rows which we initialize with state->terminal_rows and decrement as we print lines of output.
-First we print a line "Block N" and decrement this variable by one.
-
-We have a ruler line at the bottom that we need to leave room for, so we make another variable, remaining_content_lines, that is one less than remaining lines, and call count_physical_lines again with this variable, letting us determine how many lines are actually printed, and more importantly, giving us a span of the appropriate content to at-most fill the screen.
 
-We then print this content by wrs().
-Note that the int passed by reference into count_physical_lines will be DECREMENTED by the number of actual physical lines of content in the returned span.
-Therefore, the value of this variable after the call is the number of REMAINING lines of content area yet to be filled, thus, while this remains positive, we print blank lines, filling the content area.
-Finally, we call print_ruler to handle the last line of the terminal.
+/*
+rx_closure follows the epsilon moves from n instructions in seeds and leaves the resulting set in out (sorted, so equal sets look equal), returning its size.
+^ holds if bol is set; $ holds if eol is 1, fails if it is 0, and if it is -1 (not known yet) the $ instruction itself is kept in the set.
 */
 
-void print_single_block_with_skipping(int block_index, int skipped_lines) {
-    span block = state->blocks.s[block_index];
-    int remaining_rows = state->terminal_rows;
-
-    span skipped_span = count_physical_lines(block, &skipped_lines);
-    block.buf = skipped_span.end;
+int rx_closure(rx_dfa* d, int* seeds, int n, int bol, int eol, int* out) {
+    rx_node* prog = d->rx->prog[d->dir];
+    int sp = 0, count = 0;
+    d->stamp++;
+    for (int i = n - 1; i >= 0; i--) d->stack[sp++] = seeds[i];
+    while (sp) {
+        int i = d->stack[--sp];
+        if (d->mark[i] == d->stamp) continue;
+        d->mark[i] = d->stamp;
+        rx_node in = prog[i];
+        if (in.op == RX_SPLIT) {
+            d->stack[sp++] = in.b;
+            d->stack[sp++] = in.a;
+        } else if (in.op == RX_BOL) {
+            if (bol) d->stack[sp++] = in.a;
+        } else if (in.op == RX_EOL && eol >= 0) {
+            if (eol) d->stack[sp++] = in.a;
+        } else {
+            int j = count++;
+            while (j > 0 && out[j - 1] > i) out[j] = out[j - 1], j--;
+            out[j] = i;
+        }
+    }
+    return count;
+}
 
-    prt("Block %d\n", block_index + 1);
-    remaining_rows--;
+int rx_has_match(rx_dfa* d, int* list, int n) {
+    for (int i = 0; i < n; i++) if (d->rx->prog[d->dir][list[i]].op == RX_MATCH) return 1;
+    return 0;
+}
 
-    int remaining_content_lines = remaining_rows - 1;
-    span content_to_print = count_physical_lines(block, &remaining_content_lines);
+int rx_dfa_add(rx_dfa* d, int* list, int n, int bol) {
+    if (!d->uses_bol) bol = 0;
+    hasher h;
+    hash_init(&h);
+    hash_update(&h, (span){(u8*)list, (u8*)(list + n)});
+    hash_update(&h, bol ? S("b") : S("-"));
+    u64 key = hash_final(&h);
+    int mask = REGEX_DFA_MAX * 2 - 1;
+    for (int k = key & mask; d->buckets[k]; k = (k + 1) & mask) {
+        int s = d->buckets[k] - 1;
+        if (d->bol[s] == bol && d->list_len[s] == n && !memcmp(d->pool + d->list_off[s], list, n * sizeof(int))) return s;
+    }
+    if (d->n == REGEX_DFA_MAX) {
+        d->drops++;
+        d->n = 0;
+        d->pool_n = 0;
+        memset(d->buckets, 0, sizeof(d->buckets));
+    }
+    if (d->pool_n + n > d->pool_cap) {
+        d->pool_cap = (d->pool_n + n) * 2;
+        d->pool = realloc(d->pool, d->pool_cap * sizeof(int));
+        if (!d->pool) exit_with_error("Failed to allocate regex DFA");
+    }
+    int s = d->n++;
+    memcpy(d->pool + d->pool_n, list, n * sizeof(int));
+    d->list_off[s] = d->pool_n;
+    d->list_len[s] = n;
+    d->pool_n += n;
+    d->bol[s] = bol;
+    d->end_match[s] = -1;
+    for (int i = 0; i < d->rx->nclasses; i++) d->trans[s * d->rx->nclasses + i] = -1;
+    int k = key & mask;
+    while (d->buckets[k]) k = (k + 1) & mask;
+    d->buckets[k] = s + 1;
+    return s;
+}
 
-    wrs(content_to_print);
-    remaining_rows -= (state->terminal_rows - 1 - remaining_content_lines);
+int rx_dfa_start(rx_dfa* d, int bol) {
+    int n = rx_closure(d, &d->rx->start[d->dir], 1, bol, -1, d->b);
+    return rx_dfa_add(d, d->b, n, bol);
+}
 
-    while (remaining_rows > 1) {
-        terpri();
-        remaining_rows--;
+int rx_step(rx_dfa* d, int s, int c) {
+    int* t = &d->trans[s * d->rx->nclasses + c];
+    if (*t >= 0) return *t;
+    regex* rx = d->rx;
+    rx_node* prog = rx->prog[d->dir];
+    u8 byte = rx->rep[c];
+    int newline = byte == '\n';
+    int n = rx_closure(d, d->pool + d->list_off[s], d->list_len[s], d->bol[s], newline, d->a);
+    int matched = rx_has_match(d, d->a, n);
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        rx_node in = prog[d->a[i]];
+        if (in.op == RX_SET && rx_set_has(rx->sets[in.b], byte)) d->b[m++] = in.a;
     }
+    if (d->unanchored) d->b[m++] = rx->start[d->dir];
+    n = rx_closure(d, d->b, m, newline, -1, d->a);
+    int drops = d->drops;
+    int next = rx_dfa_add(d, d->a, n, newline) << 1 | matched;
+    if (d->drops == drops) *t = next; // otherwise row s now belongs to some other state, or none
+    return next;
+}
 
-    print_ruler();
+int rx_end_match(rx_dfa* d, int s) {
+    if (d->end_match[s] < 0) {
+        int n = rx_closure(d, d->pool + d->list_off[s], d->list_len[s], d->bol[s], 1, d->a);
+        d->end_match[s] = rx_has_match(d, d->a, n);
+    }
+    return d->end_match[s];
 }
+
 /*
-In print_physical_lines, we get a span, and a number of lines.
-We can use next_line on the span to get each logical line, and then we use the terminal_cols on the state to determine the number of physical lines that each one will require.
-However, note that a blank line will still require one physical line (because we will print an empty line).
-If the physical lines would be more than we need, then we only print enough characters (with wrapping) to fill the lines.
-Otherwise we print the full line, followed by a newline, and then we decrement the number of lines that we still need appropriately.
+Most of the time the forward DFA is in the same state, where nothing has matched yet and there is no partial match going on, not at the start of a line (for a pattern without ^ that is every line, see uses_bol above).
+If only one byte can take it out of this state (as for a pattern starting with a literal, or with ^, where it is newline) then rx_dfa_idle returns the state and leaves the byte in idle_byte, so that regex_find can memchr over everything else (as grammar_scan does); otherwise it returns -1.
+We work this out again whenever the states have been dropped.
+Since the states get new numbers when they are dropped, regex_find stops skipping for the rest of the text if that happens while it runs, rather than compare against a state number that now means something else.
 */
 
+int rx_dfa_idle(rx_dfa* d) {
+    if (d->idle_drops == d->drops + 1) return d->idle;
+    int drops = d->drops;
+    int s = rx_dfa_start(d, 0);
+    int only = -1;
+    for (int c = 0; c < d->rx->nclasses && only != -2; c++) {
+        if (rx_step(d, s, c) != s << 1) only = only == -1 ? c : -2;
+    }
+    int count = 0;
+    for (int b = 0; b < 256; b++) count += d->rx->class[b] == only;
+    d->idle = only >= 0 && count == 1 && d->drops == drops ? s : -1;
+    d->idle_byte = only >= 0 ? d->rx->rep[only] : 0;
+    d->idle_drops = d->drops + 1;
+    return d->idle;
+}
 
-void print_physical_lines(span block, int lines_to_print) {
-    while (!empty(block) && lines_to_print > 0) {
-        span line = next_line(&block); // Get the next logical line from the block
-
-        // Handle blank lines
-        if (line.end == line.buf) {
-            if (lines_to_print > 0) {
-                terpri(); // Print a newline for a blank logical line
-                lines_to_print--;
-            }
-            continue; // Move to the next line
+int regex_find(rx_dfa* fwd, rx_dfa* rev, span text, int bol, span* match) {
+    regex* rx = fwd->rx;
+    u8* end = NULL;
+    u8* class = rx->class;
+    int nclasses = rx->nclasses;
+    int idle = rx_dfa_idle(fwd);
+    int drops = fwd->drops;
+    int s = rx_dfa_start(fwd, bol);
+    if (fwd->drops != drops) idle = -1;
+    for (u8* p = text.buf; p < text.end; p++) {
+        if (s == idle && !(p = memchr(p, fwd->idle_byte, text.end - p))) break;
+        int t = fwd->trans[s * nclasses + class[*p]];
+        if (t < 0) {
+            t = rx_step(fwd, s, class[*p]);
+            if (fwd->drops != drops) idle = -1; // idle was numbered before the drop, so it may be some other state now
         }
-
-        // Calculate the number of physical lines required for this logical line
-        int line_length = line.end - line.buf;
-        int physical_lines_needed = (line_length / state->terminal_cols) + (line_length % state->terminal_cols != 0);
-
-        if (physical_lines_needed <= lines_to_print) {
-            // If the entire logical line fits within the remaining physical lines
-            for (int i = 0; i < line_length; i += state->terminal_cols) {
-                int chars_to_print = (i + state->terminal_cols > line_length) ? (line_length - i) : state->terminal_cols;
-                prt("%.*s\n", chars_to_print, line.buf + i); // Print a segment of the logical line
-            }
-            lines_to_print -= physical_lines_needed;
-        } else {
-            // If the logical line does not fit entirely, print parts of it to fit in the remaining lines
-            for (int i = 0; i < lines_to_print * state->terminal_cols; i += state->terminal_cols) {
-                int chars_to_print = (i + state->terminal_cols > line_length) ? (line_length - i) : state->terminal_cols;
-                prt("%.*s\n", chars_to_print, line.buf + i);
-            }
-            lines_to_print = 0; // We've filled the remaining lines
+        if (t & 1) {
+            end = p;
+            break;
         }
+        s = t >> 1;
     }
+    if (!end && rx_end_match(fwd, s)) end = text.end;
+    if (!end) return 0;
+
+    u8* start = end;
+    s = rx_dfa_start(rev, end == text.end || *end == '\n');
+    u8* p = end;
+    for (; p > text.buf && rev->list_len[s]; p--) {
+        int t = rx_step(rev, s, rx->class[p[-1]]);
+        if (t & 1) start = p;
+        s = t >> 1;
+    }
+    if (p == text.buf && (bol ? rx_end_match(rev, s) : rx_has_match(rev, rev->pool + rev->list_off[s], rev->list_len[s]))) start = text.buf;
+
+    u8* newline = memchr(start, '\n', end - start);
+    *match = (span){start, newline ? newline : end};
+    return 1;
 }
-/*
-In print_matching_physical_lines, we get the span of a block and of a match.
 
-We must print the physical lines from the block which contain the match, and then return the number of physical lines that we have printed.
+/* #search_pool
 
-We happen to know, because of how our search currently works, that a match will never cross a logical line boundary (since we don't have a way of entering newlines in the search mode).
+Search looks at every block, so on a big project perform_search and finalize_search would leave all but one core idle while the user waits.
+Instead we split the blocks into chunks of SEARCH_CHUNK blocks, and search the chunks on a pool of threads (search_pool), which we start the first time it's needed and keep for the life of the process.
+The UI thread takes part as worker 0, so a pool of n workers has n - 1 pthreads, one per core up to SEARCH_MAX_THREADS.
 
-We will loop over the logical lines using next_line as usual.
+Work stealing:
 
-When we find the logical line that contains the match (which we can do by comparing .buf and .end), then we determine where to start printing the physical lines.
-(Note: we compare .buf and .end because we already have found a match, we do not use contains() which would search the strings again!)
+- Each worker starts with an equal, contiguous run of chunks, kept as a range lo..hi packed into one u64 (search_pool.ranges), so that it can be changed with a single compare-and-swap.
+- The owner takes chunks from the bottom of its own range (lo++); when that is empty it goes round the other workers and steals one chunk from the top (hi--) of the first one that has any left.
+- Every chunk is claimed by exactly one successful CAS, so each is searched exactly once, and a worker that got the big blocks just ends up doing fewer chunks.
 
-(A logical line contains physical lines, which are runs of characters that fill the terminal_cols (on state), and therefore cause wrapping.)
+Each chunk has its own result (search_chunk): the number of matching blocks, and the first of them with its match span.
+When all the workers are done the UI thread merges these in chunk order, so the count, the first match and its span are exactly what a sequential scan gives, whichever thread did which chunk.
 
-Specifically, we want to skip any physical lines at the start of the logical line until we get to the first physical line that contains the match.
-Then we print this physical line, and keep printing physical lines until we have reached the end of the match.
-Whether or not we have printed the full logical line, we then print a newline.
+Early exit: finalize_search only wants the first match, so it passes first_only.
+A worker that finds a match then lowers search_pool.first (an atomic minimum over the chunk indexes with a match) and stops the chunk there, and every worker skips any chunk after search_pool.first, since nothing in it can come first.
+Chunks before it are still searched, so the answer is still the lowest match; only the count is meaningless in this mode.
 
-We return the number of physical lines that we have printed.
-*/
+A search of at most one chunk runs on the UI thread without waking the pool.
 
-int print_matching_physical_lines(span block, span match) {
+Hand-off: the UI thread sets up the job under search_pool.lock, bumps generation and broadcasts go; each pthread does its share and decrements pending, and the UI thread (after doing its own share) waits on done until pending is zero.
+Nothing else touches the blocks while we wait, so the workers can read state->blocks without locking.
 
-    int physical_lines_printed = 0;
-    int terminal_width = state->terminal_cols;
+If the pool can't be started (pthread_create fails) we just use however many threads we got, down to the UI thread alone.
 
-    while (!empty(block)) {
-        span line = next_line(&block);
+search_blocks is the entry point: it returns the number of matching blocks and sets *first_index (-1 if none) and *first_match.
+As before, an empty needle matches every block, with an empty match at the start of the block.
 
-        if ((match.buf >= line.buf) && (match.end <= line.end)) {
-            int start_offset = match.buf - line.buf;
-            int match_length = len(match);
-            int start_physical_line = start_offset / terminal_width;
-            int end_physical_line = (start_offset + match_length) / terminal_width;
+A needle that starts with a slash is a regex (see #regex), which we compile into search_regex (unless it is the same pattern as last time, so that the DFAs stay warm while the user moves around), and then each worker matches with its own pair of DFAs (search_pool.fwd and .rev).
+If the regex doesn't compile we return -1, and the reason is in search_regex.error.
+*/
 
-            for (int i = start_physical_line; i <= end_physical_line; ++i) {
-                int line_start = i * terminal_width;
-                int line_end = (i + 1) * terminal_width;
-                if (line_end > len(line)) {
-                    line_end = len(line);
-                }
-                prt("%.*s\n", line_end - line_start, line.buf + line_start);
-                physical_lines_printed++;
+#define SEARCH_CHUNK 64
+#define SEARCH_MAX_THREADS 32
+
+typedef struct {
+    int count;
+    int first;
+    span match;
+    int worker;
+} search_chunk;
+
+struct {
+    int nthreads;
+    pthread_t threads[SEARCH_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t go, done;
+    int generation, pending;
+    u64 ranges[SEARCH_MAX_THREADS];
+    search_chunk* chunks;
+    int nchunks, chunks_cap;
+    void (*chunk_fn)(int, int);
+    span needle;
+    regex* rx;
+    rx_dfa fwd[SEARCH_MAX_THREADS], rev[SEARCH_MAX_THREADS];
+    int first_only;
+    int first;
+} search_pool;
+
+regex search_regex;
+u8 search_regex_pattern[256];
+int search_regex_len = -1;
+
+int search_take(int worker, int own) {
+    u64* range = &search_pool.ranges[worker];
+    u64 cur = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        unsigned lo = cur >> 32, hi = (unsigned)cur;
+        if (lo >= hi) return -1;
+        u64 next = own ? (u64)(lo + 1) << 32 | hi : (u64)lo << 32 | (hi - 1);
+        if (__atomic_compare_exchange_n(range, &cur, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return own ? lo : hi - 1;
+    }
+}
+
+void search_chunk_run(int c, int worker) {
+    search_chunk* r = &search_pool.chunks[c];
+    r->count = 0;
+    r->first = -1;
+    r->match = nullspan();
+    if (search_pool.first_only && c > __atomic_load_n(&search_pool.first, __ATOMIC_RELAXED)) return;
+
+    span needle = search_pool.needle;
+    regex* rx = search_pool.rx;
+    if (rx) {
+        rx_dfa_prepare(&search_pool.fwd[worker], rx, 0);
+        rx_dfa_prepare(&search_pool.rev[worker], rx, 1);
+    }
+    int end = (c + 1) * SEARCH_CHUNK;
+    if (end > state->blocks.n) end = state->blocks.n;
+    for (int i = c * SEARCH_CHUNK; i < end; i++) {
+        span match;
+        if (rx) {
+            if (!regex_find(&search_pool.fwd[worker], &search_pool.rev[worker], state->blocks.s[i], 1, &match)) continue;
+        } else {
+            match = spanspan(state->blocks.s[i], needle);
+            if (empty(match) && !empty(needle)) continue;
+        }
+        if (r->first < 0) {
+            r->first = i;
+            r->match = match;
+            if (search_pool.first_only) {
+                int f = __atomic_load_n(&search_pool.first, __ATOMIC_RELAXED);
+                while (c < f && !__atomic_compare_exchange_n(&search_pool.first, &f, c, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+                return;
             }
-            break;
         }
+        r->count++;
     }
+}
 
-    return physical_lines_printed;
+void search_work(int worker) {
+    for (;;) {
+        int c = search_take(worker, 1);
+        for (int k = 1; c < 0 && k < search_pool.nthreads; k++) c = search_take((worker + k) % search_pool.nthreads, 0);
+        if (c < 0) return;
+        search_pool.chunk_fn(c, worker);
+    }
+}
+
+void* search_thread(void* arg) {
+    int worker = (int)(intptr_t)arg;
+    int seen = 0;
+    pthread_mutex_lock(&search_pool.lock);
+    for (;;) {
+        while (search_pool.generation == seen) pthread_cond_wait(&search_pool.go, &search_pool.lock);
+        seen = search_pool.generation;
+        pthread_mutex_unlock(&search_pool.lock);
+        search_work(worker);
+        pthread_mutex_lock(&search_pool.lock);
+        if (--search_pool.pending == 0) pthread_cond_signal(&search_pool.done);
+    }
+    return NULL;
 }
+
+void search_pool_start() {
+    if (search_pool.nthreads) return;
+    pthread_mutex_init(&search_pool.lock, NULL);
+    pthread_cond_init(&search_pool.go, NULL);
+    pthread_cond_init(&search_pool.done, NULL);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > SEARCH_MAX_THREADS) cores = SEARCH_MAX_THREADS;
+    search_pool.nthreads = 1;
+    for (int i = 1; i < cores; i++) {
+        if (pthread_create(&search_pool.threads[i], NULL, search_thread, (void*)(intptr_t)i)) break;
+        search_pool.nthreads++;
+    }
+}
+
 /*
-In finalize_search(), we update the current_index to point to the first result of the search given in the search string.
-We ignore the first character of state.search which is always slash, and find the first block which contains the rest of the search string (using contains()).
-Then we set current_index to that block, also resetting scrolled_lines.
-We then reset state.search to an empty span to indicate that we are not in search mode any more.
-Finally we call print_current_blocks to refresh the display given the block that is now the current one (replacing the search screen).
-*/
+search_pool_run runs a job over all the blocks: chunk_fn is called once for each chunk of SEARCH_CHUNK blocks, with the chunk index and the worker that's running it, as described above; the job's parameters and results are up to the caller (search_blocks below, and rank_blocks in #ranked_search).
+It returns the number of chunks, and search_pool.chunks has room for that many results.
 
+search_pool_run_n is the same for a job that isn't over the blocks, with nchunks chunks of whatever the job likes (a directory, or a file, in #dir_sources).
+*/
 
-void finalize_search() {
-    span search_span = {state->search.buf + 1, state->search.end}; // Ignore the leading slash
+int search_pool_run_n(int nchunks, void (*chunk_fn)(int, int)) {
+    if (nchunks > search_pool.chunks_cap) {
+        search_pool.chunks_cap = nchunks * 2;
+        search_pool.chunks = realloc(search_pool.chunks, search_pool.chunks_cap * sizeof(search_chunk));
+        if (!search_pool.chunks) exit_with_error("Failed to allocate search chunks");
+    }
+    search_pool.nchunks = nchunks;
+    search_pool.chunk_fn = chunk_fn;
 
-    for (int i = 0; i < state->blocks.n; i++) {
-        if (contains(state->blocks.s[i], search_span)) {
-            state->current_index = i; // Update current_index to the first match
-            state->scrolled_lines = 0;
-            break; // Exit the loop once the first match is found
-        }
+    if (nchunks <= 1) {
+        if (nchunks) chunk_fn(0, 0);
+        return nchunks;
     }
+    search_pool_start();
+    int n = search_pool.nthreads;
+    pthread_mutex_lock(&search_pool.lock);
+    for (int w = 0; w < n; w++) {
+        u64 lo = (u64)nchunks * w / n, hi = (u64)nchunks * (w + 1) / n;
+        search_pool.ranges[w] = lo << 32 | hi;
+    }
+    search_pool.pending = n - 1;
+    search_pool.generation++;
+    pthread_cond_broadcast(&search_pool.go);
+    pthread_mutex_unlock(&search_pool.lock);
 
-    state->search = nullspan(); // Reset search to indicate exit from search mode
-    //print_current_blocks(); // Refresh the display
+    search_work(0);
+
+    pthread_mutex_lock(&search_pool.lock);
+    while (search_pool.pending) pthread_cond_wait(&search_pool.done, &search_pool.lock);
+    pthread_mutex_unlock(&search_pool.lock);
+    return nchunks;
 }
 
-/* Settings.
+int search_pool_run(void (*chunk_fn)(int, int)) {
+    return search_pool_run_n((state->blocks.n + SEARCH_CHUNK - 1) / SEARCH_CHUNK, chunk_fn);
+}
 
-When the tool starts, we ask about specific configuration settings that must exist.
-Otherwise, for settings like the buildcmd we only ask the first time the feature is used.
+/*
+search_prepare sets search_pool.rx for a needle, compiling it if it is a regex (and taking the slash off), as above; it returns 0 if the regex doesn't compile.
+*/
 
-As settings are changed, we write a configuration file, which is always .cmpr/conf in the current working directory.
+int search_prepare(span* needle) {
+    search_pool.rx = NULL;
+    if (empty(*needle) || *needle->buf != '/') return 1;
+    needle->buf++;
+    if (len(*needle) != search_regex_len || memcmp(needle->buf, search_regex_pattern, len(*needle))) {
+        search_regex_len = -1;
+        if (len(*needle) >= sizeof(search_regex_pattern) || !regex_compile(&search_regex, *needle)) {
+            if (!search_regex.error[0]) snprintf(search_regex.error, sizeof(search_regex.error), "pattern too long");
+            return 0;
+        }
+        memcpy(search_regex_pattern, needle->buf, len(*needle));
+        search_regex_len = len(*needle);
+    }
+    search_pool.rx = &search_regex;
+    return 1;
+}
 
-The contents of this file will be similar to RFC822-style headers.
-We will have a key name followed by colon, space and then a value to the end of the line.
+int search_blocks(span needle, int first_only, int* first_index, span* first_match) {
+    if (!search_prepare(&needle)) {
+        *first_index = -1;
+        *first_match = nullspan();
+        return -1;
+    }
 
-We have functions to read and write this format, which we do in the cmp space.
+    search_pool.needle = needle;
+    search_pool.first_only = first_only;
+    search_pool.first = INT_MAX;
+    int nchunks = search_pool_run(search_chunk_run);
+
+    int count = 0;
+    *first_index = -1;
+    *first_match = nullspan();
+    for (int c = 0; c < nchunks; c++) {
+        search_chunk* r = &search_pool.chunks[c];
+        if (r->first >= 0 && *first_index < 0) {
+            *first_index = r->first;
+            *first_match = r->match;
+            if (first_only) break;
+        }
+        count += r->count;
+    }
+    return count;
+}
 
-In handle_conf_{language,file} we are called with a span in each case containing either a pathname or a language, in the order that these config keys occur in the config file.
+/* #match_list
 
-The idea is that when a language key occurs, it sets the language which is then used on subsequent files.
-However, as the one exception to this pattern, when files are included before any language is given, then we will add the files without a language.
+After a search, n and N step forwards and backwards through every occurrence of it, in this block or the next ones, and every occurrence on the screen is highlighted.
 
-Therefore:
+For this, finalize_search finds all the matches once into a sorted array (match_list.m) of the block, offset in the block and length of each, and after that everything is done from the array:
 
-- when we see a language line, we will set the current_language on the state
-- when we see a file line, we set the language on the file to current_language and add the file to the state
-- only in the case where we see a language line and the language was not already set, then we know that this is the first language line in the file; in this case we iterate over any files that we already added, and set the language on them.
+- n and N (match_jump) move match_list.current one along, going round at either end; if we have gone to another block since, they binary search (match_find) for the first match in the current block or after it, or the last one in it or before it, instead, so that the matches in the block we are looking at aren't skipped.
+- Either way they set scrolled_lines so that the physical line with the match is in the middle of the content area, as far as the block allows (match_center).
+- print_single_block_with_skipping calls match_print for the part of the block on the screen, which finds the first match there by binary search and shows each match in reverse video, the current one also in bold.
 
-Below we write both functions handle_conf_{language,file}.
+The matches are found on the search pool (see #search_pool) by the same matchers as search_blocks (memmem through spanspan for a string, regex_find for a regex), each one looking on from the end of the last, so matches don't overlap.
+Each worker appends to its own growable buffer, and the chunk's result says where its matches start in which buffer and how many there are, so the merge is one memcpy per chunk, in chunk order.
+Empty matches (from a regex like x*) are skipped, as there is nothing to show, and an empty search leaves the list empty, which is how to turn the highlighting off.
+
+The offsets are only good until the blocks change, so we keep the search and the blocks_version with the list, and match_list_sync finds the matches again when they are out of date.
 */
 
-void handle_conf_language(span language) {
-    state->current_language = language;
-    // Set the language for all previously added files if they have no language set
-    if (state->files.n > 0 && empty(state->files.a[0].language)) {
-        for (int i = 0; i < state->files.n; i++) {
-            if (empty(state->files.a[i].language)) {
-                state->files.a[i].language = language;
+typedef struct {
+    int block, offset, len;
+} search_match;
+
+struct {
+    search_match* m;
+    int n, cap;
+    int current;
+    u8 search[256];
+    int search_len;
+    int version;
+    search_match* buf[SEARCH_MAX_THREADS];
+    int buf_n[SEARCH_MAX_THREADS], buf_cap[SEARCH_MAX_THREADS];
+} match_list;
+
+void match_push(int worker, int block, int offset, int length) {
+    if (match_list.buf_n[worker] == match_list.buf_cap[worker]) {
+        match_list.buf_cap[worker] = match_list.buf_cap[worker] * 2 + 256;
+        match_list.buf[worker] = realloc(match_list.buf[worker], match_list.buf_cap[worker] * sizeof(search_match));
+        if (!match_list.buf[worker]) exit_with_error("Failed to allocate search matches");
+    }
+    match_list.buf[worker][match_list.buf_n[worker]++] = (search_match){block, offset, length};
+}
+
+void match_chunk_run(int c, int worker) {
+    search_chunk* r = &search_pool.chunks[c];
+    r->count = 0;
+    r->first = match_list.buf_n[worker];
+    r->worker = worker;
+
+    span needle = search_pool.needle;
+    regex* rx = search_pool.rx;
+    if (rx) {
+        rx_dfa_prepare(&search_pool.fwd[worker], rx, 0);
+        rx_dfa_prepare(&search_pool.rev[worker], rx, 1);
+    }
+    int end = (c + 1) * SEARCH_CHUNK;
+    if (end > state->blocks.n) end = state->blocks.n;
+    for (int i = c * SEARCH_CHUNK; i < end; i++) {
+        span block = state->blocks.s[i];
+        span rest = block;
+        while (rest.buf < block.end) {
+            span match;
+            if (rx) {
+                int bol = rest.buf == block.buf || rest.buf[-1] == '\n';
+                if (!regex_find(&search_pool.fwd[worker], &search_pool.rev[worker], rest, bol, &match)) break;
+            } else {
+                match = spanspan(rest, needle);
+                if (empty(match)) break;
+            }
+            if (!empty(match)) {
+                match_push(worker, i, match.buf - block.buf, len(match));
+                r->count++;
             }
+            rest.buf = empty(match) ? match.buf + 1 : match.end;
         }
     }
 }
 
-void handle_conf_file(span file_path) {
-    projfile file = { .path = file_path, .language = state->current_language, .contents = nullspan() };
-    projfiles_push(&state->files, file);
+void match_list_build(span search) {
+    if (!empty(search)) memmove(match_list.search, search.buf, len(search));
+    match_list.search_len = len(search);
+    match_list.version = state->blocks_version;
+    match_list.n = 0;
+    match_list.current = -1;
+
+    span needle = {match_list.search, match_list.search + match_list.search_len};
+    if (empty(needle) || !search_prepare(&needle) || empty(needle)) return;
+    for (int w = 0; w < SEARCH_MAX_THREADS; w++) match_list.buf_n[w] = 0;
+    search_pool.needle = needle;
+    int nchunks = search_pool_run(match_chunk_run);
+
+    int total = 0;
+    for (int c = 0; c < nchunks; c++) total += search_pool.chunks[c].count;
+    if (total > match_list.cap) {
+        match_list.cap = total * 2;
+        match_list.m = realloc(match_list.m, match_list.cap * sizeof(search_match));
+        if (!match_list.m) exit_with_error("Failed to allocate search matches");
+    }
+    for (int c = 0; c < nchunks; c++) {
+        search_chunk* r = &search_pool.chunks[c];
+        memcpy(match_list.m + match_list.n, match_list.buf[r->worker] + r->first, r->count * sizeof(search_match));
+        match_list.n += r->count;
+    }
+}
+
+void match_list_sync() {
+    if (match_list.version != state->blocks_version) match_list_build((span){match_list.search, match_list.search + match_list.search_len});
 }
 
 /*
-In the first function, parse_config, we read the contents of our config file (at state->config_file_path) into the cmp space, parse it, and set on the ui_state all the appropriate values.
+match_find returns the index of the first match that ends after offset in the block, or is in a later block (match_list.n if there is none).
+As matches don't overlap, their ends are in order too.
+*/
 
-We have a library method cmp_compl() which gives us the complement of cmp in cmp_space, which is the space that we can safely read into.
-We'll read our configuration file into that space with read_file_S_into_span().
+int match_find(int block, int offset) {
+    int lo = 0, hi = match_list.n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        search_match* m = &match_list.m[mid];
+        if (m->block < block || (m->block == block && m->offset + m->len <= offset)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
-After we read the file into cmp, we get a span back from our library method containing the file contents.
-We still have to manually update cmp.end to match the end of this span so that later uses of the cmp space don't clobber our configs.
+void match_center(search_match* m) {
+    span block = state->blocks.s[m->block];
+    int content_rows = state->terminal_rows - 2;
+    int before = INT_MAX, total = INT_MAX;
+    count_physical_lines((span){block.buf, block.buf + m->offset}, &before);
+    count_physical_lines(block, &total);
+    int scrolled = (INT_MAX - before) - content_rows / 2;
+    if (scrolled > (INT_MAX - total) - content_rows) scrolled = (INT_MAX - total) - content_rows;
+    state->scrolled_lines = scrolled < 0 ? 0 : scrolled;
+}
 
-We then can use next_line() in a loop to process them one by one.
-First we look for ":" with find_char, and if it is not found, we skip the line.
-After the colon we'll skip any whitespace with an isspace() loop and then consider the rest of the line to be the value.
-(Note that we don't trim whitespace off the end, something maybe worth documenting elsewhere for config file users).
-Next_line has already stripped the newline from the end so we don't need to do that.
+void match_jump(int direction) {
+    match_list_sync();
+    if (!match_list.n) return;
+    int i = match_list.current;
+    if (i >= 0 && match_list.m[i].block == state->current_index) i += direction;
+    else i = direction > 0 ? match_find(state->current_index, 0) : match_find(state->current_index + 1, 0) - 1;
+    if (i < 0) i = match_list.n - 1;
+    if (i >= match_list.n) i = 0;
+    match_list.current = i;
+    state->current_index = match_list.m[i].block;
+    match_center(&match_list.m[i]);
+}
 
-Next, we compare the key part before the colon with our list of configuration values above, and if it matches any of them, we set the corresponding member of the ui state, which is always named the same as the config key name.
-The values of the config keys will always be spans.
-We have CONFIG_FIELDS defined above, we use that here with an X macro.
+void match_print(int block_index, span content) {
+    match_list_sync();
+    span block = state->blocks.s[block_index];
+    for (int i = match_find(block_index, content.buf - block.buf); i < match_list.n && match_list.m[i].block == block_index; i++) {
+        u8* start = block.buf + match_list.m[i].offset;
+        u8* end = start + match_list.m[i].len;
+        if (start >= content.end) break;
+        if (start < content.buf) start = content.buf;
+        if (end > content.end) end = content.end;
+        wrs((span){content.buf, start});
+        prt(i == match_list.current ? "\033[1;7m" : "\033[7m");
+        wrs((span){start, end});
+        prt("\033[0m");
+        content.buf = end;
+    }
+    wrs(content);
+}
 
-However, there is an exception to the handling of config fields for some values that might be handled specially.
-These are not included in our CONFIG_FIELDS, but instead we handle them with custom code here.
-These are:
+/*
+print_match_status shows in the ruler where we are in the match list, if there is one.
+*/
 
-- language
-- file
+void print_match_status() {
+    if (!match_list.n) return;
+    if (match_list.current >= 0) prt(", Match %d/%d", match_list.current + 1, match_list.n);
+    else prt(", %d matches", match_list.n);
+}
 
-These are handled by custom code, so we have functions handle_conf_{language,file} (already written above) that we call with the value span for either of these each time they occur in the config file.
-*/
+/* #ranked_search
 
-void parse_config() {
-    span cmp_free_space = cmp_compl();
-    span config_content = read_file_S_into_span(state->config_file_path, cmp_free_space);
-    cmp.end = config_content.end; // Update cmp to avoid overwriting config
+A search that starts with a tilde ("/~read block") ranks the blocks, rather than going to the first one that matches, since on a big project that is rarely the one we want.
+We show the best RANK_TOP_K (as many as fit), best first, and Ctrl-N and Ctrl-P move the choice up and down the list; enter goes to the chosen block.
 
-    while (!empty(config_content)) {
-        span line = next_line(&config_content);
-        int pos = find_char(line, ':');
-        if (pos < 0) continue; // Skip line if no colon found
+The text of a block is split into tokens, which are runs of letters and digits (so read_block is two tokens, read and block), compared ignoring case.
+The query is split the same way into at most RANK_MAX_TERMS terms.
+For each term, in each block:
 
-        span key = {line.buf, line.buf + pos};
-        span value = {line.buf + pos + 1, line.end};
+- a token equal to the term is a hit,
+- if there are none, a token that starts with the same letter as the term and has all the rest of its letters in order ("blk" in "block") is a fuzzy hit, worth RANK_FUZZY times the length of the term over that of the token,
+- and hits in the comment part (block_comment_part, or block_table.comment_end as we have it) count RANK_COMMENT times, as the comment says what the block is about.
 
-        // Skip initial whitespace in the value
-        while (value.buf < value.end && isspace(*value.buf)) value.buf++;
+The weighted hits h go into BM25: idf * h * (k1 + 1) / (h + k1 * (1 - b + b * tokens / avg_tokens)), with k1 = 1.2 and b = 0.75, where tokens is the number of tokens in the block and avg_tokens the mean over all the blocks, and idf = log(1 + (N - df + 0.5) / (df + 0.5)), with N the number of blocks and df the number of them that have the term as a token.
+The score of a block is the sum over the terms, and blocks that score zero don't match.
 
-        // Handle special keys
-        if (span_eq(key, S("language"))) {
-            handle_conf_language(value);
-        } else if (span_eq(key, S("file"))) {
-            handle_conf_file(value);
-        } else {
-            // Handle general configuration keys
-            #define X(name) \
-                if (span_eq(key, S(#name))) { \
-                    state->name = value; \
-                    continue; \
-                }
-            CONFIG_FIELDS
-            #undef X
-        }
-    }
-}
+The term statistics (df, the token counts and their total) are kept in rank_index, and brought up to date by rank_sync whenever blocks_version has changed.
+This is incremental: the index is keyed by the hash of each block's contents (block_table.hash), so only blocks whose contents are new get tokenized, and blocks that have gone away have their terms taken back out of df.
+We keep each indexed block's distinct term hashes for that, and when the gone ones are more than the live ones we compact them away.
 
-void settings_mode(){}
-/*
-In read_line, we get a span pointer to some space that we can use to store input from the user.
-Just to be sure, we always assert(len(buffer)) which helps catch some programming errors that have happened in the past.
+The scoring itself needs the block text, and runs on the search pool (rank.first has a bit for each term that can start with a given byte, so that most tokens are passed over without looking at the terms) (see #search_pool): each worker keeps its best RANK_TOP_K in a bounded min-heap, and the matching count, and rank_blocks merges the heaps at the end.
+Ties in score go to the lower block index, so the list doesn't depend on which worker did what.
+The results are kept until the query or the blocks change, so moving the choice doesn't search again.
+*/
 
-We first print our prompt, which is "> ".
+#define RANK_TOP_K 64
+#define RANK_MAX_TERMS 8
+#define RANK_COMMENT 2.0
+#define RANK_FUZZY 0.3
 
-Recall that we use prt() as always.
+typedef struct {
+    u64 hash;
+    int refs, seen;
+    int ntokens;
+    int terms, nterms;
+} rank_doc;
+
+struct {
+    rank_doc* docs;
+    int ndocs, docs_cap, live;
+    int* slots;
+    int slots_cap;
+    u64* terms;
+    int nterms, terms_cap;
+    u64* df_keys;
+    int* df;
+    int df_cap, df_used;
+    u64* scratch;
+    int scratch_cap;
+    int* block_doc;
+    int block_doc_cap;
+    long total_tokens;
+    int epoch;
+    int synced, version;
+} rank_index;
 
-We handle some basic line editing using our getch() in a loop, until enter is hit.
-At that point we return a span containing the user's input.
-The span which was passed in will have been shortened such that .end of our return value is now the .buf of the passed-in span.
-(In this way, the caller can perform other necessary adjustments, or use the remaining buffer area in a loop etc.)
+typedef struct {
+    double score;
+    int index;
+} rank_hit;
+
+struct {
+    u8 query[256];
+    int query_len;
+    span terms[RANK_MAX_TERMS];
+    double idf[RANK_MAX_TERMS];
+    int nterms;
+    double avg_tokens;
+    u8 first[256];
+    rank_hit heaps[SEARCH_MAX_THREADS][RANK_TOP_K];
+    int heap_n[SEARCH_MAX_THREADS], matched_by[SEARCH_MAX_THREADS];
+    rank_hit hits[SEARCH_MAX_THREADS * RANK_TOP_K];
+    int nhits, matched, selected;
+    int version;
+} rank;
+
+u8 rank_lower[256];
+
+void rank_tables() {
+    for (int c = 0; c < 256; c++) rank_lower[c] = isalnum(c) ? tolower(c) : 0;
+}
 
-The line editing we support:
+u64 rank_hash(u8* p, int n) {
+    u64 h = 1469598103934665603ULL;
+    for (int i = 0; i < n; i++) {
+        h ^= rank_lower[p[i]];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
 
-- all kinds of backspaces shorten the span by one and redraw the line (using ANSI escapes and \r).
-- enter returns.
-- everything else just gets appended to our span, which it extends.
+int rank_is_word(u8 c) {
+    return rank_lower[c] != 0;
+}
+
+void* rank_grow(void* a, int* cap, int need, int size) {
+    if (need <= *cap) return a;
+    *cap = need * 2 > 1024 ? need * 2 : 1024;
+    a = realloc(a, (size_t)*cap * size);
+    if (!a) exit_with_error("Failed to allocate search index");
+    return a;
+}
+
+/*
+rank_df_add adds delta to the df of a term; the table is open addressing on the term hash, and a term stays in it (with df 0) once it has been seen.
 */
 
-span read_line(span* buffer) {
-    assert(len(*buffer));
-    prt("> ");
-    flush();
+void rank_df_add(u64 key, int delta) {
+    if (rank_index.df_used * 2 >= rank_index.df_cap) {
+        int old_cap = rank_index.df_cap;
+        u64* old_keys = rank_index.df_keys;
+        int* old_df = rank_index.df;
+        rank_index.df_cap = old_cap ? old_cap * 2 : 1 << 16;
+        rank_index.df_keys = calloc(rank_index.df_cap, sizeof(u64));
+        rank_index.df = calloc(rank_index.df_cap, sizeof(int));
+        if (!rank_index.df_keys || !rank_index.df) exit_with_error("Failed to allocate search index");
+        for (int i = 0; i < old_cap; i++) {
+            if (!old_keys[i]) continue;
+            int k = old_keys[i] & (rank_index.df_cap - 1);
+            while (rank_index.df_keys[k]) k = (k + 1) & (rank_index.df_cap - 1);
+            rank_index.df_keys[k] = old_keys[i];
+            rank_index.df[k] = old_df[i];
+        }
+        free(old_keys);
+        free(old_df);
+    }
+    int k = key & (rank_index.df_cap - 1);
+    while (rank_index.df_keys[k] && rank_index.df_keys[k] != key) k = (k + 1) & (rank_index.df_cap - 1);
+    if (!rank_index.df_keys[k]) {
+        rank_index.df_keys[k] = key;
+        rank_index.df_used++;
+    }
+    rank_index.df[k] += delta;
+}
 
-    span input = {buffer->buf, buffer->buf}; // Initialize input span to start at buffer start
+int rank_df_get(u64 key) {
+    if (!rank_index.df_cap) return 0;
+    int k = key & (rank_index.df_cap - 1);
+    while (rank_index.df_keys[k] && rank_index.df_keys[k] != key) k = (k + 1) & (rank_index.df_cap - 1);
+    return rank_index.df_keys[k] ? rank_index.df[k] : 0;
+}
 
-    while (1) {
-        char ch = getch(); // Read a single character from input
+void rank_doc_terms(rank_doc* d, int delta) {
+    for (int i = 0; i < d->nterms; i++) rank_df_add(rank_index.terms[d->terms + i], delta);
+    rank_index.total_tokens += delta * d->ntokens;
+    rank_index.live += delta;
+}
 
-        if (ch == '\n') {
-            prt("\n"); // Newline for visual separation of input
-            break; // Return on enter
-        } else if ((ch == '\b' || ch == 127) && input.buf < input.end) {
-            // Handle backspace (ASCII BACKSPACE and DEL)
-            input.end--; // Shorten the span by one
-            prt("\033[2K\r> %.*s", (int)(input.end - input.buf), input.buf); // Redraw the line
-        } else {
-            *input.end++ = ch; // Append character to span and extend it
-            prt("%c", ch); // Echo the character
+/*
+rank_doc_new tokenizes a block and adds it to the index; the distinct terms are found with a scratch hash set (rank_index.scratch) sized to the block.
+*/
+
+int rank_doc_new(span block, u64 hash) {
+    int cap = 64;
+    while (cap < len(block)) cap *= 2;
+    rank_index.scratch = rank_grow(rank_index.scratch, &rank_index.scratch_cap, cap, sizeof(u64));
+    memset(rank_index.scratch, 0, cap * sizeof(u64));
+
+    rank_index.docs = rank_grow(rank_index.docs, &rank_index.docs_cap, rank_index.ndocs + 1, sizeof(rank_doc));
+    rank_doc* d = &rank_index.docs[rank_index.ndocs];
+    *d = (rank_doc){.hash = hash, .terms = rank_index.nterms};
+    for (u8* p = block.buf; p < block.end;) {
+        if (!rank_is_word(*p)) {
+            p++;
+            continue;
         }
-        flush(); // Ensure output is updated immediately
+        u8* q = p;
+        while (q < block.end && rank_is_word(*q)) q++;
+        u64 h = rank_hash(p, q - p);
+        int k = h & (cap - 1);
+        while (rank_index.scratch[k] && rank_index.scratch[k] != h) k = (k + 1) & (cap - 1);
+        if (!rank_index.scratch[k]) {
+            rank_index.scratch[k] = h;
+            rank_index.terms = rank_grow(rank_index.terms, &rank_index.terms_cap, rank_index.nterms + 1, sizeof(u64));
+            rank_index.terms[rank_index.nterms++] = h;
+        }
+        d->ntokens++;
+        p = q;
     }
+    d->nterms = rank_index.nterms - d->terms;
+    return rank_index.ndocs++;
+}
 
-    buffer->buf = input.end; // Update the original buffer to point to the end of the input
-    return input; // Return the span containing the user's input
+int rank_slot(u64 hash) {
+    int k = hash & (rank_index.slots_cap - 1);
+    while (rank_index.slots[k] && rank_index.docs[rank_index.slots[k] - 1].hash != hash) k = (k + 1) & (rank_index.slots_cap - 1);
+    return k;
 }
-/* save_conf_files()
 
-Here we write the language and file lines into the conf file.
+void rank_slots_rebuild(int min_docs) {
+    int cap = 1024;
+    while (cap < min_docs * 2) cap *= 2;
+    rank_index.slots = realloc(rank_index.slots, cap * sizeof(int));
+    if (!rank_index.slots) exit_with_error("Failed to allocate search index");
+    rank_index.slots_cap = cap;
+    memset(rank_index.slots, 0, cap * sizeof(int));
+    for (int d = 0; d < rank_index.ndocs; d++) rank_index.slots[rank_slot(rank_index.docs[d].hash)] = d + 1;
+}
 
-The structure of this data in the conf file is that a language line should be included every time the language of the next file is different from the previous file.
-For example, if there are three files, with languages C, Python, Python, then we would have a language line of C, then the first file, then language Python and both the other files.
+/*
+rank_compact drops the docs that are gone (refs 0) and their terms, by copying the live ones down.
+*/
 
-Therefore, we maintain a local variable indicating the last-written language, initially empty of course.
-For each file, if the language is already equal to this, then we just print the file line, otherwise we print a language line first.
+void rank_compact() {
+    int nd = 0, nt = 0;
+    for (int d = 0; d < rank_index.ndocs; d++) {
+        rank_doc doc = rank_index.docs[d];
+        if (!doc.refs) continue;
+        memmove(rank_index.terms + nt, rank_index.terms + doc.terms, doc.nterms * sizeof(u64));
+        doc.terms = nt;
+        nt += doc.nterms;
+        rank_index.docs[nd++] = doc;
+    }
+    rank_index.ndocs = nd;
+    rank_index.nterms = nt;
+}
 
-As mentioned elsewhere, each conf line includes the key, a colon, space and the value, followed by newline.
-*/
+void rank_sync() {
+    if (rank_index.synced && rank_index.version == state->blocks_version) return;
+    TRACE_SCOPE(rank_sync);
+    if (!rank_lower['a']) rank_tables();
+    int compact = rank_index.ndocs > 2 * rank_index.live + 1024;
+    if (compact) rank_compact();
+    if (compact || rank_index.slots_cap < (rank_index.ndocs + state->blocks.n) * 2) rank_slots_rebuild(rank_index.ndocs + state->blocks.n);
 
-void save_conf_files() {
-    span last_written_language = nullspan();
-    for (int i = 0; i < state->files.n; i++) {
-        if (!span_eq(last_written_language, state->files.a[i].language)) {
-            last_written_language = state->files.a[i].language;
-            prt("language: %.*s\n", len(last_written_language), last_written_language.buf);
+    rank_index.block_doc = rank_grow(rank_index.block_doc, &rank_index.block_doc_cap, state->blocks.n, sizeof(int));
+    int epoch = ++rank_index.epoch;
+    for (int i = 0; i < state->blocks.n; i++) {
+        u64 hash = block_table.hash[i];
+        int k = rank_slot(hash);
+        int d = rank_index.slots[k] - 1;
+        if (d < 0) {
+            d = rank_doc_new(state->blocks.s[i], hash);
+            rank_index.slots[k] = d + 1;
+        }
+        rank_doc* doc = &rank_index.docs[d];
+        if (doc->seen != epoch) {
+            if (!doc->refs) rank_doc_terms(doc, 1);
+            doc->seen = epoch;
+            doc->refs = 0;
+        }
+        doc->refs++;
+        rank_index.block_doc[i] = d;
+    }
+    for (int d = 0; d < rank_index.ndocs; d++) {
+        rank_doc* doc = &rank_index.docs[d];
+        if (doc->seen != epoch && doc->refs) {
+            rank_doc_terms(doc, -1);
+            doc->refs = 0;
         }
-        prt("file: %.*s\n", len(state->files.a[i].path), state->files.a[i].path.buf);
     }
+    rank_index.synced = 1;
+    rank_index.version = state->blocks_version;
 }
+
 /*
-In save_conf(), we simply rewrite the conf file to reflect any settings that may have been changed.
+rank_worse says whether hit a ranks below hit b; the heaps keep the worst of their hits at the top, so that a better one can replace it.
+*/
 
-First we will write into the cmp space the current configuration.
-Next, we will write that into the file named by state.config_file_path.
-Finally we can shorten the cmp space back to what it was.
+int rank_worse(rank_hit a, rank_hit b) {
+    return a.score < b.score || (a.score == b.score && a.index > b.index);
+}
 
-First we store a span that has .buf pointing to the current cmp.end.
-Then we call prt2cmp() and use prt to print a line for each config var as described below.
+void rank_heap_push(int worker, rank_hit hit) {
+    rank_hit* heap = rank.heaps[worker];
+    int n = rank.heap_n[worker];
+    int i;
+    if (n < RANK_TOP_K) {
+        i = rank.heap_n[worker]++;
+        while (i > 0 && rank_worse(hit, heap[(i - 1) / 2])) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = hit;
+        return;
+    }
+    if (!rank_worse(heap[0], hit)) return;
+    i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= n) break;
+        if (c + 1 < n && rank_worse(heap[c + 1], heap[c])) c++;
+        if (!rank_worse(heap[c], hit)) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = hit;
+}
+
+int rank_fuzzy(span term, u8* p, u8* q) {
+    u8* t = term.buf + 1;
+    for (p++; p < q && t < term.end; p++) if (rank_lower[*p] == rank_lower[*t]) t++;
+    return t == term.end;
+}
+
+void rank_chunk(int c, int worker) {
+    double k1 = 1.2, b = 0.75;
+    int end = (c + 1) * SEARCH_CHUNK;
+    if (end > state->blocks.n) end = state->blocks.n;
+    for (int i = c * SEARCH_CHUNK; i < end; i++) {
+        span block = state->blocks.s[i];
+        u8* comment_end = block.buf + block_table.comment_end[i];
+        double hits[RANK_MAX_TERMS] = {0}, fuzzy[RANK_MAX_TERMS] = {0};
+        for (u8* p = block.buf; p < block.end;) {
+            if (!rank_is_word(*p)) {
+                p++;
+                continue;
+            }
+            u8* q = p;
+            while (q < block.end && rank_is_word(*q)) q++;
+            u8 mask = rank.first[*p];
+            double weight = p < comment_end ? RANK_COMMENT : 1;
+            for (int t = 0; mask; t++, mask >>= 1) {
+                if (!(mask & 1)) continue;
+                span term = rank.terms[t];
+                if (q - p == len(term) && !strncasecmp((char*)p, (char*)term.buf, len(term))) hits[t] += weight;
+                else if (!hits[t] && q - p > len(term) && rank_fuzzy(term, p, q)) fuzzy[t] += weight * len(term) / (q - p);
+            }
+            p = q;
+        }
+        double norm = k1 * (1 - b + b * rank_index.docs[rank_index.block_doc[i]].ntokens / rank.avg_tokens);
+        double score = 0;
+        for (int t = 0; t < rank.nterms; t++) {
+            double h = hits[t] ? hits[t] : RANK_FUZZY * fuzzy[t];
+            if (h) score += rank.idf[t] * h * (k1 + 1) / (h + norm);
+        }
+        if (score <= 0) continue;
+        rank.matched_by[worker]++;
+        rank_heap_push(worker, (rank_hit){score, i});
+    }
+}
+
+int rank_hit_order(const void* a, const void* b) {
+    rank_hit x = *(rank_hit*)a, y = *(rank_hit*)b;
+    return rank_worse(y, x) ? -1 : rank_worse(x, y) ? 1 : 0;
+}
+
+/*
+rank_blocks runs the ranked search for a query (the search without the slash and tilde), unless it is the one we already have results for, leaving the best first in rank.hits (rank.nhits of them, at most RANK_TOP_K) and the number of matching blocks in rank.matched.
+A new query resets the choice (rank.selected) to the top.
+*/
+
+void rank_blocks(span query) {
+    if (len(query) >= sizeof(rank.query)) query.end = query.buf + sizeof(rank.query) - 1;
+    if (rank.query_len == len(query) && !memcmp(rank.query, query.buf, len(query)) && rank.version == state->blocks_version) return;
+    if (rank.query_len != len(query) || memcmp(rank.query, query.buf, len(query))) rank.selected = 0;
+    memcpy(rank.query, query.buf, len(query));
+    rank.query_len = len(query);
+    rank.version = state->blocks_version;
+
+    rank_sync();
+    rank.nterms = 0;
+    span rest = {rank.query, rank.query + rank.query_len};
+    while (rank.nterms < RANK_MAX_TERMS) {
+        while (!empty(rest) && !rank_is_word(*rest.buf)) rest.buf++;
+        if (empty(rest)) break;
+        u8* p = rest.buf;
+        while (p < rest.end && rank_is_word(*p)) p++;
+        span term = {rest.buf, p};
+        rest.buf = p;
+        int df = rank_df_get(rank_hash(term.buf, len(term)));
+        rank.idf[rank.nterms] = log(1 + (rank_index.live - df + 0.5) / (df + 0.5));
+        rank.terms[rank.nterms++] = term;
+    }
+    memset(rank.first, 0, sizeof(rank.first));
+    for (int t = 0; t < rank.nterms; t++) {
+        for (int c = 0; c < 256; c++) if (rank_lower[c] == rank_lower[*rank.terms[t].buf]) rank.first[c] |= 1 << t;
+    }
+    rank.avg_tokens = rank_index.live ? (double)rank_index.total_tokens / rank_index.live : 1;
+    if (rank.avg_tokens <= 0) rank.avg_tokens = 1;
+
+    memset(rank.heap_n, 0, sizeof(rank.heap_n));
+    memset(rank.matched_by, 0, sizeof(rank.matched_by));
+    if (rank.nterms) search_pool_run(rank_chunk);
+
+    rank.nhits = rank.matched = 0;
+    for (int w = 0; w < SEARCH_MAX_THREADS; w++) {
+        memcpy(rank.hits + rank.nhits, rank.heaps[w], rank.heap_n[w] * sizeof(rank_hit));
+        rank.nhits += rank.heap_n[w];
+        rank.matched += rank.matched_by[w];
+    }
+    qsort(rank.hits, rank.nhits, sizeof(rank_hit), rank_hit_order);
+    if (rank.nhits > RANK_TOP_K) rank.nhits = RANK_TOP_K;
+    if (rank.selected >= rank.nhits) rank.selected = rank.nhits ? rank.nhits - 1 : 0;
+}
+
+void rank_select(int delta) {
+    rank.selected += delta;
+    if (rank.selected >= rank.nhits) rank.selected = rank.nhits - 1;
+    if (rank.selected < 0) rank.selected = 0;
+}
+
+/*
+print_ranked_results shows the results of rank_blocks in place of the usual search display: a line with the number of matching blocks, then one line per result with the block number, the score and the first line of its comment (first_comment_line), with "> " on the chosen one, scrolling the list if needed to keep that on screen, and the search string on the last line as usual.
+*/
+
+void print_ranked_results() {
+    int remaining_lines = state->terminal_rows;
+    clear_display();
+    prt("%d blocks matched, best first (Ctrl-N/Ctrl-P to choose, enter to go):\n", rank.matched);
+    remaining_lines--;
+
+    int rows = remaining_lines - 1;
+    int top = rank.selected >= rows ? rank.selected - rows + 1 : 0;
+    int width = state->terminal_cols - 20;
+    for (int i = top; i < rank.nhits && remaining_lines > 1; i++) {
+        span line = first_comment_line(state->blocks.s[rank.hits[i].index]);
+        if (width < 0) width = 0;
+        if (len(line) > width) line.end = line.buf + width;
+        prt("%s%6d %9.2f  %.*s\n", i == rank.selected ? "> " : "  ", rank.hits[i].index + 1, rank.hits[i].score, len(line), line.buf);
+        remaining_lines--;
+    }
+    while (remaining_lines > 1) {
+        terpri();
+        remaining_lines--;
+    }
+    wrs(state->search);
+    flush();
+}
+
+/*
+In perform_search(), we get the state after the search string has been updated.
+
+The search string (span state.search) will always start with a slash.
+We remove this (there is no library method for this so just directly construct the span) and take the rest of it as the actual string to search for.
+If the rest starts with another slash, it is a regex (see #regex), which search_blocks handles for us.
+If it starts with a tilde, it is a ranked search instead, and we just call rank_blocks and print_ranked_results (see #ranked_search) and return.
+We use spanspan to find the first block that matches, along with the number of other blocks that match, which search_blocks does for us on the search pool (see #search_pool).
+If the search span is empty (as when only "/" was typed) then we match every block, so we can use empty() on the result of spanspan to detect a match, but we also match if the search span is empty().
+(This will store the empty span at the beginning of the first block as the match span, which gives the behavior we want when printing the match later.)
+We store both the index of the first block that matched and a copy of the span given by spanspan for this first block only, as we will need both of them later.
+
+This tells us where the first block was that matched, and how many total blocks matched, and also the location in the span that contains the match.
+
+Once we have our search results, we call clear_display().
+
+Also at the top, we declare a local variable of remaining lines from the top of the terminal window, since we want to print something at the bottom later.
+Every time we print a line or multiple lines, we decrement this value with the number of lines we printed, no more and no less.
+In particular, we never decrement this "in advance," for lines to printed later, as that would violate the invariant that the number of actual remaining lines is the number in our variable.
+
+Next, we print "Block N:" on a line (adding one as usual).
+Then we decide how many initial lines of the block to print.
+Without changing the terminal lines remaining value (since we indeed want our last line to be on the last line) we subtract 8 from this remaining number (leaving space for other output) and divide this by two to get the number of initial block physical lines to print.
+Then we print this many physical lines of the block, by calling a function print_physical_lines(span,int).
+(Note: physical lines means terminal rows used, as opposed to logical lines actually ending in newline.)
+
+If nothing matched, then we do not print this part, but we still print the "N blocks matched" part later (0 in that case, of course) and the search string itself on the last line.
+
+After the first lines of the block, we print a blank line, then "Match:" on a line, and then the line that contains the matched span.
+We call a helper function, print_matching_physical_lines, which takes the block and the actual matched span (which we have from before), and handles finding and printing the match, and returns the number of physical lines that it used.
+
+We print another blank line and then "N blocks matched" (or, for a regex that doesn't compile, what is wrong with it).
+
+Finally, we will add empty lines until we are at the bottom of the screen as indicated by terminal_rows on the state.
+On the last line we will print the entire search string (including the slash).
+(We can do this with wrs(), we don't need to add a newline as we are already on the last line of the window anyway.)
+Before returning from the function we call flush() as we are responsible for updating the display.
+*/
+
+void perform_search() {
+    TRACE_SCOPE(perform_search);
+    int remaining_lines = state->terminal_rows;
+    span search_span = {state->search.buf + 1, state->search.end};
+    if (!empty(search_span) && *search_span.buf == '~') {
+        rank_blocks((span){search_span.buf + 1, search_span.end});
+        print_ranked_results();
+        return;
+    }
+    int first_match_index;
+    span first_match_span;
+    int match_count = search_blocks(search_span, 0, &first_match_index, &first_match_span);
+
+    clear_display();
+
+    if (first_match_index != -1) {
+        prt("Block %d:\n", first_match_index + 1);
+        remaining_lines -= 1;
+
+        int initial_lines_to_print = (remaining_lines - 8) / 2;
+        print_physical_lines(state->blocks.s[first_match_index], initial_lines_to_print);
+        remaining_lines -= initial_lines_to_print;
+
+        prt("\n");
+        remaining_lines -= 1;
+
+        prt("Match:\n");
+        remaining_lines -= 1;
+
+        int lines_printed = print_matching_physical_lines(state->blocks.s[first_match_index], first_match_span);
+        remaining_lines -= lines_printed;
+
+        prt("\n");
+        remaining_lines -= 1;
+    }
+
+    if (match_count < 0) prt("Regex error: %s\n", search_regex.error);
+    else prt("%d blocks matched\n", match_count);
+    remaining_lines -= 1;
+
+    while (remaining_lines > 1) {
+        terpri();
+        remaining_lines -= 1;
+    }
+
+    wrs(state->search);
+    flush();
+}
+/*
+In next_line_limit(span* s, int n) we are given a span and a length limit.
+We return a span which is a prefix of s.
+If the first n characters do not contain newline, and the n+1th character is also not a newline, then we return a span, not ending in newline, of n characters.
+If the first n characters do not contain newline but n+1 does, we include n+1 characters, including the newline.
+Otherwise, there is a newline within the first n characters, we return n or fewer characters with the last one being the newline.
+We also set s->buf to contain the rest of the span not in the returned prefix.
+*/
+
+
+span next_line_limit(span* s, int n) {
+    span result = {s->buf, s->buf}; // Initialize result span to start of input span
+    if (s->buf == NULL || n <= 0) return result; // Check for null pointer or non-positive length
+
+    int i;
+    for (i = 0; i < n && (s->buf + i) < s->end; i++) {
+        if (s->buf[i] == '\n') {
+            result.end = s->buf + i + 1; // Include the newline in the result
+            break;
+        }
+    }
+
+    if (i == n) { // Reached the length limit without encountering a newline
+        if ((s->buf + n) < s->end && s->buf[n] == '\n') {
+            result.end = s->buf + n + 1; // Include the next character if it is a newline
+        } else {
+            result.end = s->buf + n; // Just include up to the limit
+        }
+    }
+
+    s->buf = result.end; // Advance the start of the input span past the returned prefix
+    return result;
+}
+/*
+In print_ruler we use prt to show
+
+- the number of blocks,
+- the currently selected block,
+- the scrolled lines plus one (i.e. the one-based index of the top visible line)
+- the status of the background build, if there has been one (print_build_status)
+- the diagnostics from that build in the current block, if any (print_block_diags)
+- LLM requests in flight, or the last LLM error (print_llm_status)
+- the error from the last clipboard operation, if it failed (print_clip_status)
+- the live edit session, if any (print_live_status)
+- where we are among the matches of the last search, if any (print_match_status)
+- what the last undo or redo did (print_undo_status)
+
+all on a line without a newline.
+*/
+
+void print_build_status();
+void print_block_diags();
+void print_llm_status();
+void print_clip_status();
+void print_live_status();
+void print_match_status();
+void print_undo_status();
+
+void print_ruler() {
+    prt("%d blocks, Block %d, Line %d", state->blocks.n, state->current_index + 1, state->scrolled_lines + 1);
+    print_build_status();
+    print_block_diags();
+    print_llm_status();
+    print_clip_status();
+    print_live_status();
+    print_match_status();
+    print_undo_status();
+}
+/*
+In print_single_block_with_skipping we get a block index and a pagination index in the form of a number of lines already "scrolled off" above the top of the screen (skipped_lines).
+
+First, we call count_physical_lines, which gives us a span of skipped lines and alters an int, subtracting the number of physical lines which this span represents.
+We make a copy of the block and adjust this copy to the suffix which is meant to be aligned to the top of our content area, by setting the .buf of the copy to the .end of the scrolled-off span.
+
+We set a variable remaining_rows which we initialize with state->terminal_rows and decrement as we print lines of output.
+First we print a line "Block N" and decrement this variable by one.
+
+We have a ruler line at the bottom that we need to leave room for, so we make another variable, remaining_content_lines, that is one less than remaining lines, and call count_physical_lines again with this variable, letting us determine how many lines are actually printed, and more importantly, giving us a span of the appropriate content to at-most fill the screen.
+
+We then print this content by match_print(), which is wrs() but with the matches of the last search highlighted (see #match_list).
+Note that the int passed by reference into count_physical_lines will be DECREMENTED by the number of actual physical lines of content in the returned span.
+Therefore, the value of this variable after the call is the number of REMAINING lines of content area yet to be filled, thus, while this remains positive, we print blank lines, filling the content area.
+Finally, we call print_ruler to handle the last line of the terminal.
+*/
+
+void print_single_block_with_skipping(int block_index, int skipped_lines) {
+    span block = state->blocks.s[block_index];
+    int remaining_rows = state->terminal_rows;
+
+    span skipped_span = count_physical_lines(block, &skipped_lines);
+    block.buf = skipped_span.end;
+
+    prt("Block %d\n", block_index + 1);
+    remaining_rows--;
+
+    int remaining_content_lines = remaining_rows - 1;
+    span content_to_print = count_physical_lines(block, &remaining_content_lines);
+
+    match_print(block_index, content_to_print);
+    remaining_rows -= (state->terminal_rows - 1 - remaining_content_lines);
+
+    while (remaining_rows > 1) {
+        terpri();
+        remaining_rows--;
+    }
+
+    print_ruler();
+}
+/*
+In print_physical_lines, we get a span, and a number of lines.
+We can use next_line on the span to get each logical line, and then we use the terminal_cols on the state to determine the number of physical lines that each one will require.
+However, note that a blank line will still require one physical line (because we will print an empty line).
+If the physical lines would be more than we need, then we only print enough characters (with wrapping) to fill the lines.
+Otherwise we print the full line, followed by a newline, and then we decrement the number of lines that we still need appropriately.
+*/
+
+
+void print_physical_lines(span block, int lines_to_print) {
+    while (!empty(block) && lines_to_print > 0) {
+        span line = next_line(&block); // Get the next logical line from the block
+
+        // Handle blank lines
+        if (line.end == line.buf) {
+            if (lines_to_print > 0) {
+                terpri(); // Print a newline for a blank logical line
+                lines_to_print--;
+            }
+            continue; // Move to the next line
+        }
+
+        // Calculate the number of physical lines required for this logical line
+        int line_length = line.end - line.buf;
+        int physical_lines_needed = (line_length / state->terminal_cols) + (line_length % state->terminal_cols != 0);
+
+        if (physical_lines_needed <= lines_to_print) {
+            // If the entire logical line fits within the remaining physical lines
+            for (int i = 0; i < line_length; i += state->terminal_cols) {
+                int chars_to_print = (i + state->terminal_cols > line_length) ? (line_length - i) : state->terminal_cols;
+                prt("%.*s\n", chars_to_print, line.buf + i); // Print a segment of the logical line
+            }
+            lines_to_print -= physical_lines_needed;
+        } else {
+            // If the logical line does not fit entirely, print parts of it to fit in the remaining lines
+            for (int i = 0; i < lines_to_print * state->terminal_cols; i += state->terminal_cols) {
+                int chars_to_print = (i + state->terminal_cols > line_length) ? (line_length - i) : state->terminal_cols;
+                prt("%.*s\n", chars_to_print, line.buf + i);
+            }
+            lines_to_print = 0; // We've filled the remaining lines
+        }
+    }
+}
+/*
+In print_matching_physical_lines, we get the span of a block and of a match.
+
+We must print the physical lines from the block which contain the match, and then return the number of physical lines that we have printed.
+
+We happen to know, because of how our search currently works, that a match will never cross a logical line boundary (since we don't have a way of entering newlines in the search mode).
+
+We will loop over the logical lines using next_line as usual.
+
+When we find the logical line that contains the match (which we can do by comparing .buf and .end), then we determine where to start printing the physical lines.
+(Note: we compare .buf and .end because we already have found a match, we do not use contains() which would search the strings again!)
+
+(A logical line contains physical lines, which are runs of characters that fill the terminal_cols (on state), and therefore cause wrapping.)
+
+Specifically, we want to skip any physical lines at the start of the logical line until we get to the first physical line that contains the match.
+Then we print this physical line, and keep printing physical lines until we have reached the end of the match.
+Whether or not we have printed the full logical line, we then print a newline.
+
+We return the number of physical lines that we have printed.
+*/
+
+int print_matching_physical_lines(span block, span match) {
+
+    int physical_lines_printed = 0;
+    int terminal_width = state->terminal_cols;
+
+    while (!empty(block)) {
+        span line = next_line(&block);
+
+        if ((match.buf >= line.buf) && (match.end <= line.end)) {
+            int start_offset = match.buf - line.buf;
+            int match_length = len(match);
+            int start_physical_line = start_offset / terminal_width;
+            int end_physical_line = (start_offset + match_length) / terminal_width;
+
+            for (int i = start_physical_line; i <= end_physical_line; ++i) {
+                int line_start = i * terminal_width;
+                int line_end = (i + 1) * terminal_width;
+                if (line_end > len(line)) {
+                    line_end = len(line);
+                }
+                prt("%.*s\n", line_end - line_start, line.buf + line_start);
+                physical_lines_printed++;
+            }
+            break;
+        }
+    }
+
+    return physical_lines_printed;
+}
+/*
+In finalize_search(), we update the current_index to point to the first result of the search given in the search string.
+We ignore the first character of state.search which is always slash, and find every match of the rest of the search string (match_list_build, see #match_list), so that n and N can step through them.
+We go to the first one, scrolled so that its line is in the middle of the screen.
+If there is nothing in the list (an empty search, or a regex that only matches empty strings) we find the first block which matches instead (using search_blocks with first_only, so the pool can stop early, see #search_pool).
+For a ranked search (see #ranked_search) we go to the chosen result instead, and empty the match list.
+Then we set current_index to that block, also resetting scrolled_lines.
+We then reset state.search to an empty span to indicate that we are not in search mode any more.
+Finally we call print_current_blocks to refresh the display given the block that is now the current one (replacing the search screen).
+*/
+
+
+void finalize_search() {
+    span search_span = {state->search.buf + 1, state->search.end}; // Ignore the leading slash
+
+    int first_match_index;
+    span first_match_span;
+    if (!empty(search_span) && *search_span.buf == '~') {
+        rank_blocks((span){search_span.buf + 1, search_span.end});
+        first_match_index = rank.nhits ? rank.hits[rank.selected].index : -1;
+        match_list_build(nullspan()); // Nothing to step through or highlight
+    } else {
+        match_list_build(search_span);
+        if (match_list.n) {
+            match_list.current = 0;
+            state->current_index = match_list.m[0].block;
+            match_center(&match_list.m[0]);
+            first_match_index = -1; // Already there
+        } else {
+            search_blocks(search_span, 1, &first_match_index, &first_match_span);
+        }
+    }
+    if (first_match_index >= 0) {
+        state->current_index = first_match_index; // Update current_index to the first match
+        state->scrolled_lines = 0;
+    }
+
+    state->search = nullspan(); // Reset search to indicate exit from search mode
+    //print_current_blocks(); // Refresh the display
+}
+
+/* Settings.
+
+When the tool starts, we ask about specific configuration settings that must exist.
+Otherwise, for settings like the buildcmd we only ask the first time the feature is used.
+
+As settings are changed, we write a configuration file, which is always .cmpr/conf in the current working directory.
+
+The contents of this file will be similar to RFC822-style headers.
+We will have a key name followed by colon, space and then a value to the end of the line.
+
+We have functions to read and write this format, which we do in the cmp space.
+
+In handle_conf_{language,file} we are called with a span in each case containing either a pathname or a language, in the order that these config keys occur in the config file.
+
+The idea is that when a language key occurs, it sets the language which is then used on subsequent files.
+However, as the one exception to this pattern, when files are included before any language is given, then we will add the files without a language.
+
+Therefore:
+
+- when we see a language line, we will set the current_language on the state
+- when we see a file line, we set the language on the file to current_language and add the file to the state
+- only in the case where we see a language line and the language was not already set, then we know that this is the first language line in the file; in this case we iterate over any files that we already added, and set the language on them.
+
+Below we write both functions handle_conf_{language,file}.
+*/
+
+void handle_conf_language(span language) {
+    state->current_language = language;
+    // Set the language for all previously added files if they have no language set
+    if (state->files.n > 0 && empty(state->files.a[0].language)) {
+        for (int i = 0; i < state->files.n; i++) {
+            if (empty(state->files.a[i].language)) {
+                state->files.a[i].language = language;
+            }
+        }
+    }
+}
+
+int glob_meta(span);
+void dir_source_add(span key, span value);
+
+void handle_conf_file(span file_path) {
+    if (glob_meta(file_path) >= 0) {
+        dir_source_add(S("file"), file_path);
+        return;
+    }
+    projfile file = { .path = file_path, .language = state->current_language, .contents = nullspan() };
+    projfiles_push(&state->files, file);
+}
+/* #dir_sources
+
+Listing every file on its own file line is fine for a few files, but not for a project with thousands of them, or one that gains and loses files all the time.
+So the conf can also have lines that expand to many files when we start:
+
+    dir: src *.c *.h=C !vendor !*_test.c
+    file: lib/py_**.py
+
+A dir line is the directory to walk, then any number of patterns, separated by spaces:
+
+- a pattern includes the files that match it, and can end in =Language to give them that language,
+- a pattern starting with ! excludes matching files, and any directories that match it aren't walked at all,
+- a pattern with a slash in it matches the path under the directory (e.g. "gen/x?.c"), otherwise it matches just the file name, at any depth,
+- in a pattern, * and ? match within one name, ** matches across slashes too, and [...] (or [!...]) matches one of (or none of) a set of characters, with ranges like a-z,
+- with no include patterns, every file that has the extension of one of our grammars (see #grammar) is included.
+
+A file line with any of * ? [ in it is a glob: it's a dir line for the directory before the first of these, with the rest of the line as one pattern with a slash (so "src/x*.c" doesn't go into subdirectories of src, and "src/x**.c" does).
+
+A file's language is the one its pattern gives, otherwise the one its extension gives (language_for_path), otherwise the language line in effect at the dir line; files that still have none are skipped.
+Names starting with a dot are never included (so .git and .cmpr aren't walked), and we don't follow symlinks to directories, which could make cycles; symlinks to files are fine.
+The files are sorted by path and added where the line is, so the block order doesn't depend on the order readdir gives us.
+save_conf_files writes each dir or glob line back as it was, in place of the files it expanded to (see dir_source.at and .n).
+
+The walk (dir_walk_run) goes a level at a time, reading all the directories of a level on the search pool (see #search_pool, with one directory per chunk).
+Each worker reads its directory with readdir, which gives us the type of each entry (d_type) without any stat, so only entries whose type the filesystem doesn't give, or symlinks, cost an fstatat; it tests each name against the patterns and appends what it keeps (a kind byte, the pattern index and the path) to its own buffer, and the UI thread merges these in chunk order, as in #match_list.
+If every include pattern has a slash and no **, we know how deep the files can be, and don't read directories below that.
+
+The result is cached, in a file under .cmpr/cache named by a hash of the line, along with the language in effect and every grammar's name and extension (which decide the files a bare dir line picks), as the mtime of every directory we read followed by the files we found.
+Adding, removing or renaming a file changes the mtime of the directory it's in, so if all the directories still have the same mtimes (which we check with a parallel stat, also on the pool), the list of files is still good, and we skip the walk.
+Otherwise we walk again and rewrite the cache.
+A directory changed in the same second as the walk might have changed again without its mtime changing, so if any directory is that new we don't write the cache, and the next startup walks again.
+
+Reading the files themselves is also parallel; see read_projfiles below.
+*/
+
+#define DIR_MAX_SOURCES 64
+#define DIR_MAX_PATTERNS 32
+#define DIR_ANY 255
+
+typedef struct {
+    span key, value;
+    span language;
+    span root;
+    span pat[DIR_MAX_PATTERNS], lang[DIR_MAX_PATTERNS];
+    u8 exclude[DIR_MAX_PATTERNS], anchored[DIR_MAX_PATTERNS];
+    int npat, nincludes;
+    int depth;
+    int at, n;
+} dir_source;
+
+struct {
+    dir_source a[DIR_MAX_SOURCES];
+    int n;
+} dir_sources;
+
+typedef struct {
+    size_t path;
+    int pat;
+} dir_entry;
+
+struct {
+    dir_source* d;
+    char* paths;
+    size_t paths_n, paths_cap;
+    size_t* dirs;
+    struct timespec* mtime;
+    int ndirs, dirs_cap;
+    dir_entry* files;
+    int nfiles, files_cap;
+    int level, lo, rel_skip;
+    u8* buf[SEARCH_MAX_THREADS];
+    int buf_n[SEARCH_MAX_THREADS], buf_cap[SEARCH_MAX_THREADS];
+} dir_walk;
+
+/*
+glob_meta returns the offset of the first glob character in s, or -1 if there isn't one.
+
+glob_match matches a whole path (or name) against a whole pattern, as described above.
+A * tries every length of the rest of the path, up to the next slash (or anywhere, for **); a ** followed by a slash can also match nothing at all, so that the slash after it can be the one before a file directly in the directory.
+An unterminated [ is just a [.
+*/
+
+int glob_meta(span s) {
+    for (u8* p = s.buf; p < s.end; p++) {
+        if (*p == '*' || *p == '?' || *p == '[') return p - s.buf;
+    }
+    return -1;
+}
+
+int glob_match(u8* p, u8* pe, u8* s, u8* se) {
+    while (p < pe) {
+        if (*p == '*') {
+            int deep = p + 1 < pe && p[1] == '*';
+            p += deep ? 2 : 1;
+            if (deep && p < pe && *p == '/' && glob_match(p + 1, pe, s, se)) return 1;
+            for (u8* t = s; t <= se; t++) {
+                if (glob_match(p, pe, t, se)) return 1;
+                if (t < se && *t == '/' && !deep) return 0;
+            }
+            return 0;
+        }
+        if (s == se) return 0;
+        if (*p == '[') {
+            u8* q = p + 1;
+            int negate = q < pe && *q == '!';
+            if (negate) q++;
+            u8* set = q;
+            int hit = 0;
+            while (q < pe && (*q != ']' || q == set)) {
+                if (q + 2 < pe && q[1] == '-' && q[2] != ']') {
+                    hit |= q[0] <= *s && *s <= q[2];
+                    q += 3;
+                } else {
+                    hit |= *q++ == *s;
+                }
+            }
+            if (q < pe) {
+                if (hit == negate || *s == '/') return 0;
+                p = q + 1;
+                s++;
+                continue;
+            }
+        }
+        if (*p == '?' ? *s == '/' : *p != *s) return 0;
+        p++;
+        s++;
+    }
+    return s == se;
+}
+
+/*
+dir_source_parse splits a dir line (or a glob file line) into its root and patterns, and works out the depth limit (-1 for none), as described above.
+*/
+
+void dir_source_parse(dir_source* d, span key, span value) {
+    *d = (dir_source){.key = key, .value = value, .depth = -1};
+    if (span_eq(key, S("file"))) {
+        int slash = glob_meta(value);
+        while (slash >= 0 && value.buf[slash] != '/') slash--;
+        d->root = slash < 0 ? S(".") : (span){value.buf, value.buf + (slash ? slash : 1)};
+        d->pat[0] = (span){value.buf + slash + 1, value.end};
+        d->anchored[0] = 1;
+        d->npat = 1;
+    } else {
+        span rest = value;
+        for (int field = 0;; field++) {
+            while (!empty(rest) && isspace(*rest.buf)) rest.buf++;
+            if (empty(rest)) break;
+            u8* end = rest.buf;
+            while (end < rest.end && !isspace(*end)) end++;
+            span pat = {rest.buf, end};
+            rest.buf = end;
+            if (!field) {
+                d->root = pat;
+                continue;
+            }
+            if (d->npat == DIR_MAX_PATTERNS) {
+                prt("Error: Too many patterns on a dir line (at most %d).\n", DIR_MAX_PATTERNS);
+                flush();
+                exit(EXIT_FAILURE);
+            }
+            int i = d->npat++;
+            d->exclude[i] = pat.buf[0] == '!';
+            if (d->exclude[i]) pat.buf++;
+            int eq = len(pat) - 1;
+            while (eq >= 0 && pat.buf[eq] != '=') eq--;
+            if (eq >= 0 && !d->exclude[i]) {
+                d->lang[i] = (span){pat.buf + eq + 1, pat.end};
+                pat.end = pat.buf + eq;
+            }
+            d->pat[i] = pat;
+            d->anchored[i] = find_char(pat, '/') >= 0;
+        }
+    }
+    while (len(d->root) > 1 && d->root.end[-1] == '/') d->root.end--;
+    if (empty(d->root)) d->root = S(".");
+
+    for (int i = 0; i < d->npat; i++) {
+        if (d->exclude[i]) continue;
+        int slashes = 0;
+        for (u8* p = d->pat[i].buf; p < d->pat[i].end; p++) slashes += *p == '/';
+        if (!d->anchored[i] || contains(d->pat[i], S("**"))) d->depth = INT_MAX;
+        else if (d->depth < slashes) d->depth = slashes;
+        d->nincludes++;
+    }
+    if (!d->nincludes || d->depth == INT_MAX) d->depth = -1;
+}
+
+/*
+dir_wanted is the test for one entry, with rel its path under the root and name its last part.
+For a file it returns the index of the first include pattern it matches (DIR_ANY if there are no include patterns and it has a grammar's extension), and for a directory DIR_ANY; in both cases -1 if it is excluded or not included.
+*/
+
+int dir_pattern_match(dir_source* d, int i, span rel, span name) {
+    span target = d->anchored[i] ? rel : name;
+    return glob_match(d->pat[i].buf, d->pat[i].end, target.buf, target.end);
+}
+
+int dir_wanted(dir_source* d, span rel, span name, int is_file) {
+    for (int i = 0; i < d->npat; i++) {
+        if (d->exclude[i] && dir_pattern_match(d, i, rel, name)) return -1;
+    }
+    if (!is_file) return DIR_ANY;
+    if (!d->nincludes) return empty(language_for_path(name)) ? -1 : DIR_ANY;
+    for (int i = 0; i < d->npat; i++) {
+        if (!d->exclude[i] && dir_pattern_match(d, i, rel, name)) return i;
+    }
+    return -1;
+}
+
+/*
+The walk keeps every path it has seen, NUL-terminated, in dir_walk.paths, and refers to them by offset, since the buffer moves as it grows.
+dir_walk_path adds one, dir_walk_dir adds a directory to be read (and later its mtime), and dir_walk_file a file that is included, with its pattern.
+*/
+
+size_t dir_walk_path(span path) {
+    if (dir_walk.paths_n + len(path) + 1 > dir_walk.paths_cap) {
+        dir_walk.paths_cap = (dir_walk.paths_n + len(path) + 1) * 2;
+        dir_walk.paths = realloc(dir_walk.paths, dir_walk.paths_cap);
+        if (!dir_walk.paths) exit_with_error("Failed to allocate dir walk");
+    }
+    size_t off = dir_walk.paths_n;
+    memcpy(dir_walk.paths + off, path.buf, len(path));
+    dir_walk.paths[off + len(path)] = 0;
+    dir_walk.paths_n += len(path) + 1;
+    return off;
+}
+
+int dir_walk_dir(size_t path) {
+    if (dir_walk.ndirs == dir_walk.dirs_cap) {
+        dir_walk.dirs_cap = dir_walk.dirs_cap ? dir_walk.dirs_cap * 2 : 256;
+        dir_walk.dirs = realloc(dir_walk.dirs, dir_walk.dirs_cap * sizeof(size_t));
+        dir_walk.mtime = realloc(dir_walk.mtime, dir_walk.dirs_cap * sizeof(struct timespec));
+        if (!dir_walk.dirs || !dir_walk.mtime) exit_with_error("Failed to allocate dir walk");
+    }
+    dir_walk.dirs[dir_walk.ndirs] = path;
+    dir_walk.mtime[dir_walk.ndirs] = (struct timespec){0};
+    return dir_walk.ndirs++;
+}
+
+void dir_walk_file(size_t path, int pat) {
+    if (dir_walk.nfiles == dir_walk.files_cap) {
+        dir_walk.files_cap = dir_walk.files_cap ? dir_walk.files_cap * 2 : 1024;
+        dir_walk.files = realloc(dir_walk.files, dir_walk.files_cap * sizeof(dir_entry));
+        if (!dir_walk.files) exit_with_error("Failed to allocate dir walk");
+    }
+    dir_walk.files[dir_walk.nfiles++] = (dir_entry){path, pat};
+}
+
+/*
+dir_walk_chunk reads one directory of the current level, on any worker, as described above.
+Records are appended to the worker's own buffer, which only that worker grows, and the chunk result says where they are (first and count are byte offsets here).
+We take the mtime before reading the entries, so that anything added while we read changes it after the one we keep.
+*/
+
+void dir_walk_record(int worker, u8 kind, int pat, char* path, int l) {
+    if (dir_walk.buf_n[worker] + l + 3 > dir_walk.buf_cap[worker]) {
+        dir_walk.buf_cap[worker] = (dir_walk.buf_n[worker] + l + 3) * 2;
+        dir_walk.buf[worker] = realloc(dir_walk.buf[worker], dir_walk.buf_cap[worker]);
+        if (!dir_walk.buf[worker]) exit_with_error("Failed to allocate dir walk");
+    }
+    u8* p = dir_walk.buf[worker] + dir_walk.buf_n[worker];
+    p[0] = kind;
+    p[1] = pat;
+    memcpy(p + 2, path, l + 1);
+    dir_walk.buf_n[worker] += l + 3;
+}
+
+void dir_walk_chunk(int c, int worker) {
+    search_chunk* r = &search_pool.chunks[c];
+    r->worker = worker;
+    r->first = dir_walk.buf_n[worker];
+    dir_source* d = dir_walk.d;
+    int i = dir_walk.lo + c;
+    char* dir_path = dir_walk.paths + dir_walk.dirs[i];
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        r->count = 0;
+        return;
+    }
+    struct stat st;
+    if (fstat(dirfd(dir), &st) == 0) dir_walk.mtime[i] = st.st_mtim;
+
+    char path[4096];
+    int prefix = strcmp(dir_path, ".") == 0 ? 0 : snprintf(path, sizeof(path), "%s%s", dir_path, dir_path[strlen(dir_path) - 1] == '/' ? "" : "/");
+    int descend = d->depth < 0 || dir_walk.level < d->depth;
+    struct dirent* e;
+    while ((e = readdir(dir))) {
+        if (e->d_name[0] == '.' || strchr(e->d_name, '\n')) continue;
+        int type = e->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            if (fstatat(dirfd(dir), e->d_name, &st, 0)) continue;
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) && e->d_type != DT_LNK ? DT_DIR : DT_UNKNOWN;
+        }
+        if (type != DT_REG && !(type == DT_DIR && descend)) continue;
+        int l = prefix + snprintf(path + prefix, sizeof(path) - prefix, "%s", e->d_name);
+        if (l >= (int)sizeof(path)) continue;
+        span rel = {(u8*)path + dir_walk.rel_skip, (u8*)path + l};
+        span name = {(u8*)path + prefix, (u8*)path + l};
+        int pat = dir_wanted(d, rel, name, type == DT_REG);
+        if (pat >= 0) dir_walk_record(worker, type == DT_REG ? 'f' : 'd', pat, path, l);
+    }
+    closedir(dir);
+    r->count = dir_walk.buf_n[worker] - r->first;
+}
+
+void dir_walk_run(dir_source* d) {
+    TRACE_SCOPE(dir_walk_run);
+    dir_walk.d = d;
+    dir_walk.rel_skip = span_eq(d->root, S(".")) ? 0 : len(d->root) + (d->root.end[-1] != '/');
+    dir_walk_dir(dir_walk_path(d->root));
+    for (dir_walk.level = 0, dir_walk.lo = 0; dir_walk.lo < dir_walk.ndirs; dir_walk.level++) {
+        int hi = dir_walk.ndirs;
+        for (int w = 0; w < SEARCH_MAX_THREADS; w++) dir_walk.buf_n[w] = 0;
+        int nchunks = search_pool_run_n(hi - dir_walk.lo, dir_walk_chunk);
+        for (int c = 0; c < nchunks; c++) {
+            search_chunk* r = &search_pool.chunks[c];
+            u8* p = dir_walk.buf[r->worker] + r->first;
+            u8* end = p + r->count;
+            while (p < end) {
+                int l = strlen((char*)p + 2);
+                size_t path = dir_walk_path((span){p + 2, p + 2 + l});
+                if (p[0] == 'd') dir_walk_dir(path);
+                else dir_walk_file(path, p[1]);
+                p += l + 3;
+            }
+        }
+        dir_walk.lo = hi;
+    }
+}
+
+/*
+The cache file for a line is text:
+
+    cmpr dirs 1
+    d <seconds> <nanoseconds> <path>    (one for each directory read)
+    f <pattern index> <path>            (one for each file included)
+
+dir_cache_load reads it into dir_walk and returns 1 if every directory still has its mtime (dir_stat_chunk checks one), otherwise 0 (also if there is no cache, or we can't make sense of it).
+dir_cache_save writes dir_walk out after a walk, to a tmp file first and then renamed over the old one, like the LLM cache (see #llm_cache); failing to write it doesn't matter, we'll walk again next time.
+*/
+
+void dir_cache_path(dir_source* d, char* buf, int size) {
+    hasher h;
+    hash_init(&h);
+    hash_update(&h, d->key);
+    hash_update(&h, S(": "));
+    hash_update(&h, d->value);
+    hash_update(&h, S("\n"));
+    hash_update(&h, d->language);
+    grammar_init();
+    for (int i = 0; i < ngrammars; i++) {
+        hash_update(&h, S("\n"));
+        hash_update(&h, grammars[i].name);
+        hash_update(&h, S(" "));
+        hash_update(&h, grammars[i].ext);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "dirs-%016llx", hash_final(&h));
+    llm_cache_path(buf, size, name);
+}
+
+long long span_digits(span* s) {
+    long long n = 0;
+    while (s->buf < s->end && isdigit(*s->buf)) n = n * 10 + *s->buf++ - '0';
+    if (s->buf < s->end && *s->buf == ' ') s->buf++;
+    return n;
+}
+
+void dir_stat_chunk(int c, int worker) {
+    struct stat st;
+    struct timespec t = dir_walk.mtime[c];
+    search_pool.chunks[c].count = stat(dir_walk.paths + dir_walk.dirs[c], &st) == 0 && S_ISDIR(st.st_mode)
+        && st.st_mtim.tv_sec == t.tv_sec && st.st_mtim.tv_nsec == t.tv_nsec;
+}
+
+int dir_cache_load(dir_source* d, char* path) {
+    span cache = map_file(path);
+    span rest = cache;
+    int ok = span_eq(next_line(&rest), S("cmpr dirs 1"));
+    while (ok && !empty(rest)) {
+        span line = next_line(&rest);
+        if (len(line) < 2 || line.buf[1] != ' ') {
+            ok = 0;
+            break;
+        }
+        u8 kind = line.buf[0];
+        line.buf += 2;
+        if (kind == 'd') {
+            struct timespec t;
+            t.tv_sec = span_digits(&line);
+            t.tv_nsec = span_digits(&line);
+            int dir = dir_walk_dir(dir_walk_path(line));
+            dir_walk.mtime[dir] = t;
+        } else if (kind == 'f') {
+            int pat = span_digits(&line);
+            ok = pat == DIR_ANY || pat < d->npat;
+            dir_walk_file(dir_walk_path(line), pat);
+        } else {
+            ok = 0;
+        }
+    }
+    unmap_file(cache);
+    if (!ok || !dir_walk.ndirs) return 0;
+    int nchunks = search_pool_run_n(dir_walk.ndirs, dir_stat_chunk);
+    for (int c = 0; c < nchunks; c++) {
+        if (!search_pool.chunks[c].count) return 0;
+    }
+    return 1;
+}
+
+void dir_cache_save(char* path, time_t started) {
+    for (int i = 0; i < dir_walk.ndirs; i++) {
+        if (dir_walk.mtime[i].tv_sec >= started - 1) return;
+    }
+    span text = {cmp.end, cmp.end};
+    prt2cmp();
+    prt("cmpr dirs 1\n");
+    for (int i = 0; i < dir_walk.ndirs; i++) {
+        prt("d %lld %ld %s\n", (long long)dir_walk.mtime[i].tv_sec, dir_walk.mtime[i].tv_nsec, dir_walk.paths + dir_walk.dirs[i]);
+    }
+    for (int i = 0; i < dir_walk.nfiles; i++) {
+        prt("f %d %s\n", dir_walk.files[i].pat, dir_walk.paths + dir_walk.files[i].path);
+    }
+    prt2std();
+    text.end = cmp.end;
+    cmp.end = text.buf;
+
+    char dir[2048], tmp[2100];
+    llm_cache_path(dir, sizeof(dir), "");
+    mkdir(dir, 0755);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    int ok = write_spans(fd, &text, 1) == 0;
+    close(fd);
+    if (!ok || rename(tmp, path) < 0) unlink(tmp);
+}
+
+/*
+dir_source_add is called by parse_config for a dir line and by handle_conf_file for a glob, with the language line in effect as state->current_language.
+It gets the files from the cache or by walking, sorts them, and pushes a projfile for each one that has a language, with its path copied into cmp next to the rest of the conf (the walk's buffers are reused by the next line).
+*/
+
+int dir_entry_cmp(const void* a, const void* b) {
+    return strcmp(dir_walk.paths + ((const dir_entry*)a)->path, dir_walk.paths + ((const dir_entry*)b)->path);
+}
+
+void dir_source_add(span key, span value) {
+    TRACE_SCOPE(dir_source_add);
+    if (dir_sources.n == DIR_MAX_SOURCES) {
+        prt("Error: Too many dir and glob lines (at most %d).\n", DIR_MAX_SOURCES);
+        flush();
+        exit(EXIT_FAILURE);
+    }
+    dir_source* d = &dir_sources.a[dir_sources.n++];
+    dir_source_parse(d, key, value);
+    d->language = state->current_language;
+    grammar_init();
+
+    char path[2048];
+    dir_cache_path(d, path, sizeof(path));
+    dir_walk.paths_n = dir_walk.ndirs = dir_walk.nfiles = 0;
+    if (!dir_cache_load(d, path)) {
+        dir_walk.paths_n = dir_walk.ndirs = dir_walk.nfiles = 0;
+        time_t started = time(NULL);
+        dir_walk_run(d);
+        dir_cache_save(path, started);
+    }
+    qsort(dir_walk.files, dir_walk.nfiles, sizeof(dir_entry), dir_entry_cmp);
+
+    d->at = state->files.n;
+    for (int i = 0; i < dir_walk.nfiles; i++) {
+        dir_entry* e = &dir_walk.files[i];
+        char* p = dir_walk.paths + e->path;
+        span file_path = {(u8*)p, (u8*)p + strlen(p)};
+        span language = e->pat == DIR_ANY ? nullspan() : d->lang[e->pat];
+        if (empty(language)) language = language_for_path(file_path);
+        if (empty(language)) language = d->language;
+        if (empty(language)) continue;
+        span kept = {cmp.end, cmp.end + len(file_path)};
+        memcpy(kept.buf, file_path.buf, len(file_path));
+        cmp.end = kept.end;
+        projfiles_push(&state->files, (projfile){.path = kept, .language = language, .contents = nullspan()});
+    }
+    d->n = state->files.n - d->at;
+}
+
+/*
+In read_projfiles, called by get_code, we read all the projfiles into inp, on the search pool rather than one after another, so that on a cold cache the reads of many files are in flight at once.
+
+- First we stat every file in parallel (read_stat_chunk) for its size, and its mtime, which goes on the projfile.
+- Then, in order, we decide which files are windowed (with the room left in inp after the files before it, exactly as load_projfile would) and give every other file its slot in inp, one after another, as the one-at-a-time reading would have; windowed files are mapped here.
+- Then we read every file into its slot in parallel (read_file_chunk), checking that it is still the size we saw.
+
+If anything is off (a file we couldn't stat or read, or one that changed size between the stat and the read) we just do it all again the old way, one file at a time with load_projfile, which reports the errors as it always has.
+*/
+
+struct {
+    off_t* size;
+    u8** slot;
+    int cap;
+} read_pool;
+
+void read_stat_chunk(int c, int worker) {
+    char path[2048];
+    s(path, sizeof(path), state->files.a[c].path);
+    struct stat st;
+    int ok = stat(path, &st) == 0;
+    read_pool.size[c] = ok && S_ISREG(st.st_mode) ? st.st_size : -1;
+    state->files.a[c].mtime = ok ? st.st_mtim : (struct timespec){0};
+}
+
+void read_file_chunk(int c, int worker) {
+    search_chunk* r = &search_pool.chunks[c];
+    r->count = 1;
+    if (state->files.a[c].windowed) return;
+    char path[2048];
+    s(path, sizeof(path), state->files.a[c].path);
+    int fd = open(path, O_RDONLY);
+    off_t got = 0, size = read_pool.size[c];
+    if (fd >= 0) {
+        while (got < size) {
+            ssize_t n = pread(fd, read_pool.slot[c] + got, size - got, got);
+            if (n <= 0) break;
+            got += n;
+        }
+        u8 more;
+        if (got == size && pread(fd, &more, 1, got) != 0) got = -1; // it grew
+        close(fd);
+    }
+    r->count = fd >= 0 && got == size;
+}
+
+void read_projfiles() {
+    TRACE_SCOPE(read_projfiles);
+    int n = state->files.n;
+    if (n > read_pool.cap) {
+        read_pool.cap = n * 2;
+        read_pool.size = realloc(read_pool.size, read_pool.cap * sizeof(off_t));
+        read_pool.slot = realloc(read_pool.slot, read_pool.cap * sizeof(u8*));
+        if (!read_pool.size || !read_pool.slot) exit_with_error("Failed to allocate file reads");
+    }
+    for (int i = 0; i < n; i++) {
+        projfile* f = &state->files.a[i];
+        if (f->windowed) unmap_file(f->contents);
+        f->windowed = 0;
+        f->contents = nullspan();
+    }
+    search_pool_run_n(n, read_stat_chunk);
+
+    span start = inp;
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++) {
+        projfile* f = &state->files.a[i];
+        if (read_pool.size[i] < 0) {
+            ok = 0;
+            break;
+        }
+        f->windowed = window_wanted(read_pool.size[i]);
+        if (f->windowed) {
+            char path[2048];
+            s(path, sizeof(path), f->path);
+            f->contents = window_map(path);
+            ok = f->contents.end - f->contents.buf == read_pool.size[i];
+        } else {
+            read_pool.slot[i] = inp.end;
+            f->contents = (span){inp.end, inp.end + read_pool.size[i]};
+            inp.end = f->contents.end;
+        }
+    }
+    if (ok) {
+        int nchunks = search_pool_run_n(n, read_file_chunk);
+        for (int c = 0; c < nchunks; c++) ok &= search_pool.chunks[c].count;
+    }
+    if (ok) return;
+
+    inp = start;
+    for (int i = 0; i < n; i++) {
+        projfile* f = &state->files.a[i];
+        if (f->windowed) unmap_file(f->contents);
+        f->windowed = 0;
+        f->contents = load_projfile(f);
+        if (!f->windowed) inp.end = f->contents.end;
+    }
+}
+
+/*
+In the first function, parse_config, we read the contents of our config file (at state->config_file_path) into the cmp space, parse it, and set on the ui_state all the appropriate values.
+
+We have a library method cmp_compl() which gives us the complement of cmp in cmp_space, which is the space that we can safely read into.
+We'll read our configuration file into that space with read_file_S_into_span().
+
+After we read the file into cmp, we get a span back from our library method containing the file contents.
+We still have to manually update cmp.end to match the end of this span so that later uses of the cmp space don't clobber our configs.
+
+We then can use next_line() in a loop to process them one by one.
+First we look for ":" with find_char, and if it is not found, we skip the line.
+After the colon we'll skip any whitespace with an isspace() loop and then consider the rest of the line to be the value.
+(Note that we don't trim whitespace off the end, something maybe worth documenting elsewhere for config file users).
+Next_line has already stripped the newline from the end so we don't need to do that.
+
+Next, we compare the key part before the colon with our list of configuration values above, and if it matches any of them, we set the corresponding member of the ui state, which is always named the same as the config key name.
+The values of the config keys will always be spans.
+We have CONFIG_FIELDS defined above, we use that here with an X macro.
+
+However, there is an exception to the handling of config fields for some values that might be handled specially.
+These are not included in our CONFIG_FIELDS, but instead we handle them with custom code here.
+These are:
+
+- language
+- file
+- grammar
+- dir
+
+These are handled by custom code, so we have functions handle_conf_{language,file,grammar} (already written above) that we call with the value span for any of these each time they occur in the config file; a dir line goes to dir_source_add (see #dir_sources), as does a file line that is a glob.
+
+Finally, any file that still has no language (because the conf has no language line at all) gets the language whose extension it has (language_for_path, see #grammar), if any; check_conf_vars asks the user about the rest.
+*/
+
+void parse_config() {
+    span cmp_free_space = cmp_compl();
+    span config_content = read_file_S_into_span(state->config_file_path, cmp_free_space);
+    cmp.end = config_content.end; // Update cmp to avoid overwriting config
+
+    while (!empty(config_content)) {
+        span line = next_line(&config_content);
+        int pos = find_char(line, ':');
+        if (pos < 0) continue; // Skip line if no colon found
+
+        span key = {line.buf, line.buf + pos};
+        span value = {line.buf + pos + 1, line.end};
+
+        // Skip initial whitespace in the value
+        while (value.buf < value.end && isspace(*value.buf)) value.buf++;
+
+        // Handle special keys
+        if (span_eq(key, S("language"))) {
+            handle_conf_language(value);
+        } else if (span_eq(key, S("file"))) {
+            handle_conf_file(value);
+        } else if (span_eq(key, S("grammar"))) {
+            handle_conf_grammar(value);
+        } else if (span_eq(key, S("dir"))) {
+            dir_source_add(key, value);
+        } else {
+            // Handle general configuration keys
+            #define X(name) \
+                if (span_eq(key, S(#name))) { \
+                    state->name = value; \
+                    continue; \
+                }
+            CONFIG_FIELDS
+            #undef X
+        }
+    }
+
+    for (int i = 0; i < state->files.n; i++) {
+        projfile* f = &state->files.a[i];
+        if (empty(f->language)) f->language = language_for_path(f->path);
+    }
+}
+
+void settings_mode(){}
+/*
+In read_line, we get a span pointer to some space that we can use to store input from the user.
+Just to be sure, we always assert(len(buffer)) which helps catch some programming errors that have happened in the past.
+
+We first print our prompt, which is "> ".
+
+Recall that we use prt() as always.
+
+We handle some basic line editing using our getch() in a loop, until enter is hit.
+At that point we return a span containing the user's input.
+The span which was passed in will have been shortened such that .end of our return value is now the .buf of the passed-in span.
+(In this way, the caller can perform other necessary adjustments, or use the remaining buffer area in a loop etc.)
+
+The line editing we support:
+
+- all kinds of backspaces shorten the span by one and redraw the line (using ANSI escapes and \r).
+- enter returns.
+- everything else just gets appended to our span, which it extends.
+*/
+
+span read_line(span* buffer) {
+    assert(len(*buffer));
+    prt("> ");
+    flush();
+
+    span input = {buffer->buf, buffer->buf}; // Initialize input span to start at buffer start
+
+    while (1) {
+        char ch = getch(); // Read a single character from input
+
+        if (ch == '\n') {
+            prt("\n"); // Newline for visual separation of input
+            break; // Return on enter
+        } else if ((ch == '\b' || ch == 127) && input.buf < input.end) {
+            // Handle backspace (ASCII BACKSPACE and DEL)
+            input.end--; // Shorten the span by one
+            prt("\033[2K\r> %.*s", (int)(input.end - input.buf), input.buf); // Redraw the line
+        } else {
+            *input.end++ = ch; // Append character to span and extend it
+            prt("%c", ch); // Echo the character
+        }
+        flush(); // Ensure output is updated immediately
+    }
+
+    buffer->buf = input.end; // Update the original buffer to point to the end of the input
+    return input; // Return the span containing the user's input
+}
+/* save_conf_files()
+
+Here we write the grammar, language and file lines into the conf file.
+
+The grammar lines (see #grammar) come first, one for each grammar that came from the conf, written back exactly as they were read.
+
+The structure of this data in the conf file is that a language line should be included every time the language of the next file is different from the previous file.
+For example, if there are three files, with languages C, Python, Python, then we would have a language line of C, then the first file, then language Python and both the other files.
+
+Therefore, we maintain a local variable indicating the last-written language, initially empty of course.
+For each file, if the language is already equal to this, then we just print the file line, otherwise we print a language line first.
+
+The files that came from a dir line or a glob (see #dir_sources) are not written; instead, where the first of them was (dir_source.at), we write the line itself, after a language line for the language that was in effect where it was read, if that is different.
+
+As mentioned elsewhere, each conf line includes the key, a colon, space and the value, followed by newline.
+*/
+
+void save_conf_files() {
+    for (int i = 0; i < ngrammars; i++) {
+        if (!empty(grammars[i].conf)) prt("grammar: %.*s\n", len(grammars[i].conf), grammars[i].conf.buf);
+    }
+    span last_written_language = nullspan();
+    int source = 0;
+    for (int i = 0; i <= state->files.n; i++) {
+        while (source < dir_sources.n && dir_sources.a[source].at == i) {
+            dir_source* d = &dir_sources.a[source++];
+            if (!empty(d->language) && !span_eq(last_written_language, d->language)) {
+                last_written_language = d->language;
+                prt("language: %.*s\n", len(last_written_language), last_written_language.buf);
+            }
+            prt("%.*s: %.*s\n", len(d->key), d->key.buf, len(d->value), d->value.buf);
+            i += d->n;
+        }
+        if (i >= state->files.n) break;
+        if (!span_eq(last_written_language, state->files.a[i].language)) {
+            last_written_language = state->files.a[i].language;
+            prt("language: %.*s\n", len(last_written_language), last_written_language.buf);
+        }
+        prt("file: %.*s\n", len(state->files.a[i].path), state->files.a[i].path.buf);
+    }
+}
+/*
+In save_conf(), we simply rewrite the conf file to reflect any settings that may have been changed.
+
+First we will write into the cmp space the current configuration.
+Next, we will write that into the file named by state.config_file_path.
+Finally we can shorten the cmp space back to what it was.
+
+First we store a span that has .buf pointing to the current cmp.end.
+Then we call prt2cmp() and use prt to print a line for each config var as described below.
 Then we call prt2std().
 Next we set the .end of that span to be the current cmp.end.
 
-Then we call write_to_file_span with the span and the configuration file name.
-Finally we shorten cmp back to what it was, since the contents have been written out we no longer need them around.
+Then we call write_to_file_span with the span and the configuration file name.
+Finally we shorten cmp back to what it was, since the contents have been written out we no longer need them around.
+
+To print a config var, we print the name, a colon and single space, and then the value itself followed by newline.
+(We currently assume that none of our conf vars contain newlines (a safe assumption, as if they did we'd also have no way to read them in).)
+Our X macro handles the "normal" config fields, but then we call another function, save_conf_files, that handles the file and language lines that are special.
+*/
+
+void save_conf() {
+    TRACE_SCOPE(save_conf);
+    span original_cmp_end = {cmp.end, cmp.end};
+    prt2cmp();
+
+    #define X(name) prt(#name ": %.*s\n", len(state->name), state->name.buf);
+    CONFIG_FIELDS
+    #undef X
+
+    save_conf_files();
+    prt2std();
+    original_cmp_end.end = cmp.end;
+
+    write_to_file_span(original_cmp_end, state->config_file_path, 1);
+    cmp.end = original_cmp_end.buf;
+}
+/* #add_projfile(span)
+
+Here we add a file to the projfiles and ensure that the file exists on disk.
+This is a helper function for check_conf_vars.
+
+We add the file to the projfiles, but do not set a language on it (since that will be handled next by that function.)
+
+If it is not creatable, writable by the user, etc, we will report the error, wait for a keystroke, and then return 0, otherwise we return 1.
+*/
+
+int add_projfile(span file_path_span) {
+    char file_path[2048] = {0};
+    s(file_path, 2048, file_path_span);
+
+    FILE *file = fopen(file_path, "a+");
+    if (file == NULL) {
+        prt("Error: Cannot create or write to file %s.\nPress any key to continue...\n", file_path);
+        flush();
+        getch();
+        return 0;
+    }
+    fclose(file);
+
+    projfile new_file = {.path = file_path_span, .language = nullspan(), .contents = nullspan()};
+    projfiles_push(&state->files, new_file);
+    return 1;
+}
+/*
+In check_conf_vars() we test the state for all essential configuration variables and if any is missing we prompt the user to set that.
+
+The essential configuration variables, along with the reason why each is required, are:
+
+revdir: We save a revision every time you edit a block, this is where they will be stored (.cmpr/revs is a good choice).
+tmpdir: Location for temporary files for editing a block in the editor, a good choice is .cmpr/tmp.
+
+TODO: probably all the above "config-related metadata" should be in one place in a table for all the conf vars; we'll do that later.
+For now, a local macro cleans up this code quite a bit.
+
+For each missing variable in the order given, we print the string after the colon above as a prompt to the user (and include the configuration parameter name).
+
+We then call read_line to get the new value from the user.
+For the buffer space to use we will first call cmp_compl() to get the complement of cmp space as a span.
+After read_line returns we will always set cmp.end to point to the end of the RETURNED span; this makes sure nothing else uses that space later.
+NOTE: THIS MEANS THE VALUE THAT IS ****RETURNED**** BY THE READ_LINE FUNCTION.
+
+Additional to the "normal" conf vars, we also have the files, and the language setting for each file.
+
+First, it's a requirement that there be at least one file, even if it is empty, otherwise we have nowhere to put any blocks and no way to get things off the ground.
+Therefore if there are no files on the state, we will prompt the user to name one file that can be added to the project.
+We explain that at least one file is required otherwise there is nowhere to create any blocks and no way to proceed.
+We then create this as an empty file if it does not already exist by calling add_projfile() with the path.
+Note that this function may fail, in which case it will return 0.
+If it fails, we just loop until it succeeds as there's no going forward without it.
+
+Next, if there is a file in projfiles that doesn't have a language set, then we tell the user that this is required and set the language on the projfile in this case.
+We tell them that the language must be "Python", "C", or one that has a grammar line in the conf, and determines how blocks start and also where the comment part ends and code part starts (see #grammar).
+
+Once we have set all the required conf vars, if any of them were missing, including any languages on the projfiles, or adding the first projfile, then we call save_conf() which just rewrites the conf file.
+
+TODO: use the ensure_conf_var thing that we added after this
+*/
+
+void check_conf_vars() {
+    #define CHECK_AND_SET(var, prompt) \
+    if (empty(state->var)) { \
+        prt("%s\n", prompt); \
+        flush(); \
+        span input_space = cmp_compl(); \
+        state->var = read_line(&input_space); \
+        cmp.end = state->var.end; \
+    }
+
+    CHECK_AND_SET(revdir, "revdir: Path for revisions (.cmpr/revs is a good choice)");
+    CHECK_AND_SET(tmpdir, "tmpdir: Path for temp files (.cmpr/tmp is a good choice)");
+
+    if (state->files.n == 0) {
+        while (1) {
+            prt("At least one file is required. Please specify a file path to add:\n");
+            flush();
+            span input_space = cmp_compl();
+            span file_path_span = read_line(&input_space);
+            cmp.end = file_path_span.end;
+            if (add_projfile(file_path_span)) break;
+        }
+    }
+
+    for (int i = 0; i < state->files.n; ++i) {
+        if (empty(state->files.a[i].language)) {
+            prt("A language for each file is required. Please specify 'Python', 'C', or a language from a grammar line, for the file: %.*s\n", len(state->files.a[i].path), state->files.a[i].path.buf);
+            flush();
+            span input_space = cmp_compl();
+            state->files.a[i].language = read_line(&input_space);
+            cmp.end = state->files.a[i].language.end;
+        }
+    }
+
+    #undef CHECK_AND_SET
+    save_conf();
+}
+/*
+In ensure_conf_var() we are given a span, which must be one of the conf vars on the state, a message for the user to explain what the conf setting does and why it is required, and a default or current value that we can pass through to read_line.
+
+If the conf var is not empty, we return immediately.
+
+We call read_line to get the new value from the user.
+For the buffer space to use we will first call cmp_compl() to get the complement of cmp space as a span.
+After read_line returns we will always set cmp.end to point to the end of the returned span; this makes sure nothing else uses that space later.
+
+Then we call save_conf() which just rewrites the conf file.
+*/
+
+void ensure_conf_var(span* var, span message, span default_value) {
+    if (!empty(*var)) return; // If the configuration variable is already set, return immediately
+
+    prt("%.*s\n", len(message), message.buf); // Print the message explaining the configuration setting
+    if (!empty(default_value)) {
+        prt("Default: %.*s\n", len(default_value), default_value.buf); // Show default value if provided
+    }
+
+    span buffer = cmp_compl(); // Get complement of cmp space as a span for input
+    *var = read_line(&buffer); // Read new value from user
+
+    cmp.end = buffer.buf; // Update cmp.end to the end of the returned span from read_line
+
+    save_conf(); // Rewrite the configuration file with the updated setting
+}
+/*
+To edit the current block we first write it out to a file, which we do with a helper function write_to_file(span, char*).
+
+Once the file is written, we then launch the user's editor of choice on that file, which is handled by another helper function.
+
+That function will wait for the editor process to exit, and will indicate to us by its return value whether the editor exited normally.
+
+If so, then we call another function which will then read the edited file contents back in and handle storing the new version.
+
+If not, we print a short message to let the user know their changes were ignored.
+*/
+
+char* tmp_filename();
+int launch_editor(char* filename);
+void handle_edited_file(char* filename);
+
+void edit_current_block() {
+  if (state->current_index >= 0 && state->current_index < state->blocks.n) {
+    // Get a temporary filename based on the current UI state
+    char* filename = tmp_filename();
+
+    // Write the current block to the temporary file
+    write_to_file(state->blocks.s[state->current_index], filename);
+
+    // Launch the editor on the temporary file
+    int editor_exit_code = launch_editor(filename);
+
+    // Check if the editor exited normally
+    if (editor_exit_code == 0) {
+      // Handle the edited file (read changes, update the block, etc.)
+      handle_edited_file(filename);
+    } else {
+      // Optionally handle abnormal editor exit
+      prt("Editor exited abnormally. Changes might not be saved.\n");
+    }
+
+    // Cleanup: Free the filename if allocated dynamically
+    free(filename);
+  }
+}
+
+/*
+To generate a tmp filename for launching the user's editor, we return a string starting with state->tmpdir.
+For the filename part, we construct a timestamp in a compressed ISO 8601-like format, as YYYYMMDD-hhmmss with just a single dash as separator.
+We append a file extension: we use the block table to get the language for the current block and add the extension from its grammar (e.g. ".c" for C and ".py" for Python, see #grammar).
+We return a char* which the caller must free.
+Since state->tmpdir may or may not include a trailing slash we test for and handle both cases.
+*/
+
+char* tmp_filename() {
+    time_t now = time(NULL);
+    struct tm *tm = localtime(&now);
+    char time_str[16]; // Enough to hold YYYYMMDD-HHMMSS
+    strftime(time_str, sizeof(time_str), "%Y%m%d-%H%M%S", tm);
+
+    span extension = grammars[block_table.lang[state->current_index]].ext;
+
+    int need_slash = state->tmpdir.end[-1] != '/';
+    int total_length = (state->tmpdir.end - state->tmpdir.buf) + strlen(time_str) + len(extension) + 1 + need_slash;
+    char* filename = malloc(total_length);
+    if (!filename) {
+        perror("Failed to allocate memory for filename");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(filename, total_length, "%.*s%s%s%.*s", 
+             (int)(state->tmpdir.end - state->tmpdir.buf), state->tmpdir.buf, 
+             need_slash ? "/" : "", 
+             time_str, 
+             len(extension), extension.buf);
+
+    return filename;
+}
+/*
+In launch_editor, we are given a filename and must launch the user's editor of choice on that file, and then wait for it to exit and return its exit code.
+
+We look in the env for an EDITOR environment variable and use that if it is present, otherwise we will use "vi".
+
+As always, we never write const anywhere in C.
+*/
+
+int launch_editor(char* filename) {
+    TRACE_SCOPE(launch_editor);
+    char* editor = getenv("EDITOR");
+    if (editor == NULL) {
+        editor = "vi"; // Default to vi if EDITOR is not set
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        // Child process
+        execlp(editor, editor, filename, (char*)NULL);
+        // If execlp returns, it means it failed
+        perror("execlp failed");
+        exit(EXIT_FAILURE);
+    } else {
+        // Parent process
+        int status;
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status)) {
+            return WEXITSTATUS(status); // Return the exit status of the editor
+        } else {
+            return -1; // Editor didn't exit normally
+        }
+    }
+}
+/* int file_for_block(span)
+
+Here we're given the span of a block and we must find out the index of the file that contains that block.
+
+If .buf of the span is >= .buf of the contents of the file (recall that file contents are spans into inp and so are blocks), and the .end of the block is similarly <= .end of the file, then the file contains the block.
+
+If the block overlaps a file boundary, something has gone badly wrong and we complain as exit as usual (prt, flush, exit).
+
+Similarly if it's outside all the files.
+In short, we always return an int n, 0 <= n <= state->files.n, or don't return at all.
+*/
+
+int file_for_block(span block) {
+    for (int i = 0; i < state->files.n; i++) {
+        if (block.buf >= state->files.a[i].contents.buf && block.end <= state->files.a[i].contents.end) {
+            return i;
+        }
+    }
+    prt("Error: Block does not belong to any file.\n");
+    flush();
+    exit(EXIT_FAILURE);
+}
+/* handle_edited_file
+
+Here we are given a tmp file containing new contents of a block.
+
+Every block belongs to a projfile, and the blocks are in order of the projfiles (set up in the conf file).
+
+What we must do is replace the existing block contents with the new contents of that tmp file, and then write everything out to a new file on disk called a rev for the particular projfile that contains that block.
+
+We already have on state all the current values of the blocks, which are spans that point into inp.
+First we want to fix inp to reflect the new reality, and then we will write out the new disk file from inp (our global input span).
+We will also fix the contents spans of all of the files starting with this one, and including all later ones.
+
+We get the span corresponding to the current block, which is also the edited block, in a local variable for convenience.
+We can do the same for the .contents of the file, getting the index from block_table.file.
+
+If the tmp file has the same length as the block, it may well be unchanged (the user opened the block and quit, or saved without changes).
+In that case we read it into cmp_compl() (without advancing cmp), and if it hashes the same as the block (block_table.hash) and the bytes are indeed equal, there is nothing to do: we unlink the tmp file and return, without moving anything or writing a rev.
+
+The contents of inp are already correct, up to the start of this block, which is what we want to replace.
+Now we get the size of the tmp file and compare it to the len of the existing block (recall that len(span) exists and is one of our most commonly used library methods).
+If it is larger, we need to move the contents after it (in inp) to the right in memory, if smaller, to the left.
+We can do this using memmove.
+
+Once we have done this, we have everything correct in inp except for the contents of the file itself, and we have a space that's sufficient for the file contents to be read into.
+We construct a span that represents this space.
+This span starts at the .buf of the original block, but has the length of the file.
+
+We have a library function, span read_file_into_span(char*,span), which takes a span and reads a file into a prefix of that span, and then returns that prefix as another span.
+We can pass our "gap" span representing the part of inp that we want to replace to this function, along with the filename.
+We can confirm that the span that is returned is in fact the identical span as the buffer we passed in, since we are expecting that the file length has not changed.
+
+As usual, if this expectation is violated we will complain and exit (using our exit_with_error(char*) convenience function).
+
+Now inp is representing the new state of the project.
+
+However, the file[i].contents for the files including and subsequent to this one may be incorrect.
+Specifically, the difference in length of this block must be added to the .end of the file contents span for this file, and to both the .buf and .end of every subsequent file.
+
+As a sanity check, after this step, we could validate that the .end of the last file (that is in inp) is equal to the .end of inp itself.
+
+A windowed file (see #windowed) isn't in inp, so for one of those we map the tmp file and hand it to window_splice instead, which writes the new file and maps that; later windowed files are not moved either.
+
+We need to update the blocks, since any blocks after and including this one may have moved, so we call reindex_file(), which finds the blocks of this file again and shifts the rest.
+
+Then we call a helper function, new_rev, which takes the filename and the file index for the projfile that was altered.
+This function is responsible for storing a new rev, cleaning up the tmp file, and any reporting to the user that we might do.
+We include a forward declaration here for new_rev.
+
+Relevant helper functions:
+void new_rev(char*,int);
+*/
+
+void new_rev(char*, int);
+void undo_begin(int file_index, span old);
+void undo_end();
+
+void handle_edited_file(char* filename) {
+    TRACE_SCOPE(handle_edited_file);
+    int file_index = block_table.file[state->current_index];
+    span original_block = state->blocks.s[state->current_index];
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        prt("Error: Failed to open edited file.\n");
+        flush();
+        exit(EXIT_FAILURE);
+    }
+    off_t new_size = lseek(fd, 0, SEEK_END);
+    ssize_t size_diff = new_size - (original_block.end - original_block.buf);
+    close(fd);
+
+    if (size_diff == 0) {
+        span unchanged = read_file_into_span(filename, cmp_compl());
+        if (hash_span(unchanged) == block_table.hash[state->current_index] && span_eq(unchanged, original_block)) {
+            unlink(filename);
+            return;
+        }
+    }
+
+    undo_begin(file_index, original_block);
+    if (state->files.a[file_index].windowed) {
+        span text = map_file(filename); // An empty block maps to nullspan(), which splices in nothing
+        window_splice(file_index, original_block, &text, 1);
+        unmap_file(text);
+        undo_end();
+        new_rev(filename, file_index);
+        return;
+    }
+
+    // Adjusting the memory in inp for new content size
+    memmove(original_block.buf + new_size, original_block.end, inp.end - original_block.end);
+    inp.end += size_diff;
+
+    // Reading the new block content into the adjusted space in inp
+    span gap = {original_block.buf, original_block.buf + new_size};
+    span result = read_file_into_span(filename, gap);
+    if (len(result) != new_size) {
+        prt("Error: Unexpected file size after reading edited content.\n");
+        flush();
+        exit(EXIT_FAILURE);
+    }
+
+    // Adjusting file contents spans for this and subsequent files (windowed files are not in inp)
+    state->files.a[file_index].contents.end += size_diff;
+    for (int i = file_index + 1; i < state->files.n; ++i) {
+        if (state->files.a[i].windowed) continue;
+        state->files.a[i].contents.buf += size_diff;
+        state->files.a[i].contents.end += size_diff;
+    }
+
+    // Sanity check
+    int last = state->files.n - 1;
+    while (last > file_index && state->files.a[last].windowed) last--;
+    if (state->files.a[last].contents.end != inp.end) {
+        prt("Error: Inconsistent state after updating file contents.\n");
+        flush();
+        exit(EXIT_FAILURE);
+    }
+
+    // Updating the blocks representation
+    reindex_file(file_index, size_diff);
+    undo_end();
+
+    // Creating a new revision and cleaning up
+    new_rev(filename, file_index);
+}
+
+void update_link(char* new_filename);
+/*
+Here we store a new revision, given a filename which contains a block that was edited and the index of the projfile that contains that block.
+The file contents have already been processed, we just get the name so that we can clean up the file when done.
+
+Our conf var revdir tells us where to put the new file that we are going to write.
+We don't assume that the conf var ends in a slash, so we test for that and handle both cases.
+
+First we construct a path starting with revdir and ending with an ISO 8601-style compact timestamp like 20240501-210759.
+We then write the contents of the projfile (which has already been updated) into this file (the "rev") using write_to_file().
+For a windowed file (see #windowed) the contents are already in a staged file, with nothing else in it, so we just rename that to the rev's path, if we can.
+
+We create a copy of this file at the path for the projfile.
+The file there which may have been edited and contain unsaved changes by some other process.
+So we have a helper function, update_projfile, which takes the projfile index, the path of the rev file, and handles all of this.
+
+Several revs can be written within the same second (e.g. two quick 'R' pastes, or scripted and benchmark runs), and write_to_file refuses to clobber, so if the timestamped path already exists we append "-1", "-2", etc. until we find a free one.
+
+Since the rev names say nothing about which projfile they belong to, we also append a line to the revlog file in revdir, giving the rev's name (relative to revdir) and the projfile path, separated by a space; this is how the diff view (#diff) finds the earlier revs of a file.
+
+Finally we unlink the filename that was passed in, since we have now fully processed it.
+The filename is now optional, since we sometimes also are processing clipboard input, so if it is NULL we skip this step.
+
+Reminder: we never write `const` in C as it only brings pain.
+*/
+
+void update_projfile(int, char*);
+
+void new_rev(char* filename, int file_index) {
+    TRACE_SCOPE(new_rev);
+    char rev_path[1024];
+    time_t now = time(NULL);
+    struct tm *tm_now = localtime(&now);
+    int need_slash = state->revdir.end[-1] != '/';
+    snprintf(rev_path, sizeof(rev_path), "%.*s%s%04d%02d%02d-%02d%02d%02d", 
+             (int)(state->revdir.end - state->revdir.buf), state->revdir.buf,
+             need_slash ? "/" : "",
+             tm_now->tm_year + 1900, tm_now->tm_mon + 1, tm_now->tm_mday,
+             tm_now->tm_hour, tm_now->tm_min, tm_now->tm_sec);
+
+    int base_len = strlen(rev_path);
+    for (int n = 1; access(rev_path, F_OK) == 0; n++) {
+        snprintf(rev_path + base_len, sizeof(rev_path) - base_len, "-%d", n);
+    }
+
+    char staged[1024];
+    if (state->files.a[file_index].windowed) window_staged_path(file_index, staged, sizeof(staged));
+    if (!state->files.a[file_index].windowed || rename(staged, rev_path)) write_to_file(state->files.a[file_index].contents, rev_path);
+
+    char log_path[1024];
+    snprintf(log_path, sizeof(log_path), "%.*s%srevlog", len(state->revdir), state->revdir.buf, need_slash ? "/" : "");
+    int log_fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (log_fd >= 0) {
+        span path = state->files.a[file_index].path;
+        dprintf(log_fd, "%s %.*s\n", rev_path + len(state->revdir) + need_slash, len(path), path.buf);
+        close(log_fd);
+    }
+
+    update_projfile(file_index, rev_path);
+
+    if (filename) {
+        unlink(filename);
+    }
+}
+
+void update_projfile(int file_index, char* rev_path) {
+    char projfile_path[1024];
+    snprintf(projfile_path, sizeof(projfile_path), "%.*s", 
+             (int)(state->files.a[file_index].path.end - state->files.a[file_index].path.buf), 
+             state->files.a[file_index].path.buf);
+
+    // Check if the projfile exists and handle accordingly
+    struct stat statbuf;
+    if (lstat(projfile_path, &statbuf) == 0) {
+        if (S_ISREG(statbuf.st_mode)) {
+            // If it's a regular file, we might want to back it up before overwriting
+            char backup_path[1024];
+            snprintf(backup_path, sizeof(backup_path), "%s.bak", projfile_path);
+            rename(projfile_path, backup_path);
+        }
+    }
+
+    // Create or overwrite the projfile with the new revision
+    link(rev_path, projfile_path);
+}
+/*
+SH_FN_START
+
+update_symlink() {
+  rm -r cmpr/cmpr.c; ln -s $(cd cmpr; find revs | sort | tail -n1; ) cmpr/cmpr.c
+}
+
+SH_FN_END
+*/
+
+/* #rewrite_current_block_with_llm
+
+Here we call a helper function with the block contents which returns the top part of the block, which is usually a comment, stripping the rest which is usually code.
+It calls another function to turn this comment part into a prompt.
+
+We then call another function which writes that span into a file and calls a user-provided command that places the contents of that file on the clipboard.
+
+If llmurl is set, we instead send the prompt to the endpoint ourselves with llm_rewrite_current_block(), which streams the reply into the block (see #llm).
+If in addition there is a visual selection of more than one block, we start a batch rewrite of the whole range with llm_batch_start() and leave visual mode; the batch runs in the background (see #llm_batch).
+
+Helper functions:
+span block_comment(int);
+span comment_to_prompt(span);
+void send_to_clipboard(span);
+*/
+
+span block_comment(int block_index);
+span comment_to_prompt(span comment);
+void send_to_clipboard(span prompt);
+void llm_rewrite_current_block(span prompt);
+void llm_batch_start(int first, int end);
+
+void rewrite_current_block_with_llm() {
+  if (state->current_index < 0 || state->current_index >= state->blocks.n) {
+    fprintf(stderr, "Invalid block index.\n");
+    return;
+  }
+
+  if (!empty(state->llmurl) && state->marked_index != -1 && state->marked_index != state->current_index) {
+    int start = state->current_index < state->marked_index ? state->current_index : state->marked_index;
+    int end = state->current_index > state->marked_index ? state->current_index + 1 : state->marked_index + 1;
+    llm_batch_start(start, end);
+    state->marked_index = -1;
+    return;
+  }
+
+  // Extract the comment part of the current block
+  span comment = block_comment(state->current_index);
+
+  if (comment.buf == NULL || len(comment) == 0) {
+    fprintf(stderr, "No comment found in the current block.\n");
+    return;
+  }
+
+  // Convert the comment to a prompt
+  span prompt = comment_to_prompt(comment);
+  if (prompt.buf == NULL || len(prompt) == 0) {
+    fprintf(stderr, "Failed to create a prompt from the comment.\n");
+    fflush(stderr);
+    exit(1);
+    return;
+  }
+
+  if (!empty(state->llmurl)) {
+    llm_rewrite_current_block(prompt);
+    return;
+  }
+
+  // Send the prompt to the clipboard
+  send_to_clipboard(prompt);
+}
+
+/*
+The comment part of a block is the span up to and including the comment part terminator, and also including any newlines and whitespace after it (see #grammar for the details, which depend on the language).
+
+For the blocks in state->blocks the answer is already in the table (block_table_fill), and block_comment(int) just reads block_table.comment_end.
+block_comment_part(span) remains for blocks that are not in state->blocks (such as those found one file at a time by run_query); it looks up the language on the projfile using file_for_block(), and calls comment_end_offset, which scans the block with the grammar for that language.
+*/
+
+int comment_end_offset(span block, int lang) {
+    grammar_scan(&grammars[lang], block, 1);
+    return block_scan.comment_end[0];
+}
+
+span block_comment(int block_index) {
+    span block = state->blocks.s[block_index];
+    return (span){block.buf, block.buf + block_table.comment_end[block_index]};
+}
+
+span block_comment_part(span block) {
+    int file_index = file_for_block(block);
+    int index = comment_end_offset(block, language_id(state->files.a[file_index].language));
+    return (span){block.buf, block.buf + index};
+}
+/*
+In comment_to_prompt, we use the cmp space to construct a prompt around the given block comment.
+
+First we should create our return span and assign .buf to the cmp.end location.
+
+Then we call prt2cmp.
+
+Next we prt the literal string "```c\n".
+Then we use wrs to write the span passed in as our argument.
+Finally we write "```\n\n" and an instruction, which is usually "Write the code. Reply only with code. Do not include comments.".
+
+Next we call prt2std to go back to the normal output mode.
+
+Then we can get the new end of cmp and make that the end of our return span so that we return everything written into the cmp space.
+*/
+
+span comment_to_prompt(span comment) {
+  // Prepare the return span to capture the start of new content in cmp
+  span return_span;
+  return_span.buf = cmp.end;
+
+  // Switch to writing in the cmp space
+  prt2cmp();
+
+  // Start writing the prompt
+  /* *** manual fixup *** */
+  if (block_table.lang[block_at(comment.buf)] == LANG_PYTHON) {
+    prt("```python\n");
+    wrs(comment);
+    prt("```\n\nWrite the code. Reply only with code. Avoid using the code_interpreter.\n");
+  } else {
+    span ext = grammars[block_table.lang[block_at(comment.buf)]].ext;
+    if (!empty(ext) && *ext.buf == '.') ext.buf++;
+    prt("```%.*s\n", len(ext), ext.buf); // Begin code block
+    wrs(comment);  // Write the comment span
+    prt("```\n\nWrite the code. Reply only with code. Do not include comments.\n"); // End code block and add instruction
+  }
+
+  // Switch back to standard output space to avoid side-effects
+  prt2std();
+
+  // Capture the end of the new content written into cmp
+  return_span.end = cmp.end;
+
+  return return_span;
+}
+/* #llm
+
+Here is a small HTTP/1.1 client for OpenAI-compatible chat completions endpoints, so that "r" can send the prompt and stream the reply straight into the block, without the clipboard and a browser in between.
+
+Configuration is llmurl and llmmodel (conf vars), and the API key, which we deliberately keep out of the conf file: it comes from the environment, CMPR_LLM_KEY or else OPENAI_API_KEY (if neither is set we send no Authorization header, which is fine for local servers).
+
+Transport:
+
+- http:// URLs we handle ourselves: getaddrinfo, a non-blocking socket and connect.
+- https:// URLs need TLS, which we don't implement; for these we run curl (-sS -N -i, so that we see the status line and headers just like on a socket) with the request body on its stdin and the headers in a private tmp file (-H @file, so the key never appears in argv).
+
+Either way a request has a write fd (the socket, or curl's stdin) and a read fd (the same socket, or curl's stdout), and everything is non-blocking, so any number of requests can be in flight while the UI keeps running; wait_for_key polls their fds (llm_pollfds) and calls llm_pump() when they're ready.
+
+Each request (llm_request) is a small state machine:
+
+- LLM_CONNECTING, until the socket is writable (then we check SO_ERROR),
+- LLM_SENDING, writing the request (for curl we then close its stdin),
+- LLM_HEADERS, collecting bytes until the blank line; we take the status code from the status line, skip any "100 Continue", and note "Transfer-Encoding: chunked" (only on our own sockets; curl has already decoded the body),
+- LLM_BODY, where the body (de-chunked if necessary, by llm_dechunk) goes to llm_body(),
+- LLM_DONE or LLM_FAILED, once the connection closes (or we see "data: [DONE]").
+
+llm_body splits the body into lines; for server-sent events each "data: {...}" line is a JSON chunk whose choices[0].delta.content we append to the request's text (llm_json_string finds a key and decodes the JSON string after it, including \u escapes, into UTF-8).
+We also keep the first LLM_RAW_MAX bytes of the raw body, so that a non-streaming reply (choices[0].message.content) or an error body can be used at the end.
+
+The request buffers are our own small growable byte buffers (llm_buf), since replies can be of any size and live across many keystrokes.
+
+The UI part, llm_rewrite_current_block, starts a request for the current block and shows a live view (the comment part, then the reply as it streams in) until it finishes, or Esc cancels it.
+On success we strip a surrounding markdown code fence, if the model added one, and commit the code with replace_block_code_part(), which writes a rev as usual (or does nothing if the code is unchanged).
+On failure the ruler shows the error (print_llm_status) until the next request.
+
+Replies are cached on disk by prompt, so asking again for the same thing is instant (see #llm_cache).
+
+bench.c has a mock server (--mock-llm PORT) that streams a canned reply in this format, for testing all of this without a real endpoint.
+*/
+
+#define LLM_RAW_MAX (1 << 16)
+#define LLM_MAX_REQUESTS 64
+
+enum { LLM_CONNECTING = 1, LLM_SENDING, LLM_HEADERS, LLM_BODY, LLM_DONE, LLM_FAILED };
+
+typedef struct { u8* buf; int n, cap; } llm_buf;
+
+typedef struct {
+    int state;
+    int rfd, wfd;
+    pid_t pid;
+    char header_file[1024];
+    llm_buf req;
+    int sent;
+    llm_buf in;
+    int http_status;
+    int chunked;
+    long long chunk_left;
+    int streamed, complete;
+    long long content_length, body_n; // content_length is -1 without a Content-Length header
+    llm_buf line;
+    llm_buf raw;
+    llm_buf text;
+    int block;
+    u64 block_hash;
+    u64 cache_key;
+    int cached;
+    char error[256];
+    long long started;
+} llm_request;
+
+llm_request* llm_reqs[LLM_MAX_REQUESTS];
+int llm_nreqs;
+char llm_last_error[256];
+
+void llm_buf_add(llm_buf* b, span data) {
+    if (b->n + len(data) > b->cap) {
+        b->cap = (b->n + len(data)) * 2 + 256;
+        b->buf = realloc(b->buf, b->cap);
+        if (!b->buf) exit_with_error("Failed to allocate LLM buffer");
+    }
+    memcpy(b->buf + b->n, data.buf, len(data));
+    b->n += len(data);
+}
+
+void llm_buf_drop(llm_buf* b, int n) {
+    memmove(b->buf, b->buf + n, b->n - n);
+    b->n -= n;
+}
+
+span llm_buf_span(llm_buf* b) {
+    return (span){b->buf, b->buf + b->n};
+}
+
+void llm_fail(llm_request* r, char* message) {
+    if (r->state == LLM_DONE || r->state == LLM_FAILED) return;
+    r->state = LLM_FAILED;
+    snprintf(r->error, sizeof(r->error), "%s", message);
+}
+
+/*
+llm_json_string looks for "key" in the JSON text and decodes the string value after it into out, returning 1, or returns 0 if the key isn't there or its value isn't a string (e.g. null).
+This is not a JSON parser, but the replies we read are small, machine-generated objects in which the key we want appears once per chunk.
+*/
+
+void llm_utf8(llm_buf* out, unsigned cp) {
+    u8 b[4];
+    int n;
+    if (cp < 0x80) b[0] = cp, n = 1;
+    else if (cp < 0x800) b[0] = 0xC0 | cp >> 6, b[1] = 0x80 | (cp & 0x3F), n = 2;
+    else if (cp < 0x10000) b[0] = 0xE0 | cp >> 12, b[1] = 0x80 | (cp >> 6 & 0x3F), b[2] = 0x80 | (cp & 0x3F), n = 3;
+    else b[0] = 0xF0 | cp >> 18, b[1] = 0x80 | (cp >> 12 & 0x3F), b[2] = 0x80 | (cp >> 6 & 0x3F), b[3] = 0x80 | (cp & 0x3F), n = 4;
+    llm_buf_add(out, (span){b, b + n});
+}
+
+unsigned llm_hex4(u8* p) {
+    unsigned v = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = p[i];
+        v = v * 16 + (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10) & 15);
+    }
+    return v;
+}
+
+int llm_json_string(span json, char* key, llm_buf* out) {
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    span found = spanspan(json, S(quoted));
+    if (empty(found)) return 0;
+    u8* p = found.end;
+    while (p < json.end && (isspace(*p) || *p == ':')) p++;
+    if (p >= json.end || *p != '"') return 0;
+    p++;
+    while (p < json.end && *p != '"') {
+        if (*p != '\\' || p + 1 >= json.end) {
+            u8* q = p;
+            while (q < json.end && *q != '"' && *q != '\\') q++;
+            llm_buf_add(out, (span){p, q});
+            p = q;
+            continue;
+        }
+        u8 c = p[1];
+        p += 2;
+        if (c == 'n') llm_buf_add(out, S("\n"));
+        else if (c == 't') llm_buf_add(out, S("\t"));
+        else if (c == 'r') llm_buf_add(out, S("\r"));
+        else if (c == 'b') llm_buf_add(out, S("\b"));
+        else if (c == 'f') llm_buf_add(out, S("\f"));
+        else if (c == 'u' && json.end - p >= 4) {
+            unsigned cp = llm_hex4(p);
+            p += 4;
+            if (cp >= 0xD800 && cp < 0xDC00 && json.end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                unsigned lo = llm_hex4(p + 2);
+                if (lo >= 0xDC00 && lo < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    p += 6;
+                }
+            }
+            llm_utf8(out, cp);
+        } else llm_buf_add(out, (span){&c, &c + 1});
+    }
+    return 1;
+}
+
+void wrs_json(span text) {
+    for (u8* p = text.buf; p < text.end; p++) {
+        if (*p == '"' || *p == '\\') prt("\\%c", *p);
+        else if (*p == '\n') prt("\\n");
+        else if (*p == '\t') prt("\\t");
+        else if (*p == '\r') prt("\\r");
+        else if (*p < 0x20) prt("\\u%04x", *p);
+        else w_char(*p);
+    }
+}
+
+/*
+llm_body gets the (de-chunked) body as it arrives and handles it line by line, as described above.
+*/
+
+void llm_line(llm_request* r, span line) {
+    if (!empty(line) && line.end[-1] == '\r') line.end--;
+    if (!consume_prefix(&line, S("data:"))) return;
+    r->streamed = 1;
+    while (!empty(line) && *line.buf == ' ') line.buf++;
+    if (span_eq(line, S("[DONE]"))) {
+        r->complete = 1;
+        r->state = LLM_DONE;
+        return;
+    }
+    span delta = spanspan(line, S("\"delta\""));
+    if (!empty(delta)) llm_json_string((span){delta.buf, line.end}, "content", &r->text);
+}
+
+void llm_body(llm_request* r, span data) {
+    r->body_n += len(data);
+    if (r->raw.n < LLM_RAW_MAX) {
+        int room = LLM_RAW_MAX - r->raw.n;
+        llm_buf_add(&r->raw, first_n(data, len(data) < room ? len(data) : room));
+    }
+    while (!empty(data) && r->state == LLM_BODY) {
+        int nl = find_char(data, '\n');
+        if (nl < 0) {
+            llm_buf_add(&r->line, data);
+            return;
+        }
+        llm_buf_add(&r->line, first_n(data, nl));
+        data.buf += nl + 1;
+        llm_line(r, llm_buf_span(&r->line));
+        r->line.n = 0;
+    }
+}
+
+/*
+llm_dechunk handles Transfer-Encoding: chunked on the bytes collected in r->in.
+chunk_left is the number of data bytes left in the current chunk, 0 when we expect a chunk size line next, or -1 when we expect the CRLF that ends a chunk's data.
+A zero-size chunk ends the body.
+*/
+
+void llm_dechunk(llm_request* r) {
+    while (r->in.n > 0 && r->state == LLM_BODY) {
+        if (r->chunk_left > 0) {
+            int n = r->in.n < r->chunk_left ? r->in.n : (int)r->chunk_left;
+            llm_body(r, (span){r->in.buf, r->in.buf + n});
+            llm_buf_drop(&r->in, n);
+            r->chunk_left -= n;
+            if (r->chunk_left == 0) r->chunk_left = -1;
+        } else {
+            span avail = llm_buf_span(&r->in);
+            int nl = find_char(avail, '\n');
+            if (nl < 0) return;
+            if (r->chunk_left == -1) {
+                r->chunk_left = 0;
+            } else {
+                r->chunk_left = strtoll((char*)avail.buf, NULL, 16);
+                if (r->chunk_left == 0) {
+                    r->complete = 1;
+                    r->state = LLM_DONE;
+                }
+            }
+            llm_buf_drop(&r->in, nl + 1);
+        }
+    }
+}
+
+/*
+llm_headers is called when r->in may contain the complete headers.
+*/
+
+void llm_headers(llm_request* r) {
+    span avail = llm_buf_span(&r->in);
+    span end = spanspan(avail, S("\r\n\r\n"));
+    int skip = 4;
+    if (empty(end)) {
+        end = spanspan(avail, S("\n\n"));
+        skip = 2;
+    }
+    if (empty(end)) return;
+
+    span headers = {avail.buf, end.buf};
+    span status_line = next_line(&headers);
+    int sp = find_char(status_line, ' ');
+    r->http_status = sp < 0 ? 0 : atoi((char*)status_line.buf + sp + 1);
+    while (!empty(headers)) {
+        span h = next_line(&headers);
+        if (!empty(h) && h.end[-1] == '\r') h.end--;
+        int colon = find_char(h, ':');
+        if (colon < 0) continue;
+        char name[32];
+        s(name, sizeof(name), first_n(h, colon));
+        if (strcasecmp(name, "transfer-encoding") == 0 && contains((span){h.buf + colon + 1, h.end}, S("chunked"))) {
+            r->chunked = r->pid == 0;
+        }
+        if (strcasecmp(name, "content-length") == 0) r->content_length = strtoll((char*)h.buf + colon + 1, NULL, 10);
+    }
+    llm_buf_drop(&r->in, end.buf - avail.buf + skip);
+    if (r->http_status >= 100 && r->http_status < 200) return;
+    r->state = LLM_BODY;
+}
+
+/*
+llm_finish is called when the read side reaches EOF (or we saw [DONE]), and decides between LLM_DONE and LLM_FAILED.
+A streamed reply (one with "data:" lines) is only complete once we have seen [DONE], and a chunked body once we have seen its zero-size chunk (complete); if the connection closes before that the reply was cut off, so it fails ("stream ended early") rather than putting half the code into the block.
+A plain body with a Content-Length is complete when we have all of it (and fails if we don't); one with neither is only delimited by the connection closing, so we can't tell.
+Only a reply we know to be complete goes into the cache (#llm_cache), since a cut-off one there would come back instantly for every later "r" on the same comment.
+*/
+
+void llm_cache_put(u64 key, span text);
+
+void llm_finish(llm_request* r) {
+    if (r->line.n) {
+        llm_line(r, llm_buf_span(&r->line));
+        r->line.n = 0;
+    }
+    if (r->http_status != 200) {
+        char message[200];
+        span body = llm_buf_span(r->http_status ? &r->raw : &r->in); // without a status line, in has whatever we got (e.g. curl's error)
+        if (r->http_status) snprintf(message, sizeof(message), "HTTP %d: %.*s", r->http_status, len(body) < 120 ? len(body) : 120, body.buf);
+        else snprintf(message, sizeof(message), "no response%s%.*s", empty(body) ? "" : ": ", len(body) < 120 ? len(body) : 120, body.buf);
+        for (char* c = message; *c; c++) if (*c == '\n' || *c == '\r') *c = ' ';
+        r->state = LLM_BODY;
+        llm_fail(r, message);
+        return;
+    }
+    if ((r->streamed || r->chunked) && !r->complete) {
+        r->state = LLM_BODY;
+        llm_fail(r, "stream ended early");
+        return;
+    }
+    if (r->content_length >= 0 && r->body_n < r->content_length) {
+        r->state = LLM_BODY;
+        llm_fail(r, "reply ended early");
+        return;
+    }
+    if (r->content_length >= 0 && !r->streamed && !r->chunked) r->complete = 1;
+    if (!r->text.n) llm_json_string(llm_buf_span(&r->raw), "content", &r->text);
+    r->state = LLM_DONE;
+    if (r->text.n && r->complete) llm_cache_put(r->cache_key, llm_buf_span(&r->text));
+}
+
+void llm_close(llm_request* r) {
+    if (r->wfd >= 0 && r->wfd != r->rfd) close(r->wfd);
+    if (r->rfd >= 0) close(r->rfd);
+    r->rfd = r->wfd = -1;
+    if (r->pid > 0) {
+        kill(r->pid, SIGTERM);
+        waitpid(r->pid, NULL, 0);
+        r->pid = 0;
+    }
+    if (r->header_file[0]) {
+        unlink(r->header_file);
+        r->header_file[0] = 0;
+    }
+}
+
+/* #llm_cache
+
+Replies are cached on disk, in a "cache" directory next to the conf file (so normally .cmpr/cache), so that "r" on a comment we have already sent, unchanged or changed back to an earlier wording, doesn't go to the backend again.
+
+The key (llm_cache_key) is the hash of llmurl, llmmodel and the exact prompt from comment_to_prompt, since a different backend or model gives a different answer.
+Each reply (the text as it came back, before llm_code strips the fence) is stored in its own file, named by the key in hex.
+
+The index, the file "index" in the same directory, is a header (LLM_CACHE_MAGIC, which includes a version number) followed by fixed-size llm_cache_entry records {key, last use, size}, so loading it is a single read and no parsing.
+We load it into llm_cache the first time we need it, and write it back whole (to a tmp file, then rename) whenever it changes; at 24 bytes per entry this is cheap.
+
+The total size of the stored replies is bounded by LLM_CACHE_BYTES.
+When a new reply takes us over, we evict the least recently used entries (lowest "used", a counter we bump on every store and every hit) and delete their files.
+
+An index that is missing or has the wrong magic or size just means an empty cache, and an entry whose file has gone missing is dropped when we notice.
+None of this is fatal: if the cache can't be read or written we go to the backend as if it weren't there.
+*/
+
+#define LLM_CACHE_BYTES (32 << 20)
+#define LLM_CACHE_MAGIC 0x3165686361636c6cULL // "llcache1", little-endian
+
+typedef struct {
+    u64 key;
+    u64 used;
+    u64 bytes;
+} llm_cache_entry;
+
+struct {
+    int loaded;
+    llm_cache_entry* a;
+    int n, cap;
+    u64 total;
+    u64 clock;
+} llm_cache;
+
+void llm_cache_path(char* buf, int size, char* name) {
+    span conf = state->config_file_path;
+    int slash = len(conf) - 1;
+    while (slash >= 0 && conf.buf[slash] != '/') slash--;
+    if (slash < 0) snprintf(buf, size, "cache/%s", name);
+    else snprintf(buf, size, "%.*s/cache/%s", slash, conf.buf, name);
+}
+
+void llm_cache_entry_path(char* buf, int size, u64 key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", key);
+    llm_cache_path(buf, size, name);
+}
+
+u64 llm_cache_key(span prompt) {
+    hasher h;
+    hash_init(&h);
+    hash_update(&h, state->llmurl);
+    hash_update(&h, S("\n"));
+    hash_update(&h, state->llmmodel);
+    hash_update(&h, S("\n"));
+    hash_update(&h, prompt);
+    return hash_final(&h);
+}
+
+void llm_cache_load() {
+    if (llm_cache.loaded) return;
+    llm_cache.loaded = 1;
+    char path[2048];
+    llm_cache_path(path, sizeof(path), "index");
+    span index = map_file(path);
+    u64 magic = 0;
+    if (len(index) >= 8) memcpy(&magic, index.buf, 8);
+    if (magic != LLM_CACHE_MAGIC || (len(index) - 8) % sizeof(llm_cache_entry)) {
+        unmap_file(index);
+        return;
+    }
+    int n = (len(index) - 8) / sizeof(llm_cache_entry);
+    llm_cache.a = malloc((n ? n : 1) * sizeof(llm_cache_entry));
+    if (!llm_cache.a) exit_with_error("Failed to allocate LLM cache index");
+    memcpy(llm_cache.a, index.buf + 8, n * sizeof(llm_cache_entry));
+    llm_cache.n = llm_cache.cap = n;
+    for (int i = 0; i < n; i++) {
+        llm_cache.total += llm_cache.a[i].bytes;
+        if (llm_cache.a[i].used > llm_cache.clock) llm_cache.clock = llm_cache.a[i].used;
+    }
+    unmap_file(index);
+}
+
+void llm_cache_save() {
+    char path[2048], tmp[2100];
+    llm_cache_path(path, sizeof(path), "index");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    u64 magic = LLM_CACHE_MAGIC;
+    ssize_t size = llm_cache.n * sizeof(llm_cache_entry);
+    int ok = write(fd, &magic, 8) == 8 && write(fd, llm_cache.a, size) == size;
+    close(fd);
+    if (ok) rename(tmp, path);
+    else unlink(tmp);
+}
+
+void llm_cache_drop(int i) {
+    char path[2048];
+    llm_cache_entry_path(path, sizeof(path), llm_cache.a[i].key);
+    unlink(path);
+    llm_cache.total -= llm_cache.a[i].bytes;
+    llm_cache.a[i] = llm_cache.a[--llm_cache.n];
+}
+
+int llm_cache_get(u64 key, llm_buf* text) {
+    llm_cache_load();
+    for (int i = 0; i < llm_cache.n; i++) {
+        if (llm_cache.a[i].key != key) continue;
+        char path[2048];
+        llm_cache_entry_path(path, sizeof(path), key);
+        span data = map_file(path);
+        if (len(data) != llm_cache.a[i].bytes) {
+            unmap_file(data);
+            llm_cache_drop(i);
+            llm_cache_save();
+            return 0;
+        }
+        llm_buf_add(text, data);
+        unmap_file(data);
+        llm_cache.a[i].used = ++llm_cache.clock;
+        llm_cache_save();
+        return 1;
+    }
+    return 0;
+}
+
+void llm_cache_put(u64 key, span text) {
+    llm_cache_load();
+    if (len(text) > LLM_CACHE_BYTES) return;
+    char path[2048], tmp[2100];
+    llm_cache_path(path, sizeof(path), "");
+    mkdir(path, 0755);
+    llm_cache_entry_path(path, sizeof(path), key);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    int ok = write(fd, text.buf, len(text)) == len(text);
+    close(fd);
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return;
+    }
+
+    for (int i = 0; i < llm_cache.n; i++) {
+        if (llm_cache.a[i].key == key) {
+            llm_cache.total -= llm_cache.a[i].bytes; // file already replaced
+            llm_cache.a[i] = llm_cache.a[--llm_cache.n];
+            break;
+        }
+    }
+    if (llm_cache.n == llm_cache.cap) {
+        llm_cache.cap = llm_cache.cap ? llm_cache.cap * 2 : 64;
+        llm_cache.a = realloc(llm_cache.a, llm_cache.cap * sizeof(llm_cache_entry));
+        if (!llm_cache.a) exit_with_error("Failed to allocate LLM cache index");
+    }
+    llm_cache.a[llm_cache.n++] = (llm_cache_entry){key, ++llm_cache.clock, len(text)};
+    llm_cache.total += len(text);
+
+    while (llm_cache.total > LLM_CACHE_BYTES) {
+        int oldest = 0;
+        for (int i = 1; i < llm_cache.n; i++) {
+            if (llm_cache.a[i].used < llm_cache.a[oldest].used) oldest = i;
+        }
+        llm_cache_drop(oldest);
+    }
+    llm_cache_save();
+}
+
+/*
+llm_start makes a new request for the given prompt, to be applied to block block_index, and adds it to llm_reqs.
+It returns NULL (and sets llm_last_error) if the request couldn't even be started, e.g. a bad URL or too many requests in flight.
+
+If the reply is in the cache (see #llm_cache) we don't start anything: the request is born LLM_DONE, with the cached text and r->cached set, and callers treat it like any other finished request.
+*/
+
+char* llm_key() {
+    char* key = getenv("CMPR_LLM_KEY");
+    if (!key || !*key) key = getenv("OPENAI_API_KEY");
+    return key && *key ? key : NULL;
+}
+
+llm_request* llm_new(int block_index) {
+    llm_request* r = calloc(1, sizeof(llm_request));
+    if (!r) exit_with_error("Failed to allocate LLM request");
+    r->rfd = r->wfd = -1;
+    r->content_length = -1;
+    r->block = block_index;
+    r->block_hash = block_table.hash[block_index];
+    r->started = now_ns();
+    return r;
+}
+
+llm_request* llm_start(span prompt, int block_index) {
+    if (llm_nreqs >= LLM_MAX_REQUESTS) {
+        snprintf(llm_last_error, sizeof(llm_last_error), "too many requests in flight");
+        return NULL;
+    }
+    u64 cache_key = llm_cache_key(prompt);
+    llm_buf cached = {0};
+    if (llm_cache_get(cache_key, &cached)) {
+        llm_request* r = llm_new(block_index);
+        r->cache_key = cache_key;
+        r->cached = 1;
+        r->text = cached;
+        r->state = LLM_DONE;
+        llm_reqs[llm_nreqs++] = r;
+        llm_last_error[0] = 0;
+        return r;
+    }
+    span url = state->llmurl;
+    int https = starts_with(url, S("https://"));
+    span rest = url;
+    if (!consume_prefix(&rest, S("http://")) && !consume_prefix(&rest, S("https://"))) {
+        snprintf(llm_last_error, sizeof(llm_last_error), "llmurl must start with http:// or https://");
+        return NULL;
+    }
+    int slash = find_char(rest, '/');
+    span hostport = slash < 0 ? rest : first_n(rest, slash);
+    span path = slash < 0 ? S("/") : (span){rest.buf + slash, rest.end};
+    int colon = find_char(hostport, ':');
+    char host[256], port[16];
+    s(host, sizeof(host), colon < 0 ? hostport : first_n(hostport, colon));
+    if (colon < 0) snprintf(port, sizeof(port), "%s", https ? "443" : "80");
+    else s(port, sizeof(port), (span){hostport.buf + colon + 1, hostport.end});
+
+    llm_request* r = llm_new(block_index);
+    r->cache_key = cache_key;
+    signal(SIGPIPE, SIG_IGN); // a server or curl going away should fail the request, not kill us
+    char* key = llm_key();
+
+    // the body goes first in cmp, so that we know its length for the headers
+    u8* mark = cmp.end;
+    prt2cmp();
+    prt("{\"model\": \"");
+    wrs_json(state->llmmodel);
+    prt("\", \"stream\": true, \"messages\": [{\"role\": \"user\", \"content\": \"");
+    wrs_json(prompt);
+    prt("\"}]}");
+    span body = {mark, out.end}; // while in prt2cmp, out is the cmp space
+    span headers = {out.end, out.end};
+    if (https) {
+        prt("Content-Type: application/json\nAccept: text/event-stream\n");
+        if (key) prt("Authorization: Bearer %s\n", key);
+    } else {
+        prt("POST %.*s HTTP/1.1\r\nHost: %.*s\r\nContent-Type: application/json\r\nAccept: text/event-stream\r\n", len(path), path.buf, len(hostport), hostport.buf);
+        if (key) prt("Authorization: Bearer %s\r\n", key);
+        prt("Content-Length: %d\r\nConnection: close\r\n\r\n", len(body));
+    }
+    headers.end = out.end;
+    prt2std();
+
+    if (https) {
+        llm_buf_add(&r->req, body);
+        snprintf(r->header_file, sizeof(r->header_file), "%.*s/llm-headers-%d-%p", len(state->tmpdir), state->tmpdir.buf, (int)getpid(), (void*)r);
+        int hfd = open(r->header_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (hfd < 0 || write(hfd, headers.buf, len(headers)) != len(headers)) {
+            if (hfd >= 0) close(hfd);
+            cmp.end = mark;
+            snprintf(llm_last_error, sizeof(llm_last_error), "can't write %.200s", r->header_file);
+            free(r->req.buf);
+            free(r);
+            return NULL;
+        }
+        close(hfd);
+        cmp.end = mark;
+
+        char curl_url[2048], header_arg[1100];
+        s(curl_url, sizeof(curl_url), url);
+        snprintf(header_arg, sizeof(header_arg), "@%s", r->header_file);
+        int in[2], out[2];
+        if (pipe(in) == -1 || pipe(out) == -1) exit_with_error("Failed to create pipe for LLM request");
+        pid_t pid = fork();
+        if (pid == -1) exit_with_error("fork failed");
+        if (pid == 0) {
+            dup2(in[0], STDIN_FILENO);
+            dup2(out[1], STDOUT_FILENO);
+            dup2(out[1], STDERR_FILENO);
+            close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+            execlp("curl", "curl", "-sS", "-N", "-i", "--connect-timeout", "10", "-X", "POST", "-H", header_arg, "--data-binary", "@-", curl_url, (char*)NULL);
+            perror("curl");
+            _exit(127);
+        }
+        close(in[0]);
+        close(out[1]);
+        r->pid = pid;
+        r->wfd = in[1];
+        r->rfd = out[0];
+        fcntl(r->wfd, F_SETFL, fcntl(r->wfd, F_GETFL) | O_NONBLOCK);
+        fcntl(r->rfd, F_SETFL, fcntl(r->rfd, F_GETFL) | O_NONBLOCK);
+        fcntl(r->wfd, F_SETFD, FD_CLOEXEC);
+        fcntl(r->rfd, F_SETFD, FD_CLOEXEC);
+        r->state = LLM_SENDING;
+    } else {
+        llm_buf_add(&r->req, headers);
+        llm_buf_add(&r->req, body);
+        cmp.end = mark;
+
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *ai;
+        int err = getaddrinfo(host, port, &hints, &ai);
+        if (err) {
+            snprintf(llm_last_error, sizeof(llm_last_error), "%.100s: %s", host, gai_strerror(err));
+            free(r->req.buf);
+            free(r);
+            return NULL;
+        }
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0 || (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+            snprintf(llm_last_error, sizeof(llm_last_error), "connect to %.100s:%s: %s", host, port, strerror(errno));
+            if (fd >= 0) close(fd);
+            freeaddrinfo(ai);
+            free(r->req.buf);
+            free(r);
+            return NULL;
+        }
+        freeaddrinfo(ai);
+        r->rfd = r->wfd = fd;
+        r->state = LLM_CONNECTING;
+    }
+
+    llm_reqs[llm_nreqs++] = r;
+    llm_last_error[0] = 0;
+    return r;
+}
+
+/*
+llm_pollfds fills in pollfds for the requests in flight, starting at fds, and returns how many it used; llm_pump then advances every request as far as it can without blocking, and returns 1 if anything happened that is worth a redraw.
+Finished requests stay in llm_reqs until llm_reap() removes them (the caller has to look at the result first).
+*/
+
+int llm_active() {
+    for (int i = 0; i < llm_nreqs; i++) {
+        if (llm_reqs[i]->state != LLM_DONE && llm_reqs[i]->state != LLM_FAILED) return 1;
+    }
+    return 0;
+}
+
+int llm_pollfds(struct pollfd* fds) {
+    int n = 0;
+    for (int i = 0; i < llm_nreqs; i++) {
+        llm_request* r = llm_reqs[i];
+        if (r->state == LLM_CONNECTING || r->state == LLM_SENDING) fds[n++] = (struct pollfd){.fd = r->wfd, .events = POLLOUT};
+        else if (r->state == LLM_HEADERS || r->state == LLM_BODY) fds[n++] = (struct pollfd){.fd = r->rfd, .events = POLLIN};
+    }
+    return n;
+}
+
+int llm_pump_one(llm_request* r) {
+    int before = r->state, before_text = r->text.n;
+
+    if (r->state == LLM_CONNECTING) {
+        struct pollfd p = {.fd = r->wfd, .events = POLLOUT};
+        if (poll(&p, 1, 0) <= 0) return 0;
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(r->wfd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err) {
+            char message[200];
+            snprintf(message, sizeof(message), "connect: %s", strerror(err));
+            llm_fail(r, message);
+        } else {
+            r->state = LLM_SENDING;
+        }
+    }
+
+    while (r->state == LLM_SENDING) {
+        ssize_t n = write(r->wfd, r->req.buf + r->sent, r->req.n - r->sent);
+        if (n < 0) {
+            if (errno != EAGAIN) llm_fail(r, "write failed");
+            break;
+        }
+        r->sent += n;
+        if (r->sent == r->req.n) {
+            if (r->wfd != r->rfd) {
+                close(r->wfd);
+                r->wfd = -1;
+            }
+            r->state = LLM_HEADERS;
+        }
+    }
+
+    while (r->state == LLM_HEADERS || r->state == LLM_BODY) {
+        u8 buf[65536];
+        ssize_t n = read(r->rfd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno != EAGAIN) llm_fail(r, "read failed");
+            break;
+        }
+        if (n == 0) {
+            llm_finish(r);
+            break;
+        }
+        if (r->state == LLM_HEADERS || r->chunked) {
+            llm_buf_add(&r->in, (span){buf, buf + n});
+        } else {
+            llm_body(r, (span){buf, buf + n});
+        }
+        if (r->state == LLM_HEADERS) {
+            llm_headers(r);
+            if (r->state == LLM_BODY && !r->chunked && r->in.n) {
+                llm_body(r, llm_buf_span(&r->in));
+                r->in.n = 0;
+            }
+        }
+        if (r->state == LLM_BODY && r->chunked) llm_dechunk(r);
+        if (r->state == LLM_DONE) llm_finish(r);
+    }
+
+    if (r->state == LLM_DONE || r->state == LLM_FAILED) llm_close(r);
+    return r->state != before || r->text.n != before_text;
+}
 
-To print a config var, we print the name, a colon and single space, and then the value itself followed by newline.
-(We currently assume that none of our conf vars contain newlines (a safe assumption, as if they did we'd also have no way to read them in).)
-Our X macro handles the "normal" config fields, but then we call another function, save_conf_files, that handles the file and language lines that are special.
-*/
+int llm_pump() {
+    int changed = 0;
+    for (int i = 0; i < llm_nreqs; i++) changed |= llm_pump_one(llm_reqs[i]);
+    return changed;
+}
 
-void save_conf() {
-    span original_cmp_end = {cmp.end, cmp.end};
-    prt2cmp();
+void llm_free(llm_request* r) {
+    llm_close(r);
+    free(r->req.buf);
+    free(r->in.buf);
+    free(r->line.buf);
+    free(r->raw.buf);
+    free(r->text.buf);
+    free(r);
+}
 
-    #define X(name) prt(#name ": %.*s\n", len(state->name), state->name.buf);
-    CONFIG_FIELDS
-    #undef X
+void llm_forget(llm_request* r) {
+    for (int i = 0; i < llm_nreqs; i++) {
+        if (llm_reqs[i] == r) {
+            llm_reqs[i] = llm_reqs[--llm_nreqs];
+            break;
+        }
+    }
+}
 
-    save_conf_files();
-    prt2std();
-    original_cmp_end.end = cmp.end;
+void llm_reap(llm_request* r) {
+    llm_forget(r);
+    if (r->state == LLM_FAILED) snprintf(llm_last_error, sizeof(llm_last_error), "%s", r->error);
+    llm_free(r);
+}
 
-    write_to_file_span(original_cmp_end, state->config_file_path, 1);
-    cmp.end = original_cmp_end.buf;
+/*
+llm_code returns the code in a finished reply: the text, minus a surrounding markdown code fence (a first line starting with three backticks, and the last such line) if there is one, and with a final newline.
+The result is in cmp_compl() (cmp is not advanced), which is where replace_code_clipboard also puts the code it passes to replace_block_code_part; as with read_file_into_span, a reply that doesn't fit there (with the newline we may add) is an error, and we exit.
+*/
+
+span llm_code(llm_request* r) {
+    span text = llm_buf_span(&r->text);
+    if (starts_with(text, S("```"))) {
+        next_line(&text);
+        u8* p = text.end;
+        while (p > text.buf) {
+            u8* line = p;
+            while (line > text.buf && line[-1] != '\n') line--;
+            if (starts_with((span){line, text.end}, S("```"))) {
+                text.end = line;
+                break;
+            }
+            p = line - 1;
+        }
+    }
+    if (len(text) + 1 > len(cmp_compl())) exit_with_error("LLM reply does not fit into the cmp space");
+    span code = {cmp.end, cmp.end + len(text)};
+    memcpy(code.buf, text.buf, len(text));
+    if (!empty(code) && code.end[-1] != '\n') *code.end++ = '\n';
+    return code;
 }
-/* #add_projfile(span)
 
-Here we add a file to the projfiles and ensure that the file exists on disk.
-This is a helper function for check_conf_vars.
+/*
+In llm_rewrite_current_block we start the request and show the live view.
 
-We add the file to the projfiles, but do not set a language on it (since that will be handled next by that function.)
+Each frame shows the comment part of the block, a separator line with the model and the number of bytes so far, and as much of the end of the reply as fits on the screen.
+wait_for_key returns -1 whenever a request made progress, so we just redraw; Esc (or q) cancels.
 
-If it is not creatable, writable by the user, etc, we will report the error, wait for a keystroke, and then return 0, otherwise we return 1.
+If the block was changed while we waited (its hash no longer matches) we don't apply the reply; otherwise we commit it with replace_block_code_part.
+A reply from the cache is already done, so there is no live view, and the ruler says where it came from.
 */
 
-int add_projfile(span file_path_span) {
-    char file_path[2048] = {0};
-    s(file_path, 2048, file_path_span);
+void replace_block_code_part(span new_code);
 
-    FILE *file = fopen(file_path, "a+");
-    if (file == NULL) {
-        prt("Error: Cannot create or write to file %s.\nPress any key to continue...\n", file_path);
+void llm_rewrite_current_block(span prompt) {
+    llm_request* r = llm_start(prompt, state->current_index);
+    cmp.end = prompt.buf;
+    if (!r) return;
+
+    while (r->state != LLM_DONE && r->state != LLM_FAILED) {
+        get_screen_dimensions();
+        clear_display();
+        span comment = block_comment(r->block);
+        int rows = state->terminal_rows - 2;
+        int comment_rows = rows / 3;
+        print_physical_lines(comment, comment_rows);
+        prt("--- %.*s: %d bytes ---\n", len(state->llmmodel), state->llmmodel.buf, r->text.n);
+        int remaining = rows - comment_rows - 1;
+        span text = llm_buf_span(&r->text);
+        u8* start = text.end;
+        for (int lines = 0; start > text.buf && lines < remaining; lines++) {
+            start--;
+            while (start > text.buf && start[-1] != '\n') start--;
+        }
+        print_physical_lines((span){start, text.end}, remaining);
+        prt("\nStreaming from %.*s, Esc to cancel", len(state->llmurl), state->llmurl.buf);
         flush();
-        getch();
-        return 0;
+
+        int c = wait_for_key();
+        if (c == 27 || c == 'q') {
+            llm_fail(r, "cancelled");
+            break;
+        }
     }
-    fclose(file);
 
-    projfile new_file = {.path = file_path_span, .language = nullspan(), .contents = nullspan()};
-    projfiles_push(&state->files, new_file);
-    return 1;
+    int cached = r->cached;
+    if (r->state == LLM_DONE && r->block == state->current_index && r->block_hash == block_table.hash[r->block]) {
+        replace_block_code_part(llm_code(r));
+    } else if (r->state == LLM_DONE) {
+        llm_fail(r, "block changed while waiting, reply not applied");
+    }
+    llm_reap(r);
+    if (cached && !llm_last_error[0]) snprintf(llm_last_error, sizeof(llm_last_error), "reply from cache");
 }
+
 /*
-In check_conf_vars() we test the state for all essential configuration variables and if any is missing we prompt the user to set that.
+print_llm_status, at the end of the ruler, shows the progress of a batch rewrite if there is one (print_llm_batch_status, see #llm_batch), otherwise requests in flight, and otherwise the error from the last request that failed, if any.
+*/
 
-The essential configuration variables, along with the reason why each is required, are:
+int print_llm_batch_status();
 
-revdir: We save a revision every time you edit a block, this is where they will be stored (.cmpr/revs is a good choice).
-tmpdir: Location for temporary files for editing a block in the editor, a good choice is .cmpr/tmp.
+void print_llm_status() {
+    if (print_llm_batch_status()) return;
+    int active = 0, bytes = 0;
+    for (int i = 0; i < llm_nreqs; i++) {
+        if (llm_reqs[i]->state == LLM_DONE || llm_reqs[i]->state == LLM_FAILED) continue;
+        active++;
+        bytes += llm_reqs[i]->text.n;
+    }
+    if (active) prt(", LLM: %d running (%d bytes)", active, bytes);
+    else if (llm_last_error[0]) prt(", LLM: %s", llm_last_error);
+}
+/* #llm_batch
 
-TODO: probably all the above "config-related metadata" should be in one place in a table for all the conf vars; we'll do that later.
-For now, a local macro cleans up this code quite a bit.
+A batch rewrite is "r" on a visual selection (with llmurl set): every block in the range gets its own request, built just like the single one (block_comment, comment_to_prompt), and the replies are spliced in as they come back.
 
-For each missing variable in the order given, we print the string after the colon above as a prompt to the user (and include the configuration parameter name).
+There is one batch at a time, in the global llm_batch, which holds for the i'th block of the range (i from 0 to n-1):
 
-We then call read_line to get the new value from the user.
-For the buffer space to use we will first call cmp_compl() to get the complement of cmp space as a span.
-After read_line returns we will always set cmp.end to point to the end of the RETURNED span; this makes sure nothing else uses that space later.
-NOTE: THIS MEANS THE VALUE THAT IS ****RETURNED**** BY THE READ_LINE FUNCTION.
+- hash[i], the block's hash when the batch started, which is how we find it again later (see below)
+- reqs[i], its request, once started; NULL before that and after it has been dealt with
 
-Additional to the "normal" conf vars, we also have the files, and the language setting for each file.
+and in addition:
 
-First, it's a requirement that there be at least one file, even if it is empty, otherwise we have nowhere to put any blocks and no way to get things off the ground.
-Therefore if there are no files on the state, we will prompt the user to name one file that can be added to the project.
-We explain that at least one file is required otherwise there is nowhere to create any blocks and no way to proceed.
-We then create this as an empty file if it does not already exist by calling add_projfile() with the path.
-Note that this function may fail, in which case it will return 0.
-If it fails, we just loop until it succeeds as there's no going forward without it.
+- started, how many blocks we have sent (or skipped), always a prefix of the range
+- applied, how many blocks we have dealt with, also a prefix: we apply the replies in block order, so a fast reply for a later block waits until everything before it is in
+- shift, how many blocks our own splices have added before the next one (a reply can contain a new block comment, and then there is one more block)
+- touched, a flag per projfile, so that at the end we write a single rev for each file we changed, rather than one per block
+- rewritten (of which cached, see #llm_cache), failed and skipped counts, and the first error, for the ruler
 
-Next, if there is a file in projfiles that doesn't have a language set, then we tell the user that this is required and set the language on the projfile in this case.
-We tell them that the language must be either "Python" or "C", and determines how blocks start and also where the comment part ends and code part starts.
+We keep at most llmjobs (conf var, default 4) of our requests in flight.
 
-Once we have set all the required conf vars, if any of them were missing, including any languages on the projfiles, or adding the first projfile, then we call save_conf() which just rewrites the conf file.
+Everything happens in llm_batch_pump(), which the main loop calls before every redraw; since wait_for_key returns -1 whenever a request makes progress, this is often enough.
+It applies whatever replies are ready at the head of the range and tops up the requests in flight, over and over until neither makes progress (a reply from the cache is ready at once), and when every block has been dealt with it writes the revs and finishes.
+Finished replies waiting behind a slow one hold on to their request, so we also stop starting new ones at LLM_MAX_REQUESTS / 2 outstanding.
+The user can keep navigating and editing meanwhile, and all blocks may move, so we locate each block by its hash (llm_batch_find), starting from where we expect it to be and working outwards, so that of several identical blocks we find the right one.
+If the block is gone (its hash changed, because it was edited) the reply is dropped and counted as skipped; a block with no comment part is skipped too.
 
-TODO: use the ensure_conf_var thing that we added after this
+llm_batch_cancel (Esc in the main view) fails the requests in flight and drops the rest, but keeps (and writes revs for) what was already applied.
 */
 
-void check_conf_vars() {
-    #define CHECK_AND_SET(var, prompt) \
-    if (empty(state->var)) { \
-        prt("%s\n", prompt); \
-        flush(); \
-        span input_space = cmp_compl(); \
-        state->var = read_line(&input_space); \
-        cmp.end = state->var.end; \
+struct {
+    int first, n;
+    int started, applied;
+    int shift;
+    int rewritten, failed, skipped, cached;
+    u64* hash;
+    llm_request** reqs;
+    u8* touched;
+    int nfiles;
+    char error[256];
+} llm_batch;
+
+int splice_block_code_part(int block_index, span new_code);
+
+int llm_batch_jobs() {
+    char buf[32] = {0};
+    s(buf, sizeof(buf), state->llmjobs);
+    int jobs = atoi(buf);
+    if (jobs <= 0) jobs = 4;
+    if (jobs > LLM_MAX_REQUESTS / 2) jobs = LLM_MAX_REQUESTS / 2;
+    return jobs;
+}
+
+int llm_batch_find(int i) {
+    int n = state->blocks.n;
+    int expect = llm_batch.first + i + llm_batch.shift;
+    if (expect < 0) expect = 0;
+    if (expect >= n) expect = n - 1;
+    for (int d = 0; d < n; d++) {
+        if (expect - d >= 0 && block_table.hash[expect - d] == llm_batch.hash[i]) return expect - d;
+        if (d && expect + d < n && block_table.hash[expect + d] == llm_batch.hash[i]) return expect + d;
     }
+    return -1;
+}
 
-    CHECK_AND_SET(revdir, "revdir: Path for revisions (.cmpr/revs is a good choice)");
-    CHECK_AND_SET(tmpdir, "tmpdir: Path for temp files (.cmpr/tmp is a good choice)");
+void llm_batch_start(int first, int end) {
+    if (llm_batch.hash) return; // one at a time
+    memset(&llm_batch, 0, sizeof(llm_batch));
+    llm_batch.first = first;
+    llm_batch.n = end - first;
+    llm_batch.nfiles = state->files.n;
+    llm_batch.hash = malloc(llm_batch.n * sizeof(u64));
+    llm_batch.reqs = calloc(llm_batch.n, sizeof(llm_request*));
+    llm_batch.touched = calloc(llm_batch.nfiles, 1);
+    if (!llm_batch.hash || !llm_batch.reqs || !llm_batch.touched) exit_with_error("Failed to allocate LLM batch");
+    for (int i = 0; i < llm_batch.n; i++) llm_batch.hash[i] = block_table.hash[first + i];
+    llm_last_error[0] = 0;
+}
 
-    if (state->files.n == 0) {
-        while (1) {
-            prt("At least one file is required. Please specify a file path to add:\n");
-            flush();
-            span input_space = cmp_compl();
-            span file_path_span = read_line(&input_space);
-            cmp.end = file_path_span.end;
-            if (add_projfile(file_path_span)) break;
-        }
+void llm_batch_error(char* message) {
+    llm_batch.failed++;
+    if (!llm_batch.error[0]) snprintf(llm_batch.error, sizeof(llm_batch.error), "%s", message);
+}
+
+void llm_batch_finish() {
+    for (int f = 0; f < llm_batch.nfiles && f < state->files.n; f++) {
+        if (llm_batch.touched[f]) new_rev(NULL, f);
     }
+    snprintf(llm_last_error, sizeof(llm_last_error), "batch: %d rewritten (%d from cache), %d failed, %d skipped%s%.180s",
+             llm_batch.rewritten, llm_batch.cached, llm_batch.failed, llm_batch.skipped, llm_batch.error[0] ? "; " : "", llm_batch.error);
+    free(llm_batch.hash);
+    free(llm_batch.reqs);
+    free(llm_batch.touched);
+    llm_batch.hash = NULL;
+}
 
-    for (int i = 0; i < state->files.n; ++i) {
-        if (empty(state->files.a[i].language)) {
-            prt("A language for each file is required. Please specify 'Python' or 'C' for the file: %.*s\n", len(state->files.a[i].path), state->files.a[i].path.buf);
-            flush();
-            span input_space = cmp_compl();
-            state->files.a[i].language = read_line(&input_space);
-            cmp.end = state->files.a[i].language.end;
-        }
+void llm_batch_apply(int i) {
+    llm_request* r = llm_batch.reqs[i];
+    llm_batch.reqs[i] = NULL;
+    llm_forget(r);
+    int block = r->state == LLM_DONE ? llm_batch_find(i) : -1;
+    if (r->state == LLM_FAILED) {
+        llm_batch_error(r->error);
+    } else if (block < 0) {
+        llm_batch.skipped++;
+    } else {
+        int file_index = block_table.file[block];
+        int before = state->blocks.n;
+        if (splice_block_code_part(block, llm_code(r)) && file_index < llm_batch.nfiles) llm_batch.touched[file_index] = 1;
+        llm_batch.shift += state->blocks.n - before;
+        llm_batch.rewritten++;
+        llm_batch.cached += r->cached;
     }
+    llm_free(r);
+}
 
-    #undef CHECK_AND_SET
-    save_conf();
+void llm_batch_apply_ready() {
+    while (llm_batch.applied < llm_batch.started) {
+        llm_request* r = llm_batch.reqs[llm_batch.applied];
+        if (r && r->state != LLM_DONE && r->state != LLM_FAILED) break;
+        if (r) llm_batch_apply(llm_batch.applied);
+        llm_batch.applied++;
+    }
 }
-/*
-In ensure_conf_var() we are given a span, which must be one of the conf vars on the state, a message for the user to explain what the conf setting does and why it is required, and a default or current value that we can pass through to read_line.
 
-If the conf var is not empty, we return immediately.
+int llm_batch_running() {
+    int running = 0;
+    for (int i = llm_batch.applied; i < llm_batch.started; i++) {
+        llm_request* r = llm_batch.reqs[i];
+        if (r && r->state != LLM_DONE && r->state != LLM_FAILED) running++;
+    }
+    return running;
+}
 
-We call read_line to get the new value from the user.
-For the buffer space to use we will first call cmp_compl() to get the complement of cmp space as a span.
-After read_line returns we will always set cmp.end to point to the end of the returned span; this makes sure nothing else uses that space later.
+void llm_batch_pump() {
+    if (!llm_batch.hash) return;
 
-Then we call save_conf() which just rewrites the conf file.
-*/
+    int jobs = llm_batch_jobs();
+    while (1) {
+        llm_batch_apply_ready();
+        if (llm_batch.started == llm_batch.n || llm_batch_running() >= jobs) break;
+        if (llm_batch.started - llm_batch.applied >= LLM_MAX_REQUESTS / 2) break; // replies waiting for a slow one
+
+        int i = llm_batch.started++;
+        int block = llm_batch_find(i);
+        if (block < 0 || empty(block_comment(block))) {
+            llm_batch.skipped++;
+            continue;
+        }
+        span prompt = comment_to_prompt(block_comment(block));
+        llm_request* r = llm_start(prompt, block);
+        cmp.end = prompt.buf;
+        if (!r) {
+            llm_batch_error(llm_last_error);
+            llm_last_error[0] = 0;
+            continue;
+        }
+        llm_batch.reqs[i] = r;
+    }
 
-void ensure_conf_var(span* var, span message, span default_value) {
-    if (!empty(*var)) return; // If the configuration variable is already set, return immediately
+    if (llm_batch.applied == llm_batch.n) llm_batch_finish();
+}
 
-    prt("%.*s\n", len(message), message.buf); // Print the message explaining the configuration setting
-    if (!empty(default_value)) {
-        prt("Default: %.*s\n", len(default_value), default_value.buf); // Show default value if provided
+void llm_batch_cancel() {
+    if (!llm_batch.hash) return;
+    for (int i = llm_batch.applied; i < llm_batch.started; i++) {
+        llm_request* r = llm_batch.reqs[i];
+        if (r && r->state != LLM_DONE && r->state != LLM_FAILED) llm_fail(r, "cancelled");
     }
+    llm_batch.skipped += llm_batch.n - llm_batch.started;
+    llm_batch.n = llm_batch.started;
+    llm_batch_pump();
+}
 
-    span buffer = cmp_compl(); // Get complement of cmp space as a span for input
-    *var = read_line(&buffer); // Read new value from user
-
-    cmp.end = buffer.buf; // Update cmp.end to the end of the returned span from read_line
+/*
+print_llm_batch_status shows the progress of the batch, if one is running, and returns 1 if it printed anything.
+*/
 
-    save_conf(); // Rewrite the configuration file with the updated setting
+int print_llm_batch_status() {
+    if (!llm_batch.hash) return 0;
+    int running = 0, bytes = 0;
+    for (int i = llm_batch.applied; i < llm_batch.started; i++) {
+        llm_request* r = llm_batch.reqs[i];
+        if (!r || r->state == LLM_DONE || r->state == LLM_FAILED) continue;
+        running++;
+        bytes += r->text.n;
+    }
+    prt(", LLM batch: %d/%d done, %d running (%d bytes)", llm_batch.applied, llm_batch.n, running, bytes);
+    if (llm_batch.failed) prt(", %d failed", llm_batch.failed);
+    if (llm_batch.skipped) prt(", %d skipped", llm_batch.skipped);
+    prt(", Esc to cancel");
+    return 1;
 }
 /*
-To edit the current block we first write it out to a file, which we do with a helper function write_to_file(span, char*).
-
-Once the file is written, we then launch the user's editor of choice on that file, which is handled by another helper function.
+In send_to_clipboard, we are given a span and we must send it to the clipboard using a user-provided method, since this varies quite a bit between environments.
 
-That function will wait for the editor process to exit, and will indicate to us by its return value whether the editor exited normally.
+There is a global ui_state* variable "state" with a span cbcopy on it.
 
-If so, then we call another function which will then read the edited file contents back in and handle storing the new version.
+Before we do anything else we ensure this is set by calling ensure_conf_var with the message "The command to pipe data to the clipboard on your system. For Mac try \"pbcopy\", Linux \"xclip -i -selection clipboard\", Windows please let me know and I'll add something here".
 
-If not, we print a short message to let the user know their changes were ignored.
+We then hand the data to clip_send(), which knows the different ways of getting it there (see #clipboard_transport).
+If that fails, the ruler shows why (clip_error, print_clip_status) and we carry on; nothing here is worth exiting over.
 */
 
-char* tmp_filename();
-int launch_editor(char* filename);
-void handle_edited_file(char* filename);
-
-void edit_current_block() {
-  if (state->current_index >= 0 && state->current_index < state->blocks.n) {
-    // Get a temporary filename based on the current UI state
-    char* filename = tmp_filename();
+int clip_send(span transport, span data);
+span clip_receive(span transport, span buffer);
 
-    // Write the current block to the temporary file
-    write_to_file(state->blocks.s[state->current_index], filename);
+void send_to_clipboard(span content) {
+    TRACE_SCOPE(send_to_clipboard);
+    ensure_conf_var(&(state->cbcopy), S("The command to pipe data to the clipboard on your system. For Mac try \"pbcopy\", Linux \"xclip -i -selection clipboard\", Windows please let me know and I'll add something here"), S(""));
+    clip_send(state->cbcopy, content);
+}
+/* #clipboard_transport
 
-    // Launch the editor on the temporary file
-    int editor_exit_code = launch_editor(filename);
+cbcopy and cbpaste are usually shell commands, like pbcopy or xclip, but that means a fork of a shell and a fork of the command for every "r" and "R".
+Instead, either of them can name a transport that we talk to directly:
 
-    // Check if the editor exited normally
-    if (editor_exit_code == 0) {
-      // Handle the edited file (read changes, update the block, etc.)
-      handle_edited_file(filename);
-    } else {
-      // Optionally handle abnormal editor exit
-      prt("Editor exited abnormally. Changes might not be saved.\n");
-    }
+- "unix:PATH", a Unix socket where a long-lived helper listens (which can keep a clipboard connection, or a local model runner, warm between requests)
+- "fifo:PATH", a named pipe that a helper reads from (cbcopy) or writes to (cbpaste)
+- "file:PATH", a file drop, e.g. on a tmpfs, that something else watches or fills in
+- anything else is a command, run with popen() as before
 
-    // Cleanup: Free the filename if allocated dynamically
-    free(filename);
-  }
-}
+The protocols are as simple as we can make them, so that a helper is a few lines of shell or Python:
 
-/*
-To generate a tmp filename for launching the user's editor, we return a string starting with state->tmpdir.
-For the filename part, we construct a timestamp in a compressed ISO 8601-like format, as YYYYMMDD-hhmmss with just a single dash as separator.
-We append a file extension: we use file_for_block and current_block to get the language for the current block and if it's C we add ".c" and if it's Python we add ".py" to the filename; otherwise we don't add anything.
-We return a char* which the caller must free.
-Since state->tmpdir may or may not include a trailing slash we test for and handle both cases.
-*/
+- unix, copy: we connect, send "copy N\n" and then the N bytes of data, and shut down our side; the helper may reply "ok", or an error message, and closes
+- unix, paste: we send "paste\n" and shut down our side, and the helper replies with the clipboard contents and closes
+- fifo, copy: each time we open the pipe, write the data and close it; if no helper has it open we fail at once rather than block
+- fifo, paste: we open the pipe and read until the helper has written the contents and closed its end
+- file, copy: we write the file under a tmp name and rename it into place, so a watcher never sees half of it
+- file, paste: we read the file
 
-int file_for_block(span);
+Data goes out with write_spans() (writev), straight from where it is in cmp with any header in front of it, without copying it together first.
+Reads go directly into the caller's buffer (clip_read), and wait at most CLIP_TIMEOUT_MS for each bit of data, so a stuck helper can't hang us forever.
+If the buffer fills up, clip_read tries to read one more byte (when asked to get the whole of it, as for a paste; the reply to a copy is just a status, which we may cut short), and if there is one the paste fails (with errno EFBIG, which the messages call "too big to paste") rather than hand back the first part of the clipboard as if it were all of it.
 
-char* tmp_filename() {
-    time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
-    char time_str[16]; // Enough to hold YYYYMMDD-HHMMSS
-    strftime(time_str, sizeof(time_str), "%Y%m%d-%H%M%S", tm);
+clip_send returns 0 or -1, and clip_receive returns the span read into the buffer, or a span with .buf NULL on failure.
+Either way, on failure clip_error says what went wrong, and the ruler shows it (print_clip_status) until the next clipboard operation succeeds.
+*/
 
-    int file_index = file_for_block(state->blocks.s[state->current_index]);
-    char* extension = "";
-    if (span_eq(state->files.a[file_index].language, S("C"))) {
-        extension = ".c";
-    } else if (span_eq(state->files.a[file_index].language, S("Python"))) {
-        extension = ".py";
-    }
+#define CLIP_TIMEOUT_MS 10000
 
-    int need_slash = state->tmpdir.end[-1] != '/';
-    int total_length = (state->tmpdir.end - state->tmpdir.buf) + strlen(time_str) + strlen(extension) + 1 + need_slash;
-    char* filename = malloc(total_length);
-    if (!filename) {
-        perror("Failed to allocate memory for filename");
-        exit(EXIT_FAILURE);
-    }
+char clip_error[256];
 
-    snprintf(filename, total_length, "%.*s%s%s%s", 
-             (int)(state->tmpdir.end - state->tmpdir.buf), state->tmpdir.buf, 
-             need_slash ? "/" : "", 
-             time_str, 
-             extension);
+char* clip_strerror(int e) {
+    return e == EFBIG ? "too big to paste" : strerror(e);
+}
 
-    return filename;
+int clip_fail(char* what, span transport) {
+    snprintf(clip_error, sizeof(clip_error), "%s %.*s: %s", what, len(transport) < 150 ? len(transport) : 150, transport.buf, clip_strerror(errno));
+    return -1;
 }
-/*
-In launch_editor, we are given a filename and must launch the user's editor of choice on that file, and then wait for it to exit and return its exit code.
 
-We look in the env for an EDITOR environment variable and use that if it is present, otherwise we will use "vi".
+span clip_read(int fd, span buffer, int whole) {
+    span got = {buffer.buf, buffer.buf};
+    while (got.end < buffer.end) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, CLIP_TIMEOUT_MS);
+        if (ready == 0) errno = ETIMEDOUT;
+        if (ready <= 0) {
+            if (ready < 0 && errno == EINTR) continue;
+            return (span){0};
+        }
+        ssize_t n = read(fd, got.end, buffer.end - got.end);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n < 0) return (span){0};
+        if (n == 0) break;
+        got.end += n;
+    }
+    if (whole && got.end == buffer.end) {
+        u8 more;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        ssize_t n = poll(&pfd, 1, CLIP_TIMEOUT_MS) > 0 ? read(fd, &more, 1) : 0;
+        if (n > 0) {
+            errno = EFBIG;
+            return (span){0};
+        }
+    }
+    return got;
+}
 
-As always, we never write const anywhere in C.
-*/
+int clip_connect(char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    struct timeval tv = {CLIP_TIMEOUT_MS / 1000, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
 
-int launch_editor(char* filename) {
-    char* editor = getenv("EDITOR");
-    if (editor == NULL) {
-        editor = "vi"; // Default to vi if EDITOR is not set
+int clip_send(span transport, span data) {
+    char path[2048];
+    span rest = transport;
+    signal(SIGPIPE, SIG_IGN); // a helper going away should fail the copy, not kill us
+
+    if (consume_prefix(&rest, S("unix:"))) {
+        s(path, sizeof(path), rest);
+        int fd = clip_connect(path);
+        if (fd < 0) return clip_fail("can't connect to", transport);
+        char header[32];
+        snprintf(header, sizeof(header), "copy %d\n", len(data));
+        span parts[2] = {S(header), data};
+        if (write_spans(fd, parts, 2) < 0) {
+            close(fd);
+            return clip_fail("can't write to", transport);
+        }
+        shutdown(fd, SHUT_WR);
+        char reply_buf[200];
+        span reply = clip_read(fd, (span){(u8*)reply_buf, (u8*)reply_buf + sizeof(reply_buf) - 1}, 0);
+        close(fd);
+        if (!reply.buf) return clip_fail("no reply from", transport);
+        if (!empty(reply) && !starts_with(reply, S("ok"))) {
+            while (!empty(reply) && isspace(reply.end[-1])) reply.end--;
+            snprintf(clip_error, sizeof(clip_error), "%.*s", len(reply), reply.buf);
+            return -1;
+        }
+    } else if (consume_prefix(&rest, S("fifo:"))) {
+        s(path, sizeof(path), rest);
+        int fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) return clip_fail(errno == ENXIO ? "no helper reading" : "can't open", transport);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        int failed = write_spans(fd, &data, 1) < 0;
+        close(fd);
+        if (failed) return clip_fail("can't write to", transport);
+    } else if (consume_prefix(&rest, S("file:"))) {
+        char tmp[2100];
+        s(path, sizeof(path), rest);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) return clip_fail("can't write", transport);
+        int failed = write_spans(fd, &data, 1) < 0;
+        close(fd);
+        if (failed || rename(tmp, path) < 0) {
+            unlink(tmp);
+            return clip_fail("can't write", transport);
+        }
+    } else {
+        s(path, sizeof(path), transport);
+        FILE* pipe = popen(path, "w");
+        if (!pipe) return clip_fail("can't run", transport);
+        int failed = write_spans(fileno(pipe), &data, 1) < 0;
+        int status = pclose(pipe);
+        if (failed || status != 0) {
+            snprintf(clip_error, sizeof(clip_error), "%.150s failed (%s)", path, failed ? strerror(errno) : "exit status");
+            return -1;
+        }
     }
+    clip_error[0] = 0;
+    return 0;
+}
 
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("fork failed");
-        exit(EXIT_FAILURE);
-    } else if (pid == 0) {
-        // Child process
-        execlp(editor, editor, filename, (char*)NULL);
-        // If execlp returns, it means it failed
-        perror("execlp failed");
-        exit(EXIT_FAILURE);
+span clip_receive(span transport, span buffer) {
+    char path[2048];
+    span rest = transport;
+    span got = {0};
+
+    if (consume_prefix(&rest, S("unix:"))) {
+        s(path, sizeof(path), rest);
+        int fd = clip_connect(path);
+        if (fd < 0) {
+            clip_fail("can't connect to", transport);
+            return (span){0};
+        }
+        span request = S("paste\n");
+        if (write_spans(fd, &request, 1) == 0) {
+            shutdown(fd, SHUT_WR);
+            got = clip_read(fd, buffer, 1);
+        }
+        close(fd);
+        if (!got.buf) {
+            clip_fail("no reply from", transport);
+            return (span){0};
+        }
+    } else if (consume_prefix(&rest, S("fifo:")) || consume_prefix(&rest, S("file:"))) {
+        s(path, sizeof(path), rest);
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            clip_fail("can't open", transport);
+            return (span){0};
+        }
+        got = clip_read(fd, buffer, 1);
+        close(fd);
+        if (!got.buf) {
+            clip_fail("can't read", transport);
+            return (span){0};
+        }
     } else {
-        // Parent process
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status)) {
-            return WEXITSTATUS(status); // Return the exit status of the editor
-        } else {
-            return -1; // Editor didn't exit normally
+        s(path, sizeof(path), transport);
+        FILE* pipe = popen(path, "r");
+        if (!pipe) {
+            clip_fail("can't run", transport);
+            return (span){0};
+        }
+        got = clip_read(fileno(pipe), buffer, 1);
+        int saved = errno;
+        int status = pclose(pipe);
+        if (!got.buf || status != 0) {
+            snprintf(clip_error, sizeof(clip_error), "%.150s failed (%s)", path, !got.buf ? clip_strerror(saved) : "exit status");
+            return (span){0};
         }
     }
+    clip_error[0] = 0;
+    return got;
 }
-/* int file_for_block(span)
 
-Here we're given the span of a block and we must find out the index of the file that contains that block.
+/*
+print_clip_status, in the ruler, shows the error from the last clipboard operation, if it failed.
+*/
 
-If .buf of the span is >= .buf of the contents of the file (recall that file contents are spans into inp and so are blocks), and the .end of the block is similarly <= .end of the file, then the file contains the block.
+void print_clip_status() {
+    if (clip_error[0]) prt(", Clipboard: %s", clip_error);
+}
+/* #compile()
 
-If the block overlaps a file boundary, something has gone badly wrong and we complain as exit as usual (prt, flush, exit).
+In compile(), we start buildcmd, which is a config parameter, as a background child process, and return immediately so that navigation and editing keep working while it runs.
 
-Similarly if it's outside all the files.
-In short, we always return an int n, 0 <= n <= state->files.n, or don't return at all.
+First we call ensure_conf_var(state->buildcmd), since we are about to use that setting.
+
+If a build is already running, we don't start another one but set build.pending; when the running build finishes, we start exactly one more, however many times B was hit in the meantime (coalescing).
+Otherwise we call start_build().
+
+The build state is a single global struct, build:
+
+- pid, the child (0 if none running)
+- fd, the read end of a pipe that is the child's stdout and stderr (-1 if none)
+- status, one of BUILD_NONE, BUILD_RUNNING, BUILD_OK, BUILD_FAILED
+- exit_code, for the failed case
+- pending, a rebuild was requested while running
+- started and finished, CLOCK_MONOTONIC times in ns (see now_ns)
+- ring and total, the captured output: a bounded ring buffer of BUILD_RING bytes, with total counting every byte ever written for this build, so the last min(total, BUILD_RING) bytes are the ones we still have
+- line_starts, the offset (counted like total) of the start of each line of the output, kept up to date as it arrives so that the log pane (show_build_log) doesn't have to split the whole ring on every redraw; lines_skip of them at the front are for lines that have dropped out of the ring entirely, and we move the rest down when those are more than half
+
+In start_build, we make the pipe, fork, and in the child point stdout and stderr at the pipe and stdin at /dev/null, then exec /bin/sh -c buildcmd.
+In the parent we close the write end and make the read end non-blocking, reset the ring, and mark the build running.
+
+In build_pump(), which is called whenever the pipe is readable (or just to check), we read everything available into the ring with build_received().
+On EOF we close the fd; then once waitpid(WNOHANG) reaps the child we record the status and the finish time, and if a rebuild is pending we start it.
+We return 1 if the status changed, so the caller knows to redraw.
+
+build_received(span) is the one place where build output arrives, as it streams, and as well as keeping it in the ring and adding to line_starts we hand it to diag_feed() to pick out compiler diagnostics (see #diagnostics).
 */
 
-int file_for_block(span block) {
-    for (int i = 0; i < state->files.n; i++) {
-        if (block.buf >= state->files.a[i].contents.buf && block.end <= state->files.a[i].contents.end) {
-            return i;
-        }
+void diag_reset();
+void diag_feed(span);
+
+#define BUILD_RING (1 << 20)
+
+enum { BUILD_NONE, BUILD_RUNNING, BUILD_OK, BUILD_FAILED };
+
+struct {
+    pid_t pid;
+    int fd;
+    int status;
+    int exit_code;
+    int pending;
+    long long started;
+    long long finished;
+    u8 ring[BUILD_RING];
+    unsigned long long total;
+    unsigned long long* line_starts;
+    int lines_n, lines_cap, lines_skip;
+} build = {.fd = -1};
+
+void build_line_push(unsigned long long start) {
+    if (build.lines_skip > build.lines_n / 2 && build.lines_skip > 1024) {
+        build.lines_n -= build.lines_skip;
+        memmove(build.line_starts, build.line_starts + build.lines_skip, build.lines_n * sizeof(unsigned long long));
+        build.lines_skip = 0;
     }
-    prt("Error: Block does not belong to any file.\n");
-    flush();
-    exit(EXIT_FAILURE);
+    if (build.lines_n == build.lines_cap) {
+        build.lines_cap = build.lines_cap ? build.lines_cap * 2 : 4096;
+        build.line_starts = realloc(build.line_starts, build.lines_cap * sizeof(unsigned long long));
+        if (!build.line_starts) exit_with_error("Failed to allocate build log lines");
+    }
+    build.line_starts[build.lines_n++] = start;
 }
-/* handle_edited_file
 
-Here we are given a tmp file containing new contents of a block.
+void start_build() {
+    char buf[2048] = {0};
+    s(buf, sizeof(buf), state->buildcmd);
 
-Every block belongs to a projfile, and the blocks are in order of the projfiles (set up in the conf file).
+    int fds[2];
+    if (pipe(fds) == -1) exit_with_error("Failed to create pipe for build");
 
-What we must do is replace the existing block contents with the new contents of that tmp file, and then write everything out to a new file on disk called a rev for the particular projfile that contains that block.
+    pid_t pid = fork();
+    if (pid == -1) exit_with_error("fork failed");
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull >= 0) dup2(devnull, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", buf, (char*)NULL);
+        perror("execl failed");
+        _exit(127);
+    }
 
-We already have on state all the current values of the blocks, which are spans that point into inp.
-First we want to fix inp to reflect the new reality, and then we will write out the new disk file from inp (our global input span).
-We will also fix the contents spans of all of the files starting with this one, and including all later ones.
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    diag_reset();
+    build.pid = pid;
+    build.fd = fds[0];
+    build.status = BUILD_RUNNING;
+    build.pending = 0;
+    build.total = 0;
+    build.lines_n = build.lines_skip = 0;
+    build_line_push(0);
+    build.started = now_ns();
+}
 
-We get the span corresponding to the current block, which is also the edited block, in a local variable for convenience.
-We can do the same for the .contents of the file, calling file_for_block to get the index.
+void compile() {
+    TRACE_SCOPE(compile);
+    ensure_conf_var(&state->buildcmd, S("The build command will be run every time you hit 'B' and should build the code you are editing (typically in projfile)"), nullspan());
 
-The contents of inp are already correct, up to the start of this block, which is what we want to replace.
-Now we get the size of the tmp file and compare it to the len of the existing block (recall that len(span) exists and is one of our most commonly used library methods).
-If it is larger, we need to move the contents after it (in inp) to the right in memory, if smaller, to the left.
-We can do this using memmove.
+    if (build.status == BUILD_RUNNING) {
+        build.pending = 1;
+        return;
+    }
+    start_build();
+}
 
-Once we have done this, we have everything correct in inp except for the contents of the file itself, and we have a space that's sufficient for the file contents to be read into.
-We construct a span that represents this space.
-This span starts at the .buf of the original block, but has the length of the file.
+void build_received(span data) {
+    for (u8* p = data.buf; (p = memchr(p, '\n', data.end - p)); p++) build_line_push(build.total + (p + 1 - data.buf));
+    for (u8* p = data.buf; p < data.end; ) {
+        int at = build.total % BUILD_RING;
+        int n = BUILD_RING - at;
+        if (n > data.end - p) n = data.end - p;
+        memcpy(build.ring + at, p, n);
+        build.total += n;
+        p += n;
+    }
+    unsigned long long oldest = build.total > BUILD_RING ? build.total - BUILD_RING : 0;
+    while (build.lines_skip + 1 < build.lines_n && build.line_starts[build.lines_skip + 1] <= oldest) build.lines_skip++;
+    diag_feed(data);
+}
 
-We have a library function, span read_file_into_span(char*,span), which takes a span and reads a file into a prefix of that span, and then returns that prefix as another span.
-We can pass our "gap" span representing the part of inp that we want to replace to this function, along with the filename.
-We can confirm that the span that is returned is in fact the identical span as the buffer we passed in, since we are expecting that the file length has not changed.
+int build_pump() {
+    if (build.status != BUILD_RUNNING) return 0;
 
-As usual, if this expectation is violated we will complain and exit (using our exit_with_error(char*) convenience function).
+    if (build.fd >= 0) {
+        u8 buf[65536];
+        for (;;) {
+            ssize_t n = read(build.fd, buf, sizeof(buf));
+            if (n > 0) {
+                build_received((span){buf, buf + n});
+                continue;
+            }
+            if (n == 0) {
+                close(build.fd);
+                build.fd = -1;
+            }
+            break;
+        }
+    }
 
-Now inp is representing the new state of the project.
+    int status;
+    if (waitpid(build.pid, &status, WNOHANG) != build.pid) return 0;
 
-However, the file[i].contents for the files including and subsequent to this one may be incorrect.
-Specifically, the difference in length of this block must be added to the .end of the file contents span for this file, and to both the .buf and .end of every subsequent file.
+    if (build.fd >= 0) {
+        close(build.fd);
+        build.fd = -1;
+    }
+    build.pid = 0;
+    build.finished = now_ns();
+    build.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    build.status = build.exit_code == 0 ? BUILD_OK : BUILD_FAILED;
+    if (build.pending) start_build();
+    return 1;
+}
+/* #live_edit
 
-As a sanity check, after this step, we could validate that the .end of the last file is equal to the .end of inp itself.
+"e" hands the terminal to $EDITOR and waits for it to exit before reading the block back (handle_edited_file), so every small change means starting the editor again.
+"E" is the alternative: we write the current block to a tmp file just the same, but then keep running and watch the file with inotify, and every time it is saved we apply the new contents to inp straight away (splice_file), re-index and write a rev.
+Meanwhile the view (e.g. in a split next to the editor) redraws after each save.
+If a build has been started before (build.status is not BUILD_NONE), each save also starts a new one, so the ruler shows whether the change compiles.
 
-We need to update the blocks, since any blocks after and including this one may have moved, so we call find_all_blocks().
+The editor is whatever the conf var liveedit says, run in the background with the file name appended and without our terminal: e.g. "tmux split-window vi", or a GUI editor.
+If liveedit is empty we just show the file name in the ruler, and the user opens it however they like.
+We don't wait for that command (tmux split-window, for one, returns at once); the session lasts until "E" is pressed again.
 
-Then we call a helper function, new_rev, which takes the filename and the file index for the projfile that was altered.
-This function is responsible for storing a new rev, cleaning up the tmp file, and any reporting to the user that we might do.
-We include a forward declaration here for new_rev.
+We watch the directory rather than the file, for IN_CLOSE_WRITE and IN_MOVED_TO events with the file's name, since many editors save by writing a new file and renaming it over the old one.
 
-Relevant helper functions:
-void new_rev(char*,int);
-*/
+The session (the global live) remembers where the text we gave the editor is: the projfile, the offset into its contents, the size and a hash.
+Before applying a save we check that this text is still there, i.e. that nothing else has edited it, or anything before it in the same file; if it isn't, we stop the session with a message rather than overwrite something else.
+The saved text may have more or fewer blocks in it than before (e.g. a new block comment); that's fine, since we only track the range of bytes.
+A save that is empty, or that changes nothing, we ignore.
 
-void new_rev(char*, int);
+live_pump() is called by wait_for_key when the inotify fd is readable, and returns 1 if a save was applied so that the view redraws.
 
-void handle_edited_file(char* filename) {
-    int file_index = file_for_block(state->blocks.s[state->current_index]);
-    span original_block = state->blocks.s[state->current_index];
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        prt("Error: Failed to open edited file.\n");
-        flush();
-        exit(EXIT_FAILURE);
+live_stop ends the session, and removes the tmp file even if we never got as far as watching it.
+The liveedit command of a session may still be running when the next one starts (a GUI editor, say), so rather than lose track of it when live.pid is reused we move it to live.old, and live_reap collects whichever of those have exited, each time a session starts or stops; if there are ever LIVE_OLD of them still running we wait for the oldest.
+*/
+
+#define LIVE_OLD 16
+
+struct {
+    int fd;
+    char path[1024];
+    char* name;
+    pid_t pid;
+    int file;
+    long offset, size;
+    u64 hash;
+    int saves;
+    char message[256];
+    pid_t old[LIVE_OLD];
+    int nold;
+} live = {.fd = -1};
+
+void live_reap() {
+    if (live.pid > 0 && waitpid(live.pid, NULL, WNOHANG) == live.pid) live.pid = 0;
+    int n = 0;
+    for (int i = 0; i < live.nold; i++) {
+        if (waitpid(live.old[i], NULL, WNOHANG) == 0) live.old[n++] = live.old[i];
     }
-    off_t new_size = lseek(fd, 0, SEEK_END);
-    ssize_t size_diff = new_size - (original_block.end - original_block.buf);
-    close(fd);
+    live.nold = n;
+}
 
-    // Adjusting the memory in inp for new content size
-    memmove(original_block.buf + new_size, original_block.end, inp.end - original_block.end);
-    inp.end += size_diff;
+void live_stop(char* message) {
+    if (live.fd >= 0) close(live.fd);
+    live.fd = -1;
+    if (live.path[0]) unlink(live.path);
+    live.path[0] = 0;
+    live_reap();
+    snprintf(live.message, sizeof(live.message), "%s", message);
+}
 
-    // Reading the new block content into the adjusted space in inp
-    span gap = {original_block.buf, original_block.buf + new_size};
-    span result = read_file_into_span(filename, gap);
-    if (len(result) != new_size) {
-        prt("Error: Unexpected file size after reading edited content.\n");
-        flush();
-        exit(EXIT_FAILURE);
+void live_start() {
+    if (state->current_index < 0 || state->current_index >= state->blocks.n) return;
+    live_reap();
+    if (live.pid > 0) {
+        if (live.nold == LIVE_OLD) {
+            waitpid(live.old[0], NULL, 0);
+            memmove(live.old, live.old + 1, --live.nold * sizeof(pid_t));
+        }
+        live.old[live.nold++] = live.pid;
+        live.pid = 0;
     }
-
-    // Adjusting file contents spans for this and subsequent files
-    state->files.a[file_index].contents.end += size_diff;
-    for (int i = file_index + 1; i < state->files.n; ++i) {
-        state->files.a[i].contents.buf += size_diff;
-        state->files.a[i].contents.end += size_diff;
+    char* filename = tmp_filename();
+    snprintf(live.path, sizeof(live.path), "%s", filename);
+    free(filename);
+    span block = state->blocks.s[state->current_index];
+    write_to_file(block, live.path);
+
+    char dir[1024];
+    char* slash = strrchr(live.path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - live.path) : 1, slash ? live.path : ".");
+    live.name = slash ? slash + 1 : live.path;
+    live.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (live.fd < 0 || inotify_add_watch(live.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        char message[256];
+        snprintf(message, sizeof(message), "can't watch %.200s: %s", dir, strerror(errno));
+        live_stop(message);
+        return;
     }
 
-    // Sanity check
-    if (state->files.a[state->files.n - 1].contents.end != inp.end) {
-        prt("Error: Inconsistent state after updating file contents.\n");
-        flush();
-        exit(EXIT_FAILURE);
+    live.file = block_table.file[state->current_index];
+    live.offset = block.buf - state->files.a[live.file].contents.buf;
+    live.size = len(block);
+    live.hash = block_table.hash[state->current_index];
+    live.saves = 0;
+    live.message[0] = 0;
+
+    if (!empty(state->liveedit)) {
+        char command[2048];
+        snprintf(command, sizeof(command), "%.*s '%s'", len(state->liveedit), state->liveedit.buf, live.path);
+        pid_t pid = fork();
+        if (pid == -1) exit_with_error("fork failed");
+        if (pid == 0) {
+            int devnull = open("/dev/null", O_RDWR);
+            if (devnull >= 0) {
+                dup2(devnull, STDIN_FILENO);
+                dup2(devnull, STDOUT_FILENO);
+                dup2(devnull, STDERR_FILENO);
+            }
+            execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+            _exit(127);
+        }
+        live.pid = pid;
     }
+}
 
-    // Updating the blocks representation
-    find_all_blocks();
-
-    // Creating a new revision and cleaning up
-    new_rev(filename, file_index);
+void live_edit_toggle() {
+    if (live.fd >= 0) live_stop("");
+    else live_start();
 }
 
-void update_link(char* new_filename);
-/*
-Here we store a new revision, given a filename which contains a block that was edited and the index of the projfile that contains that block.
-The file contents have already been processed, we just get the name so that we can clean up the file when done.
+int live_apply() {
+    projfile* f = &state->files.a[live.file];
+    span old = {f->contents.buf + live.offset, f->contents.buf + live.offset + live.size};
+    if (old.end > f->contents.end || hash_span(old) != live.hash) {
+        live_stop("block changed outside the editor, live edit stopped");
+        return 1;
+    }
+    span text = map_file(live.path);
+    if (empty(text) || (len(text) == len(old) && span_eq(text, old))) {
+        unmap_file(text);
+        return 0;
+    }
 
-Our conf var revdir tells us where to put the new file that we are going to write.
-We don't assume that the conf var ends in a slash, so we test for that and handle both cases.
+    undo_begin(live.file, old);
+    splice_file(live.file, old, text);
+    undo_end();
 
-First we construct a path starting with revdir and ending with an ISO 8601-style compact timestamp like 20240501-210759.
-We then write the contents of the projfile (which has already been updated) into this file (the "rev") using write_to_file().
+    live.size = len(text);
+    live.hash = hash_span(text);
+    live.saves++;
+    unmap_file(text);
+    if (state->current_index >= state->blocks.n) state->current_index = state->blocks.n - 1;
 
-We create a copy of this file at the path for the projfile.
-The file there which may have been edited and contain unsaved changes by some other process.
-So we have a helper function, update_projfile, which takes the projfile index, the path of the rev file, and handles all of this.
+    new_rev(NULL, live.file);
+    if (build.status != BUILD_NONE) compile();
+    return 1;
+}
 
-Finally we unlink the filename that was passed in, since we have now fully processed it.
-The filename is now optional, since we sometimes also are processing clipboard input, so if it is NULL we skip this step.
+int live_pump() {
+    if (live.fd < 0) return 0;
+    int status;
+    if (live.pid > 0 && waitpid(live.pid, &status, WNOHANG) == live.pid) {
+        live.pid = 0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) snprintf(live.message, sizeof(live.message), "liveedit command failed");
+    }
 
-Reminder: we never write `const` in C as it only brings pain.
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int saved = 0;
+    ssize_t n;
+    while ((n = read(live.fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if (event->len && !strcmp(event->name, live.name)) saved = 1;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return saved ? live_apply() : 0;
+}
+
+/*
+print_live_status, in the ruler, shows the live edit session, if there is one, or why the last one stopped.
 */
 
-void update_projfile(int, char*);
+void print_live_status() {
+    if (live.fd >= 0) prt(", Live: %s (%d saves%s%s), E to stop", live.path, live.saves, live.message[0] ? ", " : "", live.message);
+    else if (live.message[0]) prt(", Live: %s", live.message);
+}
+/*
+In wait_for_key, we wait for either a keystroke or a background event (build output or exit, LLM requests making progress, or a live edit being saved), and return the key (as a non-negative int) or -1 if we should just redraw.
 
-void new_rev(char* filename, int file_index) {
-    char rev_path[1024];
-    time_t now = time(NULL);
-    struct tm *tm_now = localtime(&now);
-    int need_slash = state->revdir.end[-1] != '/';
-    snprintf(rev_path, sizeof(rev_path), "%.*s%s%04d%02d%02d-%02d%02d%02d", 
-             (int)(state->revdir.end - state->revdir.buf), state->revdir.buf,
-             need_slash ? "/" : "",
-             tm_now->tm_year + 1900, tm_now->tm_mon + 1, tm_now->tm_mday,
-             tm_now->tm_hour, tm_now->tm_min, tm_now->tm_sec);
+If no build is running, no LLM request is in flight and there is no live edit session, this is just getch().
 
-    write_to_file(state->files.a[file_index].contents, rev_path);
+Otherwise, we put the terminal into the same non-canonical mode that getch() uses (so a single keystroke makes stdin readable), and poll() stdin, the build pipe, the fds of the LLM requests (llm_pollfds) and the live edit inotify fd.
+When the build pipe has gone away but the child hasn't been reaped yet, we poll with a short timeout instead, so we notice it exiting.
+If the build status changes, a request makes progress or a save was applied we return -1; otherwise when stdin is readable we read the key.
+We always restore the terminal settings before returning.
 
-    update_projfile(file_index, rev_path);
+In headless mode, the keys are always ready, so we just give the build and the live edit a chance to make progress with build_pump() and live_pump().
+LLM requests, though, we let run to completion (returning -1 for each bit of progress) before handing out the next key, so that scripts don't race the network.
+*/
 
-    if (filename) {
-        unlink(filename);
+int llm_active();
+int llm_pollfds(struct pollfd* fds);
+int llm_pump();
+
+int wait_for_key() {
+    if (build.status != BUILD_RUNNING && !llm_active() && live.fd < 0) return (u8)getch();
+    if (state->headless) {
+        build_pump();
+        live_pump();
+        if (llm_active()) {
+            struct pollfd fds[LLM_MAX_REQUESTS];
+            poll(fds, llm_pollfds(fds), 100);
+            llm_pump();
+            return -1;
+        }
+        return (u8)getch();
     }
-}
-
-void update_projfile(int file_index, char* rev_path) {
-    char projfile_path[1024];
-    snprintf(projfile_path, sizeof(projfile_path), "%.*s", 
-             (int)(state->files.a[file_index].path.end - state->files.a[file_index].path.buf), 
-             state->files.a[file_index].path.buf);
 
-    // Check if the projfile exists and handle accordingly
-    struct stat statbuf;
-    if (lstat(projfile_path, &statbuf) == 0) {
-        if (S_ISREG(statbuf.st_mode)) {
-            // If it's a regular file, we might want to back it up before overwriting
-            char backup_path[1024];
-            snprintf(backup_path, sizeof(backup_path), "%s.bak", projfile_path);
-            rename(projfile_path, backup_path);
+    struct termios old = {0}, new = {0};
+    if (tcgetattr(0, &old) < 0) perror("tcgetattr()");
+    new = old;
+    new.c_lflag &= ~(ICANON | ECHO);
+    new.c_cc[VMIN] = 1;
+    new.c_cc[VTIME] = 0;
+    if (tcsetattr(0, TCSANOW, &new) < 0) perror("tcsetattr ICANON");
+
+    int result = -1;
+    while (build.status == BUILD_RUNNING || llm_active() || live.fd >= 0) {
+        struct pollfd fds[3 + LLM_MAX_REQUESTS] = {{.fd = STDIN_FILENO, .events = POLLIN}};
+        int nfds = 1;
+        if (build.fd >= 0) fds[nfds++] = (struct pollfd){.fd = build.fd, .events = POLLIN};
+        if (live.fd >= 0) fds[nfds++] = (struct pollfd){.fd = live.fd, .events = POLLIN};
+        nfds += llm_pollfds(fds + nfds);
+        poll(fds, nfds, build.status == BUILD_RUNNING && build.fd < 0 ? 100 : -1);
+        int changed = build_pump();
+        changed |= llm_pump();
+        changed |= live_pump();
+        if (changed) break;
+        if (fds[0].revents & POLLIN) {
+            char c = 0;
+            if (read(0, &c, 1) < 0) perror("read()");
+            result = (u8)c;
+            break;
         }
     }
 
-    // Create or overwrite the projfile with the new revision
-    link(rev_path, projfile_path);
+    if (tcsetattr(0, TCSADRAIN, &old) < 0) perror("tcsetattr ~ICANON");
+    return result;
 }
 /*
-SH_FN_START
+In print_build_status, which is called at the end of the ruler, we show the build status, if any build has been started:
 
-update_symlink() {
-  rm -r cmpr/cmpr.c; ln -s $(cd cmpr; find revs | sort | tail -n1; ) cmpr/cmpr.c
+- running: ", Build: running" (with " (rebuild queued)" if pending)
+- ok: ", Build: ok (3.2s)"
+- failed: ", Build: FAILED, exit 2 (3.2s), L for output"
+*/
+
+void print_build_status() {
+    double secs = (build.finished - build.started) / 1e9;
+    switch (build.status) {
+        case BUILD_RUNNING:
+            prt(", Build: running%s", build.pending ? " (rebuild queued)" : "");
+            break;
+        case BUILD_OK:
+            prt(", Build: ok (%.1fs)", secs);
+            break;
+        case BUILD_FAILED:
+            prt(", Build: FAILED, exit %d (%.1fs), L for output", build.exit_code, secs);
+            break;
+    }
 }
+/*
+In show_build_log we show the captured build output in a full-screen pane, which stays live while the build is running.
 
-SH_FN_END
+The logical lines are the ones in build.line_starts (see #build), except that the first may have started before the oldest byte still in the ring, so we start it there (build_log_line), and that output ending in a newline doesn't have an empty line after it.
+We only copy the lines that are on screen out of the ring, in order, into the cmp space (at cmp_compl(), without advancing cmp.end, since we only need them while drawing).
+
+The pane shows as many lines as fit above a ruler line, wrapping long lines like everywhere else.
+The position is `from_bottom`, the number of logical lines hidden below the bottom of the pane; 0 means we follow the end of the output as it arrives.
+To draw, we walk backwards from the last visible line adding up physical lines until the pane is full, then print forwards from there with print_physical_lines().
+
+Keys (through wait_for_key, so output keeps arriving and being drawn):
+
+- j/k scroll down/up one line, space/b a page down/up, G and g to the end and start
+- q, L or escape go back to the blocks
 */
 
-/* #rewrite_current_block_with_llm
+unsigned long long build_log_line(int k, int nlines) {
+    if (k >= nlines) return build.total;
+    unsigned long long oldest = build.total > BUILD_RING ? build.total - BUILD_RING : 0;
+    unsigned long long start = build.line_starts[build.lines_skip + k];
+    return start < oldest ? oldest : start;
+}
 
-Here we call a helper function with the block contents which returns the top part of the block, which is usually a comment, stripping the rest which is usually code.
-It calls another function to turn this comment part into a prompt.
+void show_build_log() {
+    int from_bottom = 0;
 
-We then call another function which writes that span into a file and calls a user-provided command that places the contents of that file on the clipboard.
+    while (1) {
+        get_screen_dimensions();
+        int rows = state->terminal_rows - 2;
+        if (rows < 1) rows = 1;
+
+        int nlines = build.lines_n - build.lines_skip;
+        if (nlines > 0 && build.line_starts[build.lines_n - 1] == build.total) nlines--;
+
+        if (from_bottom > nlines) from_bottom = nlines;
+        int last = nlines - from_bottom;
+        int top = last;
+        for (int used = 0; top > 0; top--) {
+            long long l = build_log_line(top, nlines) - build_log_line(top - 1, nlines);
+            int phys = l <= 1 ? 1 : (l - 1 + state->terminal_cols - 1) / state->terminal_cols;
+            if (used + phys > rows) break;
+            used += phys;
+        }
 
-Helper functions:
-span block_comment_part(span);
-span comment_to_prompt(span);
-void send_to_clipboard(span);
+        clear_display();
+        prt("Build output (%s)\n", build.status == BUILD_RUNNING ? "running" : build.status == BUILD_OK ? "ok" : build.status == BUILD_FAILED ? "failed" : "no build yet");
+        unsigned long long from = build_log_line(top, nlines), to = build_log_line(last, nlines);
+        span visible = {cmp.end, cmp.end + (to - from)};
+        int at = from % BUILD_RING;
+        int first = BUILD_RING - at < (long long)(to - from) ? BUILD_RING - at : (int)(to - from);
+        memcpy(visible.buf, build.ring + at, first);
+        memcpy(visible.buf + first, build.ring, (to - from) - first);
+        int remaining = rows;
+        while (!empty(visible) && remaining > 0) {
+            span line = next_line(&visible);
+            if (empty(line)) { terpri(); remaining--; continue; }
+            int phys = (len(line) + state->terminal_cols - 1) / state->terminal_cols;
+            if (phys > remaining) phys = remaining;
+            print_physical_lines(line, phys);
+            remaining -= phys;
+        }
+        while (remaining-- > 0) terpri();
+        prt("Lines %d-%d of %d, q to return", top + 1, last, nlines);
+        print_build_status();
+        flush();
+
+        int c = wait_for_key();
+        if (c < 0) continue;
+        if (c == 'q' || c == 'L' || c == 27) break;
+        else if (c == 'j' && from_bottom > 0) from_bottom--;
+        else if (c == 'k') from_bottom++;
+        else if (c == ' ') from_bottom = from_bottom > rows ? from_bottom - rows : 0;
+        else if (c == 'b') from_bottom += rows;
+        else if (c == 'G') from_bottom = 0;
+        else if (c == 'g') from_bottom = nlines;
+    }
+}
+/* #diagnostics
+
+Here we bring compiler errors into the workflow, by mapping the file:line of each diagnostic in the build output to the block that contains it.
+
+The build output arrives in arbitrary chunks as it streams; diag_feed() collects bytes into a partial line (at most DIAG_LINE bytes, the rest of a longer line is dropped) and calls diag_parse_line() on each complete line.
+We recognize:
+
+- gcc/clang style, "path:line:col: severity: message" or "path:line: severity: message", where severity is error, fatal error or warning (notes are skipped),
+- Python tracebacks, "  File "path", line N, in func", which we record as errors with the "in func" part as the message.
+
+The path is resolved to a projfile with diag_file(): either the paths are equal, or one ends with "/" followed by the other (so "cmpr/cmpr.c" matches "cmpr.c", and "./src/x.c" matches "src/x.c"); if several projfiles match we take the first.
+A build can print thousands of lines, so rather than trying every projfile for each one, diag_paths_build() (called from diag_reset, when a build starts) sorts a table of paths once: each projfile's path, marked as full, and every tail of it after a "/", not marked.
+A path from the build then matches a projfile if it is in the table at all (it is the projfile's path or a tail of it), or if one of its own tails after a "/" is there as a full path; each is a binary search.
+Diagnostics for files that aren't in the project are dropped.
+
+Each diagnostic stores the file index, the line and column, the severity, and its message (copied into diags.text, since the build output itself is only kept in a ring).
+We keep the line number rather than an offset or block, since edits move both; the block is worked out when needed:
+
+- file_line_index(i) builds the line-start index for file i if it doesn't have one yet (one pass with memchr), so a line number becomes an offset with one array read,
+- block_in_file(file, p) (see #block_table) finds the block containing an offset, or -1 if there isn't one (the file has no blocks), and then we drop the diagnostic.
+
+diag_refresh() does this for every diagnostic when blocks_version has changed since the last time, then sorts an order array of those that have a block (diags.placed of them) by block and line, so that jumping to the next or previous failing block is a binary search, and the diagnostics for the current block are a contiguous run.
+
+The arrays grow with realloc as needed; diag_reset() (called when a build starts) just sets the counts back to zero.
 */
 
-span block_comment_part(span block);
-span comment_to_prompt(span comment);
-void send_to_clipboard(span prompt);
+#define DIAG_LINE 4096
 
-void rewrite_current_block_with_llm() {
-  if (state->current_index < 0 || state->current_index >= state->blocks.n) {
-    fprintf(stderr, "Invalid block index.\n");
-    return;
-  }
+enum { DIAG_ERROR, DIAG_WARNING };
 
-  // Extract the comment part of the current block
-  span current_block = state->blocks.s[state->current_index];
-  span comment = block_comment_part(current_block);
+typedef struct {
+    int file;
+    int line;
+    int col;
+    int severity;
+    int block;
+    int msg_off;
+    int msg_len;
+} diagnostic;
 
-  if (comment.buf == NULL || len(comment) == 0) {
-    fprintf(stderr, "No comment found in the current block.\n");
-    return;
-  }
+typedef struct {
+    span path;
+    int file;
+    int full;
+} diag_path;
+
+struct {
+    diagnostic* a;
+    int n, cap;
+    int* order;
+    u8* text;
+    int text_len, text_cap;
+    u8 partial[DIAG_LINE];
+    int partial_len;
+    int version, placed;
+    diag_path* paths;
+    int paths_n, paths_cap;
+} diags;
+
+int diag_path_cmp(const void* a, const void* b) {
+    const diag_path* x = a;
+    const diag_path* y = b;
+    int c = span_cmp(x->path, y->path);
+    return c ? c : x->file - y->file;
+}
 
-  // Convert the comment to a prompt
-  span prompt = comment_to_prompt(comment);
-  if (prompt.buf == NULL || len(prompt) == 0) {
-    fprintf(stderr, "Failed to create a prompt from the comment.\n");
-    fflush(stderr);
-    exit(1);
-    return;
-  }
+void diag_path_push(span path, int file, int full) {
+    if (diags.paths_n == diags.paths_cap) {
+        diags.paths_cap = diags.paths_cap ? diags.paths_cap * 2 : 256;
+        diags.paths = realloc(diags.paths, diags.paths_cap * sizeof(diag_path));
+        if (!diags.paths) exit_with_error("Failed to allocate diagnostics");
+    }
+    diags.paths[diags.paths_n++] = (diag_path){path, file, full};
+}
 
-  // Send the prompt to the clipboard
-  send_to_clipboard(prompt);
+void diag_paths_build() {
+    diags.paths_n = 0;
+    for (int i = 0; i < state->files.n; i++) {
+        span fp = state->files.a[i].path;
+        while (consume_prefix(&fp, S("./")));
+        if (empty(fp)) continue;
+        diag_path_push(fp, i, 1);
+        for (u8* p = fp.buf; p < fp.end - 1; p++) {
+            if (*p == '/') diag_path_push((span){p + 1, fp.end}, i, 0);
+        }
+    }
+    qsort(diags.paths, diags.paths_n, sizeof(diag_path), diag_path_cmp);
+}
+
+void diag_reset() {
+    diags.n = 0;
+    diags.text_len = 0;
+    diags.partial_len = 0;
+    diags.version = -1;
+    diag_paths_build();
+}
+
+ssize_t* file_line_index(int file_index) {
+    projfile* f = &state->files.a[file_index];
+    if (f->line_starts) return f->line_starts;
+    ssize_t n = 1;
+    for (u8* p = f->contents.buf; (p = memchr(p, '\n', f->contents.end - p)); p++) n++;
+    f->line_starts = malloc((n + 1) * sizeof(ssize_t));
+    if (!f->line_starts) exit_with_error("Failed to allocate line index");
+    f->line_starts[0] = 0;
+    ssize_t i = 1;
+    for (u8* p = f->contents.buf; (p = memchr(p, '\n', f->contents.end - p)); p++) f->line_starts[i++] = p + 1 - f->contents.buf;
+    f->line_starts[n] = f->contents.end - f->contents.buf;
+    f->nlines = n;
+    return f->line_starts;
+}
+
+int diag_path_find(span path, int full_only) {
+    int lo = 0, hi = diags.paths_n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (span_cmp(diags.paths[mid].path, path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < diags.paths_n && span_eq(diags.paths[lo].path, path); lo++) {
+        if (!full_only || diags.paths[lo].full) return diags.paths[lo].file;
+    }
+    return -1;
 }
 
-/*
-To split out the block_comment_part of a span, we first write two helper functions, one for C and one for Python.
+int diag_file(span path) {
+    while (consume_prefix(&path, S("./")));
+    if (empty(path)) return -1;
+    int file = diag_path_find(path, 0);
+    for (u8* p = path.buf; p < path.end - 1; p++) {
+        if (*p != '/') continue;
+        int f = diag_path_find((span){p + 1, path.end}, 1);
+        if (f >= 0 && (file < 0 || f < file)) file = f;
+    }
+    return file;
+}
 
-Then we dispatch based on the language on the projfile which we lookup using file_for_block().
-If this span contains "Python" we call the Python version, and otherwise we call the C version (which therefore is our default).
+void diag_add(span path, int line, int col, int severity, span msg) {
+    int file = diag_file(path);
+    if (file < 0 || line < 1) return;
+    if (diags.n == diags.cap) {
+        diags.cap = diags.cap ? diags.cap * 2 : 256;
+        diags.a = realloc(diags.a, diags.cap * sizeof(diagnostic));
+        diags.order = realloc(diags.order, diags.cap * sizeof(int));
+        if (!diags.a || !diags.order) exit_with_error("Failed to allocate diagnostics");
+    }
+    if (diags.text_len + len(msg) > diags.text_cap) {
+        diags.text_cap = (diags.text_cap + len(msg)) * 2;
+        diags.text = realloc(diags.text, diags.text_cap);
+        if (!diags.text) exit_with_error("Failed to allocate diagnostics");
+    }
+    memcpy(diags.text + diags.text_len, msg.buf, len(msg));
+    diags.a[diags.n++] = (diagnostic){.file = file, .line = line, .col = col, .severity = severity,
+                                      .block = -1, .msg_off = diags.text_len, .msg_len = len(msg)};
+    diags.text_len += len(msg);
+    diags.version = -1;
+}
 
-The helper function takes a span and returns an index offset to the location of the "block comment part terminator".
-For Python this is the second occurrence of the triple doublequote in the block, and for C it is star slash.
+int diag_number(span* s) {
+    int n = 0, digits = 0;
+    while (!empty(*s) && isdigit(*s->buf)) { n = n * 10 + (*s->buf - '0'); s->buf++; digits++; }
+    return digits ? n : -1;
+}
 
-In the main function block_comment_part, we return the span up to and including the comment part terminator, and also including any newlines and whitespace after it.
-*/
+void diag_parse_line(span line) {
+    span rest = line;
+    if (consume_prefix(&rest, S("  File \""))) {
+        int q = find_char(rest, '"');
+        if (q < 0) return;
+        span path = first_n(rest, q);
+        rest.buf += q + 1;
+        if (!consume_prefix(&rest, S(", line "))) return;
+        int n = diag_number(&rest);
+        consume_prefix(&rest, S(", "));
+        diag_add(path, n, 0, DIAG_ERROR, rest);
+        return;
+    }
 
-int find_block_comment_end_c(span block) {
-    for (int i = 0; i < len(block) - 1; ++i) {
-        if (block.buf[i] == '*' && block.buf[i + 1] == '/') {
-            return i + 2; // Include the "*/" in the index
+    for (u8* p = line.buf; p < line.end; p++) {
+        if (*p != ':' || p + 1 >= line.end || !isdigit(p[1])) continue;
+        span path = {line.buf, p};
+        rest = (span){p + 1, line.end};
+        int n = diag_number(&rest);
+        if (!consume_prefix(&rest, S(":"))) continue;
+        int col = 0;
+        if (!empty(rest) && isdigit(*rest.buf)) {
+            col = diag_number(&rest);
+            if (!consume_prefix(&rest, S(":"))) continue;
         }
+        while (!empty(rest) && *rest.buf == ' ') rest.buf++;
+        int severity;
+        if (consume_prefix(&rest, S("error:")) || consume_prefix(&rest, S("fatal error:"))) severity = DIAG_ERROR;
+        else if (consume_prefix(&rest, S("warning:"))) severity = DIAG_WARNING;
+        else return;
+        while (!empty(rest) && *rest.buf == ' ') rest.buf++;
+        diag_add(path, n, col, severity, rest);
+        return;
     }
-    return len(block);
 }
 
-int find_block_comment_end_python(span block) {
-    int quote_count = 0;
-    for (int i = 0; i < len(block) - 2; ++i) {
-        if (block.buf[i] == '"' && block.buf[i + 1] == '"' && block.buf[i + 2] == '"') {
-            quote_count++;
-            if (quote_count == 2) { // Second occurrence
-                return i + 3; // Include the """ in the index
-            }
-            i += 2; // Skip past this quote
+void diag_feed(span data) {
+    for (u8* p = data.buf; p < data.end; p++) {
+        if (*p == '\n') {
+            diag_parse_line((span){diags.partial, diags.partial + diags.partial_len});
+            diags.partial_len = 0;
+        } else if (diags.partial_len < DIAG_LINE) {
+            diags.partial[diags.partial_len++] = *p;
         }
     }
-    return len(block);
 }
 
-span block_comment_part(span block) {
-    int file_index = file_for_block(block);
-    span language = state->files.a[file_index].language;
-    int index;
+int diag_cmp(const void* a, const void* b) {
+    diagnostic* x = &diags.a[*(int*)a];
+    diagnostic* y = &diags.a[*(int*)b];
+    if (x->block != y->block) return x->block - y->block;
+    if (x->line != y->line) return x->line - y->line;
+    return *(int*)a - *(int*)b;
+}
 
-    if (span_eq(language, S("Python"))) {
-        index = find_block_comment_end_python(block);
-    } else { // Default to C
-        index = find_block_comment_end_c(block);
+void diag_refresh() {
+    if (diags.version == state->blocks_version) return;
+    diags.placed = 0;
+    for (int i = 0; i < diags.n; i++) {
+        diagnostic* d = &diags.a[i];
+        projfile* f = &state->files.a[d->file];
+        ssize_t* starts = file_line_index(d->file);
+        ssize_t line = d->line <= f->nlines ? d->line : f->nlines;
+        d->block = block_in_file(d->file, f->contents.buf + starts[line - 1]);
+        if (d->block >= 0) diags.order[diags.placed++] = i;
     }
+    qsort(diags.order, diags.placed, sizeof(int), diag_cmp);
+    diags.version = state->blocks_version;
+}
 
-    // Include any newlines and whitespace after the terminator
-    while (index < len(block) && isspace(block.buf[index])) {
-        ++index;
+/*
+In diag_jump we move to the next (direction 1) or previous (-1) block, from the current one, that has a diagnostic, wrapping around at the ends.
+We binary search the sorted order (diag_first_from, which finds the first diagnostic in the given block or any later one) for the first diagnostic in a block after the current one (or the last one before it).
+If there are no diagnostics we do nothing.
+
+In print_block_diags, part of the ruler, we show how many errors and warnings the last build reported in the current block, followed by the first of them (line and message, cut short at 60 chars).
+The current block's diagnostics are the contiguous run that diag_first_from finds the start of, so we only count along that run.
+*/
+
+int diag_first_from(int block) {
+    int lo = 0, hi = diags.placed;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (diags.a[diags.order[mid]].block < block) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
+}
 
-    return (span){block.buf, block.buf + index};
+void diag_jump(int direction) {
+    diag_refresh();
+    if (!diags.placed) return;
+    int cur = state->current_index;
+    int lo = diag_first_from(direction > 0 ? cur + 1 : cur);
+    int k = direction > 0 ? (lo < diags.placed ? lo : 0) : (lo > 0 ? lo - 1 : diags.placed - 1);
+    state->current_index = diags.a[diags.order[k]].block;
+    state->scrolled_lines = 0;
 }
-/*
-In comment_to_prompt, we use the cmp space to construct a prompt around the given block comment.
 
-First we should create our return span and assign .buf to the cmp.end location.
+void print_block_diags() {
+    diag_refresh();
+    int errors = 0, warnings = 0;
+    int first = diag_first_from(state->current_index);
+    for (int k = first; k < diags.placed && diags.a[diags.order[k]].block == state->current_index; k++) {
+        if (diags.a[diags.order[k]].severity == DIAG_ERROR) errors++;
+        else warnings++;
+    }
+    if (!errors && !warnings) return;
+    diagnostic* d = &diags.a[diags.order[first]];
+    prt(", %d errors, %d warnings: %d: %.*s", errors, warnings, d->line, d->msg_len < 60 ? d->msg_len : 60, diags.text + d->msg_off);
+}
+/* #diff
 
-Then we call prt2cmp.
+The "d" key shows how the current block differs from its most recent earlier version.
 
-Next we prt the literal string "```c\n".
-Then we use wrs to write the span passed in as our argument.
-Finally we write "```\n\n" and an instruction, which is usually "Write the code. Reply only with code. Do not include comments.".
+Finding the earlier version:
 
-Next we call prt2std to go back to the normal output mode.
+The revlog in revdir (written by new_rev) lists every rev with its projfile path, oldest first.
+We map it (map_file) and walk it from the end, and for each rev of the current block's file (at most DIFF_MAX_REVS of them) we map the rev and find its blocks with find_blocks_by_type.
+Revs are never copied into inp; the mapped rev is released when we move on to an older one or leave the view.
 
-Then we can get the new end of cmp and make that the end of our return span so that we return everything written into the cmp space.
-*/
+To find "the same block" in the old rev we use the block hashes (see #block_table):
 
-span comment_to_prompt(span comment) {
-  // Prepare the return span to capture the start of new content in cmp
-  span return_span;
-  return_span.buf = cmp.end;
+- if some old block hashes the same as the current block, the block didn't change in that rev and we keep going back (the newest rev usually is the current contents, since every edit in cmpr writes one),
+- otherwise we look for the old block that follows a block hashing the same as our previous neighbour, or precedes one hashing the same as our next neighbour, preferring the one nearest our own position in the file,
+- failing both, we take the block at the same position (clamped to the old file), which is right when the block was edited along with both its neighbours.
 
-  // Switch to writing in the cmp space
-  prt2cmp();
+(If nothing in the revlog differs we also try the projfile's ".bak", see diff_find_old_block.)
 
-  // Start writing the prompt
-  /* *** manual fixup *** */
-  int index = file_for_block(comment);
-  span lang = state->files.a[index].language;
-  if (span_eq(lang, S("Python"))) {
-    prt("```python\n");
-    wrs(comment);
-    prt("```\n\nWrite the code. Reply only with code. Avoid using the code_interpreter.\n");
-  } else {
-    prt("```c\n"); // Begin code block
-    wrs(comment);  // Write the comment span
-    prt("```\n\nWrite the code. Reply only with code. Do not include comments.\n"); // End code block and add instruction
-  }
+The diff:
 
-  // Switch back to standard output space to avoid side-effects
-  prt2std();
+Each line (without its newline) is hashed with hash_span, so from here on the comparison is between u64s only.
+diff_compare is the linear-space Myers algorithm (as in GNU diff): trim the common prefix and suffix, and if one side is then empty, the rest of the other side is all inserted or deleted; otherwise diff_midpoint finds a point on a shortest edit path about half way along it, by running the forward and backward searches towards each other, and we recurse on the two halves.
+The result is a flag per line, del[] for old lines and ins[] for new lines, marking the lines not in common.
 
-  // Capture the end of the new content written into cmp
-  return_span.end = cmp.end;
+To stay interactive on blocks with tens of thousands of lines, diff_midpoint gives up on finding the exact middle after DIFF_MAX_COST steps and takes whichever of the two searches has got furthest (the diff is then still correct, just possibly not minimal).
+If that point is a corner (so we wouldn't make progress) we mark the whole remaining range as changed.
 
-  return return_span;
-}
-/*
-In send_to_clipboard, we are given a span and we must send it to the clipboard using a user-provided method, since this varies quite a bit between environments.
+The view:
 
-There is a global ui_state* variable "state" with a span cbcopy on it.
+diff_rows turns the flags into rows {old line, new line}, with -1 for a missing side.
+In unified mode a deleted line is {i, -1} and an inserted one {-1, j}; in side-by-side mode, within each run of changes the k-th deleted line is paired with the k-th inserted line.
+We only keep rows within DIFF_CONTEXT rows of a change, and start each group with a hunk header row {-2, -2} (printed as "@@ -old +new @@" with the line numbers of its first row, one-based within the block).
 
-Before we do anything else we ensure this is set by calling ensure_conf_var with the message "The command to pipe data to the clipboard on your system. For Mac try \"pbcopy\", Linux \"xclip -i -selection clipboard\", Windows please let me know and I'll add something here".
+show_block_diff shows it in a scrollable pane (diff_pane) like show_build_log: j/k scroll a line, space/b a page, g/G to the top or bottom, s switches between unified and side-by-side, and q, d or Esc return.
+Lines are cut at the terminal width (or half of it side by side).
+*/
 
-We run this as a command and pass the span data to its stdin.
-We use the `s()` library method and heap buffer pattern to get a null-terminated string for popen from our span conf var.
+#define DIFF_MAX_REVS 64
+#define DIFF_MAX_COST 1024
+#define DIFF_CONTEXT 3
 
-We complain and exit if anything goes wrong as per usual.
-*/
+typedef struct {
+    u64* a;
+    u64* b;
+    u8* del;
+    u8* ins;
+    int* fd;
+    int* bd;
+} diff_state;
+
+typedef struct { int a; int b; } diff_row;
+
+int diff_midpoint(diff_state* ds, int xoff, int xlim, int yoff, int ylim, int* xmid, int* ymid) {
+    int* fd = ds->fd;
+    int* bd = ds->bd;
+    int dmin = xoff - ylim, dmax = xlim - yoff;
+    int fmid = xoff - yoff, bmid = xlim - ylim;
+    int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    int odd = (fmid - bmid) & 1;
+    fd[fmid] = xoff;
+    bd[bmid] = xlim;
+
+    for (int c = 1;; c++) {
+        if (fmin > dmin) fd[--fmin - 1] = -1;
+        else ++fmin;
+        if (fmax < dmax) fd[++fmax + 1] = -1;
+        else --fmax;
+        for (int d = fmax; d >= fmin; d -= 2) {
+            int lo = fd[d - 1], hi = fd[d + 1];
+            int x = lo >= hi ? lo + 1 : hi;
+            int y = x - d;
+            while (x < xlim && y < ylim && ds->a[x] == ds->b[y]) x++, y++;
+            fd[d] = x;
+            if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+                *xmid = x;
+                *ymid = y;
+                return 1;
+            }
+        }
 
-void send_to_clipboard(span content) {
-    ensure_conf_var(&(state->cbcopy), S("The command to pipe data to the clipboard on your system. For Mac try \"pbcopy\", Linux \"xclip -i -selection clipboard\", Windows please let me know and I'll add something here"), S(""));
+        if (bmin > dmin) bd[--bmin - 1] = INT_MAX;
+        else ++bmin;
+        if (bmax < dmax) bd[++bmax + 1] = INT_MAX;
+        else --bmax;
+        for (int d = bmax; d >= bmin; d -= 2) {
+            int lo = bd[d - 1], hi = bd[d + 1];
+            int x = lo < hi ? lo : hi - 1;
+            int y = x - d;
+            while (x > xoff && y > yoff && ds->a[x - 1] == ds->b[y - 1]) x--, y--;
+            bd[d] = x;
+            if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+                *xmid = x;
+                *ymid = y;
+                return 1;
+            }
+        }
+
+        if (c >= DIFF_MAX_COST) {
+            int fbest = -1, fx = 0, bbest = INT_MAX, bx = 0;
+            for (int d = fmax; d >= fmin; d -= 2) {
+                int x = fd[d] < xlim ? fd[d] : xlim;
+                if (x - d > ylim) x = ylim + d;
+                if (x + x - d > fbest) fbest = x + x - d, fx = x;
+            }
+            for (int d = bmax; d >= bmin; d -= 2) {
+                int x = bd[d] > xoff ? bd[d] : xoff;
+                if (x - d < yoff) x = yoff + d;
+                if (x + x - d < bbest) bbest = x + x - d, bx = x;
+            }
+            if ((xlim + ylim) - bbest < fbest - (xoff + yoff)) {
+                *xmid = fx;
+                *ymid = fbest - fx;
+            } else {
+                *xmid = bx;
+                *ymid = bbest - bx;
+            }
+            return 0;
+        }
+    }
+}
 
-    char command[2048];
-    snprintf(command, sizeof(command), "%.*s", (int)(state->cbcopy.end - state->cbcopy.buf), state->cbcopy.buf);
+void diff_compare(diff_state* ds, int xoff, int xlim, int yoff, int ylim) {
+    while (xoff < xlim && yoff < ylim && ds->a[xoff] == ds->b[yoff]) xoff++, yoff++;
+    while (xlim > xoff && ylim > yoff && ds->a[xlim - 1] == ds->b[ylim - 1]) xlim--, ylim--;
 
-    FILE* pipe = popen(command, "w");
-    if (!pipe) {
-        perror("Failed to open pipe for clipboard command");
-        exit(EXIT_FAILURE);
+    if (xoff == xlim || yoff == ylim) {
+        memset(ds->del + xoff, 1, xlim - xoff);
+        memset(ds->ins + yoff, 1, ylim - yoff);
+        return;
     }
 
-    fwrite(content.buf, sizeof(char), content.end - content.buf, pipe);
+    int xmid, ymid;
+    diff_midpoint(ds, xoff, xlim, yoff, ylim, &xmid, &ymid);
+    if ((xmid == xoff && ymid == yoff) || (xmid == xlim && ymid == ylim)) {
+        memset(ds->del + xoff, 1, xlim - xoff);
+        memset(ds->ins + yoff, 1, ylim - yoff);
+        return;
+    }
+    diff_compare(ds, xoff, xmid, yoff, ymid);
+    diff_compare(ds, xmid, xlim, ymid, ylim);
+}
 
-    if (pclose(pipe) != 0) {
-        perror("Failed to execute clipboard command");
-        exit(EXIT_FAILURE);
+int diff_split_lines(span text, span** lines, u64** hashes) {
+    int n = 0;
+    for (span rest = text; !empty(rest); n++) next_line(&rest);
+    *lines = malloc((n + 1) * sizeof(span));
+    *hashes = malloc((n + 1) * sizeof(u64));
+    if (!*lines || !*hashes) exit_with_error("Failed to allocate diff lines");
+    n = 0;
+    for (span rest = text; !empty(rest); n++) {
+        (*lines)[n] = next_line(&rest);
+        (*hashes)[n] = hash_span((*lines)[n]);
     }
+    return n;
 }
-/* #compile()
 
-In compile(), we take the state and execute buildcmd, which is a config parameter.
+int diff_rows(diff_state* ds, int n, int m, int side_by_side, diff_row* all, diff_row* rows) {
+    int r = 0, i = 0, j = 0;
+    while (i < n || j < m) {
+        if ((i < n && ds->del[i]) || (j < m && ds->ins[j])) {
+            int di = i, dj = j;
+            while (di < n && ds->del[di]) di++;
+            while (dj < m && ds->ins[dj]) dj++;
+            if (side_by_side) {
+                while (i < di || j < dj) all[r++] = (diff_row){i < di ? i++ : -1, j < dj ? j++ : -1};
+            } else {
+                while (i < di) all[r++] = (diff_row){i++, -1};
+                while (j < dj) all[r++] = (diff_row){-1, j++};
+            }
+        } else {
+            all[r++] = (diff_row){i++, j++};
+        }
+    }
 
-First we call ensure_conf_var(state->buildcmd), since we are about to use that setting.
+    // near[k] is the distance from row k to the nearest changed row, looking both ways
+    int* near = malloc((r + 1) * sizeof(int));
+    if (!near) exit_with_error("Failed to allocate diff rows");
+    for (int k = 0, last = -r - DIFF_CONTEXT - 1; k < r; k++) {
+        if (all[k].a < 0 || all[k].b < 0 || ds->del[all[k].a]) last = k;
+        near[k] = k - last;
+    }
+    for (int k = r - 1, next = 2 * r + DIFF_CONTEXT + 1; k >= 0; k--) {
+        if (all[k].a < 0 || all[k].b < 0 || ds->del[all[k].a]) next = k;
+        if (next - k < near[k]) near[k] = next - k;
+    }
+
+    int kept = 0;
+    for (int k = 0; k < r; k++) {
+        if (near[k] > DIFF_CONTEXT) continue;
+        if (k == 0 || near[k - 1] > DIFF_CONTEXT) rows[kept++] = (diff_row){-2, -2};
+        rows[kept++] = all[k];
+    }
+    free(near);
+    return kept;
+}
+
+/*
+diff_find_old_block does the search through the revlog described above, trying each rev with diff_try_rev.
+If no rev in the revlog differs, as a last resort we try the projfile's ".bak" file, which update_projfile leaves behind holding the previous contents of the projfile (this is the only earlier version of a file that has never been edited in cmpr before, or whose revs predate the revlog).
+
+diff_try_rev maps the file at path and looks for the block in it as described; if it finds a differing version it returns it and leaves the rev mapped in *mapped (for the caller to unmap_file), otherwise it unmaps it and returns nullspan().
+*/
+
+span diff_try_rev(char* path, span* mapped) {
+    int cur = state->current_index;
+    int file_index = block_table.file[cur];
+    int first = block_table.first[file_index], last = block_table.first[file_index + 1] - 1;
+    int pos = cur - first;
+    span rev = map_file(path);
+    if (empty(rev)) return nullspan();
+
+    span_arena_push();
+    spans old = find_blocks_by_type(rev, state->files.a[file_index].language);
+    int found = -1, same = 0, best = INT_MAX;
+    u64 prev = pos > 0 ? block_table.hash[cur - 1] : 0;
+    u64 next = cur < last ? block_table.hash[cur + 1] : 0;
+    u64* h = malloc((old.n + 1) * sizeof(u64));
+    if (!h) exit_with_error("Failed to allocate diff hashes");
+    for (int j = 0; j < old.n; j++) {
+        h[j] = hash_span(old.s[j]);
+        if (h[j] == block_table.hash[cur]) same = 1;
+    }
+    for (int j = 0; j < old.n && !same; j++) {
+        int matches = (pos > 0 && j > 0 && h[j - 1] == prev) || (cur < last && j + 1 < old.n && h[j + 1] == next);
+        if (matches && abs(j - pos) < best) {
+            best = abs(j - pos);
+            found = j;
+        }
+    }
+    if (!same && found < 0 && old.n > 0) found = cur == last ? old.n - 1 : pos < old.n ? pos : old.n - 1;
+    free(h);
 
-Next we print the command that we are going to run and flush, so the user sees something before the compiler process, which may be slow to produce output.
+    span result = nullspan();
+    if (!same && found >= 0) {
+        result = old.s[found];
+        *mapped = rev;
+    } else {
+        unmap_file(rev);
+    }
+    span_arena_pop();
+    return result;
+}
 
-Then we use system(3) on a 2048-char buf which we allocate and statically zero.
-Our s() interface (s(char*,int,span)) lets us set buildcmd as a null-terminated string beginning at buf.
+span diff_find_old_block(span* mapped, char* rev_name, int name_size, int* searched) {
+    span path = state->files.a[block_table.file[state->current_index]].path;
+    int need_slash = state->revdir.end[-1] != '/';
+    char buf[2048];
+    *searched = 0;
+    *mapped = nullspan();
+
+    snprintf(buf, sizeof(buf), "%.*s%srevlog", len(state->revdir), state->revdir.buf, need_slash ? "/" : "");
+    span revlog = map_file(buf);
+    span result = nullspan();
+
+    u8* end = revlog.end;
+    while (end > revlog.buf && *searched < DIFF_MAX_REVS && empty(result)) {
+        u8* start = end - 1;
+        while (start > revlog.buf && start[-1] != '\n') start--;
+        span line = {start, end};
+        end = start;
+        if (!empty(line) && line.end[-1] == '\n') line.end--;
+        int sp = find_char(line, ' ');
+        if (sp < 0 || !span_eq((span){line.buf + sp + 1, line.end}, path)) continue;
+
+        span name = first_n(line, sp);
+        snprintf(buf, sizeof(buf), "%.*s%s%.*s", len(state->revdir), state->revdir.buf, need_slash ? "/" : "", len(name), name.buf);
+        (*searched)++;
+        result = diff_try_rev(buf, mapped);
+        snprintf(rev_name, name_size, "%.*s", len(name), name.buf);
+    }
+    unmap_file(revlog);
 
-We wait for another keystroke before returning if the compiler process fails, so the user can read the compiler errors (later we'll handle them better).
-(Remember to call flush() before getch() so the user sees the prompt (which is "Build failed, press any key to continue...").)
+    if (empty(result)) {
+        snprintf(buf, sizeof(buf), "%.*s.bak", len(path), path.buf);
+        (*searched)++;
+        result = diff_try_rev(buf, mapped);
+        snprintf(rev_name, name_size, "%s", buf);
+    }
+    return result;
+}
 
-On the other hand, if the build succeeds, we don't need the extra keystroke and go back to the main loop after a 1s delay so the user has time to read the success message before the main loop refreshes the current block.
-In this case we prt "Build succeeded" on a line.
+void diff_print_cut(span line, int width) {
+    int n = len(line) < width ? len(line) : width;
+    wrs(first_n(line, n));
+    for (int k = n; k < width; k++) sp();
+}
 
-(We aren't doing this yet, but later we'll put something on the state to provide more status info to the user.)
+/*
+diff_pane shows the diff of old_block against new_block in the scrollable pane described above, with title (and the line counts) at the top and hint after the row counts at the bottom.
+It returns the key that closed it: q, d or Esc, or any of the keys in exits, which the history view (#history) uses for its own keys.
 */
 
-void compile() {
-    ensure_conf_var(&state->buildcmd, S("The build command will be run every time you hit 'b' and should build the code you are editing (typically in projfile)"), nullspan());
-    
-    char buf[2048] = {0};
-    s(buf, sizeof(buf), state->buildcmd);
-    
-    prt("Running command: %s\n", buf);
-    flush();
-    
-    int status = system(buf);
-    
-    if (status != 0) {
-        prt("Build failed, press any key to continue...\n");
+int diff_pane(span old_block, span new_block, char* title, char* hint, char* exits) {
+    span* old_lines;
+    span* new_lines;
+    diff_state ds = {0};
+    int n = diff_split_lines(old_block, &old_lines, &ds.a);
+    int m = diff_split_lines(new_block, &new_lines, &ds.b);
+    ds.del = calloc(n + 1, 1);
+    ds.ins = calloc(m + 1, 1);
+    ds.fd = malloc((2 * (n + m) + 5) * sizeof(int));
+    ds.bd = malloc((2 * (n + m) + 5) * sizeof(int));
+    diff_row* all = malloc((n + m + 1) * sizeof(diff_row));
+    diff_row* rows = malloc((2 * (n + m) + 2) * sizeof(diff_row));
+    if (!ds.del || !ds.ins || !ds.fd || !ds.bd || !all || !rows) exit_with_error("Failed to allocate diff");
+    int* fd_base = ds.fd;
+    int* bd_base = ds.bd;
+    ds.fd += m + 2;
+    ds.bd += m + 2;
+    diff_compare(&ds, 0, n, 0, m);
+
+    int removed = 0, added = 0;
+    for (int i = 0; i < n; i++) removed += ds.del[i];
+    for (int j = 0; j < m; j++) added += ds.ins[j];
+
+    int side_by_side = 0, top = 0, c;
+    int nrows = diff_rows(&ds, n, m, side_by_side, all, rows);
+    while (1) {
+        get_screen_dimensions();
+        int height = state->terminal_rows - 2;
+        if (height < 1) height = 1;
+        if (top > nrows - height) top = nrows - height;
+        if (top < 0) top = 0;
+
+        clear_display();
+        prt("%s: -%d +%d lines\n", title, removed, added);
+        int half = (state->terminal_cols - 3) / 2;
+        for (int k = top; k < top + height; k++) {
+            if (k >= nrows) {
+                terpri();
+                continue;
+            }
+            diff_row row = rows[k];
+            if (row.a == -2) {
+                diff_row first = rows[k + 1];
+                int oi = first.a, nj = first.b;
+                for (int q = k + 1; q < nrows && (oi < 0 || nj < 0) && rows[q].a != -2; q++) {
+                    if (oi < 0) oi = rows[q].a;
+                    if (nj < 0) nj = rows[q].b;
+                }
+                prt("@@ -%d +%d @@\n", oi + 1, nj + 1);
+            } else if (side_by_side) {
+                int changed = row.a < 0 || row.b < 0 || ds.del[row.a];
+                diff_print_cut(row.a >= 0 ? old_lines[row.a] : nullspan(), half);
+                prt(changed ? " | " : "   ");
+                diff_print_cut(row.b >= 0 ? new_lines[row.b] : nullspan(), half);
+                terpri();
+            } else {
+                span line = row.b >= 0 ? new_lines[row.b] : old_lines[row.a];
+                prt(row.a < 0 ? "+ " : row.b < 0 ? "- " : "  ");
+                wrs(first_n(line, len(line) < state->terminal_cols - 2 ? len(line) : state->terminal_cols - 2));
+                terpri();
+            }
+        }
+        prt("Rows %d-%d of %d, s for %s, q to return%s", nrows ? top + 1 : 0, top + height < nrows ? top + height : nrows, nrows, side_by_side ? "unified" : "side-by-side", hint);
         flush();
-        getch();
-    } else {
-        prt("Build succeeded\n");
+
+        c = wait_for_key();
+        if (c < 0) continue;
+        if (c == 'q' || c == 'd' || c == 27 || (c && strchr(exits, c))) break;
+        else if (c == 'j') top++;
+        else if (c == 'k') top--;
+        else if (c == ' ') top += height;
+        else if (c == 'b') top -= height;
+        else if (c == 'g') top = 0;
+        else if (c == 'G') top = nrows;
+        else if (c == 's') {
+            side_by_side = !side_by_side;
+            nrows = diff_rows(&ds, n, m, side_by_side, all, rows);
+            top = 0;
+        }
+    }
+
+    free(old_lines);
+    free(new_lines);
+    free(ds.a);
+    free(ds.b);
+    free(ds.del);
+    free(ds.ins);
+    free(fd_base);
+    free(bd_base);
+    free(all);
+    free(rows);
+    return c;
+}
+
+void show_block_diff() {
+    span mapped;
+    char rev_name[256];
+    int searched;
+    span old_block = diff_find_old_block(&mapped, rev_name, sizeof(rev_name), &searched);
+    if (empty(old_block)) {
+        clear_display();
+        prt("No earlier version of block %d differs from the current one (%d revs searched).\n", state->current_index + 1, searched);
+        prt("Press any key to return...\n");
         flush();
-        sleep(1); // Give time for the user to read the message
+        getch();
+        return;
     }
+
+    char title[512];
+    snprintf(title, sizeof(title), "Block %d against rev %s", state->current_index + 1, rev_name);
+    diff_pane(old_block, state->blocks.s[state->current_index], title, "", "");
+    unmap_file(mapped);
 }
 /*
 In replace_code_clipboard, we pipe in the result of running state->cbpaste.
 
 First we call ensure_conf_var with the message "Command to get text from the clipboard on your platform (Mac: pbpaste, Linux: try xclip -o -selection clipboard, Windows: ???)".
 
-This will contain a command like "xclip -o -selection clipboard" (our default) or "pbpaste" on Mac, and comes from our conf file.
+This will contain a command like "xclip -o -selection clipboard" (our default) or "pbpaste" on Mac, and comes from our conf file; it can also name one of the other transports (see #clipboard_transport).
 
 We use the cmp buffer to store this data, starting from cmp.end (which is always somewhere before the end of the cmp space big buffer).
 
 The space that we can use is the difference between cmp_space + BUF_SZ, which locates the end of the cmp_space, and cmp.end, which is always less than this limit.
 
-We then create a span, which is pointing into cmp, capturing the new data we just captured.
+clip_receive() reads the clipboard into this space and returns a span, pointing into cmp, capturing the new data we just captured.
+If it fails (the span has a NULL .buf), the ruler shows why and we leave the block alone.
 
 We call another function, replace_block_code_part(span) which takes this new span and the current state.
 It is responsible for all further processing, notifications to the user, etc.
@@ -2324,32 +7747,20 @@ This invalidates the span we created, but that's fine since it's about to go out
 void replace_block_code_part(span new_code);
 
 void replace_code_clipboard() {
+    TRACE_SCOPE(replace_code_clipboard);
     ensure_conf_var(&(state->cbpaste), S("Command to get text from the clipboard on your platform (Mac: pbpaste, Linux: try xclip -o -selection clipboard, Windows: \?\?\?)"), S(""));
-    char command[2048];
-    snprintf(command, sizeof(command), "%.*s", (int)(state->cbpaste.end - state->cbpaste.buf), state->cbpaste.buf);
 
-    FILE* pipe = popen(command, "r");
-    if (!pipe) {
-        perror("Failed to open clipboard paste command");
-        exit(EXIT_FAILURE);
-    }
-
-    span buffer = cmp_compl();
-    size_t bytes_read = fread(buffer.buf, 1, buffer.end - buffer.buf, pipe);
-    if (ferror(pipe)) {
-        perror("Failed to read clipboard content");
-        pclose(pipe);
-        exit(EXIT_FAILURE);
-    }
-    pclose(pipe);
-
-    span new_code = {buffer.buf, buffer.buf + bytes_read};
+    span new_code = clip_receive(state->cbpaste, cmp_compl());
+    if (!new_code.buf) return; // clip_error says why, in the ruler
     replace_block_code_part(new_code);
 }
 /* #replace_block_code_part(span)
 
 Here we get a span (into cmp space) which contains a new code part for the current block.
 
+The work is done by splice_block_code_part(block_index, span), which does everything below except the rev, and returns 1 if inp changed (0 for a no-op); this lets a batch of LLM replies (see #llm_batch) splice many blocks and write one rev per file at the end.
+replace_block_code_part is then just the splice on the current block, plus new_rev if it changed anything.
+
 Note: To get the length of a span, use len().
 Note: Do this every time, not the just the first time.
 
@@ -2359,13 +7770,14 @@ We put the original block's span in a local variable for convenience.
 
 The end result of inp should contain:
 - the contents of inp currently, up to the start (the .buf) of the original block.
-- the comment part of the current block, which we can get from block_comment_part on the current block.
+- the comment part of the current block, which we can get from block_comment on the current block index.
 - up to two newlines unless the block comment part already ends with them
 - the code part coming from the clipboard in our second argument
 - current contents of inp from the .end of the original block to the inp.end of original input.
 
 So, first we check whether we are adding one, zero, or two newlines, being careful about SEGV.
-We get the index of the projfile from file_for_block.
+If the new block would be the same length as the old one, we hash the three pieces of the new block (streaming them through one hasher, without building the new block anywhere) and compare with block_table.hash; if they match and the code part bytes are equal, the paste changes nothing and we return without touching inp or writing a rev.
+We get the index of the projfile from block_table.file.
 Then we check the length of what the new block will be (comment part + opt. newlines + new part).
 We then compare this to the old block length and do a memmove if necessary on the "rest" of inp, so that we have a gap to accommodate the new block's len.
 Then we simply copy any newlines and the new code into inp.
@@ -2373,15 +7785,17 @@ Then we simply copy any newlines and the new code into inp.
 
 We then must update the .end of the current file contents, and both the .buf and .end of all subsequent projfiles, since the block length may have changed and therefore the file contents lengths will have also changed.
 
-As before we then find the current locations of the blocks.
+If the file is windowed (see #windowed) we do none of this in inp; the comment part, newlines and new code go to window_splice as three spans instead.
+
+As before we then find the current locations of the blocks, with reindex_file().
 
 Once all this is done, we call new_rev, passing NULL for the filename argument, since there's no filename here.
 */
 
-void replace_block_code_part(span new_code) {
-    int file_index = file_for_block(state->blocks.s[state->current_index]);
-    span original_block = state->blocks.s[state->current_index];
-    span comment_part = block_comment_part(original_block);
+int splice_block_code_part(int block_index, span new_code) {
+    int file_index = block_table.file[block_index];
+    span original_block = state->blocks.s[block_index];
+    span comment_part = block_comment(block_index);
 
     int newlines_needed = 2;
     if (len(comment_part) > 0 && comment_part.end[-1] == '\n') {
@@ -2394,6 +7808,26 @@ void replace_block_code_part(span new_code) {
     size_t new_block_length = len(comment_part) + newlines_needed + len(new_code);
     ssize_t size_diff = new_block_length - (original_block.end - original_block.buf);
 
+    if (size_diff == 0) {
+        hasher hs;
+        hash_init(&hs);
+        hash_update(&hs, comment_part);
+        hash_update(&hs, first_n(S("\n\n"), newlines_needed));
+        hash_update(&hs, new_code);
+        span old_code = {comment_part.end + newlines_needed, original_block.end};
+        if (hash_final(&hs) == block_table.hash[block_index] && span_eq(old_code, new_code)) {
+            return 0;
+        }
+    }
+
+    undo_begin(file_index, original_block);
+    if (state->files.a[file_index].windowed) {
+        span parts[3] = {comment_part, first_n(S("\n\n"), newlines_needed), new_code};
+        window_splice(file_index, original_block, parts, 3);
+        undo_end();
+        return 1;
+    }
+
     if (size_diff != 0) {
         memmove(original_block.end + size_diff, original_block.end, inp.end - original_block.end);
     }
@@ -2408,25 +7842,478 @@ void replace_block_code_part(span new_code) {
     // Update inp.end to reflect the new size
     inp.end += size_diff;
 
-    // Update the contents span of the current and subsequent files
+    // Update the contents span of the current and subsequent files (but not windowed ones, which are not in inp)
     state->files.a[file_index].contents.end += size_diff;
     for (int i = file_index + 1; i < state->files.n; ++i) {
+        if (state->files.a[i].windowed) continue;
         state->files.a[i].contents.buf += size_diff;
         state->files.a[i].contents.end += size_diff;
     }
 
-    // Re-find all the blocks since inp has changed
-    find_all_blocks();
+    // Re-find the blocks of this file and shift the rest, since inp has changed
+    reindex_file(file_index, size_diff);
+    undo_end();
+    return 1;
+}
+
+void replace_block_code_part(span new_code) {
+    TRACE_SCOPE(replace_block_code_part);
+    int file_index = block_table.file[state->current_index];
 
     // Store a new revision, no filename required
+    if (splice_block_code_part(state->current_index, new_code)) new_rev(NULL, file_index);
+}
+/* #undo
+
+Every edit that goes through us (e, E, R, and the LLM rewrites, one by one or in a batch) is recorded, so that "u" can take it back and Ctrl-R put it back again, without going to the revs.
+
+An edit record (undo_record) says which file, where in it (offset), and the bytes that were there before (old) and after (new).
+The bytes live in one append-only store (undo.store), and a record only has their offsets and lengths there, so undoing or redoing is one splice straight out of the store (splice_file, see #windowed), of the bytes of that one block, then reindex_file and a rev, as for any other edit.
+When the same block is edited again, its old bytes are the new bytes of the edit before, so we point at those rather than storing them a second time.
+
+Recording is two calls around the splice, in handle_edited_file, splice_block_code_part and live_apply:
+
+- undo_begin, before the splice, copies the old bytes into the store (or finds them there already), and notes the file and its length,
+- undo_end, after it, works out how long the new text is from how much the file grew or shrank, and copies it in from the file's contents.
+
+The records are a stack, with undo.at the number of them that are done: "u" undoes record at - 1, and Ctrl-R redoes record at; a new edit drops any records after at, as in any editor.
+Before splicing we check that the bytes we are about to replace are still the ones the record expects (someone may have changed the file on disk, or a live edit may have been applied while its record was undone); if they aren't, we leave everything alone and say so in the ruler.
+Like the edits, an undo or redo writes a rev, so the revs still have every state the file has been in.
+
+The history uses at most undomax megabytes (conf var, default 64): when the store would outgrow that we forget the oldest records, and move the bytes that are still used to the front of the store.
+Since the store is append-only, and each record's old bytes come before its new ones, the oldest byte still used is the old bytes of the oldest record we keep.
+An edit too big to fit at all clears the history, since the history would have a gap in it.
+*/
+
+typedef struct {
+    int file;
+    size_t offset;
+    size_t old_at, old_len;
+    size_t new_at, new_len;
+} undo_record;
+
+struct {
+    u8* store;
+    size_t store_n, store_cap;
+    undo_record* a;
+    int n, at, cap;
+    int pending;
+    undo_record rec;
+    size_t file_len;
+    char message[256];
+} undo;
+
+size_t undo_budget() {
+    char buf[32] = {0};
+    s(buf, sizeof(buf), state->undomax);
+    long mb = atol(buf);
+    if (mb <= 0) mb = 64;
+    return (size_t)mb << 20;
+}
+
+void undo_clear() {
+    undo.n = undo.at = 0;
+    undo.store_n = 0;
+    undo.pending = 0;
+}
+
+/*
+undo_append copies bytes to the end of the store and returns where they went, first making room by forgetting the oldest records if the store would go over budget (keeping the record being made, whose old bytes are already in the store); it returns -1 if the bytes can't fit even then.
+*/
+
+ssize_t undo_append(span bytes) {
+    size_t need = bytes.end - bytes.buf, budget = undo_budget();
+    size_t keep = undo.pending ? undo.rec.old_at : undo.store_n;
+    int drop = 0;
+    size_t base = undo.n ? undo.a[0].old_at : keep;
+    while (undo.store_n - base + need > budget && drop < undo.n) {
+        drop++;
+        base = drop < undo.n ? undo.a[drop].old_at : keep;
+    }
+    if (undo.store_n - base + need > budget) return -1;
+    if (base) {
+        memmove(undo.store, undo.store + base, undo.store_n - base);
+        undo.store_n -= base;
+        memmove(undo.a, undo.a + drop, (undo.n - drop) * sizeof(undo_record));
+        undo.n -= drop;
+        undo.at -= drop;
+        for (int i = 0; i < undo.n; i++) {
+            undo.a[i].old_at -= base;
+            undo.a[i].new_at -= base;
+        }
+        if (undo.pending) undo.rec.old_at -= base;
+    }
+    if (undo.store_n + need > undo.store_cap) {
+        size_t cap = undo.store_cap ? undo.store_cap * 2 : 1 << 16;
+        while (cap < undo.store_n + need) cap *= 2;
+        if (cap > budget) cap = budget;
+        undo.store = realloc(undo.store, cap);
+        if (!undo.store) exit_with_error("Failed to allocate undo history");
+        undo.store_cap = cap;
+    }
+    size_t at = undo.store_n;
+    memcpy(undo.store + at, bytes.buf, need);
+    undo.store_n += need;
+    return at;
+}
+
+void undo_begin(int file_index, span old) {
+    projfile* f = &state->files.a[file_index];
+    undo.n = undo.at;
+    undo.store_n = undo.n ? undo.a[undo.n - 1].new_at + undo.a[undo.n - 1].new_len : 0;
+    undo.rec = (undo_record){.file = file_index, .offset = old.buf - f->contents.buf, .old_len = old.end - old.buf};
+    undo.file_len = f->contents.end - f->contents.buf;
+    undo.message[0] = 0;
+
+    undo_record* last = undo.n ? &undo.a[undo.n - 1] : NULL;
+    if (last && last->file == file_index && last->offset == undo.rec.offset && last->new_len == undo.rec.old_len
+        && !memcmp(undo.store + last->new_at, old.buf, undo.rec.old_len)) {
+        undo.rec.old_at = last->new_at;
+        undo.pending = 1;
+        return;
+    }
+    ssize_t at = undo_append(old);
+    if (at < 0) {
+        undo_clear();
+        return;
+    }
+    undo.rec.old_at = at;
+    undo.pending = 1;
+}
+
+void undo_end() {
+    if (!undo.pending) return;
+    projfile* f = &state->files.a[undo.rec.file];
+    undo.rec.new_len = (f->contents.end - f->contents.buf) - undo.file_len + undo.rec.old_len;
+    u8* p = f->contents.buf + undo.rec.offset;
+    ssize_t at = undo_append((span){p, p + undo.rec.new_len});
+    if (at < 0) {
+        undo_clear();
+        return;
+    }
+    undo.rec.new_at = at;
+    undo.pending = 0;
+    if (undo.n == undo.cap) {
+        undo.cap = undo.cap ? undo.cap * 2 : 64;
+        undo.a = realloc(undo.a, undo.cap * sizeof(undo_record));
+        if (!undo.a) exit_with_error("Failed to allocate undo history");
+    }
+    undo.a[undo.n++] = undo.rec;
+    undo.at = undo.n;
+}
+
+/*
+undo_step undoes the last edit (redo 0, "u") or redoes the next one (redo 1, Ctrl-R), as described above, and goes to the block where it was.
+*/
+
+void undo_step(int redo) {
+    TRACE_SCOPE(undo_step);
+    if (redo ? undo.at == undo.n : undo.at == 0) {
+        snprintf(undo.message, sizeof(undo.message), "nothing to %s", redo ? "redo" : "undo");
+        return;
+    }
+    undo_record* r = &undo.a[redo ? undo.at : undo.at - 1];
+    projfile* f = &state->files.a[r->file];
+    span expect = redo ? (span){undo.store + r->old_at, undo.store + r->old_at + r->old_len} : (span){undo.store + r->new_at, undo.store + r->new_at + r->new_len};
+    span want = redo ? (span){undo.store + r->new_at, undo.store + r->new_at + r->new_len} : (span){undo.store + r->old_at, undo.store + r->old_at + r->old_len};
+    span current = {f->contents.buf + r->offset, f->contents.buf + r->offset + len(expect)};
+    if (current.end > f->contents.end || !span_eq(current, expect)) {
+        snprintf(undo.message, sizeof(undo.message), "the text has changed since, can't %s", redo ? "redo" : "undo");
+        return;
+    }
+
+    splice_file(r->file, current, want);
+    new_rev(NULL, r->file);
+    undo.at += redo ? 1 : -1;
+    int b = block_in_file(r->file, f->contents.buf + r->offset);
+    if (b >= 0) state->current_index = b;
+    else if (state->current_index >= state->blocks.n) state->current_index = state->blocks.n - 1;
+    state->scrolled_lines = 0;
+    snprintf(undo.message, sizeof(undo.message), "%s, %d more to undo, %d to redo", redo ? "redone" : "undone", undo.at, undo.n - undo.at);
+}
+
+/*
+print_undo_status shows in the ruler what the last u or Ctrl-R did, until the next edit.
+*/
+
+void print_undo_status() {
+    if (undo.message[0]) prt(", Undo: %s", undo.message);
+}
+/* #history
+
+The "H" key opens the history of the current block: its earlier versions, newest first, each shown as a diff (diff_pane, see #diff) against the version after it, and any of them can be put back with one key.
+
+A version is a rev in which the block differs from the next newer version; revs in which the block didn't change (because some other block of the file was edited) are passed over.
+We walk the revlog from the end, as diff_find_old_block does, but lazily: history_more finds just the next older version, and is only called when the user steps past the oldest one found so far, so opening the view costs about as much as "d", and a block with thousands of revs behind it is only walked as far as the user goes.
+
+Locating the block in each rev without scanning it:
+
+We keep the newest file version visited so far (history.base: the projfile contents at first, then a rev), and where the block is in it (off and blen), along with its hash and its neighbours' hashes (see #block_table).
+For the next older rev we find how many leading and trailing bytes it has in common with base (memcmp, a page at a time); since each edit writes a rev, consecutive revs of a file usually differ in one place only.
+
+- If the block and the line after it (which begins the next block) are in the common prefix, the block is unchanged and at the same offset.
+- If the block and the newline before it are in the common suffix, the block is unchanged and has moved by the difference in file sizes.
+- Otherwise the edit touched the block or its boundary, and only then do we find the rev's blocks (find_blocks_by_type) and hash them: a block hashing the same as ours means ours is unchanged, but moved; failing that we match by neighbour hashes, or position, exactly as diff_try_rev does, and that block is an older version.
+
+A rev is mapped (map_file) while we look at it, and stays mapped only while it is base or holds a version we found; never copied into inp.
+If the revlog has no revs of the file at all we try the projfile's ".bak", as diff_find_old_block does (otherwise the .bak is just the contents before the last rev, which the revs already have).
+
+The view:
+
+The title says which version we're on, how many we've found (with a "+" while there may be more), and how many revs we looked at to find them.
+On top of diff_pane's keys, p steps to the next older version and n back to the newer one, c switches between diffing against the next newer version (what that edit changed) and against the current block (what restoring it would change), and r restores the version shown.
+Restoring is like any other edit: splice_file with the version's bytes, recorded for undo (#undo), and a rev, so "u" takes it back again.
+*/
+
+#define HISTORY_NAME 256
+
+typedef struct {
+    char rev[HISTORY_NAME]; // rev name, or "" for the current block
+    span mapped;            // the rev, for unmap_file (nullspan() for the current block)
+    span block;
+} history_version;
+
+struct {
+    history_version* v; // v[0] is the current block, then older versions, newest first
+    int n, cap;
+    int file_index;
+    span revlog;
+    u8* cursor;         // the revlog lines before this are still to be walked
+    int searched, scanned, done;
+    span base;          // the newest file version visited, with the block at off, blen bytes long
+    int base_mapped;    // base is a rev we mapped and no version holds
+    size_t off, blen;
+    u64 hash, prev, next;
+    int pos, last;
+} history;
+
+/*
+history_common returns the number of bytes at the start (or at the end, if backwards) that a and b have in common, comparing at most n.
+*/
+
+size_t history_common(u8* a, u8* b, size_t n, int backwards) {
+    size_t k = 0;
+    while (k + 4096 <= n && !memcmp(backwards ? a - k - 4096 : a + k, backwards ? b - k - 4096 : b + k, 4096)) k += 4096;
+    while (k < n && (backwards ? a[-1 - (ssize_t)k] == b[-1 - (ssize_t)k] : a[k] == b[k])) k++;
+    return k;
+}
+
+void history_add(char* name, span mapped, span block) {
+    if (history.n == history.cap) {
+        history.cap = history.cap ? history.cap * 2 : 16;
+        history.v = realloc(history.v, history.cap * sizeof(history_version));
+        if (!history.v) exit_with_error("Failed to allocate history");
+    }
+    history_version* v = &history.v[history.n++];
+    snprintf(v->rev, sizeof(v->rev), "%s", name);
+    v->mapped = mapped;
+    v->block = block;
+}
+
+/*
+history_scan finds the block in rev by hashing the rev's blocks, as described above.
+It returns 1 and adds the version if the block differs there, or 0 if the block is unchanged; either way it moves our idea of where the block is (and its neighbours) to rev.
+*/
+
+int history_scan(span rev, char* name) {
+    history.scanned++;
+    span_arena_push();
+    spans old = find_blocks_by_type(rev, state->files.a[history.file_index].language);
+    u64* h = malloc((old.n + 1) * sizeof(u64));
+    if (!h) exit_with_error("Failed to allocate history hashes");
+    int same = -1, found = -1, best = INT_MAX;
+    for (int j = 0; j < old.n; j++) {
+        h[j] = hash_span(old.s[j]);
+        if (h[j] == history.hash && (same < 0 || abs(j - history.pos) < abs(same - history.pos))) same = j;
+    }
+    for (int j = 0; j < old.n && same < 0; j++) {
+        int matches = (history.pos > 0 && j > 0 && h[j - 1] == history.prev) || (!history.last && j + 1 < old.n && h[j + 1] == history.next);
+        if (matches && abs(j - history.pos) < best) {
+            best = abs(j - history.pos);
+            found = j;
+        }
+    }
+    if (same < 0 && found < 0 && old.n > 0) found = history.last ? old.n - 1 : history.pos < old.n ? history.pos : old.n - 1;
+
+    int j = same >= 0 ? same : found;
+    if (j >= 0) {
+        history.off = old.s[j].buf - rev.buf;
+        history.blen = len(old.s[j]);
+        history.hash = h[j];
+        history.prev = j > 0 ? h[j - 1] : 0;
+        history.next = j + 1 < old.n ? h[j + 1] : 0;
+        history.pos = j;
+        history.last = j == old.n - 1;
+    }
+    if (same < 0 && found >= 0) history_add(name, rev, old.s[found]);
+    free(h);
+    span_arena_pop();
+    return same < 0 && found >= 0;
+}
+
+/*
+history_try maps the rev at path (named name in the view) and compares it with base, as described above, falling back on history_scan.
+It returns 1 if the rev holds an older version of the block (which is then added to history.v, and keeps the rev mapped).
+*/
+
+int history_try(char* path, char* name) {
+    span rev = map_file(path);
+    if (empty(rev)) return 0;
+    history.searched++;
+
+    span base = history.base;
+    size_t nb = len(base), nr = len(rev), lim = nb < nr ? nb : nr;
+    size_t p = history_common(base.buf, rev.buf, lim, 0);
+    size_t s = history_common(base.end, rev.end, lim - p, 1);
+    size_t end = history.off + history.blen, line_end = end;
+    while (line_end < nb && base.buf[line_end] != '\n') line_end++;
+    if (line_end < nb) line_end++;
+
+    int added = 0;
+    if ((line_end < nb && line_end <= p) || (p == nb && nb == nr)) {
+        // unchanged, at the same offset
+    } else if (history.off > 0 && history.off - 1 >= nb - s) {
+        history.off = history.off + nr - nb;
+    } else {
+        added = history_scan(rev, name);
+    }
+
+    if (history.base_mapped) unmap_file(history.base);
+    history.base = rev;
+    history.base_mapped = !added;
+    return added;
+}
+
+/*
+history_more walks the revlog further back until it finds the next older version of the block, and returns 1 if it found one, or 0 if there are no more.
+*/
+
+int history_more() {
+    span path = state->files.a[history.file_index].path;
+    int need_slash = state->revdir.end[-1] != '/';
+    char buf[2048];
+    while (history.cursor > history.revlog.buf) {
+        u8* start = history.cursor - 1;
+        while (start > history.revlog.buf && start[-1] != '\n') start--;
+        span line = {start, history.cursor};
+        history.cursor = start;
+        if (!empty(line) && line.end[-1] == '\n') line.end--;
+        int sp = find_char(line, ' ');
+        if (sp < 0 || !span_eq((span){line.buf + sp + 1, line.end}, path)) continue;
+
+        char name[HISTORY_NAME];
+        snprintf(name, sizeof(name), "%.*s", sp, line.buf);
+        snprintf(buf, sizeof(buf), "%.*s%s%s", len(state->revdir), state->revdir.buf, need_slash ? "/" : "", name);
+        if (history_try(buf, name)) return 1;
+    }
+    if (history.done) return 0;
+    history.done = 1;
+    if (history.searched) return 0;
+    snprintf(buf, sizeof(buf), "%.*s.bak", len(path), path.buf);
+    return history_try(buf, buf);
+}
+
+void history_open() {
+    int cur = state->current_index;
+    int file_index = block_table.file[cur];
+    int first = block_table.first[file_index], last = block_table.first[file_index + 1] - 1;
+    span block = state->blocks.s[cur];
+    char buf[2048];
+
+    history.n = 0;
+    history.file_index = file_index;
+    history.searched = history.scanned = history.done = 0;
+    history_add("", nullspan(), block);
+
+    history.base = state->files.a[file_index].contents;
+    history.base_mapped = 0;
+    history.off = block.buf - history.base.buf;
+    history.blen = len(block);
+    history.hash = block_table.hash[cur];
+    history.prev = cur > first ? block_table.hash[cur - 1] : 0;
+    history.next = cur < last ? block_table.hash[cur + 1] : 0;
+    history.pos = cur - first;
+    history.last = cur == last;
+
+    snprintf(buf, sizeof(buf), "%.*s%srevlog", len(state->revdir), state->revdir.buf, state->revdir.end[-1] != '/' ? "/" : "");
+    history.revlog = map_file(buf);
+    history.cursor = history.revlog.end;
+}
+
+void history_close() {
+    for (int k = 1; k < history.n; k++) unmap_file(history.v[k].mapped);
+    if (history.base_mapped) unmap_file(history.base);
+    unmap_file(history.revlog);
+    history.n = 0;
+}
+
+/*
+history_restore puts version k back in place of the current block, as described above.
+*/
+
+void history_restore(int k) {
+    int cur = state->current_index;
+    int file_index = history.file_index;
+    projfile* f = &state->files.a[file_index];
+    span block = state->blocks.s[cur];
+    if (span_eq(block, history.v[k].block)) {
+        snprintf(undo.message, sizeof(undo.message), "rev %.200s is the same as the current block", history.v[k].rev);
+        return;
+    }
+    size_t offset = block.buf - f->contents.buf;
+    undo_begin(file_index, block);
+    splice_file(file_index, block, history.v[k].block);
+    undo_end();
     new_rev(NULL, file_index);
+    state->current_index = block_in_file(file_index, f->contents.buf + offset);
+    state->scrolled_lines = 0;
+    snprintf(undo.message, sizeof(undo.message), "restored block from rev %.200s, u to undo", history.v[k].rev);
+}
+
+void show_block_history() {
+    TRACE_SCOPE(show_block_history);
+    history_open();
+    if (!history_more()) {
+        clear_display();
+        prt("No earlier version of block %d differs from the current one (%d revs searched).\n", state->current_index + 1, history.searched);
+        prt("Press any key to return...\n");
+        flush();
+        getch();
+        history_close();
+        return;
+    }
+
+    int k = 1, against_current = 0;
+    char title[1024];
+    while (1) {
+        history.v[0].block = state->blocks.s[state->current_index];
+        history_version* older = &history.v[k];
+        history_version* newer = against_current ? &history.v[0] : &history.v[k - 1];
+        snprintf(title, sizeof(title), "Block %d, version %d of %d%s (rev %s, %d revs searched) against %s%s", state->current_index + 1, k, history.n - 1,
+            history.done ? "" : "+", older->rev, history.searched,
+            newer->rev[0] ? "rev " : "the current block", newer->rev);
+        int c = diff_pane(older->block, newer->block, title, ", p/n older/newer, c against current, r to restore", "pncrH");
+        if (c == 'p') {
+            if (k + 1 < history.n || history_more()) k++;
+        } else if (c == 'n') {
+            if (k > 1) k--;
+        } else if (c == 'c') {
+            against_current = !against_current;
+        } else if (c == 'r') {
+            history_restore(k);
+            break;
+        } else {
+            break;
+        }
+    }
+    history_close();
 }
 /* cmpr_init
 We are called without args and set up some configuration and empty directories to prepare the CWD for use as a cmpr project.
 
 In sh terms:
 
-- mkdir -p .cmpr/{,revs,tmp}
+- mkdir -p .cmpr/{,revs,tmp,cache}
 - touch .cmpr/conf
 
 Note that if the CWD is already initialized this is a no-op i.e. the init is idempotent (up to file access times and similar).
@@ -2436,6 +8323,7 @@ void cmpr_init() {
     mkdir(".cmpr", 0755);
     mkdir(".cmpr/revs", 0755);
     mkdir(".cmpr/tmp", 0755);
+    mkdir(".cmpr/cache", 0755);
 
     FILE *file = fopen(".cmpr/conf", "a");
     if (file != NULL) {
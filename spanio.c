@@ -14,9 +14,12 @@ We ALWAYS use spanio methods when possible and never use null-terminated C strin
 - `sp()`: Appends a space character to the output span.
 - `terpri()`: Appends a newline character to the output span.
 - `flush()`, `flush_err()`, `flush_to(char*)`: Flushes the output span to standard output, standard error, or a specified file.
+- `flush_reset()`: Flushes to stdout and rewinds out, for streaming any amount of output in constant memory.
 - `write_to_file(span, const char*)`: Writes the contents of a span to a specified file.
 - `read_file_into_span(char*, span)`: Reads the contents of a file into a span.
 - `read_file_S_into_span(span, span)`: Ibid, but taking the filename as a span.
+- `map_file(char*)`, `unmap_file(span)`: Map a file read-only and return its contents as a span (nullspan() if it can't be opened or is empty), and unmap it again.
+- `write_spans(int, span*, int)`: Write several spans to a file descriptor with writev (no copying them together first), returning 0, or -1 on error with errno set.
 - `redir(span)`, `reset()`: Redirects output to a new span and resets it to the previous output span.
 - `save()`, `push(span)`, `pop(span*)`, `pop_into_span()`: Manipulates a stack for saving and restoring spans.
 - `advance1(span*)`, `advance(span*, int)`: Advances the start pointer of a span by one or a specified number of characters.
@@ -37,6 +40,8 @@ We ALWAYS use spanio methods when possible and never use null-terminated C strin
 - `is_one_of(span, spans)`: Checks if a span is one of the spans in a spans.
 - `spanspan(span, span)`: Finds the first occurrence of a span within another span and returns a span into haystack.
 - `w_char_esc(char)`, `w_char_esc_pad(char)`, `w_char_esc_dq(char)`, `w_char_esc_sq(char)`, `wrs_esc()`: Write characters (or in the case of wrs, spans) to out, the output span, applying various escape sequences as needed.
+- `hash_span(span)`, `hash_init(hasher*)`, `hash_update(hasher*, span)`, `hash_final(hasher*)`: A fast non-cryptographic 64-bit hash, all at once or streamed in pieces (same result however the input is split).
+- `TRACE_SCOPE(name)`, `TRACE_BEGIN(name)`, `TRACE_END(name)`, `trace_dump(char*)`: Hot-path tracing, compiled in only with -DCMPR_TRACE.
 
 typedef struct { u8* buf; u8* end; } span; // reminder of the type of span
 
@@ -91,6 +96,18 @@ A common idiom is next_line() in a loop with !empty().
 #include <errno.h>
 #include <time.h>
 #include <math.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <dirent.h>
 /* convenient debugging macros */
 #define dbgd(x) prt(#x ": %d\n", x),flush()
 #define dbgx(x) prt(#x ": %x\n", x),flush()
@@ -98,6 +115,105 @@ A common idiom is next_line() in a loop with !empty().
 #define dbgp(x) prt(#x ": %p\n", x),flush()
 
 typedef unsigned char u8;
+typedef unsigned long long u64;
+
+/* #trace
+
+Compile-time tracing of hot paths.
+
+Build with -DCMPR_TRACE to enable; without it every macro below expands to nothing, so there is no cost at all in normal builds.
+
+- TRACE_SCOPE(name) times from where it appears to the end of the enclosing C scope (using the cleanup attribute), so early returns are covered.
+- TRACE_BEGIN(name) and TRACE_END(name) bracket a region explicitly within one function; the name must match.
+
+The name is a bare identifier, e.g. TRACE_SCOPE(find_all_blocks), which becomes the event name in the trace.
+
+Each thread gets its own ring buffer of TRACE_RING complete events (name, start, duration) in CLOCK_MONOTONIC nanoseconds, allocated on its first event and registered in a global table so that trace_dump can find every thread's ring.
+Writing an event is two clock reads and a store; when the ring is full we overwrite the oldest events.
+We record "complete" events rather than separate begin and end events, so a wrapped ring never contains half a pair.
+
+trace_dump(char* path) writes all rings as Chrome trace-event JSON (load it in chrome://tracing or Perfetto).
+Timestamps are in microseconds relative to the first recorded event.
+*/
+
+#ifdef CMPR_TRACE
+
+#define TRACE_RING (1 << 16)
+#define TRACE_MAX_THREADS 256
+
+typedef struct { char* name; long long start; long long dur; } trace_event;
+typedef struct { trace_event ev[TRACE_RING]; unsigned long long n; int tid; } trace_ring;
+typedef struct { char* name; long long start; } trace_scope;
+
+trace_ring* trace_rings[TRACE_MAX_THREADS];
+int trace_nrings;
+__thread trace_ring* trace_my_ring;
+
+long long trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_record(char* name, long long start) {
+  long long end = trace_now();
+  if (!trace_my_ring) {
+    int slot = __atomic_fetch_add(&trace_nrings, 1, __ATOMIC_RELAXED);
+    if (slot >= TRACE_MAX_THREADS) return;
+    trace_my_ring = calloc(1, sizeof(trace_ring));
+    if (!trace_my_ring) return;
+    trace_my_ring->tid = slot + 1;
+    __atomic_store_n(&trace_rings[slot], trace_my_ring, __ATOMIC_RELEASE);
+  }
+  trace_event* e = &trace_my_ring->ev[trace_my_ring->n++ % TRACE_RING];
+  e->name = name;
+  e->start = start;
+  e->dur = end - start;
+}
+
+void trace_scope_end(trace_scope* s) { trace_record(s->name, s->start); }
+
+#define TRACE_SCOPE(name) trace_scope trace_scope_##name __attribute__((cleanup(trace_scope_end))) = {#name, trace_now()}
+#define TRACE_BEGIN(name) long long trace_begin_##name = trace_now()
+#define TRACE_END(name) trace_record(#name, trace_begin_##name)
+
+void trace_dump(char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) { perror("Failed to open trace file"); return; }
+  int nrings = trace_nrings < TRACE_MAX_THREADS ? trace_nrings : TRACE_MAX_THREADS;
+  long long t0 = LLONG_MAX;
+  for (int r = 0; r < nrings; r++) {
+    trace_ring* ring = __atomic_load_n(&trace_rings[r], __ATOMIC_ACQUIRE);
+    if (!ring) continue;
+    unsigned long long first = ring->n > TRACE_RING ? ring->n - TRACE_RING : 0;
+    for (unsigned long long i = first; i < ring->n; i++) {
+      if (ring->ev[i % TRACE_RING].start < t0) t0 = ring->ev[i % TRACE_RING].start;
+    }
+  }
+  fprintf(f, "{\"traceEvents\":[");
+  int comma = 0;
+  for (int r = 0; r < nrings; r++) {
+    trace_ring* ring = __atomic_load_n(&trace_rings[r], __ATOMIC_ACQUIRE);
+    if (!ring) continue;
+    unsigned long long first = ring->n > TRACE_RING ? ring->n - TRACE_RING : 0;
+    for (unsigned long long i = first; i < ring->n; i++) {
+      trace_event* e = &ring->ev[i % TRACE_RING];
+      fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+              comma ? "," : "", e->name, (e->start - t0) / 1e3, e->dur / 1e3, (int)getpid(), ring->tid);
+      comma = 1;
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+}
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+
+#endif
 
 /* span
 
@@ -157,7 +273,11 @@ void terpri();
 void flush();
 void flush_err();
 void flush_to(char*);
+void flush_reset();
 void write_to_file(span content, const char* filename);
+span map_file(char*);
+void unmap_file(span);
+int write_spans(int, span*, int);
 span read_file_into_span(char *filename, span buffer);
 void redir(span);
 span reset();
@@ -182,6 +302,13 @@ int span_cmp(span, span);
 span S(char*);
 span nullspan();
 
+typedef struct { u64 h; u64 tail; int ntail; u64 n; } hasher;
+
+void hash_init(hasher*);
+void hash_update(hasher*, span);
+u64 hash_final(hasher*);
+u64 hash_span(span);
+
 typedef struct {
   span *s; // array of spans (points into span arena)
   int n;   // length of array
@@ -386,6 +513,7 @@ void wrs_esc(span s) {
 }
 
 void flush() {
+  TRACE_SCOPE(flush);
   if (out_WRITTEN < len(out)) {
     printf("%.*s", len(out) - out_WRITTEN, out.buf + out_WRITTEN);
     out_WRITTEN = len(out);
@@ -403,7 +531,7 @@ void flush_err() {
 
 void flush_to(char *fname) {
   int fd = open(fname, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-  dprintf(fd, "%*s", len(out) - out_WRITTEN, out.buf + out_WRITTEN);
+  dprintf(fd, "%.*s", len(out) - out_WRITTEN, out.buf + out_WRITTEN);
   //out_WRITTEN = len(out);
   // reset for constant memory usage
   out_WRITTEN = 0;
@@ -412,6 +540,16 @@ void flush_to(char *fname) {
   close(fd);
 }
 
+/* flush_reset is flush, followed by rewinding out to the start of its space, like flush_to does.
+This is for streaming output of any size in constant memory, so it must only be used when nothing else holds spans into out.
+*/
+
+void flush_reset() {
+  flush();
+  out_WRITTEN = 0;
+  out.end = out.buf;
+}
+
 /* 
 In write_to_file we open a file, which must not exist, and write the contents of a span into it, and close it.
 If the file exists or there is any other error, we prt(), flush(), and exit as per usual.
@@ -442,9 +580,8 @@ void write_to_file_2(span content, const char* filename, int clobber) {
     exit(EXIT_FAILURE);
   }
 
-  // Write the content of the span to the file
-  ssize_t written = write(fd, content.buf, len(content));
-  if (written != len(content)) {
+  // Write the content of the span to the file (write_spans loops over short writes)
+  if (write_spans(fd, &content, 1) < 0) {
     // Handle partial write or write error
     prt("Error writing to file %s.\n", filename);
     flush();
@@ -520,6 +657,63 @@ span read_file_into_span(char* filename, span buffer) {
   return new_span;
 }
 
+/*
+map_file is for reading files we only look at, such as old revs, without copying them into one of our spaces.
+Unlike read_file_into_span, failing to open the file is not fatal: the caller gets nullspan() and decides what to do (an empty file also gives nullspan(), since it can't be mapped).
+The span stays valid until unmap_file, which accepts nullspan() too.
+A mapped file can be bigger than an int, so here (and in write_spans) we take sizes from the pointers rather than len().
+*/
+
+span map_file(char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return nullspan();
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) == -1 || statbuf.st_size == 0) {
+    close(fd);
+    return nullspan();
+  }
+  u8* p = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return nullspan();
+  return (span){p, p + statbuf.st_size};
+}
+
+void unmap_file(span mapped) {
+  if (mapped.buf) munmap(mapped.buf, mapped.end - mapped.buf);
+}
+
+/*
+write_spans writes n spans to fd, in order, straight from wherever they are (e.g. a header we just formatted, followed by a big span in cmp), with writev.
+writev may write less than everything, so we loop, advancing past what was written, until it's all out; EINTR we retry, other errors we return to the caller as -1.
+*/
+
+int write_spans(int fd, span* parts, int n) {
+  struct iovec iov[16];
+  assert(n <= 16);
+  for (int i = 0; i < n; i++) iov[i] = (struct iovec){parts[i].buf, parts[i].end - parts[i].buf};
+  struct iovec* v = iov;
+  while (n > 0) {
+    if (v->iov_len == 0) {
+      v++, n--;
+      continue;
+    }
+    ssize_t written = writev(fd, v, n);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)written >= v->iov_len) {
+      written -= v->iov_len;
+      v++, n--;
+    }
+    if (n > 0) {
+      v->iov_base = (u8*)v->iov_base + written;
+      v->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
 u8 *save_stack[16] = {0};
 int save_count = 0;
 
@@ -853,6 +1047,75 @@ span out_compl() {
   return compl;
 }
 
+/* #hash
+
+A fast non-cryptographic 64-bit hash, for noticing when bytes have (or haven't) changed.
+
+We take the input eight bytes at a time as words (memcpy, so any alignment is fine; the leftover bytes are assembled little-endian to match, which is the byte order of every machine we run on), scramble each word with a multiply and rotate, and fold it into the state with another rotate and multiply.
+At the end, the zero-padded leftover bytes are folded in the same way, then the total length, and a final avalanche (the murmur3 finalizer) so every input bit affects every output bit.
+
+The streaming form keeps up to seven leftover bytes in tail between calls to hash_update, so the result only depends on the bytes, not on how they were split up; hash_span(s) is just init, update, final.
+*/
+
+#define HASH_K1 0x87c37b91114253d5ull
+#define HASH_K2 0x9e3779b97f4a7c15ull
+
+u64 hash_rotl(u64 x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+u64 hash_word(u64 h, u64 w) {
+  w = hash_rotl(w * HASH_K1, 31) * HASH_K2;
+  return hash_rotl(h ^ w, 27) * HASH_K1 + HASH_K2;
+}
+
+void hash_init(hasher* hs) {
+  hs->h = HASH_K2;
+  hs->tail = 0;
+  hs->ntail = 0;
+  hs->n = 0;
+}
+
+void hash_update(hasher* hs, span s) {
+  u8* p = s.buf;
+  hs->n += len(s);
+  while (hs->ntail && p < s.end) {
+    hs->tail |= (u64)*p++ << (8 * hs->ntail);
+    if (++hs->ntail == 8) {
+      hs->h = hash_word(hs->h, hs->tail);
+      hs->tail = 0;
+      hs->ntail = 0;
+    }
+  }
+  u64 h = hs->h;
+  for (; s.end - p >= 8; p += 8) {
+    u64 w;
+    memcpy(&w, p, 8);
+    h = hash_word(h, w);
+  }
+  hs->h = h;
+  while (p < s.end) hs->tail |= (u64)*p++ << (8 * hs->ntail++);
+}
+
+u64 hash_final(hasher* hs) {
+  u64 h = hs->h;
+  if (hs->ntail) h = hash_word(h, hs->tail);
+  h ^= hs->n;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+u64 hash_span(span s) {
+  hasher hs;
+  hash_init(&hs);
+  hash_update(&hs, s);
+  return hash_final(&hs);
+}
+
 /* Random or experimental prompts.
 
 You are writing a C program. You are not explaining how to write the code to me, rather I explain how to write the code to you and you actually write the code. Therefore do not include sample or "in actual implementation..." style comments. You are actually writing the production code, and it must be complete and functional.